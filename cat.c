@@ -13,12 +13,12 @@ fatio_cat(const wchar_t* path)
 	FRESULT rc = f_open(&fil, path, FA_READ);
 	if (rc == FR_OK || rc == FR_EXIST)
 	{
-		while (f_gets(line, sizeof line, &fil)) {
-			wprintf(L"%s", line);
+		while (f_gets(line, sizeof line / sizeof line[0], &fil)) {
+			wprintf(L"%ls", line);
 		}
 		f_close(&fil);
 		return true;
 	}
-	wprintf(L"cat %s failed %d\n", path, rc);
+	wprintf(L"cat %ls failed %d\n", path, rc);
 	return false;
 }
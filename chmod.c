@@ -30,6 +30,6 @@ fatio_chmod(const wchar_t* path, const wchar_t* attributes[])
 	FRESULT rc = f_chmod(path, add_attribute, add_attribute | del_attribute);
 	if (rc == FR_OK || rc == FR_EXIST)
 		return true;
-	wprintf(L"chmod %s failed %d\n", path, rc);
+	wprintf(L"chmod %ls failed %d\n", path, rc);
 	return false;
 }
@@ -1,19 +1,69 @@
 #include <stdio.h>
 #include <fatio.h>
 #include <wchar.h>
+#ifdef _WIN32
 #include <io.h>
+#endif
 #include <dirent.h>
 #include <time.h>
 #include <math.h>
+#include <stdlib.h>
 
 #include "fatfs/ff.h"
 
+// Number of host reader threads feeding the FatFs writer
+#define COPY_READERS 4
+// Number of slots g_ctx.buffer is split into
+#define COPY_SLOTS 8
+// Smallest slot, a single host read never gets smaller than this
+#define COPY_MIN_SLOT 0x10000
+
 // Global variables for tracking copy progress
 static UINT64 g_total_size = 0;		// Total size of all files
 static UINT64 g_copied_size = 0;	// Size of copied data
 static int g_total_progress = -1; // Current progress percentage
 static UINT32 g_total_files = 0;	// Total number of files
 
+// One file to copy, chunks [first_chunk, first_chunk + nr_chunks) belong to it
+struct copy_job
+{
+	wchar_t *src;
+	wchar_t *dst;
+	UINT64 size;
+	UINT64 first_chunk;
+	UINT64 nr_chunks;
+	bool planned;	// dst already exists with its clusters reserved
+};
+
+// A piece of g_ctx.buffer holding chunk 'seq' (slot index == seq % nr_slots)
+struct copy_slot
+{
+	BYTE *data;
+	UINT64 seq;
+	UINT len;
+	bool ready;
+	bool failed;
+};
+
+static struct
+{
+	struct copy_job *jobs;
+	UINT32 nr_jobs;
+	UINT32 max_jobs;
+	UINT64 nr_chunks;
+
+	struct copy_slot slots[COPY_SLOTS];
+	UINT nr_slots;
+	UINT slot_size;
+
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE filled;	// A slot became ready
+	CONDITION_VARIABLE freed;	// The writer released a slot
+	UINT64 consumed;			// Chunks released by the writer so far
+	UINT32 next_job;			// Next job a reader will pick up
+	bool abort;
+} m_pipe;
+
 // Format file size with appropriate units
 static const wchar_t *format_size(UINT64 size)
 {
@@ -29,193 +79,533 @@ static const wchar_t *format_size(UINT64 size)
 	}
 
 	if (unit == 0)
-		swprintf(buf, sizeof(buf) / sizeof(wchar_t), L"%.0f %s", size_d, units[unit]);
+		swprintf(buf, sizeof(buf) / sizeof(wchar_t), L"%.0f %ls", size_d, units[unit]);
 	else
-		swprintf(buf, sizeof(buf) / sizeof(wchar_t), L"%.2f %s", size_d, units[unit]);
+		swprintf(buf, sizeof(buf) / sizeof(wchar_t), L"%.2f %ls", size_d, units[unit]);
 
 	return buf;
 }
 
-// Calculate total size and count of files in directory
-static UINT64 calculate_total_size(const wchar_t *path)
+// Update and display total progress
+static void update_total_progress(void)
+{
+	if (g_total_size > 0)
+	{
+		int new_progress = (int)(((double)g_copied_size / (double)g_total_size) * 100);
+		if (new_progress != g_total_progress)
+		{
+			g_total_progress = new_progress;
+			loader(g_total_progress);
+		}
+	}
+}
+
+// Check whether the destination already matches the source (update mode)
+static bool is_up_to_date(const wchar_t *out_name, const struct _stat *stbuf)
+{
+	FILINFO out_info;
+
+	if (f_stat(out_name, &out_info) != FR_OK)
+		return false;
+
+	time_t fatTimestamp = ((out_info.fdate >> 9) + 1980 - 1970) * 31536000L + ((out_info.fdate >> 5) & 15) * 2592000L + (out_info.fdate & 31) * 86400L + (out_info.ftime >> 11) * 3600L + ((out_info.ftime >> 5) & 63) * 60L + (out_info.ftime & 31) * 2L;
+
+	struct tm *file_time_utc = gmtime(&stbuf->st_mtime);
+	struct tm *fat_time_utc = gmtime(&fatTimestamp);
+
+	time_t file_time_utc_ts = mktime(file_time_utc);
+	time_t fat_time_utc_ts = mktime(fat_time_utc);
+
+	return out_info.fsize == (FSIZE_t)stbuf->st_size && fabs(file_time_utc_ts - fat_time_utc_ts) <= 2;
+}
+
+// Queue a file, chunk numbers are assigned in queue order
+static bool add_job(const wchar_t *in_name, const wchar_t *out_name, UINT64 size)
+{
+	struct copy_job *job;
+
+	if (m_pipe.nr_jobs == m_pipe.max_jobs)
+	{
+		UINT32 max_jobs = m_pipe.max_jobs ? m_pipe.max_jobs * 2 : 256;
+		struct copy_job *jobs = grub_realloc(m_pipe.jobs, max_jobs * sizeof(struct copy_job));
+		if (!jobs)
+			return false;
+		m_pipe.jobs = jobs;
+		m_pipe.max_jobs = max_jobs;
+	}
+
+	job = &m_pipe.jobs[m_pipe.nr_jobs];
+	job->src = _wcsdup(in_name);
+	job->dst = _wcsdup(out_name);
+	if (!job->src || !job->dst)
+	{
+		free(job->src);
+		free(job->dst);
+		return false;
+	}
+	job->size = size;
+	job->planned = false;
+	job->first_chunk = m_pipe.nr_chunks;
+	job->nr_chunks = (size + m_pipe.slot_size - 1) / m_pipe.slot_size;
+	m_pipe.nr_chunks += job->nr_chunks;
+	m_pipe.nr_jobs++;
+
+	g_total_size += size;
+	g_total_files++;
+	return true;
+}
+
+static void free_jobs(void)
 {
-	UINT64 total = 0;
-	_WDIR *dir = wopendir(path);
+	for (UINT32 i = 0; i < m_pipe.nr_jobs; i++)
+	{
+		free(m_pipe.jobs[i].src);
+		free(m_pipe.jobs[i].dst);
+	}
+	grub_free(m_pipe.jobs);
+	m_pipe.jobs = NULL;
+	m_pipe.nr_jobs = m_pipe.max_jobs = 0;
+	m_pipe.nr_chunks = 0;
+}
+
+static bool queue_file(const wchar_t *in_name, const wchar_t *out_name, const struct _stat *stbuf, bool update)
+{
+	// Check if file can be skipped
+	if (update && is_up_to_date(out_name, stbuf))
+		return true;
+	return add_job(in_name, out_name, stbuf->st_size);
+}
+
+// Walk the source tree, create target directories and queue every file
+static bool queue_folder(const wchar_t *in_name, const wchar_t *out_name, bool update)
+{
+	_WDIR *dir = wopendir(in_name);
 	struct _stat stbuf;
 	struct wdirent *ent;
 	wchar_t new_path[MAX_PATH];
+	wchar_t out_path[MAX_PATH];
 
 	if (!dir)
-		return 0;
+	{
+		wprintf(L"open %ls failed\n", in_name);
+		return false;
+	}
+
+	FRESULT out_stat = f_stat(out_name, NULL);
+	if (out_stat == FR_NO_PATH || out_stat == FR_NO_FILE)
+		f_mkdir(out_name);
 
 	while ((ent = wreaddir(dir)) != NULL)
 	{
 		if (wcscmp(ent->d_name, L".") == 0 || wcscmp(ent->d_name, L"..") == 0)
 			continue;
 
-		swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%s\\%s", path, ent->d_name);
+		swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%ls" HOST_PATH_SEP L"%ls", in_name, ent->d_name);
+		swprintf(out_path, sizeof(out_path) / sizeof(out_path[0]), L"%ls\\%ls", out_name, ent->d_name);
 
 		if (_wstat(new_path, &stbuf) == -1)
 			continue;
-
 		if (S_ISDIR(stbuf.st_mode))
+			queue_folder(new_path, out_path, update);
+		else if (S_ISREG(stbuf.st_mode) && !queue_file(new_path, out_path, &stbuf, update))
 		{
-			total += calculate_total_size(new_path);
-		}
-		else if (S_ISREG(stbuf.st_mode))
-		{
-			total += stbuf.st_size;
-			g_total_files++;
+			wclosedir(dir);
+			return false;
 		}
 	}
 	wclosedir(dir);
-	return total;
+	return true;
 }
 
-// Update and display total progress
-static void update_total_progress(void)
+// Refuse to start a copy that cannot fit, before anything is written
+static bool check_free_space(void)
 {
-	if (g_total_size > 0)
+	FATFS *fs;
+	DWORD nfree;
+	UINT64 cluster, need = 0, reclaim = 0;
+	FILINFO out_info;
+	FRESULT res;
+
+	// The free count is cached or kept on the volume, this rarely scans
+	res = f_getfree(L"", &nfree, &fs);
+	if (res != FR_OK)
 	{
-		int new_progress = (int)(((double)g_copied_size / (double)g_total_size) * 100);
-		if (new_progress != g_total_progress)
-		{
-			g_total_progress = new_progress;
-			loader(g_total_progress);
-		}
+		grub_printf("get free space failed %d\n", res);
+		return false;
+	}
+	cluster = (UINT64)fs->csize * fs->ssize;
+	for (UINT32 i = 0; i < m_pipe.nr_jobs; i++)
+		need += (m_pipe.jobs[i].size + cluster - 1) / cluster;
+	if (need <= nfree)
+		return true;
+
+	// Files that get overwritten give their clusters back
+	for (UINT32 i = 0; i < m_pipe.nr_jobs && need > nfree + reclaim; i++)
+	{
+		if (f_stat(m_pipe.jobs[i].dst, &out_info) == FR_OK)
+			reclaim += (out_info.fsize + cluster - 1) / cluster;
 	}
+	if (need <= nfree + reclaim)
+		return true;
+
+	wprintf(L"Not enough free space, need %ls", format_size(need * cluster));
+	wprintf(L", free %ls\n", format_size((nfree + reclaim) * cluster));
+	return false;
 }
 
-bool copy_file(const wchar_t *in_name, const wchar_t *out_name, bool update)
+static int cmp_job_size(const void *a, const void *b)
 {
-	bool rc = FALSE;
-	FRESULT res;
-	UINT br, bw;
-	UINT64 ofs = 0;
+	UINT64 sa = m_pipe.jobs[*(const UINT32 *)a].size;
+	UINT64 sb = m_pipe.jobs[*(const UINT32 *)b].size;
+
+	return (sa < sb) ? 1 : (sa > sb) ? -1 : 0;
+}
+
+// Reserve a contiguous extent for every file before any data is written.
+// Largest files go first, so small ones cannot split the big free regions.
+// A fresh volume has a single free region, there the extents follow the
+// copy order and the writes stream through the volume front to back.
+static void plan_jobs(void)
+{
+	UINT32 *order;
+	UINT32 n = 0, fragmented = 0;
 	FIL out;
-	FILE *file = 0;
-	struct _stat stbuf;
-	FILINFO out_info;
 
-	// Open input file
-	if (_wfopen_s(&file, in_name, L"rb") != 0)
+	order = grub_malloc(m_pipe.nr_jobs * sizeof(UINT32));
+	if (!order)
+		return;
+	for (UINT32 i = 0; i < m_pipe.nr_jobs; i++)
 	{
-		grub_printf("src open failed\n");
-		return false;
+		if (m_pipe.jobs[i].size)
+			order[n++] = i;
+	}
+	if (!g_ctx.fresh)
+		qsort(order, n, sizeof(UINT32), cmp_job_size);
+
+	for (UINT32 i = 0; i < n; i++)
+	{
+		struct copy_job *job = &m_pipe.jobs[order[i]];
+
+		if (f_open(&out, job->dst, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+			continue;
+		if (f_expand(&out, job->size, 1) == FR_OK)
+			job->planned = true;
+		else
+			fragmented++;
+		f_close(&out);
 	}
+	grub_free(order);
 
-	// Set larger buffer for input file
-	setvbuf(file, NULL, _IOFBF, BUFFER_SIZE);
+	// These grow cluster by cluster while being written
+	if (fragmented)
+		wprintf(L"%u files do not fit in contiguous free space\n", fragmented);
+}
 
-	// Get input file size
-	if (_wstat(in_name, &stbuf) == -1)
+// Drop the reserved files a failed copy never reached
+static void unplan_jobs(UINT32 first)
+{
+	for (UINT32 i = first; i < m_pipe.nr_jobs; i++)
 	{
-		grub_printf("Failed to get file size\n");
-		fclose(file);
-		return false;
+		if (m_pipe.jobs[i].planned)
+			f_unlink(m_pipe.jobs[i].dst);
 	}
-	long long file_size = stbuf.st_size;
+}
 
-	// Check if file can be skipped
-	if (update && f_stat(out_name, &out_info) == FR_OK)
+// Reader side: wait until chunk 'seq' may use its slot
+static struct copy_slot *acquire_slot(UINT64 seq)
+{
+	struct copy_slot *slot = &m_pipe.slots[seq % m_pipe.nr_slots];
+
+	EnterCriticalSection(&m_pipe.lock);
+	while (!m_pipe.abort && seq >= m_pipe.consumed + m_pipe.nr_slots)
+		SleepConditionVariableCS(&m_pipe.freed, &m_pipe.lock, INFINITE);
+	LeaveCriticalSection(&m_pipe.lock);
+	return m_pipe.abort ? NULL : slot;
+}
+
+static void publish_slot(struct copy_slot *slot, UINT64 seq, UINT len, bool failed)
+{
+	EnterCriticalSection(&m_pipe.lock);
+	slot->seq = seq;
+	slot->len = len;
+	slot->failed = failed;
+	slot->ready = true;
+	WakeAllConditionVariable(&m_pipe.filled);
+	LeaveCriticalSection(&m_pipe.lock);
+}
+
+static DWORD WINAPI reader_thread(void *param)
+{
+	(void)param;
+
+	for (;;)
 	{
-		time_t fatTimestamp = ((out_info.fdate >> 9) + 1980 - 1970) * 31536000L + ((out_info.fdate >> 5) & 15) * 2592000L + (out_info.fdate & 31) * 86400L + (out_info.ftime >> 11) * 3600L + ((out_info.ftime >> 5) & 63) * 60L + (out_info.ftime & 31) * 2L;
+		struct copy_job *job;
+		FILE *file = 0;
+		bool failed = false;
+		UINT64 left;
 
-		struct tm *file_time_utc = gmtime(&stbuf.st_mtime);
-		struct tm *fat_time_utc = gmtime(&fatTimestamp);
+		EnterCriticalSection(&m_pipe.lock);
+		if (m_pipe.abort || m_pipe.next_job >= m_pipe.nr_jobs)
+		{
+			LeaveCriticalSection(&m_pipe.lock);
+			break;
+		}
+		job = &m_pipe.jobs[m_pipe.next_job++];
+		LeaveCriticalSection(&m_pipe.lock);
 
-		time_t file_time_utc_ts = mktime(file_time_utc);
-		time_t fat_time_utc_ts = mktime(fat_time_utc);
+		if (job->nr_chunks && _wfopen_s(&file, job->src, L"rb") != 0)
+			failed = true;
+		// Slots are large, let fread go straight into them
+		if (file)
+			setvbuf(file, NULL, _IONBF, 0);
 
-		if (out_info.fsize == file_size && fabs(file_time_utc_ts - fat_time_utc_ts) <= 2)
+		left = job->size;
+		for (UINT64 i = 0; i < job->nr_chunks; i++)
 		{
-			g_copied_size += file_size; // Update copied size
-			update_total_progress();		// Update progress display
-			fclose(file);
-			return true;
+			UINT64 seq = job->first_chunk + i;
+			UINT len = (left > m_pipe.slot_size) ? m_pipe.slot_size : (UINT)left;
+			struct copy_slot *slot = acquire_slot(seq);
+			if (!slot)
+				break;
+			// Once a read failed, the remaining chunks only carry the error
+			if (!failed && fread(slot->data, 1, len, file) != len)
+				failed = true;
+			publish_slot(slot, seq, len, failed);
+			left -= len;
 		}
+
+		if (file)
+			fclose(file);
 	}
+	return 0;
+}
+
+// Writer side: wait for chunk 'seq' in order
+static struct copy_slot *wait_slot(UINT64 seq)
+{
+	struct copy_slot *slot = &m_pipe.slots[seq % m_pipe.nr_slots];
+
+	EnterCriticalSection(&m_pipe.lock);
+	while (!(slot->ready && slot->seq == seq))
+		SleepConditionVariableCS(&m_pipe.filled, &m_pipe.lock, INFINITE);
+	LeaveCriticalSection(&m_pipe.lock);
+	return slot;
+}
+
+static void release_slot(struct copy_slot *slot)
+{
+	EnterCriticalSection(&m_pipe.lock);
+	slot->ready = false;
+	m_pipe.consumed++;
+	WakeAllConditionVariable(&m_pipe.freed);
+	LeaveCriticalSection(&m_pipe.lock);
+}
+
+static void abort_pipeline(void)
+{
+	EnterCriticalSection(&m_pipe.lock);
+	m_pipe.abort = true;
+	WakeAllConditionVariable(&m_pipe.freed);
+	LeaveCriticalSection(&m_pipe.lock);
+}
 
-	// Open output file
-	res = f_open(&out, out_name, FA_WRITE | FA_CREATE_ALWAYS);
+// Drain one job, always consumes all of its chunks unless the target failed.
+// 'ok' is cleared when the file was skipped or could not be read in full.
+static FRESULT write_job(struct copy_job *job, bool *ok)
+{
+	FRESULT res;
+	UINT bw;
+	FIL out;
+	UINT64 i = 0;
+	bool empty;
+
+	*ok = true;
+
+	// Open output file, a planned one already has its full size allocated
+	res = f_open(&out, job->dst, job->planned ? FA_WRITE | FA_OPEN_EXISTING : FA_WRITE | FA_CREATE_ALWAYS);
 	if (res)
 	{
-		grub_printf("dst open failed %d\n", res);
-		fclose(file);
-		return false;
+		wprintf(L"dst open %ls failed %d\n", job->dst, res);
+		*ok = false;
+		// Do not leave the reserved clusters behind
+		if (job->planned)
+			f_unlink(job->dst);
+		goto skip;
 	}
 
-	// Pre-allocate space for large files (>10MB)
-	if (file_size > 10 * 1024 * 1024)
+	for (; i < job->nr_chunks; i++)
 	{
-		f_expand(&out, file_size, 1);
-	}
+		struct copy_slot *slot = wait_slot(job->first_chunk + i);
 
-	while ((br = fread(g_ctx.buffer, 1, BUFFER_SIZE, file)) > 0)
-	{
-		ofs += br;
-		if (f_write(&out, g_ctx.buffer, br, &bw) != FR_OK || bw < br)
+		if (slot->failed)
 		{
-			grub_printf("write failed\n");
-			rc = FALSE;
+			release_slot(slot);
+			*ok = false;
+			i++;
 			break;
 		}
+		res = f_write(&out, slot->data, slot->len, &bw);
+		if (res == FR_OK && bw < slot->len)
+			res = FR_DENIED; // disk full
+		release_slot(slot);
+		if (res != FR_OK)
+		{
+			grub_printf("write failed %d\n", res);
+			f_truncate(&out);
+			f_close(&out);
+			return res;
+		}
 
 		g_copied_size += bw;		 // Update copied size
 		update_total_progress(); // Update progress display
 	}
 
+	// Do not leave the reserved tail of a short file behind
+	if (!*ok)
+		f_truncate(&out);
+	empty = (f_size(&out) == 0);
+
 	// Ensure all data is written
 	f_sync(&out);
 	f_close(&out);
-	fclose(file);
 
-	return br == 0;
+	// A planned file that got no data at all is not kept as an empty one
+	if (!*ok && job->planned && empty)
+		f_unlink(job->dst);
+
+skip:
+	// Discard what the reader still delivers for this file
+	for (; i < job->nr_chunks; i++)
+	{
+		struct copy_slot *slot = wait_slot(job->first_chunk + i);
+		g_copied_size += slot->len;
+		release_slot(slot);
+	}
+	if (!*ok && res == FR_OK)
+		wprintf(L"read %ls failed\n", job->src);
+	return FR_OK;
 }
 
-bool copy_folder(const wchar_t *in_name, const wchar_t *out_name, bool update)
+// Reader threads prefetch host files into the slots, this thread is the only FatFs user
+static bool run_pipeline(void)
 {
-	_WDIR *dir = wopendir(in_name);
-	struct _stat stbuf;
-	struct wdirent *ent;
-	wchar_t new_path[MAX_PATH];
-	wchar_t out_path[MAX_PATH];
+	HANDLE readers[COPY_READERS];
+	UINT nr_readers = 0;
+	bool result = true;
+	UINT64 start, elapsed;
 
-	if (!dir)
+	m_pipe.consumed = 0;
+	m_pipe.next_job = 0;
+	m_pipe.abort = false;
+	for (UINT i = 0; i < m_pipe.nr_slots; i++)
+		m_pipe.slots[i].ready = false;
+
+	start = GetTickCount64();
+
+	for (UINT i = 0; i < COPY_READERS && i < m_pipe.nr_jobs; i++)
 	{
-		wprintf(L"open %s failed\n", in_name);
+		readers[nr_readers] = CreateThread(NULL, 0, reader_thread, NULL, 0, NULL);
+		if (readers[nr_readers] == NULL)
+			break;
+		nr_readers++;
+	}
+	if (nr_readers == 0 && m_pipe.nr_jobs)
+	{
+		grub_printf("failed to start reader threads\n");
+		unplan_jobs(0);
 		return false;
 	}
 
-	FRESULT out_stat = f_stat(out_name, NULL);
-	if (out_stat == FR_NO_PATH || out_stat == FR_NO_FILE)
-		f_mkdir(out_name);
+	for (UINT32 i = 0; i < m_pipe.nr_jobs; i++)
+	{
+		bool ok;
+		if (write_job(&m_pipe.jobs[i], &ok) != FR_OK)
+		{
+			abort_pipeline();
+			unplan_jobs(i + 1);
+			result = false;
+			break;
+		}
+		if (!ok)
+			result = false;
+	}
+
+	WaitForMultipleObjects(nr_readers, readers, TRUE, INFINITE);
+	for (UINT i = 0; i < nr_readers; i++)
+		CloseHandle(readers[i]);
+
+	elapsed = GetTickCount64() - start;
+	if (g_total_progress >= 0)
+		grub_printf("\n");
+	wprintf(L"Copied %ls", format_size(g_copied_size));
+	if (elapsed)
+		wprintf(L" in %.2f s, %.2f MB/s\n", elapsed / 1000.0, (g_copied_size / 1048576.0) / (elapsed / 1000.0));
+	else
+		wprintf(L"\n");
+	return result;
+}
+
+wchar_t *get_file_name(const wchar_t *path)
+{
+	const wchar_t *fileName = wcsrchr(path, L'/');
+	if (fileName == NULL)
+		fileName = wcsrchr(path, L'\\');
+	return _wcsdup((fileName != NULL) ? fileName + 1 : path);
+}
 
+// Measure a source folder and everything below it
+static void plan_folder(const wchar_t *in_name, struct fatio_plan *plan)
+{
+	_WDIR *dir = wopendir(in_name);
+	struct _stat stbuf;
+	struct wdirent *ent;
+	wchar_t new_path[MAX_PATH];
+	UINT64 entry_bytes = 0;
+
+	if (!dir)
+		return;
 	while ((ent = wreaddir(dir)) != NULL)
 	{
 		if (wcscmp(ent->d_name, L".") == 0 || wcscmp(ent->d_name, L"..") == 0)
 			continue;
 
-		swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%s\\%s", in_name, ent->d_name);
-		swprintf(out_path, sizeof(out_path) / sizeof(out_path[0]), L"%s\\%s", out_name, ent->d_name);
-
+		swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%ls" HOST_PATH_SEP L"%ls", in_name, ent->d_name);
 		if (_wstat(new_path, &stbuf) == -1)
 			continue;
+		entry_bytes += fatio_plan_name(wcslen(ent->d_name));
 		if (S_ISDIR(stbuf.st_mode))
-			copy_folder(new_path, out_path, update);
+			plan_folder(new_path, plan);
 		else if (S_ISREG(stbuf.st_mode))
-			copy_file(new_path, out_path, update);
+			fatio_plan_file(plan, stbuf.st_size);
 	}
 	wclosedir(dir);
-	return true;
+	fatio_plan_dir(plan, entry_bytes);
 }
 
-wchar_t *get_file_name(const wchar_t *path)
+// Measure what copying IN_NAME puts on a new volume
+bool fatio_copy_plan(const wchar_t *in_name, struct fatio_plan *plan)
 {
-	const wchar_t *fileName = wcsrchr(path, L'/');
-	if (fileName == NULL)
-		fileName = wcsrchr(path, L'\\');
-	return _wcsdup((fileName != NULL) ? fileName + 1 : path);
+	struct _stat instbuf;
+	wchar_t *file_name;
+
+	if (_wstat(in_name, &instbuf) == -1)
+	{
+		wprintf(L"open %ls failed\n", in_name);
+		return false;
+	}
+	if (S_ISDIR(instbuf.st_mode))
+		plan_folder(in_name, plan);
+	else if (S_ISREG(instbuf.st_mode))
+		fatio_plan_file(plan, instbuf.st_size);
+	else
+		return false;
+
+	// The root directory holding it
+	file_name = get_file_name(in_name);
+	fatio_plan_dir(plan, file_name ? fatio_plan_name(wcslen(file_name)) : 0);
+	free(file_name);
+	return true;
 }
 
 bool fatio_copy(const wchar_t *in_name, const wchar_t *out_name, bool update)
@@ -232,45 +622,65 @@ bool fatio_copy(const wchar_t *in_name, const wchar_t *out_name, bool update)
 
 	if (_wstat(in_name, &instbuf) == -1)
 	{
-		wprintf(L"open %s failed\n", in_name);
+		wprintf(L"open %ls failed\n", in_name);
 		return false;
 	}
 
-	// Calculate total size and file count
-	if (S_ISDIR(instbuf.st_mode))
+	// Carve g_ctx.buffer into pipeline slots
+	m_pipe.slot_size = (BUFFER_SIZE / COPY_SLOTS) & ~(COPY_MIN_SLOT - 1);
+	m_pipe.nr_slots = COPY_SLOTS;
+	if (m_pipe.slot_size < COPY_MIN_SLOT)
 	{
-		g_total_size = calculate_total_size(in_name);
-		wprintf(L"Copy %s -> %s\n", in_name, out_name);
-		wprintf(L"Total files: %u\n", g_total_files);
-		wprintf(L"Total size: %s\n\n", format_size(g_total_size));
+		m_pipe.nr_slots = BUFFER_SIZE / COPY_MIN_SLOT;
+		m_pipe.slot_size = COPY_MIN_SLOT;
 	}
-	else if (S_ISREG(instbuf.st_mode))
+	if (m_pipe.nr_slots < 2)
 	{
-		g_total_size = instbuf.st_size;
-		wprintf(L"Copy %s -> %s\n", in_name, out_name);
-		wprintf(L"Size: %s\n\n", format_size(g_total_size));
+		grub_printf("buffer too small\n");
+		return false;
 	}
+	for (UINT i = 0; i < m_pipe.nr_slots; i++)
+		m_pipe.slots[i].data = g_ctx.buffer + (grub_size_t)i * m_pipe.slot_size;
 
-	// Execute copy operation
+	// Build the job list and calculate total size and file count
 	if (S_ISDIR(instbuf.st_mode))
 	{
-		result = copy_folder(in_name, out_name, update);
+		wprintf(L"Copy %ls -> %ls\n", in_name, out_name);
+		result = queue_folder(in_name, out_name, update);
+		wprintf(L"Total files: %u\n", g_total_files);
+		wprintf(L"Total size: %ls\n\n", format_size(g_total_size));
 	}
 	else if (S_ISREG(instbuf.st_mode))
 	{
+		wchar_t *file_name = get_file_name(in_name);
 		if (wcscmp(out_name, L"\\") == 0)
-			swprintf(out_path, sizeof(out_path) / sizeof(out_path[0]), L"\\%ls", get_file_name(in_name));
+			swprintf(out_path, sizeof(out_path) / sizeof(out_path[0]), L"\\%ls", file_name);
 		else
-			swprintf(out_path, sizeof(out_path) / sizeof(out_path[0]), L"%ls\\%ls", out_name, get_file_name(in_name));
-		result = copy_file(in_name, out_path, update);
+			swprintf(out_path, sizeof(out_path) / sizeof(out_path[0]), L"%ls\\%ls", out_name, file_name);
+		free(file_name);
+		wprintf(L"Copy %ls -> %ls\n", in_name, out_name);
+		wprintf(L"Size: %ls\n\n", format_size(instbuf.st_size));
+		result = queue_file(in_name, out_path, &instbuf, update);
 	}
 	else
 	{
 		result = false;
 	}
 
-	if (g_total_progress >= 0)
-		grub_printf("\n");
+	if (result)
+		result = check_free_space();
+	if (result)
+		plan_jobs();
+
+	if (result)
+	{
+		InitializeCriticalSection(&m_pipe.lock);
+		InitializeConditionVariable(&m_pipe.filled);
+		InitializeConditionVariable(&m_pipe.freed);
+		result = run_pipeline();
+		DeleteCriticalSection(&m_pipe.lock);
+	}
 
+	free_jobs();
 	return result;
 }
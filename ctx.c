@@ -2,14 +2,19 @@
 #include <fatio.h>
 #include <dl.h>
 #include <wchar.h>
+#ifdef _WIN32
 #include <winioctl.h>
+#endif
 
 #include <grub/disk.h>
 #include <grub/fs.h>
 #include <grub/err.h>
 #include <grub/partition.h>
+#include <grub/msdos_partition.h>
+#include <imgdisk.h>
 
 #include "fatfs/ff.h"
+#include "fatfs/diskio.h"
 
 struct fatio_ctx g_ctx;
 
@@ -22,6 +27,7 @@ fatio_remove_trailing_backslash(wchar_t* path)
 	path[len - 1] = L'\0';
 }
 
+#ifdef _WIN32
 static bool
 lock_volume(unsigned disk_id)
 {
@@ -67,7 +73,7 @@ lock_volume(unsigned disk_id)
 			goto next;
 		if (lba != (grub_uint64_t)(pie.StartingOffset.QuadPart >> GRUB_DISK_SECTOR_BITS))
 			goto next;
-		//wprintf(L"Locking: %s, %lu, %lu, %llu\n", path, sdn.DeviceNumber, sdn.PartitionNumber, pie.StartingOffset.QuadPart >> GRUB_DISK_SECTOR_BITS);
+		//wprintf(L"Locking: %ls, %lu, %lu, %llu\n", path, sdn.DeviceNumber, sdn.PartitionNumber, pie.StartingOffset.QuadPart >> GRUB_DISK_SECTOR_BITS);
 		dw = 0;
 		if (!DeviceIoControl(hv, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &dw, NULL))
 		{
@@ -85,6 +91,15 @@ lock_volume(unsigned disk_id)
 	}
 	return true;
 }
+#else
+// Physical disks are Windows only, see windisk.c
+static bool
+lock_volume(unsigned disk_id)
+{
+	(void)disk_id;
+	return true;
+}
+#endif
 
 bool
 fatio_set_disk(unsigned disk_id, unsigned part_id)
@@ -121,17 +136,140 @@ fatio_set_disk(unsigned disk_id, unsigned part_id)
 	return false;
 }
 
+// Open the volume of the image grub_imgdisk_set/create just attached
+static bool
+open_image_part(unsigned part_id)
+{
+	char* name = NULL;
+	/* Part 0 means the image holds a bare volume without partition table.  */
+	if (part_id)
+		name = grub_xasprintf("img,%u", part_id);
+	else
+		name = grub_strdup("img");
+	if (name == NULL)
+		goto fail;
+	g_ctx.disk = grub_disk_open(name);
+	grub_free(name);
+	if (g_ctx.disk == NULL)
+		goto fail;
+	g_ctx.total_sectors = grub_disk_native_sectors(g_ctx.disk);
+	g_ctx.buffer = grub_malloc(BUFFER_SIZE);
+	if (g_ctx.buffer)
+		return true;
+	grub_disk_close(g_ctx.disk);
+	g_ctx.disk = NULL;
+fail:
+	grub_imgdisk_unset();
+	return false;
+}
+
+bool
+fatio_set_image(const wchar_t* path, unsigned part_id)
+{
+	g_ctx.volume = INVALID_HANDLE_VALUE;
+	if (!grub_imgdisk_set(path))
+		return false;
+	return open_image_part(part_id);
+}
+
+// Start of the single partition of a new image in 512-byte sectors, 1 MB
+// like Windows does
+#define IMAGE_PART_START 2048
+
+// Put an MBR with one active partition spanning the image in sector 0. The
+// entries count sectors of the image's own size.
+static bool
+write_image_mbr(BYTE fmt)
+{
+	struct grub_msdos_partition_mbr mbr;
+	struct grub_msdos_partition_entry* e = &mbr.entries[0];
+	grub_disk_t disk;
+	grub_uint32_t id = GetTickCount();
+	grub_uint64_t sectors, start;
+	grub_err_t err;
+
+	disk = grub_disk_open("img");
+	if (!disk)
+		return false;
+	sectors = disk->total_sectors;
+	start = IMAGE_PART_START >> (disk->log_sector_size - GRUB_DISK_SECTOR_BITS);
+	if (sectors - start > 0xFFFFFFFF)
+	{
+		grub_printf("Image too large for an MBR partition\n");
+		grub_disk_close(disk);
+		return false;
+	}
+	grub_memset(&mbr, 0, sizeof(mbr));
+	grub_memcpy(mbr.code + 440, &id, sizeof(id));
+	e->flag = 0x80;
+	// LBA only, the CHS fields hold the usual "beyond 8 GB" values
+	e->start_head = e->end_head = 0xFE;
+	e->start_sector = e->end_sector = 0xFF;
+	e->start_cylinder = e->end_cylinder = 0xFF;
+	if (fmt & FM_EXFAT)
+		e->type = GRUB_PC_PARTITION_TYPE_NTFS;
+	else if (fmt & FM_FAT32)
+		e->type = GRUB_PC_PARTITION_TYPE_FAT32_LBA;
+	else
+		e->type = GRUB_PC_PARTITION_TYPE_FAT16_LBA;
+	e->start = grub_cpu_to_le32((grub_uint32_t)start);
+	e->length = grub_cpu_to_le32((grub_uint32_t)(sectors - start));
+	mbr.signature = grub_cpu_to_le16_compile_time(0xAA55);
+
+	err = grub_disk_write(disk, 0, 0, sizeof(mbr), &mbr);
+	grub_disk_close(disk);
+	return err == GRUB_ERR_NONE;
+}
+
+// Create PATH as a new sparse image of SIZE bytes and open it. Part 1 gets
+// an MBR with one partition of type FMT, part 0 is a bare volume. On failure
+// the new file is deleted again.
+bool
+fatio_create_image(const wchar_t* path, unsigned part_id, grub_uint64_t size, BYTE fmt)
+{
+	g_ctx.volume = INVALID_HANDLE_VALUE;
+	if (part_id > 1)
+	{
+		grub_printf("A new image has one partition at most\n");
+		return false;
+	}
+	if (!grub_imgdisk_create(path, size))
+		return false;
+	if (part_id && !write_image_mbr(fmt))
+	{
+		grub_imgdisk_unset();
+		DeleteFileW(path);
+		return false;
+	}
+	if (!open_image_part(part_id))
+	{
+		DeleteFileW(path);
+		return false;
+	}
+	g_ctx.fresh = true;
+	return true;
+}
+
 void
 fatio_unset_disk(void)
 {
 	if (g_ctx.disk)
+	{
+		// Write back whatever FatFs left in the write-back buffer
+		disk_ioctl(0, CTRL_SYNC, NULL);
 		grub_disk_close(g_ctx.disk);
+	}
 	g_ctx.disk = NULL;
 	g_ctx.total_sectors = 0;
+	g_ctx.fresh = false;
 	if (g_ctx.buffer)
 		grub_free(g_ctx.buffer);
 	g_ctx.buffer = NULL;
 	if (g_ctx.volume != NULL && g_ctx.volume != INVALID_HANDLE_VALUE)
 		CloseHandle(g_ctx.volume);
+	g_ctx.volume = INVALID_HANDLE_VALUE;
+	grub_imgdisk_unset();
+#ifdef _WIN32
 	GetLogicalDrives();
+#endif
 }
@@ -25,7 +25,7 @@ fatio_dump(const wchar_t* in_name, const wchar_t* out_name)
 		return false;
 	}
 	br = BUFFER_SIZE;
-	wprintf(L"copy %s -> %s\n", in_name, out_name);
+	wprintf(L"copy %ls -> %ls\n", in_name, out_name);
 	for (;;)
 	{
 		// read file
@@ -11,19 +11,25 @@
 #include "fatfs/ff.h"
 
 static wchar_t*
-get_u16_path(const char* file)
+get_u16_name(const char* name)
 {
 	wchar_t* buf = NULL;
-	const char* p = grub_strchr(file, ')');
-	p++;
-	grub_size_t len = grub_strlen(p) + 1;
+	grub_size_t len = grub_strlen(name) + 1;
 	buf = grub_calloc(len, sizeof(wchar_t));
-	grub_utf8_to_utf16(buf, len, (const grub_uint8_t*)p, -1, NULL);
+	// wchar_t is UTF-16 on Windows and UTF-32 elsewhere
+#ifdef _WIN32
+	if (buf)
+		grub_utf8_to_utf16(buf, len, (const grub_uint8_t*)name, -1, NULL);
+#else
+	if (buf)
+		grub_utf8_to_ucs4((grub_uint32_t*)buf, len, (const grub_uint8_t*)name, -1, NULL);
+#endif
 	return buf;
 }
 
+// Copy an opened source file to OUT_NAME, relative to the FatFs current directory.
 static bool
-grub_copy(const char* in_name, const wchar_t* out_name)
+grub_copy(grub_file_t file, const wchar_t* out_name)
 {
 	bool rc = FALSE;
 	FRESULT res;
@@ -31,13 +37,6 @@ grub_copy(const char* in_name, const wchar_t* out_name)
 	UINT bw;
 	UINT64 ofs = 0;
 	FIL out;
-	grub_file_t file = 0;
-	file = grub_file_open(in_name, GRUB_FILE_TYPE_CAT | GRUB_FILE_TYPE_NO_DECOMPRESS);
-	if (file == NULL)
-	{
-		grub_printf("%s open failed\n", in_name);
-		return false;
-	}
 	res = f_open(&out, out_name, FA_WRITE | FA_CREATE_ALWAYS);
 	if (res)
 	{
@@ -69,7 +68,6 @@ grub_copy(const char* in_name, const wchar_t* out_name)
 		}
 	}
 	grub_printf("\n");
-	grub_file_close(file);
 	f_close(&out);
 
 	return rc;
@@ -89,79 +87,228 @@ struct ctx_extract_file
 {
 	grub_fs_t fs;
 	grub_disk_t disk;
+	// Source directory, "(loop)/a/b"
 	char* pwd;
+	// Destination directory, absolute FatFs path, it is the current directory
+	wchar_t* cwd;
+	// Set when only measuring, see fatio_extract_plan
+	struct fatio_plan* plan;
+	// Directory entry bytes of the directory being measured
+	UINT64 entry_bytes;
 };
 
 static void
 extract_dir_real(struct ctx_extract_file* ctx);
 
+static void
+extract_subdir(struct ctx_extract_file* ctx, const char* filename, const wchar_t* name)
+{
+	struct ctx_extract_file new_ctx;
+	grub_size_t len = wcslen(ctx->cwd) + wcslen(name) + 2;
+	FRESULT res;
+
+	new_ctx.fs = ctx->fs;
+	new_ctx.disk = ctx->disk;
+	new_ctx.pwd = grub_xasprintf("%s/%s", ctx->pwd, filename);
+	new_ctx.cwd = grub_calloc(len, sizeof(wchar_t));
+	if (!new_ctx.pwd || !new_ctx.cwd)
+		goto out;
+	wcscpy(new_ctx.cwd, ctx->cwd);
+	wcscat(new_ctx.cwd, name);
+	wcscat(new_ctx.cwd, L"/");
+	grub_printf("[+] %s/\n", new_ctx.pwd);
+	res = f_mkdir(name);
+	if (res != FR_OK && res != FR_EXIST)
+	{
+		wprintf(L"mkdir %ls failed %d\n", new_ctx.cwd, res);
+		goto out;
+	}
+	if (f_chdir(name) != FR_OK)
+		goto out;
+	extract_dir_real(&new_ctx);
+	f_chdir(ctx->cwd);
+out:
+	grub_free(new_ctx.pwd);
+	grub_free(new_ctx.cwd);
+}
+
+static grub_file_t
+open_source(struct ctx_extract_file* ctx, const char* filename,
+	const struct grub_dirhook_info* info)
+{
+	grub_file_t file = NULL;
+
+	// Use the node the fs already resolved, no second path walk
+	if (ctx->fs->fs_open_entry && info->entry)
+		file = grub_file_open_entry(ctx->disk, ctx->fs, info);
+	if (!file)
+	{
+		char* path = grub_xasprintf("%s/%s", ctx->pwd, filename);
+		grub_errno = GRUB_ERR_NONE;
+		if (path)
+			file = grub_file_open(path, GRUB_FILE_TYPE_CAT | GRUB_FILE_TYPE_NO_DECOMPRESS);
+		grub_free(path);
+	}
+	if (!file)
+		grub_printf("%s/%s open failed\n", ctx->pwd, filename);
+	return file;
+}
+
+static void
+extract_file(struct ctx_extract_file* ctx, const char* filename,
+	const struct grub_dirhook_info* info, const wchar_t* name)
+{
+	grub_file_t file;
+
+	grub_printf("--- %s/%s\n", ctx->pwd, filename);
+	file = open_source(ctx, filename, info);
+	if (!file)
+		return;
+	grub_copy(file, name);
+	grub_file_close(file);
+}
+
+static void
+plan_dir_real(struct ctx_extract_file* ctx);
+
 static int
-callback_extract_file(const char* filename,
+callback_plan_file(const char* filename,
 	const struct grub_dirhook_info* info, void* data)
 {
 	struct ctx_extract_file* ctx = data;
-	if (is_hidden(filename))
+	struct ctx_extract_file new_ctx;
+	grub_file_t file;
+	wchar_t* name;
+
+	if (is_hidden(filename) || info->symlink)
 		return 0;
-	if (info->symlink)
+	name = get_u16_name(filename);
+	if (!name)
 		return 0;
+	ctx->entry_bytes += fatio_plan_name(wcslen(name));
+	grub_free(name);
 	if (info->dir)
 	{
-		struct ctx_extract_file* new_ctx = grub_malloc(sizeof(struct ctx_extract_file));
-		new_ctx->pwd = grub_xasprintf("%s/%s/", ctx->pwd, filename);
-		new_ctx->fs = ctx->fs;
-		new_ctx->disk = ctx->disk;
-		grub_printf("[+] %s\n", new_ctx->pwd);
-		wchar_t* u16 = get_u16_path(new_ctx->pwd);
-		fatio_mkdir(u16);
-		grub_free(u16);
-		extract_dir_real(new_ctx);
-		grub_free(new_ctx->pwd);
-		grub_free(new_ctx);
+		new_ctx = *ctx;
+		new_ctx.pwd = grub_xasprintf("%s/%s", ctx->pwd, filename);
+		if (new_ctx.pwd)
+			plan_dir_real(&new_ctx);
+		grub_free(new_ctx.pwd);
 	}
 	else
 	{
-		char* path = grub_xasprintf("%s/%s", ctx->pwd, filename);
-		grub_printf("--- %s\n", path);
-		wchar_t* u16 = get_u16_path(path);
-		grub_copy(path, u16);
-		grub_free(u16);
-		grub_free(path);
+		file = open_source(ctx, filename, info);
+		if (file)
+		{
+			fatio_plan_file(ctx->plan, file->size);
+			grub_file_close(file);
+		}
 	}
 	grub_errno = GRUB_ERR_NONE;
 	return 0;
 }
 
+static void
+plan_dir_real(struct ctx_extract_file* ctx)
+{
+	char* dir = grub_strchr(ctx->pwd, ')') + 1;
+
+	grub_errno = GRUB_ERR_NONE;
+	ctx->entry_bytes = 0;
+	ctx->fs->fs_dir(ctx->disk, *dir ? dir : "/", callback_plan_file, ctx);
+	fatio_plan_dir(ctx->plan, ctx->entry_bytes);
+	grub_errno = GRUB_ERR_NONE;
+}
+
+static int
+callback_extract_file(const char* filename,
+	const struct grub_dirhook_info* info, void* data)
+{
+	struct ctx_extract_file* ctx = data;
+	wchar_t* name;
+	if (is_hidden(filename))
+		return 0;
+	if (info->symlink)
+		return 0;
+	name = get_u16_name(filename);
+	if (!name)
+		return 0;
+	if (info->dir)
+		extract_subdir(ctx, filename, name);
+	else
+		extract_file(ctx, filename, info, name);
+	grub_free(name);
+	grub_errno = GRUB_ERR_NONE;
+	return 0;
+}
+
 static void
 extract_dir_real(struct ctx_extract_file* ctx)
 {
 	grub_errno = GRUB_ERR_NONE;
 	char* dir = grub_strchr(ctx->pwd, ')');
-	ctx->fs->fs_dir(ctx->disk, ++dir, callback_extract_file, ctx);
+	dir++;
+	ctx->fs->fs_dir(ctx->disk, *dir ? dir : "/", callback_extract_file, ctx);
 	grub_errno = GRUB_ERR_NONE;
 }
 
-bool
-fatio_extract(const wchar_t* src)
+// Attach SRC and probe the file system in it
+static grub_disk_t
+open_archive(const wchar_t* src, grub_fs_t* fs)
 {
 	grub_disk_t disk = NULL;
-	grub_fs_t fs = NULL;
 	if (!grub_loopback_set(src))
-		return false;
+		return NULL;
 	disk = grub_disk_open("loop");
 	if (!disk)
 	{
 		grub_printf("Failed to open loop disk\n");
 		grub_loopback_unset();
-		return false;
+		return NULL;
 	}
-	fs = grub_fs_probe(disk);
-	if (!fs)
+	*fs = grub_fs_probe(disk);
+	if (!*fs)
 	{
 		grub_printf("Failed to probe fs\n");
 		grub_disk_close(disk);
 		grub_loopback_unset();
-		return false;
+		return NULL;
 	}
+	return disk;
+}
+
+// Measure what extracting SRC puts on a new volume
+bool
+fatio_extract_plan(const wchar_t* src, struct fatio_plan* plan)
+{
+	grub_fs_t fs = NULL;
+	grub_disk_t disk = open_archive(src, &fs);
+	if (!disk)
+		return false;
+
+	struct ctx_extract_file ctx =
+	{
+		.fs = fs,
+		.disk = disk,
+		.pwd = grub_strdup("(loop)"),
+		.plan = plan,
+	};
+	if (ctx.pwd)
+		plan_dir_real(&ctx);
+	grub_free(ctx.pwd);
+
+	grub_disk_close(disk);
+	grub_loopback_unset();
+	return true;
+}
+
+bool
+fatio_extract(const wchar_t* src)
+{
+	grub_fs_t fs = NULL;
+	grub_disk_t disk = open_archive(src, &fs);
+	if (!disk)
+		return false;
 
 	grub_printf("fs: %s\n", fs->name);
 
@@ -169,9 +316,13 @@ fatio_extract(const wchar_t* src)
 	{
 		.fs = fs,
 		.disk = disk,
-		.pwd = grub_strdup("(loop)/"),
+		.pwd = grub_strdup("(loop)"),
+		.cwd = L"/",
 	};
+	// Files are created relative to the directory being extracted
+	f_chdir(ctx.cwd);
 	extract_dir_real(&ctx);
+	f_chdir(L"/");
 	grub_free(ctx.pwd);
 
 	grub_disk_close(disk);
@@ -16,6 +16,164 @@
 #include <locale.h>
 
 
+/*-----------------------------------------------------------------------*/
+/* Write-back buffer                                                     */
+/*-----------------------------------------------------------------------*/
+/* Small writes are held in memory until CTRL_SYNC or until the buffer   */
+/* fills up, then written back in ascending sector order as runs of      */
+/* adjacent sectors split at DISKIO_WB_RUN boundaries. Writes of at      */
+/* least DISKIO_WB_RUN sectors go straight to the device. Reads see the  */
+/* buffered data. FatFs issues CTRL_SYNC before the FSInfo sector is     */
+/* written, so FSInfo never reaches the volume ahead of the FAT.         */
+/*                                                                       */
+/* FatFs sectors are the native sectors of the disk, 4096 bytes on a     */
+/* 4Kn drive, so every write grub gets is whole sectors. The buffer and  */
+/* the run keep their size in bytes and hold fewer, larger sectors.      */
+
+#define DISKIO_WB_SECTORS	2048	/* Capacity of the buffer in 512-byte sectors */
+#define DISKIO_WB_RUN		128		/* Largest write issued by a flush, in 512-byte sectors */
+
+typedef struct {
+	LBA_t	sect;		/* Buffered sector */
+	UINT	slot;		/* Index of its data in WbData */
+} WBENT;
+
+static WBENT WbEnt[DISKIO_WB_SECTORS];	/* Buffered sectors in ascending order */
+static UINT WbUsed[DISKIO_WB_SECTORS];	/* Free slot stack */
+static UINT WbCount;					/* Number of buffered sectors */
+static UINT WbFree;						/* Number of free slots */
+static UINT WbRunMax;					/* DISKIO_WB_RUN in disk sectors */
+static BYTE WbInit;
+static BYTE WbBits;						/* Sector size the buffer is laid out for */
+static BYTE WbData[DISKIO_WB_SECTORS * GRUB_DISK_SECTOR_SIZE];
+static BYTE WbRun[DISKIO_WB_RUN * GRUB_DISK_SECTOR_SIZE];
+
+#define SS_BITS		(g_ctx.disk->log_sector_size)	/* Log2 of the disk sector size */
+#define SS_SHIFT	(SS_BITS - GRUB_DISK_SECTOR_BITS)	/* Disk sector to grub sector address */
+#define WB_DATA(slot)	(WbData + ((grub_size_t)(slot) << WbBits))
+
+
+static UINT wb_search (	/* Index of the first entry at or above sect */
+	LBA_t sect
+)
+{
+	UINT lo = 0, hi = WbCount, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (WbEnt[mid].sect < sect)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+static void wb_reset (void)
+{
+	UINT i, n;
+
+	WbBits = (BYTE)SS_BITS;
+	n = DISKIO_WB_SECTORS >> SS_SHIFT;
+	for (i = 0; i < n; i++)
+		WbUsed[i] = n - 1 - i;
+	WbFree = n;
+	WbRunMax = DISKIO_WB_RUN >> SS_SHIFT;
+	WbCount = 0;
+	WbInit = 1;
+}
+
+
+/* Drop buffered sectors in a range, they are about to be overwritten */
+static void wb_discard (
+	LBA_t sect,
+	LBA_t count
+)
+{
+	UINT i = wb_search(sect), j = i;
+
+	while (j < WbCount && WbEnt[j].sect - sect < count)
+		WbUsed[WbFree++] = WbEnt[j++].slot;
+	if (j > i)
+	{
+		memmove(&WbEnt[i], &WbEnt[j], (WbCount - j) * sizeof(WBENT));
+		WbCount -= j - i;
+	}
+}
+
+
+/* Write back all buffered sectors. Runs that fail stay in the buffer, */
+/* still dirty, and are retried by the next flush.                     */
+static DRESULT wb_flush (void)
+{
+	DRESULT res = RES_OK;
+	UINT i, n, k, kept = 0;
+	LBA_t sect;
+
+	for (i = 0; i < WbCount; i += n)
+	{
+		sect = WbEnt[i].sect;
+		for (n = 1; i + n < WbCount && n < WbRunMax
+			&& WbEnt[i + n].sect == sect + n && (sect + n) % WbRunMax != 0; n++)
+			;
+		for (k = 0; k < n; k++)
+			memcpy(WbRun + ((grub_size_t)k << WbBits), WB_DATA(WbEnt[i + k].slot), (grub_size_t)1 << WbBits);
+		if (grub_disk_write(g_ctx.disk, sect << (WbBits - GRUB_DISK_SECTOR_BITS), 0, (grub_size_t)n << WbBits, WbRun) != GRUB_ERR_NONE)
+		{
+			grub_print_error();
+			res = RES_ERROR;
+			memmove(&WbEnt[kept], &WbEnt[i], n * sizeof(WBENT));
+			kept += n;
+		}
+		else
+		{
+			for (k = 0; k < n; k++)
+				WbUsed[WbFree++] = WbEnt[i + k].slot;
+		}
+	}
+	WbCount = kept;
+	return res;
+}
+
+
+static DRESULT wb_write (
+	const BYTE *buff,
+	LBA_t sector,
+	UINT count
+)
+{
+	UINT i, slot;
+
+	for (; count; count--, sector++, buff += (grub_size_t)1 << WbBits)
+	{
+		i = wb_search(sector);
+		if (i < WbCount && WbEnt[i].sect == sector)
+		{
+			slot = WbEnt[i].slot;	/* Rewrite of a buffered sector */
+		}
+		else
+		{
+			if (WbFree == 0)
+			{
+				/* Buffer pressure */
+				if (wb_flush() != RES_OK)
+					return RES_ERROR;
+				i = 0;
+			}
+			slot = WbUsed[--WbFree];
+			memmove(&WbEnt[i + 1], &WbEnt[i], (WbCount - i) * sizeof(WBENT));
+			WbEnt[i].sect = sector;
+			WbEnt[i].slot = slot;
+			WbCount++;
+		}
+		memcpy(WB_DATA(slot), buff, (grub_size_t)1 << WbBits);
+	}
+	return RES_OK;
+}
+
+
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
 /*-----------------------------------------------------------------------*/
@@ -53,16 +211,21 @@ DRESULT disk_read (
 	UINT count		/* Number of sectors to read */
 )
 {
-	grub_size_t size = count << GRUB_DISK_SECTOR_BITS;
+	grub_size_t size;
+	UINT i;
 
 	if (g_ctx.disk == NULL)
 		return RES_NOTRDY;
-	if (sector > g_ctx.total_sectors)
+	if (sector > (g_ctx.total_sectors >> SS_SHIFT))
 		return RES_ERROR;
 
-	if (grub_disk_read(g_ctx.disk, sector, 0, size, buff) == GRUB_ERR_NONE)
-		return RES_OK;
-	return RES_ERROR;
+	size = (grub_size_t)count << SS_BITS;
+	if (grub_disk_read(g_ctx.disk, sector << SS_SHIFT, 0, size, buff) != GRUB_ERR_NONE)
+		return RES_ERROR;
+	/* Overlay sectors still waiting in the write-back buffer */
+	for (i = wb_search(sector); i < WbCount && WbEnt[i].sect - sector < count; i++)
+		memcpy(buff + ((grub_size_t)(WbEnt[i].sect - sector) << WbBits), WB_DATA(WbEnt[i].slot), (grub_size_t)1 << WbBits);
+	return RES_OK;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -78,14 +241,22 @@ DRESULT disk_write (
 	UINT count			/* Number of sectors to write */
 )
 {
-	grub_size_t size = count << GRUB_DISK_SECTOR_BITS;
+	grub_size_t size;
 
 	if (g_ctx.disk == NULL)
 		return RES_NOTRDY;
-	if (sector > g_ctx.total_sectors)
+	if (sector > (g_ctx.total_sectors >> SS_SHIFT))
 		return RES_ERROR;
 
-	if (grub_disk_write(g_ctx.disk, sector, 0, size, buff) == GRUB_ERR_NONE)
+	if (!WbInit || WbBits != SS_BITS)
+		wb_reset();		/* Empty here, the previous disk was synced when it was closed */
+	if (count < WbRunMax)
+		return wb_write(buff, sector, count);
+
+	/* Large transfer, newer than anything buffered for the same sectors */
+	wb_discard(sector, count);
+	size = (grub_size_t)count << SS_BITS;
+	if (grub_disk_write(g_ctx.disk, sector << SS_SHIFT, 0, size, buff) == GRUB_ERR_NONE)
 		return RES_OK;
 	grub_print_error();
 	return RES_ERROR;
@@ -109,25 +280,70 @@ DRESULT disk_ioctl (
 	switch (cmd)
 	{
 	case CTRL_SYNC:
-		return RES_OK;
+		if (!WbInit)
+			return RES_OK;
+		return wb_flush();
 	case GET_SECTOR_COUNT:
-		*(LBA_t*)buff = g_ctx.total_sectors;
+		*(LBA_t*)buff = g_ctx.total_sectors >> SS_SHIFT;
 		return RES_OK;
 	case GET_SECTOR_SIZE:
-		*(WORD*)buff = GRUB_DISK_SECTOR_SIZE;
+		*(WORD*)buff = (WORD)(1U << SS_BITS);
 		return RES_OK;
 	case GET_BLOCK_SIZE:
-		*(DWORD*)buff = 8;
+		/* 4 KB alignment, a single sector on a 4Kn disk */
+		*(DWORD*)buff = (SS_BITS < 12) ? 1U << (12 - SS_BITS) : 1;
 		return RES_OK;
 	case CTRL_TRIM:
+		/* Only a hint, the sectors are free whether the device takes it or not */
+		if (WbInit)
+			wb_discard(((LBA_t*)buff)[0], ((LBA_t*)buff)[1] - ((LBA_t*)buff)[0] + 1);
+		if (grub_disk_discard(g_ctx.disk, ((LBA_t*)buff)[0] << SS_SHIFT, (((LBA_t*)buff)[1] - ((LBA_t*)buff)[0] + 1) << SS_SHIFT, 0) != GRUB_ERR_NONE)
+			grub_errno = GRUB_ERR_NONE;
 		return RES_OK;
+	case CTRL_ZERO:
+		if (WbInit)
+			wb_discard(((LBA_t*)buff)[0], ((LBA_t*)buff)[1] - ((LBA_t*)buff)[0] + 1);
+		if (grub_disk_discard(g_ctx.disk, ((LBA_t*)buff)[0] << SS_SHIFT, (((LBA_t*)buff)[1] - ((LBA_t*)buff)[0] + 1) << SS_SHIFT, 1) == GRUB_ERR_NONE)
+			return RES_OK;
+		grub_errno = GRUB_ERR_NONE;
+		return RES_ERROR;
 	}
 
 	return RES_PARERR;
 }
 
+#if FF_USE_MKFS && FF_MKFS_PHASE
+
+/* Time the steps of f_mkfs and print them when it returns */
+
+static const char* MkfsStep;
+static UINT64 MkfsStart;
+static char MkfsLog[256];
+
+void ff_mkfs_phase (
+	const char* name	/* Step entered, NULL when f_mkfs returns */
+)
+{
+	UINT64 now = GetTickCount64();
+	grub_size_t len = grub_strlen(MkfsLog);
+
+	if (MkfsStep)
+		grub_snprintf(MkfsLog + len, sizeof(MkfsLog) - len, "%s%s %llu ms",
+			len ? ", " : "", MkfsStep, (unsigned long long)(now - MkfsStart));
+	MkfsStep = name;
+	MkfsStart = now;
+	if (!name && MkfsLog[0])
+	{
+		grub_printf("Format: %s\n", MkfsLog);
+		MkfsLog[0] = '\0';
+	}
+}
+
+#endif
+
 DWORD get_fattime(void)
 {
+#ifdef _WIN32
 	SYSTEMTIME tm;
 
 	/* Get local time */
@@ -135,4 +351,11 @@ DWORD get_fattime(void)
 
 	/* Pack date and time into a DWORD variable */
 	return   (tm.wYear - 1980) << 25 | tm.wMonth << 21 | tm.wDay << 16 | tm.wHour << 11 | tm.wMinute << 5 | tm.wSecond >> 1;
+#else
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	return (DWORD)(tm.tm_year - 80) << 25 | (DWORD)(tm.tm_mon + 1) << 21 | (DWORD)tm.tm_mday << 16 | (DWORD)tm.tm_hour << 11 | (DWORD)tm.tm_min << 5 | (DWORD)tm.tm_sec >> 1;
+#endif
 }
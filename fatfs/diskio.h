@@ -55,6 +55,9 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define CTRL_EJECT			7	/* Eject media */
 #define CTRL_FORMAT			8	/* Create physical format on the media */
 
+/* fatio specific ioctl command */
+#define CTRL_ZERO			9	/* Make the block of sectors read as zeros without writing them, fails if the device cannot */
+
 /* MMC/SDC specific ioctl command */
 #define MMC_GET_TYPE		10	/* Get card type */
 #define MMC_GET_CSD			11	/* Get CSD */
@@ -146,6 +146,16 @@
 #define BPB_DrvNumEx		111		/* exFAT: Physical drive number for int13h (BYTE) */
 #define BPB_PercInUseEx		112		/* exFAT: Percent in use (BYTE) */
 #define BPB_RsvdEx			113		/* exFAT: Reserved (7-byte) */
+#define BS_OEMParamEx		9		/* exFAT: OEM parameters sector in the boot region */
+#define BS_SumEx			11		/* exFAT: Boot checksum sector in the boot region */
+#define BS_BackupEx			12		/* exFAT: Offset of the backup boot region */
+#define XINF_Free			16		/* exFAT free count record: Number of free clusters (DWORD) */
+#define XINF_NumClus		20		/* exFAT free count record: Number of clusters it was counted for (DWORD) */
+#define XINF_VolID			24		/* exFAT free count record: Volume serial number (DWORD) */
+#define XINF_PercInUse		28		/* exFAT free count record: Percent in use written with it (BYTE) */
+#define XINF_Sum			32		/* exFAT free count record: Checksum of the bytes before (DWORD) */
+#define SZ_XINF				48		/* exFAT: Size of an OEM parameter record */
+#define N_XINF				10		/* exFAT: Number of OEM parameter records */
 #define BS_BootCodeEx		120		/* exFAT: Boot code (390-byte) */
 
 #define DIR_Name			0		/* Short file name (11-byte) */
@@ -488,6 +498,104 @@ static const char *const VolumeStr[FF_VOLUMES] = {FF_VOLUME_STRS};	/* Pre-define
 #endif
 static const BYTE GUID_MS_Basic[16] = {0xA2,0xA0,0xD0,0xEB,0xE5,0xB9,0x33,0x44,0x87,0xC0,0x68,0xB6,0xB7,0x26,0x99,0xC7};
 #endif
+#if FF_FS_EXFAT && FF_FS_EXFATINFO && !FF_FS_READONLY
+static const BYTE GUID_FreeInfo[16] = {0x3D,0x8E,0x1B,0x6A,0x52,0x74,0x4C,0x49,0x9B,0x0F,0x7E,0x25,0xD1,0x43,0xA8,0x66};	/* OEM parameter GUID of the free count record */
+#endif
+
+
+
+/*--------------------------------*/
+/* Window cache                   */
+/*--------------------------------*/
+
+#if FF_WCACHE_FAT < 0 || FF_WCACHE_DIR < 0 || FF_WCACHE_RUN < 1
+#error Wrong setting of FF_WCACHE_FAT, FF_WCACHE_DIR or FF_WCACHE_RUN
+#endif
+#define WCACHE	(!FF_FS_READONLY && !FF_FS_TINY && FF_WCACHE_FAT + FF_WCACHE_DIR > 0)
+
+#if WCACHE
+typedef struct {
+	LBA_t	sect;		/* Sector held by the entry ((LBA_t)0 - 1:unused) */
+	DWORD	stamp;		/* Last use, for LRU replacement */
+	BYTE	dirty;		/* Entry differs from the volume */
+} WCENT;
+
+static struct {
+	FATFS*	fs;			/* Filesystem object owning the cache (0:not in use) */
+	DWORD	stamp;		/* LRU clock */
+	WCENT	ent[FF_WCACHE_FAT + FF_WCACHE_DIR];				/* Entries, FAT pool first */
+	BYTE	buf[FF_WCACHE_FAT + FF_WCACHE_DIR][FF_MAX_SS];	/* Sector data of each entry */
+	BYTE	run[FF_WCACHE_RUN * FF_MAX_SS];					/* Read-ahead and write-back run buffer */
+} WinCache;
+#endif
+
+
+
+/*--------------------------------*/
+/* Free extent index              */
+/*--------------------------------*/
+
+#if FF_FREE_EXTENTS < 0
+#error Wrong setting of FF_FREE_EXTENTS
+#endif
+#define FREEIDX	(!FF_FS_READONLY && FF_USE_LFN == 3 && FF_FREE_EXTENTS > 0)
+
+#if FREEIDX
+typedef struct {
+	DWORD	start;		/* First free cluster */
+	DWORD	len;		/* Number of free clusters */
+} FXENT;
+
+static struct {
+	FATFS*	fs;			/* Filesystem object indexed (0:not built) */
+	UINT	n;			/* Number of extents */
+	BYTE	partial;	/* Some free extents are not in the index */
+	DWORD	minlen;		/* Shortest extent kept */
+	DWORD	want;		/* Clusters the caller of create_chain() is going to need */
+	FXENT	ext[FF_FREE_EXTENTS];	/* Free extents sorted by start cluster */
+} FreeIdx;
+#endif
+
+
+
+/*--------------------------------*/
+/* Directory name index           */
+/*--------------------------------*/
+
+#if FF_DIR_INDEX < 0
+#error Wrong setting of FF_DIR_INDEX
+#endif
+#define DIRIDX	(FF_USE_LFN == 3 && FF_FS_MINIMIZE <= 1 && FF_DIR_INDEX > 0)
+
+#if DIRIDX
+#define DX_NAME		0		/* Key: xname_sum() of the name */
+#define DX_SFN		1		/* Key: hash of the SFN (FAT only) */
+#define DX_OFS		2		/* Key: offset of the entry */
+#define DX_DEAD		0xFFFFFFFF	/* Removed item */
+
+typedef struct {
+	DWORD	blk;		/* Offset of the first entry of the item (DX_DEAD:removed) */
+	DWORD	ofs;		/* Offset of the SFN entry or the exFAT file entry */
+	WORD	hash[2];	/* DX_NAME and DX_SFN hash values */
+	BYTE	keys;		/* Keys the item is linked with (bit mask of 1 << DX_xxx) */
+	UINT	next[3];	/* Next item in each bucket (index + 1, 0:end) */
+} DXENT;
+
+typedef struct {
+	FATFS*	fs;			/* Filesystem object (0:slot not in use) */
+	WORD	id;			/* Volume mount ID */
+	DWORD	sclust;		/* Directory start cluster (0:root) */
+	DWORD	stamp;		/* Last use, for LRU replacement */
+	DWORD	free_ofs;	/* No free entry is before this offset */
+	UINT	n, max;		/* Items stored and allocated */
+	UINT	mask;		/* Number of buckets per key - 1 */
+	DXENT*	ent;		/* Items */
+	UINT*	head;		/* Bucket heads of DX_NAME, DX_SFN and DX_OFS (index + 1, 0:empty) */
+} DXDIR;
+
+static DXDIR DirIdx[FF_DIR_INDEX];
+static DWORD DirIdxStamp;
+#endif
 
 
 
@@ -502,7 +610,7 @@ static const BYTE GUID_MS_Basic[16] = {0xA2,0xA0,0xD0,0xEB,0xE5,0xB9,0x33,0x44,0
 #define DEF_NAMBUF
 #define INIT_NAMBUF(fs)
 #define FREE_NAMBUF()
-#define LEAVE_MKFS(res)	return res
+#define LEAVE_MKFS(res)	{ MKFS_PHASE(0); return res; }
 
 #else					/* LFN configurations */
 #if FF_MAX_LFN < 12 || FF_MAX_LFN > 255
@@ -525,7 +633,7 @@ static WCHAR LfnBuf[FF_MAX_LFN + 1];		/* LFN working buffer */
 #define DEF_NAMBUF
 #define INIT_NAMBUF(fs)
 #define FREE_NAMBUF()
-#define LEAVE_MKFS(res)	return res
+#define LEAVE_MKFS(res)	{ MKFS_PHASE(0); return res; }
 
 #elif FF_USE_LFN == 2 	/* LFN enabled with dynamic working buffer on the stack */
 #if FF_FS_EXFAT
@@ -537,7 +645,7 @@ static WCHAR LfnBuf[FF_MAX_LFN + 1];		/* LFN working buffer */
 #define INIT_NAMBUF(fs)	{ (fs)->lfnbuf = lbuf; }
 #define FREE_NAMBUF()
 #endif
-#define LEAVE_MKFS(res)	return res
+#define LEAVE_MKFS(res)	{ MKFS_PHASE(0); return res; }
 
 #elif FF_USE_LFN == 3 	/* LFN enabled with dynamic working buffer on the heap */
 #if FF_FS_EXFAT
@@ -549,8 +657,9 @@ static WCHAR LfnBuf[FF_MAX_LFN + 1];		/* LFN working buffer */
 #define INIT_NAMBUF(fs)	{ lfn = ff_memalloc((FF_MAX_LFN+1)*2); if (!lfn) LEAVE_FF(fs, FR_NOT_ENOUGH_CORE); (fs)->lfnbuf = lfn; }
 #define FREE_NAMBUF()	ff_memfree(lfn)
 #endif
-#define LEAVE_MKFS(res)	{ if (!work) ff_memfree(buf); return res; }
+#define LEAVE_MKFS(res)	{ MKFS_PHASE(0); if (!work) ff_memfree(buf); return res; }
 #define MAX_MALLOC	0x8000	/* Must be >=FF_MAX_SS */
+#define MAX_SCAN	0x40000	/* Size of the FAT scan buffer, must be >=FF_MAX_SS */
 
 #else
 #error Wrong setting of FF_USE_LFN
@@ -1054,7 +1163,7 @@ static void clear_share (	/* Clear all lock entries of the volume */
 /* Move/Flush disk access window in the filesystem object                */
 /*-----------------------------------------------------------------------*/
 #if !FF_FS_READONLY
-static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
+static FRESULT write_window (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs			/* Filesystem object */
 )
 {
@@ -1076,6 +1185,251 @@ static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 #endif
 
 
+#if WCACHE
+/* Get the pool a sector belongs to, returns its size and first entry */
+static UINT wc_pool (
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect,		/* Sector number */
+	UINT* top		/* First entry of the pool */
+)
+{
+	if (sect - fs->fatbase < (LBA_t)fs->fsize * fs->n_fats
+#if FF_FS_EXFAT
+		|| (fs->fs_type == FS_EXFAT && sect - fs->bitbase < (fs->n_fatent - 2 + SS(fs) * 8 - 1) / (SS(fs) * 8))
+#endif
+	) {
+		*top = 0;
+		return FF_WCACHE_FAT;
+	}
+	*top = FF_WCACHE_FAT;
+	return FF_WCACHE_DIR;
+}
+
+
+static int wc_find (	/* Entry index, -1:Not cached */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect		/* Sector number */
+)
+{
+	UINT i, top, n;
+
+
+	n = wc_pool(fs, sect, &top);
+	for (i = top; i < top + n; i++) {
+		if (WinCache.ent[i].sect == sect) return (int)i;
+	}
+	return -1;
+}
+
+
+/* Write back all dirty entries, sorted and merged into runs of consecutive sectors */
+static FRESULT wc_flush (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	UINT idx[FF_WCACHE_FAT + FF_WCACHE_DIR];
+	UINT n = 0, i, j, cnt;
+	LBA_t sect;
+	BYTE *buf;
+	FRESULT res = FR_OK;
+
+
+	for (i = 0; i < FF_WCACHE_FAT + FF_WCACHE_DIR; i++) {	/* Collect dirty entries in sector order */
+		if (!WinCache.ent[i].dirty) continue;
+		for (j = n; j > 0 && WinCache.ent[idx[j - 1]].sect > WinCache.ent[i].sect; j--) idx[j] = idx[j - 1];
+		idx[j] = i; n++;
+	}
+	for (i = 0; i < n; i += cnt) {
+		sect = WinCache.ent[idx[i]].sect;
+		for (cnt = 1; i + cnt < n && cnt < FF_WCACHE_RUN	/* Extend the run while sectors are consecutive and on the same side of the 1st FAT end */
+			&& WinCache.ent[idx[i + cnt]].sect == sect + cnt
+			&& (sect - fs->fatbase < fs->fsize) == (sect + cnt - fs->fatbase < fs->fsize); cnt++) ;
+		if (cnt == 1) {
+			buf = WinCache.buf[idx[i]];
+		} else {
+			buf = WinCache.run;
+			for (j = 0; j < cnt; j++) memcpy(buf + j * SS(fs), WinCache.buf[idx[i + j]], SS(fs));
+		}
+		if (disk_write(fs->pdrv, buf, sect, cnt) != RES_OK) {
+			res = FR_DISK_ERR;
+			continue;
+		}
+		for (j = 0; j < cnt; j++) WinCache.ent[idx[i + j]].dirty = 0;
+		if (sect - fs->fatbase < fs->fsize && fs->n_fats == 2) {	/* Reflect it to 2nd FAT if needed */
+			disk_write(fs->pdrv, buf, sect + fs->fsize, cnt);
+		}
+	}
+	return res;
+}
+
+
+static int wc_alloc (	/* Entry index, -1:Pool disabled or no clean victim */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect,		/* Sector to be cached */
+	int flush		/* Write back dirty entries if the victim is dirty */
+)
+{
+	UINT i, top, n;
+	int v = -1;
+
+
+	n = wc_pool(fs, sect, &top);
+	if (n == 0) return -1;
+	for (i = top; i < top + n; i++) {	/* Take an unused entry or the least recently used one */
+		if (WinCache.ent[i].sect == (LBA_t)0 - 1) {
+			v = (int)i; break;
+		}
+		if (v < 0 || WinCache.ent[i].stamp < WinCache.ent[v].stamp) v = (int)i;
+	}
+	if (WinCache.ent[v].dirty && (!flush || wc_flush(fs) != FR_OK)) return -1;
+	WinCache.ent[v].sect = sect;
+	WinCache.ent[v].dirty = 0;
+	WinCache.ent[v].stamp = ++WinCache.stamp;
+	return v;
+}
+
+
+/* Drop cached sectors in a range, e.g. clusters being freed or overwritten */
+static void wc_discard (
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect,		/* Start sector */
+	LBA_t n			/* Number of sectors */
+)
+{
+	UINT i;
+
+
+	if (WinCache.fs != fs) return;
+	for (i = 0; i < FF_WCACHE_FAT + FF_WCACHE_DIR; i++) {
+		if (WinCache.ent[i].sect - sect < n) {
+			WinCache.ent[i].sect = (LBA_t)0 - 1;
+			WinCache.ent[i].dirty = 0;
+		}
+	}
+}
+
+
+static void wc_reset (
+	FATFS* fs		/* Filesystem object to own the cache (0:not in use) */
+)
+{
+	UINT i;
+
+
+	WinCache.fs = fs;
+	WinCache.stamp = 0;
+	for (i = 0; i < FF_WCACHE_FAT + FF_WCACHE_DIR; i++) {
+		WinCache.ent[i].sect = (LBA_t)0 - 1;
+		WinCache.ent[i].dirty = 0;
+		WinCache.ent[i].stamp = 0;
+	}
+}
+
+
+static UINT wc_ahead (	/* Number of sectors worth reading from sect on a miss */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect		/* Sector being loaded */
+)
+{
+	LBA_t end;
+
+
+	if (fs->fs_type == 0) return 1;	/* Volume is being mounted */
+	if (sect - fs->fatbase < fs->fsize) {	/* Rest of the 1st FAT */
+		end = fs->fatbase + fs->fsize;
+#if FF_FS_EXFAT
+	} else if (fs->fs_type == FS_EXFAT && sect - fs->bitbase < (fs->n_fatent - 2 + SS(fs) * 8 - 1) / (SS(fs) * 8)) {	/* Rest of the allocation bitmap */
+		end = fs->bitbase + (fs->n_fatent - 2 + SS(fs) * 8 - 1) / (SS(fs) * 8);
+#endif
+	} else if (sect >= fs->database) {	/* Rest of the cluster */
+		end = sect + fs->csize - (sect - fs->database) % fs->csize;
+	} else if (fs->fs_type != FS_FAT32 && fs->fs_type != FS_EXFAT && sect >= fs->dirbase) {	/* Rest of the FAT12/16 root directory */
+		end = fs->database;
+	} else {
+		return 1;
+	}
+	return (end - sect > FF_WCACHE_RUN) ? FF_WCACHE_RUN : (UINT)(end - sect);
+}
+
+
+/* Put the window into the cache instead of writing it back */
+static FRESULT wc_stash (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	UINT top;
+	int i;
+
+
+	if (fs->winsect == (LBA_t)0 - 1) return FR_OK;	/* Window is not valid */
+	if (wc_pool(fs, fs->winsect, &top) == 0) return write_window(fs);	/* Pool disabled */
+	i = wc_find(fs, fs->winsect);
+	if (i < 0) i = wc_alloc(fs, fs->winsect, 1);
+	if (i < 0) return FR_DISK_ERR;
+	memcpy(WinCache.buf[i], fs->win, SS(fs));
+	WinCache.ent[i].dirty |= fs->wflag;
+	WinCache.ent[i].stamp = ++WinCache.stamp;
+	fs->wflag = 0;
+	return FR_OK;
+}
+
+
+/* Fill the window from the cache, or from the volume with read-ahead */
+static FRESULT wc_load (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect		/* Sector to load */
+)
+{
+	UINT n, k;
+	int i;
+
+
+	i = wc_find(fs, sect);
+	if (i >= 0) {	/* Hit: the window takes over the entry */
+		memcpy(fs->win, WinCache.buf[i], SS(fs));
+		fs->wflag = WinCache.ent[i].dirty;
+		WinCache.ent[i].sect = (LBA_t)0 - 1;
+		WinCache.ent[i].dirty = 0;
+		fs->winsect = sect;
+		return FR_OK;
+	}
+	n = wc_ahead(fs, sect);
+	if (disk_read(fs->pdrv, n > 1 ? WinCache.run : fs->win, sect, n) != RES_OK) {
+		fs->winsect = (LBA_t)0 - 1;	/* Invalidate window if read data is not valid */
+		return FR_DISK_ERR;
+	}
+	if (n > 1) {
+		memcpy(fs->win, WinCache.run, SS(fs));
+		for (k = 1; k < n; k++) {	/* Keep the read-ahead sectors not cached yet, without evicting dirty ones */
+			if (wc_find(fs, sect + k) >= 0) continue;
+			i = wc_alloc(fs, sect + k, 0);
+			if (i < 0) break;
+			memcpy(WinCache.buf[i], WinCache.run + k * SS(fs), SS(fs));
+		}
+	}
+	fs->winsect = sect;
+	return FR_OK;
+}
+#endif	/* WCACHE */
+
+
+#if !FF_FS_READONLY
+static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs			/* Filesystem object */
+)
+{
+	FRESULT res;
+
+
+	res = write_window(fs);
+#if WCACHE
+	if (res == FR_OK && WinCache.fs == fs) res = wc_flush(fs);	/* Write back the cached sectors too */
+#endif
+	return res;
+}
+#endif
+
+
 static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs,		/* Filesystem object */
 	LBA_t sect		/* Sector LBA to make appearance in the fs->win[] */
@@ -1085,8 +1439,15 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 	if (sect != fs->winsect) {	/* Window offset changed? */
+#if WCACHE
+		if (WinCache.fs == fs) {	/* Swap the window through the cache */
+			res = wc_stash(fs);
+			if (res == FR_OK) res = wc_load(fs, sect);
+			return res;
+		}
+#endif
 #if !FF_FS_READONLY
-		res = sync_window(fs);		/* Flush the window */
+		res = write_window(fs);		/* Flush the window */
 #endif
 		if (res == FR_OK) {			/* Fill sector window with new data */
 			if (disk_read(fs->pdrv, fs->win, sect, 1) != RES_OK) {
@@ -1102,6 +1463,183 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 
+#if !FF_FS_READONLY && (FF_USE_MKFS || (FF_FS_EXFAT && FF_FS_EXFATINFO))
+static DWORD xsum32 (	/* Returns 32-bit checksum */
+	BYTE  dat,			/* Byte to be calculated (byte-by-byte processing) */
+	DWORD sum			/* Previous sum value */
+)
+{
+	sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + dat;
+	return sum;
+}
+#endif
+
+
+
+#if FF_FS_EXFAT && FF_FS_EXFATINFO && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* exFAT: Free cluster count record in the OEM parameters sector         */
+/*-----------------------------------------------------------------------*/
+
+static int xinfo_find (	/* Offset of the record in the sector, -1:Not found */
+	const BYTE* sec,	/* OEM parameters sector */
+	int alloc			/* 1:Return an unused slot if the record is not there */
+)
+{
+	UINT ofs, i;
+	int unused = -1;
+
+
+	for (ofs = 0; ofs < N_XINF * SZ_XINF; ofs += SZ_XINF) {
+		if (!memcmp(sec + ofs, GUID_FreeInfo, 16)) return (int)ofs;
+		for (i = 0; i < 16 && sec[ofs + i] == 0; i++) ;	/* Null GUID: unused parameter */
+		if (alloc && unused < 0 && i == 16) unused = (int)ofs;
+	}
+	return unused;
+}
+
+
+static DWORD xinfo_sum (	/* Checksum of the record */
+	const BYTE* rec
+)
+{
+	UINT i;
+	DWORD sum = 0;
+
+
+	for (i = 0; i < XINF_Sum; i++) sum = xsum32(rec[i], sum);
+	return sum;
+}
+
+
+/* Drop boot region sectors held by the window and the cache, they are */
+/* rewritten behind them                                               */
+static void xinfo_forget (
+	FATFS* fs		/* Filesystem object */
+)
+{
+	if (fs->winsect - fs->volbase < BS_BackupEx * 2) fs->winsect = (LBA_t)0 - 1;	/* Never dirty there */
+#if WCACHE
+	wc_discard(fs, fs->volbase, BS_BackupEx * 2);
+#endif
+}
+
+
+/* Update the VBR of both boot regions. VolumeFlags and PercentInUse are */
+/* outside the boot checksum, so each region stays valid at any time.   */
+static FRESULT xinfo_vbr (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	BYTE* buf,		/* Sector buffer */
+	int dirty,		/* VolumeDirty to be set (1) or cleared (0) */
+	UINT pct		/* PercentInUse to be set, >100:Leave as is */
+)
+{
+	LBA_t sect;
+	WORD flags;
+	UINT r;
+
+
+	for (r = 0; r < 2; r++) {	/* Main and backup boot region */
+		sect = fs->volbase + r * BS_BackupEx;
+		if (disk_read(fs->pdrv, buf, sect, 1) != RES_OK) return FR_DISK_ERR;
+		flags = ld_word(buf + BPB_VolFlagEx);
+		st_word(buf + BPB_VolFlagEx, dirty ? flags | 2 : flags & ~2);
+		if (pct <= 100) buf[BPB_PercInUseEx] = (BYTE)pct;
+		if (disk_write(fs->pdrv, buf, sect, 1) != RES_OK) return FR_DISK_ERR;
+	}
+	return disk_ioctl(fs->pdrv, CTRL_SYNC, 0) == RES_OK ? FR_OK : FR_DISK_ERR;
+}
+
+
+/* Set VolumeDirty before the first change of the allocation bitmap, so */
+/* that the free count record is not trusted after a crash              */
+static FRESULT xinfo_dirty (	/* Returns FR_OK, FR_DISK_ERR or FR_NOT_ENOUGH_CORE */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	FRESULT res;
+	BYTE *buf;
+
+
+	buf = ff_memalloc(SS(fs));
+	if (!buf) return FR_NOT_ENOUGH_CORE;
+	xinfo_forget(fs);
+	res = xinfo_vbr(fs, buf, 1, 0xFF);
+	if (res == FR_OK) fs->xflag = 1;
+	ff_memfree(buf);
+	return res;
+}
+
+
+/* At unmount: store the free cluster count (or remove a record that no */
+/* longer holds) in both boot regions with their checksums, then set    */
+/* PercentInUse and clear VolumeDirty, which makes the record valid     */
+static FRESULT sync_xinfo (	/* Returns FR_OK, FR_DISK_ERR or FR_NOT_ENOUGH_CORE */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	DWORD nclst = fs->n_fatent - 2, sum, vsn;
+	UINT i, j, r, pct = 0xFF;
+	int ofs, valid;
+	LBA_t sect;
+	BYTE *buf, *rec;
+	FRESULT res = FR_OK;
+
+
+	if (fs->xflag & 0x80) return FR_OK;					/* Dirty before mount: not ours to clear, the record is not trusted anyway */
+	if (fs->xflag == 0 && fs->fsi_flag != 1) return FR_OK;	/* Nothing changed */
+	buf = ff_memalloc(SS(fs));
+	if (!buf) return FR_NOT_ENOUGH_CORE;
+	xinfo_forget(fs);
+	valid = (fs->free_clst <= nclst);
+	if (valid) pct = (UINT)((QWORD)(nclst - fs->free_clst) * 100 / nclst);
+
+	for (r = 0; r < 2 && res == FR_OK; r++) {	/* Main and backup boot region */
+		sect = fs->volbase + r * BS_BackupEx;
+		if (disk_read(fs->pdrv, buf, sect, 1) != RES_OK) { res = FR_DISK_ERR; break; }
+		vsn = ld_dword(buf + BPB_VolIDEx);
+		if (disk_read(fs->pdrv, buf, sect + BS_OEMParamEx, 1) != RES_OK) { res = FR_DISK_ERR; break; }
+		ofs = xinfo_find(buf, valid);
+		if (ofs < 0) continue;		/* No record to remove or no room for one */
+		rec = buf + ofs;
+		memset(rec, 0, SZ_XINF);	/* Removed record: null GUID */
+		if (valid) {
+			memcpy(rec, GUID_FreeInfo, 16);
+			st_dword(rec + XINF_Free, fs->free_clst);
+			st_dword(rec + XINF_NumClus, nclst);
+			st_dword(rec + XINF_VolID, vsn);
+			rec[XINF_PercInUse] = (BYTE)pct;
+			st_dword(rec + XINF_Sum, xinfo_sum(rec));
+		}
+		if (disk_write(fs->pdrv, buf, sect + BS_OEMParamEx, 1) != RES_OK) { res = FR_DISK_ERR; break; }
+
+		for (sum = 0, j = 0; j < BS_SumEx; j++) {	/* Rebuild the boot checksum of the region */
+			if (disk_read(fs->pdrv, buf, sect + j, 1) != RES_OK) { res = FR_DISK_ERR; break; }
+			for (i = 0; i < SS(fs); i++) {
+				if (j == 0 && (i == BPB_VolFlagEx || i == BPB_VolFlagEx + 1 || i == BPB_PercInUseEx)) continue;
+				sum = xsum32(buf[i], sum);
+			}
+		}
+		if (res != FR_OK) break;
+		for (i = 0; i < SS(fs); i += 4) st_dword(buf + i, sum);	/* Fill the sum record with the checksum */
+		if (disk_write(fs->pdrv, buf, sect + BS_SumEx, 1) != RES_OK) res = FR_DISK_ERR;
+		/* The main region is complete before the backup is touched */
+		if (res == FR_OK && disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
+	}
+	if (res == FR_OK) res = xinfo_vbr(fs, buf, 0, pct);	/* Commit: clear VolumeDirty */
+	if (res == FR_OK) {
+		fs->xflag = 0;
+		fs->fsi_flag = 0;
+	}
+	ff_memfree(buf);
+	return res;
+}
+
+#endif	/* FF_FS_EXFAT && FF_FS_EXFATINFO && !FF_FS_READONLY */
+
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Synchronize filesystem and data on the storage                        */
@@ -1117,6 +1655,8 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 	res = sync_window(fs);
 	if (res == FR_OK) {
 		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {	/* FAT32: Update FSInfo sector if needed */
+			/* The FAT must reach the volume before the FSInfo describing it */
+			if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) return FR_DISK_ERR;
 			/* Create FSInfo structure */
 			memset(fs->win, 0, sizeof fs->win);
 			st_word(fs->win + BS_55AA, 0xAA55);					/* Boot signature */
@@ -1125,6 +1665,9 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 			st_dword(fs->win + FSI_Free_Count, fs->free_clst);	/* Number of free clusters */
 			st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);	/* Last allocated culuster */
 			fs->winsect = fs->volbase + 1;						/* Write it into the FSInfo sector (Next to VBR) */
+#if WCACHE
+			wc_discard(fs, fs->winsect, 1);
+#endif
 			disk_write(fs->pdrv, fs->win, fs->winsect, 1);
 			fs->fsi_flag = 0;
 		}
@@ -1233,6 +1776,279 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 
 
 
+#if FREEIDX
+/*-----------------------------------------------------------------------*/
+/* FAT access - Free extent index                                        */
+/*-----------------------------------------------------------------------*/
+
+static void fx_reset (
+	FATFS* fs		/* Filesystem object to own the index (0:not built) */
+)
+{
+	FreeIdx.fs = fs;
+	FreeIdx.n = 0;
+	FreeIdx.partial = 0;
+	FreeIdx.minlen = 1;
+	FreeIdx.want = 1;
+}
+
+
+static UINT fx_lower (	/* Index of the first extent ending after clst */
+	DWORD clst
+)
+{
+	UINT lo = 0, hi = FreeIdx.n, mid;
+
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (FreeIdx.ext[mid].start + FreeIdx.ext[mid].len <= clst) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+
+static void fx_insert (
+	UINT i,			/* Index to insert at */
+	DWORD start,	/* First free cluster */
+	DWORD len		/* Number of free clusters */
+)
+{
+	UINT j, k;
+
+
+	if (len < FreeIdx.minlen) {		/* Too short to be kept */
+		FreeIdx.partial = 1;
+		return;
+	}
+	if (FreeIdx.n >= FF_FREE_EXTENTS) {	/* Full? Drop the shortest extents */
+		FreeIdx.partial = 1;
+		do {
+			FreeIdx.minlen *= 2;
+			for (j = k = 0; j < FreeIdx.n; j++) {
+				if (FreeIdx.ext[j].len >= FreeIdx.minlen) FreeIdx.ext[k++] = FreeIdx.ext[j];
+			}
+			FreeIdx.n = k;
+		} while (FreeIdx.n >= FF_FREE_EXTENTS);
+		if (len < FreeIdx.minlen) return;
+		i = fx_lower(start);
+	}
+	memmove(&FreeIdx.ext[i + 1], &FreeIdx.ext[i], (FreeIdx.n - i) * sizeof FreeIdx.ext[0]);
+	FreeIdx.ext[i].start = start;
+	FreeIdx.ext[i].len = len;
+	FreeIdx.n++;
+}
+
+
+static void fx_remove (
+	UINT i			/* Index to remove */
+)
+{
+	FreeIdx.n--;
+	memmove(&FreeIdx.ext[i], &FreeIdx.ext[i + 1], (FreeIdx.n - i) * sizeof FreeIdx.ext[0]);
+}
+
+
+/* Clusters are going to be in use */
+static void fx_take (
+	DWORD clst,		/* First cluster */
+	DWORD ncl		/* Number of clusters */
+)
+{
+	DWORD end = clst + ncl, s, e;
+	UINT i;
+
+
+	for (i = fx_lower(clst); i < FreeIdx.n && FreeIdx.ext[i].start < end; ) {
+		s = FreeIdx.ext[i].start; e = s + FreeIdx.ext[i].len;
+		if (s < clst) {				/* Keep the head */
+			FreeIdx.ext[i].len = clst - s;
+			if (e > end) {			/* and the tail */
+				fx_insert(i + 1, end, e - end);
+				return;
+			}
+			i++;
+		} else if (e > end) {		/* Keep the tail */
+			FreeIdx.ext[i].start = end;
+			FreeIdx.ext[i].len = e - end;
+			return;
+		} else {					/* Entire extent is taken */
+			fx_remove(i);
+		}
+	}
+}
+
+
+/* Clusters have been freed */
+static void fx_give (
+	DWORD clst,		/* First cluster */
+	DWORD ncl		/* Number of clusters */
+)
+{
+	DWORD end = clst + ncl;
+	UINT i = fx_lower(clst);
+
+
+	if (i < FreeIdx.n && FreeIdx.ext[i].start < end) {	/* Already free? The index went out of sync */
+		fx_reset(0);
+		return;
+	}
+	if (i > 0 && FreeIdx.ext[i - 1].start + FreeIdx.ext[i - 1].len == clst) {	/* Extend the previous extent */
+		FreeIdx.ext[i - 1].len += ncl;
+		if (i < FreeIdx.n && FreeIdx.ext[i].start == end) {	/* and merge the next one */
+			FreeIdx.ext[i - 1].len += FreeIdx.ext[i].len;
+			fx_remove(i);
+		}
+	} else if (i < FreeIdx.n && FreeIdx.ext[i].start == end) {	/* Extend the next extent downward */
+		FreeIdx.ext[i].start = clst;
+		FreeIdx.ext[i].len += ncl;
+	} else {
+		fx_insert(i, clst, ncl);
+	}
+}
+
+
+static DWORD fx_room (	/* Number of free clusters from clst on in the index */
+	DWORD clst
+)
+{
+	UINT i = fx_lower(clst);
+
+
+	if (i < FreeIdx.n && FreeIdx.ext[i].start <= clst) {
+		return FreeIdx.ext[i].start + FreeIdx.ext[i].len - clst;
+	}
+	return 0;
+}
+
+
+static DWORD fx_pick (	/* 0:Not found, >=2:Top of the block to allocate */
+	DWORD ncl,		/* Number of contiguous clusters wanted */
+	int exact		/* 0:Largest block if no block is long enough, 1:Block must hold ncl clusters */
+)
+{
+	UINT i, best = FreeIdx.n, big = FreeIdx.n;
+
+
+	for (i = 0; i < FreeIdx.n; i++) {	/* Best-fit */
+		if (FreeIdx.ext[i].len >= ncl && (best == FreeIdx.n || FreeIdx.ext[i].len < FreeIdx.ext[best].len)) {
+			best = i;
+			if (FreeIdx.ext[i].len == ncl) break;
+		}
+		if (big == FreeIdx.n || FreeIdx.ext[i].len > FreeIdx.ext[big].len) big = i;
+	}
+	if (best < FreeIdx.n) return FreeIdx.ext[best].start;
+	if (!exact && big < FreeIdx.n) return FreeIdx.ext[big].start;
+	return 0;
+}
+
+
+/* Build the index by reading the FAT or the allocation bitmap in bulk */
+static void fx_build (
+	FATFS* fs		/* Filesystem object */
+)
+{
+	DWORD clst, rs, nfree, w;
+	LBA_t sect;
+	UINT szb, n, i, b;
+	BYTE *buf;
+	FFOBJID obj;
+
+
+	fx_reset(0);
+	if (sync_window(fs) != FR_OK) return;	/* FAT sectors behind the window go to the disk first */
+	rs = nfree = 0;	/* rs: top of the current free run (0:in use) */
+
+	if (fs->fs_type == FS_FAT12) {	/* FAT12: Entries straddle sectors and the table is small */
+		obj.fs = fs;
+		for (clst = 2; clst < fs->n_fatent; clst++) {
+			w = get_fat(&obj, clst);
+			if (w == 1 || w == 0xFFFFFFFF) return;
+			if (w == 0) {
+				if (rs == 0) rs = clst;
+			} else if (rs != 0) {
+				fx_insert(FreeIdx.n, rs, clst - rs); nfree += clst - rs; rs = 0;
+			}
+		}
+	} else {
+		for (szb = MAX_SCAN, buf = 0; szb >= SS(fs) && (buf = ff_memalloc(szb)) == 0; szb /= 2) ;
+		if (!buf) return;
+		szb /= SS(fs);	/* Bytes -> Sectors */
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan the bitmap a DWORD at a time */
+			sect = fs->bitbase;
+			for (clst = 2; clst < fs->n_fatent; sect += szb) {
+				n = (UINT)((fs->n_fatent - clst + 7) / 8 / SS(fs) + 1);	/* Sectors left */
+				if (n > szb) n = szb;
+				if (disk_read(fs->pdrv, buf, sect, n) != RES_OK) break;
+				for (i = 0; i < n * SS(fs) && clst < fs->n_fatent; i += 4) {
+					w = ld_dword(buf + i);
+					if (clst + 32 <= fs->n_fatent && (w == 0 || w == 0xFFFFFFFF)) {	/* 32 free or 32 used clusters */
+						if (w == 0) {
+							if (rs == 0) rs = clst;
+						} else if (rs != 0) {
+							fx_insert(FreeIdx.n, rs, clst - rs); nfree += clst - rs; rs = 0;
+						}
+						clst += 32;
+						continue;
+					}
+					for (b = 0; b < 32 && clst < fs->n_fatent; b++, clst++, w >>= 1) {
+						if (!(w & 1)) {
+							if (rs == 0) rs = clst;
+						} else if (rs != 0) {
+							fx_insert(FreeIdx.n, rs, clst - rs); nfree += clst - rs; rs = 0;
+						}
+					}
+				}
+			}
+		} else
+#endif
+		{	/* FAT16/32: Scan WORD/DWORD entries */
+			sect = fs->fatbase;
+			for (clst = 0; clst < fs->n_fatent; sect += szb) {
+				n = szb;
+				if (n > fs->fsize - (DWORD)(sect - fs->fatbase)) n = (UINT)(fs->fsize - (DWORD)(sect - fs->fatbase));
+				if (n == 0 || disk_read(fs->pdrv, buf, sect, n) != RES_OK) break;
+				for (i = 0; i < n * SS(fs) && clst < fs->n_fatent; clst++) {
+					if (fs->fs_type == FS_FAT16) {
+						w = ld_word(buf + i); i += 2;
+					} else {
+						w = ld_dword(buf + i) & 0x0FFFFFFF; i += 4;
+					}
+					if (clst < 2) continue;		/* Reserved entries */
+					if (w == 0) {
+						if (rs == 0) rs = clst;
+					} else if (rs != 0) {
+						fx_insert(FreeIdx.n, rs, clst - rs); nfree += clst - rs; rs = 0;
+					}
+				}
+			}
+		}
+		ff_memfree(buf);
+		if (clst < fs->n_fatent) {	/* Disk error */
+			fx_reset(0);
+			return;
+		}
+	}
+	if (rs != 0) {
+		fx_insert(FreeIdx.n, rs, fs->n_fatent - rs); nfree += fs->n_fatent - rs;
+	}
+	FreeIdx.fs = fs;
+	if (fs->free_clst != nfree) {	/* The scan gives the exact free cluster count for free */
+		fs->free_clst = nfree;
+		fs->fsi_flag |= 1;
+	}
+}
+
+#endif	/* FREEIDX */
+
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* FAT access - Change value of an FAT entry                             */
@@ -1285,6 +2101,15 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 			fs->wflag = 1;
 			break;
 		}
+#if FREEIDX
+		if (res == FR_OK && FreeIdx.fs == fs && fs->fs_type != FS_EXFAT) {	/* exFAT keeps the allocation state in the bitmap */
+			if (val == 0) {
+				fx_give(clst, 1);
+			} else {
+				fx_take(clst, 1);
+			}
+		}
+#endif
 	}
 	return res;
 }
@@ -1355,15 +2180,36 @@ static FRESULT change_bitmap (
 	LBA_t sect;
 
 
+#if FF_FS_EXFATINFO
+	if (fs->xflag == 0) {	/* First change since mount: invalidate the free count record */
+		FRESULT res = xinfo_dirty(fs);
+
+		if (res != FR_OK) return res;
+	}
+#endif
+#if FREEIDX
+	if (FreeIdx.fs == fs) {		/* Keep the free extent index in step */
+		if (bv) {
+			fx_take(clst, ncl);
+		} else {
+			fx_give(clst, ncl);
+		}
+	}
+#endif
 	clst -= 2;	/* The first bit corresponds to cluster #2 */
 	sect = fs->bitbase + clst / 8 / SS(fs);	/* Sector address */
 	i = clst / 8 % SS(fs);					/* Byte offset in the sector */
 	bm = 1 << (clst % 8);					/* Bit mask in the byte */
 	for (;;) {
-		if (move_window(fs, sect++) != FR_OK) return FR_DISK_ERR;
+		if (move_window(fs, sect++) != FR_OK) break;
 		do {
 			do {
-				if (bv == (int)((fs->win[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
+				if (bv == (int)((fs->win[i] & bm) != 0)) {	/* Is the bit expected value? */
+#if FREEIDX
+					if (FreeIdx.fs == fs) fx_reset(0);
+#endif
+					return FR_INT_ERR;
+				}
 				fs->win[i] ^= bm;	/* Flip the bit */
 				fs->wflag = 1;
 				if (--ncl == 0) return FR_OK;	/* All bits processed? */
@@ -1372,6 +2218,10 @@ static FRESULT change_bitmap (
 		} while (++i < SS(fs));		/* Next byte */
 		i = 0;
 	}
+#if FREEIDX
+	if (FreeIdx.fs == fs) fx_reset(0);
+#endif
+	return FR_DISK_ERR;
 }
 
 
@@ -1437,7 +2287,7 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 	FRESULT res = FR_OK;
 	DWORD nxt;
 	FATFS *fs = obj->fs;
-#if FF_FS_EXFAT || FF_USE_TRIM
+#if FF_FS_EXFAT || FF_USE_TRIM || WCACHE
 	DWORD scl = clst, ecl = clst;
 #endif
 #if FF_USE_TRIM
@@ -1466,10 +2316,13 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
 		}
-#if FF_FS_EXFAT || FF_USE_TRIM
+#if FF_FS_EXFAT || FF_USE_TRIM || WCACHE
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
 			ecl = nxt;
 		} else {				/* End of contiguous cluster block */
+#if WCACHE
+			wc_discard(fs, clst2sect(fs, scl), (LBA_t)(ecl - scl + 1) * fs->csize);	/* Freed clusters may be reused as file data */
+#endif
 #if FF_FS_EXFAT
 			if (fs->fs_type == FS_EXFAT) {
 				res = change_bitmap(fs, scl, ecl - scl + 1, 0);	/* Mark the cluster block 'free' on the bitmap */
@@ -1531,6 +2384,9 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	DWORD cs, ncl, scl;
 	FRESULT res;
 	FATFS *fs = obj->fs;
+#if FREEIDX
+	DWORD want = FreeIdx.want ? FreeIdx.want : 1;	/* Zero until the index is first reset */
+#endif
 
 
 	if (clst == 0) {	/* Create a new chain */
@@ -1545,10 +2401,21 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 		scl = clst;							/* Cluster to start to find */
 	}
 	if (fs->free_clst == 0) return 0;		/* No free cluster */
+#if FREEIDX
+	if (FreeIdx.fs != fs) fx_build(fs);
+#endif
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		ncl = find_bitmap(fs, scl, 1);				/* Find a free cluster */
+		ncl = 0;
+#if FREEIDX
+		if (FreeIdx.fs == fs) {		/* Take it from the free extent index */
+			ncl = scl + 1;			/* Next to the chain or the last allocation if it has the room */
+			if (fx_room(ncl) < (clst != 0 ? 1 : want)) ncl = fx_pick(want, 0);
+			if (ncl == 0 && !FreeIdx.partial) return 0;
+		}
+#endif
+		if (ncl == 0) ncl = find_bitmap(fs, scl, 1);	/* Find a free cluster */
 		if (ncl == 0 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or hard error? */
 		res = change_bitmap(fs, ncl, 1, 1);			/* Mark the cluster 'in use' */
 		if (res == FR_INT_ERR) return 1;
@@ -1585,6 +2452,13 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 				ncl = 0;
 			}
 		}
+#if FREEIDX
+		if (ncl == 0 && FreeIdx.fs == fs) {	/* Take it from the free extent index */
+			ncl = scl + 1;
+			if (fx_room(ncl) < want) ncl = fx_pick(want, 0);
+			if (ncl == 0 && !FreeIdx.partial) return 0;
+		}
+#endif
 		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
 			ncl = scl;	/* Start cluster */
 			for (;;) {
@@ -1621,6 +2495,30 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Get length of the contiguous run at current cluster    */
+/*-----------------------------------------------------------------------*/
+
+static UINT clst_run (	/* Number of clusters contiguous from fp->clust on the chain (1..ncl) */
+	FIL* fp,		/* Pointer to the file object */
+	UINT ncl		/* Number of clusters wanted */
+)
+{
+	DWORD clst = fp->clust, nxt;
+	UINT n;
+
+
+	for (n = 1; n < ncl; n++) {
+		nxt = get_fat(&fp->obj, clst);	/* No FAT access on the exFAT contiguous file */
+		if (nxt != clst + 1) break;		/* End of chain, next fragment or error is left to the caller */
+		clst = nxt;
+	}
+	return n;
+}
+
+
+
+
 #if FF_USE_FASTSEEK
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Convert offset into cluster with link map table        */
@@ -1670,6 +2568,9 @@ static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
 	if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
 	sect = clst2sect(fs, clst);		/* Top of the cluster */
 	fs->winsect = sect;				/* Set window to top of the cluster */
+#if WCACHE
+	wc_discard(fs, sect, fs->csize);	/* Cached copies are about to be stale */
+#endif
 	memset(fs->win, 0, sizeof fs->win);	/* Clear window buffer */
 #if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
 	/* Allocate a temporary buffer */
@@ -1791,12 +2692,208 @@ static FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DEN
 			}
 		}
 	}
-	dp->dptr = ofs;						/* Current entry */
-	dp->dir = fs->win + ofs % SS(fs);	/* Pointer to the entry in the win[] */
+	dp->dptr = ofs;						/* Current entry */
+	dp->dir = fs->win + ofs % SS(fs);	/* Pointer to the entry in the win[] */
+
+	return FR_OK;
+}
+
+
+
+
+#if DIRIDX
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Name index                                       */
+/*-----------------------------------------------------------------------*/
+
+static void dx_free (
+	DXDIR* x		/* Index slot to release */
+)
+{
+	if (x->ent) ff_memfree(x->ent);
+	if (x->head) ff_memfree(x->head);
+	memset(x, 0, sizeof (DXDIR));
+}
+
+
+static void dx_reset (
+	FATFS* fs		/* Filesystem object whose indexes are dropped (0:all) */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < FF_DIR_INDEX; i++) {
+		if (!fs || DirIdx[i].fs == fs) dx_free(&DirIdx[i]);
+	}
+}
+
+
+static DWORD dx_key (	/* Start cluster the index of a directory is kept under (0:root) */
+	FATFS* fs,		/* Filesystem object */
+	DWORD sclust	/* Start cluster of the directory */
+)
+{
+	if (fs->fs_type >= FS_FAT32 && sclust == (DWORD)fs->dirbase) return 0;	/* Root directory reached by its start cluster */
+	return sclust;
+}
+
+
+static void dx_drop (
+	FATFS* fs,		/* Filesystem object */
+	DWORD sclust	/* Start cluster of the directory whose index is dropped (0:root) */
+)
+{
+	UINT i;
+
+
+	sclust = dx_key(fs, sclust);
+	for (i = 0; i < FF_DIR_INDEX; i++) {
+		if (DirIdx[i].fs == fs && DirIdx[i].sclust == sclust) dx_free(&DirIdx[i]);
+	}
+}
+
+
+static DXDIR* dx_slot (	/* Index of the directory (0:not indexed) */
+	DIR* dp,		/* Directory object */
+	int create		/* 1:Take the least recently used slot if the directory has none */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	DXDIR *x, *lru = &DirIdx[0];
+	DWORD sclust = dx_key(fs, dp->obj.sclust);
+	UINT i;
+
+
+	for (i = 0; i < FF_DIR_INDEX; i++) {
+		x = &DirIdx[i];
+		if (x->fs == fs && x->id == fs->id && x->sclust == sclust) {
+			x->stamp = ++DirIdxStamp;
+			return x;
+		}
+		if (x->stamp < lru->stamp) lru = x;
+	}
+	if (!create) return 0;
+
+	dx_free(lru);		/* A new slot is empty until dx_build() fills it */
+	lru->fs = fs;
+	lru->id = fs->id;
+	lru->sclust = sclust;
+	lru->stamp = ++DirIdxStamp;
+	return lru;
+}
+
+
+static void dx_link (
+	DXDIR* x,		/* Index */
+	UINT i			/* Item to put into the buckets of its keys */
+)
+{
+	DXENT *e = &x->ent[i];
+	UINT k, *h;
+
+
+	for (k = DX_NAME; k <= DX_OFS; k++) {
+		if (e->keys & (1 << k)) {
+			h = &x->head[k * (x->mask + 1) + ((k == DX_OFS ? e->ofs / SZDIRE : e->hash[k]) & x->mask)];
+			e->next[k] = *h;
+			*h = i + 1;
+		}
+	}
+}
+
+
+static int dx_grow (	/* 1:succeeded, 0:not enough memory */
+	DXDIR* x		/* Index to enlarge (removed items are dropped on the way) */
+)
+{
+	DXENT *ent;
+	UINT *head, i, n, max = 64;
+
+
+	for (i = n = 0; i < x->n; i++) {	/* Count live items */
+		if (x->ent[i].blk != DX_DEAD) n++;
+	}
+	while (max < n * 2) max *= 2;
+	ent = ff_memalloc(max * sizeof (DXENT));
+	head = ff_memalloc(max * 3 * sizeof (UINT));
+	if (!ent || !head) {
+		if (ent) ff_memfree(ent);
+		if (head) ff_memfree(head);
+		return 0;
+	}
+	for (i = n = 0; i < x->n; i++) {
+		if (x->ent[i].blk != DX_DEAD) ent[n++] = x->ent[i];
+	}
+	if (x->ent) ff_memfree(x->ent);
+	if (x->head) ff_memfree(x->head);
+	x->ent = ent; x->head = head;
+	x->n = n; x->max = max; x->mask = max - 1;
+	memset(head, 0, max * 3 * sizeof (UINT));
+	for (i = 0; i < n; i++) dx_link(x, i);	/* Rehash all items */
+	return 1;
+}
+
+
+static int dx_add (	/* 1:succeeded, 0:not enough memory */
+	DXDIR* x,		/* Index */
+	DWORD blk,		/* Offset of the first entry of the item */
+	DWORD ofs,		/* Offset of the SFN entry (FAT) or the file entry (exFAT) */
+	WORD hname,		/* Hash of the name */
+	WORD hsfn,		/* Hash of the SFN */
+	BYTE keys		/* Keys to find the item by (1 << DX_NAME and/or 1 << DX_SFN) */
+)
+{
+	DXENT *e;
+
+
+	if (x->n == x->max && !dx_grow(x)) return 0;
+	e = &x->ent[x->n];
+	e->blk = blk;
+	e->ofs = ofs;
+	e->hash[DX_NAME] = hname;
+	e->hash[DX_SFN] = hsfn;
+	e->keys = keys | (1 << DX_OFS);
+	dx_link(x, x->n++);
+	return 1;
+}
+
+
+static void dx_unlink (
+	DXDIR* x,		/* Index */
+	DWORD ofs		/* Offset of the SFN entry (FAT) or the file entry (exFAT) */
+)
+{
+	DXENT *e;
+	UINT i;
+
+
+	for (i = x->head[DX_OFS * (x->mask + 1) + (ofs / SZDIRE & x->mask)]; i; i = e->next[DX_OFS]) {
+		e = &x->ent[i - 1];
+		if (e->blk != DX_DEAD && e->ofs == ofs) {
+			e->blk = DX_DEAD;	/* Left in the buckets until the next dx_grow() */
+			break;
+		}
+	}
+}
 
-	return FR_OK;
+
+static WORD sfn_hash (	/* Hash of the SFN */
+	const BYTE* sfn		/* Pointer to the SFN (11 bytes, as stored in the entry) */
+)
+{
+	UINT i;
+	WORD sum = 0;
+
+
+	for (i = 0; i < 11; i++) {
+		sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + sfn[i];
+	}
+	return sum;
 }
 
+#endif	/* DIRIDX */
+
 
 
 
@@ -1813,9 +2910,20 @@ static FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 	FRESULT res;
 	UINT n;
 	FATFS *fs = dp->obj.fs;
+#if DIRIDX
+	DXDIR *x = dx_slot(dp, 0);
+	DWORD top = 0;
 
 
+	if (x) {			/* Indexed directory: no entry is free before free_ofs */
+		top = x->free_ofs;
+		if (top && dir_sdi(dp, top) != FR_OK) top -= SZDIRE;	/* At end of the table, stretch it from the last entry */
+	}
+	res = dir_sdi(dp, top);
+	if (res != FR_OK && top) res = dir_sdi(dp, 0);
+#else
 	res = dir_sdi(dp, 0);
+#endif
 	if (res == FR_OK) {
 		n = 0;
 		do {
@@ -1835,6 +2943,11 @@ static FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 	}
 
 	if (res == FR_NO_FILE) res = FR_DENIED;	/* No directory entry to allocate */
+#if DIRIDX
+	if (x && res == FR_OK && dp->dptr - (n_ent - 1) * SZDIRE == x->free_ofs) {
+		x->free_ofs = dp->dptr + SZDIRE;	/* The block was the first free one */
+	}
+#endif
 	return res;
 }
 
@@ -2095,6 +3208,10 @@ static WORD xdir_sum (	/* Get checksum of the directoly entry block */
 
 
 
+#endif
+
+
+#if FF_FS_EXFAT || DIRIDX
 static WORD xname_sum (	/* Get check sum (to be used as hash) of the file name */
 	const WCHAR* name	/* File name to be calculated */
 )
@@ -2110,18 +3227,10 @@ static WORD xname_sum (	/* Get check sum (to be used as hash) of the file name *
 	}
 	return sum;
 }
+#endif
 
 
-#if !FF_FS_READONLY && FF_USE_MKFS
-static DWORD xsum32 (	/* Returns 32-bit checksum */
-	BYTE  dat,			/* Byte to be calculated (byte-by-byte processing) */
-	DWORD sum			/* Previous sum value */
-)
-{
-	sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + dat;
-	return sum;
-}
-#endif
+#if FF_FS_EXFAT
 
 
 
@@ -2383,44 +3492,43 @@ static FRESULT dir_read (
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
 
-static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
-	DIR* dp					/* Pointer to the directory object with the file name */
+#if FF_FS_EXFAT
+static int xdir_cmp (	/* 1:matched, 0:not matched */
+	FATFS* fs		/* Filesystem object with the entry block in dirbuf[] and the name in lfnbuf[] */
 )
 {
-	FRESULT res;
-	FATFS *fs = dp->obj.fs;
-	BYTE c;
-#if FF_USE_LFN
-	BYTE a, ord, sum;
-#endif
+	BYTE nc;
+	UINT di, ni;
 
-	res = dir_sdi(dp, 0);			/* Rewind directory object */
-	if (res != FR_OK) return res;
-#if FF_FS_EXFAT
-	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		BYTE nc;
-		UINT di, ni;
-		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
 
-		while ((res = DIR_READ_FILE(dp)) == FR_OK) {	/* Read an item */
 #if FF_MAX_LFN < 255
-			if (fs->dirbuf[XDIR_NumName] > FF_MAX_LFN) continue;		/* Skip comparison if inaccessible object name */
+	if (fs->dirbuf[XDIR_NumName] > FF_MAX_LFN) return 0;	/* Inaccessible object name */
 #endif
-			if (ld_word(fs->dirbuf + XDIR_NameHash) != hash) continue;	/* Skip comparison if hash mismatched */
-			for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
-				if ((di % SZDIRE) == 0) di += 2;
-				if (ff_wtoupper(ld_word(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
-			}
-			if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
-		}
-		return res;
+	for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
+		if ((di % SZDIRE) == 0) di += 2;
+		if (ff_wtoupper(ld_word(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
 	}
+	return nc == 0 && !fs->lfnbuf[ni];
+}
 #endif
-	/* On the FAT/FAT32 volume */
+
+
+/* FAT: Scan the table from the current entry up to an offset for the name */
+static FRESULT dir_scan (	/* FR_OK(0):found, FR_NO_FILE:not found, !=0:error */
+	DIR* dp,				/* Pointer to the directory object with the file name */
+	DWORD end				/* Offset of the last entry to examine */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	BYTE c;
 #if FF_USE_LFN
+	BYTE a, ord, sum;
+
 	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 #endif
 	do {
+		if (dp->dptr > end) { res = FR_NO_FILE; break; }	/* Out of the range to examine */
 		res = move_window(fs, dp->sect);
 		if (res != FR_OK) break;
 		c = dp->dir[DIR_Name];
@@ -2457,6 +3565,150 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 }
 
 
+#if DIRIDX
+/* Fill the index with all items in the directory */
+static FRESULT dx_build (	/* FR_OK:succeeded, FR_NOT_ENOUGH_CORE:no memory for the index, !=0:error */
+	DIR* dp,				/* Pointer to the directory object */
+	DXDIR* x				/* Empty index slot of the directory */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	WCHAR lfn[FF_MAX_LFN + 1];	/* fs->lfnbuf[] holds the name being searched */
+	DWORD blk = 0xFFFFFFFF;
+	BYTE c, a, ord = 0xFF, sum = 0xFF;
+	int ok;
+
+
+	if (!dx_grow(x)) return FR_NOT_ENOUGH_CORE;
+	x->free_ofs = DX_DEAD;		/* No free entry found yet */
+	res = dir_sdi(dp, 0);
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+		blk = 0;					/* Offset following the last item */
+		while (res == FR_OK && (res = DIR_READ_FILE(dp)) == FR_OK) {
+			if (x->free_ofs == DX_DEAD && dp->blk_ofs != blk) x->free_ofs = blk;	/* A gap before the item */
+			if (!dx_add(x, dp->blk_ofs, dp->blk_ofs, ld_word(fs->dirbuf + XDIR_NameHash), 0, 1 << DX_NAME)) return FR_NOT_ENOUGH_CORE;
+			blk = dp->dptr + SZDIRE;
+			res = dir_next(dp, 0);
+		}
+		if (x->free_ofs == DX_DEAD) x->free_ofs = blk;
+		return (res == FR_NO_FILE) ? FR_OK : res;
+	}
+#endif
+	/* On the FAT/FAT32 volume */
+	while (res == FR_OK) {
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		c = dp->dir[DIR_Name];
+		a = dp->dir[DIR_Attr] & AM_MASK;
+		if (c == 0 || c == DDEM) {			/* A free entry */
+			if (x->free_ofs == DX_DEAD) x->free_ofs = dp->dptr;
+			if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of table */
+			ord = 0xFF; blk = 0xFFFFFFFF;
+		} else if ((a & AM_VOL) && a != AM_LFN) {	/* Volume label */
+			ord = 0xFF; blk = 0xFFFFFFFF;
+		} else if (a == AM_LFN) {			/* An LFN entry, tracked the same way as dir_scan() does */
+			if (c & LLEF) {
+				sum = dp->dir[LDIR_Chksum];
+				c &= (BYTE)~LLEF; ord = c;
+				blk = dp->dptr;
+			}
+			ord = (c == ord && sum == dp->dir[LDIR_Chksum] && pick_lfn(lfn, dp->dir)) ? ord - 1 : 0xFF;
+		} else {							/* An SFN entry */
+			if (ord == 0 && sum == sum_sfn(dp->dir)) {	/* With a valid LFN */
+				ok = dx_add(x, blk, dp->dptr, xname_sum(lfn), sfn_hash(dp->dir), (1 << DX_NAME) | (1 << DX_SFN));
+			} else {
+				ok = dx_add(x, (blk == 0xFFFFFFFF) ? dp->dptr : blk, dp->dptr, 0, sfn_hash(dp->dir), 1 << DX_SFN);
+			}
+			if (!ok) return FR_NOT_ENOUGH_CORE;
+			ord = 0xFF; blk = 0xFFFFFFFF;
+		}
+		res = dir_next(dp, 0);
+	}
+	if (res == FR_NO_FILE) {
+		if (x->free_ofs == DX_DEAD) x->free_ofs = dp->dptr + SZDIRE;	/* The table is full */
+		res = FR_OK;
+	}
+	return res;
+}
+
+
+/* Look up the name through one key of the index */
+static FRESULT dx_find (	/* FR_OK(0):found, FR_NO_FILE:not found, !=0:error */
+	DIR* dp,				/* Pointer to the directory object with the file name */
+	DXDIR* x,				/* Index of the directory */
+	UINT key,				/* DX_NAME or DX_SFN */
+	WORD h					/* Hash of the name */
+)
+{
+	FRESULT res;
+	DXENT *e;
+	UINT i;
+
+
+	for (i = x->head[key * (x->mask + 1) + (h & x->mask)]; i; i = e->next[key]) {
+		e = &x->ent[i - 1];
+		if (e->blk == DX_DEAD || e->hash[key] != h) continue;
+		res = dir_sdi(dp, e->blk);		/* Verify the candidate on the table */
+		if (res == FR_OK) {
+#if FF_FS_EXFAT
+			if (dp->obj.fs->fs_type == FS_EXFAT) {
+				res = DIR_READ_FILE(dp);
+				if (res == FR_OK && (dp->blk_ofs != e->blk || !xdir_cmp(dp->obj.fs))) res = FR_NO_FILE;
+			} else
+#endif
+			{
+				res = dir_scan(dp, e->ofs);
+			}
+		}
+		if (res != FR_NO_FILE) return res;
+	}
+	return FR_NO_FILE;
+}
+#endif
+
+
+static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp					/* Pointer to the directory object with the file name */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+#if DIRIDX
+	DXDIR *x;
+
+
+	x = dx_slot(dp, 1);
+	if (x && !x->ent && dx_build(dp, x) != FR_OK) {	/* Index the directory at first access */
+		dx_free(x); x = 0;		/* or search it without index */
+	}
+	if (x) {
+		if (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) return dx_find(dp, x, DX_NAME, xname_sum(fs->lfnbuf));
+		res = FR_NO_FILE;
+		if (!(dp->fn[NSFLAG] & NS_NOLFN)) res = dx_find(dp, x, DX_NAME, xname_sum(fs->lfnbuf));	/* LFN matched? */
+		if (res == FR_NO_FILE && !(dp->fn[NSFLAG] & NS_LOSS)) res = dx_find(dp, x, DX_SFN, sfn_hash(dp->fn));	/* SFN matched? */
+		return res;
+	}
+#endif
+
+	res = dir_sdi(dp, 0);			/* Rewind directory object */
+	if (res != FR_OK) return res;
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
+
+		while ((res = DIR_READ_FILE(dp)) == FR_OK) {	/* Read an item */
+			if (ld_word(fs->dirbuf + XDIR_NameHash) != hash) continue;	/* Skip comparison if hash mismatched */
+			if (xdir_cmp(fs)) break;	/* Name matched? */
+		}
+		return res;
+	}
+#endif
+	return dir_scan(dp, 0xFFFFFFFF);	/* On the FAT/FAT32 volume */
+}
+
+
 
 
 #if !FF_FS_READONLY
@@ -2473,6 +3725,10 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 #if FF_USE_LFN		/* LFN configuration */
 	UINT n, len, n_ent;
 	BYTE sn[12], sum;
+#if DIRIDX
+	DXDIR *x;
+	DWORD blk;
+#endif
 
 
 	if (dp->fn[NSFLAG] & (NS_DOT | NS_NONAME)) return FR_INVALID_NAME;	/* Check name validity */
@@ -2506,13 +3762,17 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 		}
 
 		create_xdir(fs->dirbuf, fs->lfnbuf);	/* Create on-memory directory block to be written later */
+#if DIRIDX
+		x = dx_slot(dp, 0);
+		if (x && !dx_add(x, dp->blk_ofs, dp->blk_ofs, ld_word(fs->dirbuf + XDIR_NameHash), 0, 1 << DX_NAME)) dx_free(x);
+#endif
 		return FR_OK;
 	}
 #endif
 	/* On the FAT/FAT32 volume */
 	memcpy(sn, dp->fn, 12);
 	if (sn[NSFLAG] & NS_LOSS) {			/* When LFN is out of 8.3 format, generate a numbered name */
-		dp->fn[NSFLAG] = NS_NOLFN;		/* Find only SFN */
+		dp->fn[NSFLAG] = NS_NOLFN;		/* Find only SFN (a bucket probe when the directory is indexed) */
 		for (n = 1; n < 100; n++) {
 			gen_numname(dp->fn, sn, fs->lfnbuf, n);	/* Generate a numbered name */
 			res = dir_find(dp);				/* Check if the name collides with existing SFN */
@@ -2526,6 +3786,9 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	/* Create an SFN with/without LFNs. */
 	n_ent = (sn[NSFLAG] & NS_LFN) ? (len + 12) / 13 + 1 : 1;	/* Number of entries to allocate */
 	res = dir_alloc(dp, n_ent);		/* Allocate entries */
+#if DIRIDX
+	blk = dp->dptr - (n_ent - 1) * SZDIRE;	/* Top of the allocated block */
+#endif
 	if (res == FR_OK && --n_ent) {	/* Set LFN entry if needed */
 		res = dir_sdi(dp, dp->dptr - n_ent * SZDIRE);
 		if (res == FR_OK) {
@@ -2557,6 +3820,17 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 			fs->wflag = 1;
 		}
 	}
+#if DIRIDX
+	x = dx_slot(dp, 0);
+	if (x) {
+		if (res != FR_OK) {
+			dx_free(x);		/* The table may have been partly written */
+		} else if (!dx_add(x, blk, dp->dptr, (sn[NSFLAG] & NS_LFN) ? xname_sum(fs->lfnbuf) : 0, sfn_hash(dp->fn),
+				(sn[NSFLAG] & NS_LFN) ? (1 << DX_NAME) | (1 << DX_SFN) : (1 << DX_SFN))) {
+			dx_free(x);
+		}
+	}
+#endif
 
 	return res;
 }
@@ -2595,6 +3869,21 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 		} while (res == FR_OK);
 		if (res == FR_NO_FILE) res = FR_INT_ERR;
 	}
+#if DIRIDX
+	{
+		DXDIR *x = dx_slot(dp, 0);
+		DWORD top = (dp->blk_ofs == 0xFFFFFFFF) ? last : dp->blk_ofs;
+
+		if (x) {
+			if (res != FR_OK) {
+				dx_free(x);
+			} else {
+				dx_unlink(x, (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) ? dp->blk_ofs : last);
+				if (top < x->free_ofs) x->free_ofs = top;	/* The freed block may be the first free one */
+			}
+		}
+	}
+#endif
 #else			/* Non LFN configuration */
 
 	res = move_window(fs, dp->sect);
@@ -3300,6 +4589,15 @@ static UINT check_fs (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS,
 
 
 	fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
+#if WCACHE
+	wc_reset(fs);									/* and the sectors behind it */
+#endif
+#if FREEIDX
+	if (FreeIdx.fs == fs) fx_reset(0);				/* The volume may have been changed */
+#endif
+#if DIRIDX
+	dx_reset(fs);
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load the boot sector */
 	sign = ld_word(fs->win + BS_55AA);
 #if FF_FS_EXFAT
@@ -3506,6 +4804,33 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 #if !FF_FS_READONLY
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+#if FF_FS_EXFATINFO
+		/* Get the free count record if available */
+		fs->fsi_flag = 0x80;
+		fs->xflag = 0x80;	/* Leave the boot region alone if it cannot be read */
+		if (move_window(fs, bsect) == FR_OK) {
+			cv = ld_dword(fs->win + BPB_VolIDEx);		/* Volume serial number */
+			so = fs->win[BPB_PercInUseEx];				/* Percent in use */
+			i = ld_word(fs->win + BPB_VolFlagEx);		/* Volume flags */
+			fs->xflag = (i & 2) ? 0x80 : 0;				/* Dirty already: another driver or a crash, neither trusted nor cleared */
+			if (move_window(fs, bsect + BS_OEMParamEx) == FR_OK) {
+				int xo = xinfo_find(fs->win, 0);
+
+				fs->fsi_flag = 0;
+#if (FF_FS_NOFSINFO & 1) == 0
+				if (xo >= 0 && !(i & 2) && so <= 100	/* Volume is clean and PercentInUse is maintained */
+					&& ld_dword(fs->win + xo + XINF_Sum) == xinfo_sum(fs->win + xo)
+					&& ld_dword(fs->win + xo + XINF_NumClus) == nclst
+					&& ld_dword(fs->win + xo + XINF_VolID) == cv
+					&& fs->win[xo + XINF_PercInUse] == so	/* Nobody else changed the usage since */
+					&& ld_dword(fs->win + xo + XINF_Free) <= nclst)
+				{
+					fs->free_clst = ld_dword(fs->win + xo + XINF_Free);
+				}
+#endif
+			}
+		}
+#endif
 #endif
 		fmt = FS_EXFAT;			/* FAT sub-type */
 	} else
@@ -3674,6 +4999,24 @@ FRESULT f_mount (
 	cfs = FatFs[vol];			/* Pointer to the filesystem object of the volume */
 
 	if (cfs) {					/* Unregister current filesystem object if regsitered */
+#if !FF_FS_READONLY
+		if (cfs->fs_type) {		/* Write back the cached sectors, FSInfo and the lower layer */
+			if (sync_fs(cfs) == FR_OK) {
+#if FF_FS_EXFAT && FF_FS_EXFATINFO
+				if (cfs->fs_type == FS_EXFAT) sync_xinfo(cfs);	/* exFAT: Free count record, only when the volume is released */
+#endif
+			}
+		}
+#endif
+#if WCACHE
+		if (WinCache.fs == cfs) wc_reset(0);
+#endif
+#if FREEIDX
+		if (FreeIdx.fs == cfs) fx_reset(0);
+#endif
+#if DIRIDX
+		dx_reset(cfs);
+#endif
 		FatFs[vol] = 0;
 #if FF_FS_LOCK
 		clear_share(cfs);
@@ -3925,7 +5268,7 @@ FRESULT f_read (
 	DWORD clst;
 	LBA_t sect;
 	FSIZE_t remain;
-	UINT rcnt, cc, csect;
+	UINT rcnt, cc, csect, n;
 	BYTE *rbuff = (BYTE*)buff;
 
 
@@ -3961,8 +5304,10 @@ FRESULT f_read (
 			sect += csect;
 			cc = btr / SS(fs);					/* When remaining bytes >= sector size, */
 			if (cc > 0) {						/* Read maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				if (csect + cc > fs->csize) {	/* Span the following clusters while they are contiguous */
+					n = clst_run(fp, (csect + cc + fs->csize - 1) / fs->csize);
+					if (csect + cc > n * fs->csize) cc = n * fs->csize - csect;	/* Clip at end of the run */
+					fp->clust += n - 1;			/* Cluster of the last sector read */
 				}
 				if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 #if !FF_FS_READONLY && FF_FS_MINIMIZE <= 2		/* Replace one of the read sectors with cached data if it contains a dirty sector */
@@ -4024,7 +5369,7 @@ FRESULT f_write (
 	FATFS *fs;
 	DWORD clst;
 	LBA_t sect;
-	UINT wcnt, cc, csect;
+	UINT wcnt, cc, csect, n;
 	const BYTE *wbuff = (const BYTE*)buff;
 
 
@@ -4042,6 +5387,9 @@ FRESULT f_write (
 		if (fp->fptr % SS(fs) == 0) {		/* On the sector boundary? */
 			csect = (UINT)(fp->fptr / SS(fs)) & (fs->csize - 1);	/* Sector offset in the cluster */
 			if (csect == 0) {				/* On the cluster boundary? */
+#if FREEIDX
+				FreeIdx.want = (btw - 1) / ((DWORD)fs->csize * SS(fs)) + 1;	/* Let a new fragment fit the rest of the data */
+#endif
 				if (fp->fptr == 0) {		/* On the top of the file? */
 					clst = fp->obj.sclust;	/* Follow from the origin */
 					if (clst == 0) {		/* If no cluster is allocated, */
@@ -4057,6 +5405,9 @@ FRESULT f_write (
 						clst = create_chain(&fp->obj, fp->clust);	/* Follow or stretch cluster chain on the FAT */
 					}
 				}
+#if FREEIDX
+				FreeIdx.want = 1;
+#endif
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
 				if (clst == 1) ABORT(fs, FR_INT_ERR);
 				if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
@@ -4076,8 +5427,10 @@ FRESULT f_write (
 			sect += csect;
 			cc = btw / SS(fs);				/* When remaining bytes >= sector size, */
 			if (cc > 0) {					/* Write maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				if (csect + cc > fs->csize) {	/* Span the following allocated clusters while they are contiguous */
+					n = clst_run(fp, (csect + cc + fs->csize - 1) / fs->csize);
+					if (csect + cc > n * fs->csize) cc = n * fs->csize - csect;	/* Clip at end of the run */
+					fp->clust += n - 1;			/* Cluster of the last sector written */
 				}
 				if (disk_write(fs->pdrv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 #if FF_FS_MINIMIZE <= 2
@@ -4815,6 +6168,88 @@ FRESULT f_stat (
 /* Get Number of Free Clusters                                           */
 /*-----------------------------------------------------------------------*/
 
+#if FF_USE_LFN == 3
+static UINT pop32 (	/* Number of bits set in the word */
+	DWORD w
+)
+{
+	w = w - ((w >> 1) & 0x55555555);
+	w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+	w = (w + (w >> 4)) & 0x0F0F0F0F;
+	return (UINT)((w * 0x01010101) >> 24);
+}
+
+
+/* Count free clusters by reading the FAT16/32 or the allocation bitmap in large chunks */
+static FRESULT count_free (	/* FR_OK, FR_DISK_ERR or FR_NOT_ENOUGH_CORE:No scan buffer */
+	FATFS* fs,		/* Filesystem object */
+	DWORD* nfree	/* Pointer to return the number of free clusters */
+)
+{
+	FRESULT res = FR_OK;
+	DWORD clst, w, cnt = 0;
+	LBA_t sect, last;
+	UINT szb, n, i;
+	BYTE *buf;
+
+
+	for (szb = MAX_SCAN, buf = 0; szb >= SS(fs) && (buf = ff_memalloc(szb)) == 0; szb /= 2) ;
+	if (!buf) return FR_NOT_ENOUGH_CORE;
+	szb /= SS(fs);	/* Bytes -> Sectors */
+	if (sync_window(fs) != FR_OK) res = FR_DISK_ERR;	/* FAT sectors behind the window go to the disk first */
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* exFAT: Count zero bits a DWORD at a time */
+		clst = fs->n_fatent - 2;	/* Bits left */
+		sect = fs->bitbase;
+		last = sect + (clst + SS(fs) * 8 - 1) / (SS(fs) * 8);
+		for ( ; res == FR_OK && clst; sect += n) {
+			n = (last - sect > szb) ? szb : (UINT)(last - sect);
+			if (disk_read(fs->pdrv, buf, sect, n) != RES_OK) {
+				res = FR_DISK_ERR; break;
+			}
+			for (i = 0; i < n * SS(fs) && clst; i += 4) {
+				w = ~ld_dword(buf + i);
+				if (clst < 32) {	/* Bits past the last cluster are not counted */
+					w &= ((DWORD)1 << clst) - 1;
+					clst = 32;
+				}
+				cnt += pop32(w);
+				clst -= 32;
+			}
+		}
+	} else
+#endif
+	{	/* FAT16/32: Count zero entries */
+		clst = fs->n_fatent;	/* Entries left */
+		sect = fs->fatbase;
+		last = sect + fs->fsize;
+		for ( ; res == FR_OK && clst; sect += n) {
+			n = (last - sect > szb) ? szb : (UINT)(last - sect);
+			if (n == 0 || disk_read(fs->pdrv, buf, sect, n) != RES_OK) {
+				res = FR_DISK_ERR; break;
+			}
+			if (fs->fs_type == FS_FAT16) {
+				for (i = 0; i < n * SS(fs) && clst; i += 2, clst--) {
+					if (clst >= 2 && i + 4 <= n * SS(fs) && ld_dword(buf + i) == 0) {	/* Two free entries */
+						cnt += 2; i += 2; clst--;
+						continue;
+					}
+					if (ld_word(buf + i) == 0) cnt++;
+				}
+			} else {
+				for (i = 0; i < n * SS(fs) && clst; i += 4, clst--) {
+					if ((ld_dword(buf + i) & 0x0FFFFFFF) == 0) cnt++;
+				}
+			}
+		}
+	}
+	ff_memfree(buf);
+	*nfree = cnt;
+	return res;
+}
+#endif
+
+
 FRESULT f_getfree (
 	const TCHAR* path,	/* Logical drive number */
 	DWORD* nclst,		/* Pointer to a variable to return number of free clusters */
@@ -4852,6 +6287,12 @@ FRESULT f_getfree (
 					if (stat == 0) nfree++;
 				} while (++clst < fs->n_fatent);
 			} else {
+#if FF_USE_LFN == 3
+				res = count_free(fs, &nfree);	/* Read the table in large chunks */
+				if (res == FR_NOT_ENOUGH_CORE) {	/* No scan buffer, go sector by sector */
+					nfree = 0; res = FR_OK;
+				} else
+#endif
 #if FF_FS_EXFAT
 				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
 					BYTE bm;
@@ -5032,6 +6473,9 @@ FRESULT f_unlink (
 			}
 			if (res == FR_OK) {
 				res = dir_remove(&dj);			/* Remove the directory entry */
+#if DIRIDX
+				if (res == FR_OK && dclst != 0) dx_drop(fs, dclst);	/* Index of the removed sub-directory */
+#endif
 				if (res == FR_OK && dclst != 0) {	/* Remove the cluster chain if exist */
 #if FF_FS_EXFAT
 					res = remove_chain(&obj, dclst, 0);
@@ -5084,6 +6528,9 @@ FRESULT f_mkdir (
 			if (dcl == 1) res = FR_INT_ERR;		/* Any insanity? */
 			if (dcl == 0xFFFFFFFF) res = FR_DISK_ERR;	/* Disk error? */
 			tm = GET_FATTIME();
+#if DIRIDX
+			if (res == FR_OK) dx_drop(fs, dcl);	/* Stale index of a table that used the cluster */
+#endif
 			if (res == FR_OK) {
 				res = dir_clear(fs, dcl);		/* Clean up the new table */
 				if (res == FR_OK) {
@@ -5462,6 +6909,9 @@ FRESULT f_setlabel (
 	/* Get logical drive */
 	res = mount_volume(&label, &fs, FA_WRITE);
 	if (res != FR_OK) LEAVE_FF(fs, res);
+#if DIRIDX
+	dx_drop(fs, 0);		/* The label entry is not in the index of the root directory */
+#endif
 #if FF_STR_VOLUME_ID == 2
 	for ( ; *label == '/'; label++) ;	/* Snip the separators off */
 #endif
@@ -5589,10 +7039,18 @@ FRESULT f_expand (
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
 	stcl = fs->last_clst; lclst = 0;
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+	scl = 0;
+#if FREEIDX
+	if (FreeIdx.fs != fs) fx_build(fs);
+	if (FreeIdx.fs == fs) {
+		scl = fx_pick(tcl, 1);	/* Best-fit contiguous block */
+		if (scl == 0 && !FreeIdx.partial) LEAVE_FF(fs, FR_DENIED);
+	}
+#endif
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {
-		scl = find_bitmap(fs, stcl, tcl);			/* Find a contiguous cluster block */
+		if (scl == 0) scl = find_bitmap(fs, stcl, tcl);	/* Find a contiguous cluster block */
 		if (scl == 0) res = FR_DENIED;				/* No contiguous cluster block was found */
 		if (scl == 0xFFFFFFFF) res = FR_DISK_ERR;
 		if (res == FR_OK) {	/* A contiguous free area is found */
@@ -5606,23 +7064,25 @@ FRESULT f_expand (
 	} else
 #endif
 	{
-		scl = clst = stcl; ncl = 0;
-		for (;;) {	/* Find a contiguous cluster block */
-			n = get_fat(&fp->obj, clst);
-			if (++clst >= fs->n_fatent) clst = 2;
-			if (n == 1) {
-				res = FR_INT_ERR; break;
-			}
-			if (n == 0xFFFFFFFF) {
-				res = FR_DISK_ERR; break;
-			}
-			if (n == 0) {	/* Is it a free cluster? */
-				if (++ncl == tcl) break;	/* Break if a contiguous cluster block is found */
-			} else {
-				scl = clst; ncl = 0;		/* Not a free cluster */
-			}
-			if (clst == stcl) {		/* No contiguous cluster? */
-				res = FR_DENIED; break;
+		if (scl == 0) {
+			scl = clst = stcl; ncl = 0;
+			for (;;) {	/* Find a contiguous cluster block */
+				n = get_fat(&fp->obj, clst);
+				if (++clst >= fs->n_fatent) clst = 2;
+				if (n == 1) {
+					res = FR_INT_ERR; break;
+				}
+				if (n == 0xFFFFFFFF) {
+					res = FR_DISK_ERR; break;
+				}
+				if (n == 0) {	/* Is it a free cluster? */
+					if (++ncl == tcl) break;	/* Break if a contiguous cluster block is found */
+				} else {
+					scl = clst; ncl = 0;		/* Not a free cluster */
+				}
+				if (clst == stcl) {		/* No contiguous cluster? */
+					res = FR_DENIED; break;
+				}
 			}
 		}
 		if (res == FR_OK) {	/* A contiguous free area is found */
@@ -5739,6 +7199,12 @@ FRESULT f_forward (
 #define	GPT_ALIGN	0x100000	/* Alignment of partitions in GPT [byte] (>=128KB) */
 #define GPT_ITEMS	128			/* Number of GPT table size (>=128, sector aligned) */
 
+#if FF_MKFS_PHASE
+#define MKFS_PHASE(name)	ff_mkfs_phase(name)	/* Report the step f_mkfs enters (null: returning) */
+#else
+#define MKFS_PHASE(name)
+#endif
+
 
 /* Create partitions on the physical drive in format of MBR or GPT */
 
@@ -5885,6 +7351,40 @@ static FRESULT create_partition (
 
 
 
+/* Fill sectors with zero for f_mkfs. A drive that can clear the range by */
+/* itself gets a single request, others get zeros written from the work  */
+/* buffer in chunks aligned to the buffer size. The buffer is cleared.   */
+
+static FRESULT mkfs_zero (
+	BYTE pdrv,		/* Physical drive number */
+	LBA_t sect,		/* Start sector */
+	LBA_t nsect,	/* Number of sectors */
+	BYTE* buf,		/* Working buffer */
+	DWORD sz_buf,	/* Size of working buffer [sector] */
+	UINT ss			/* Sector size [byte] */
+)
+{
+	LBA_t lba[2];
+	DWORD n;
+
+
+	if (nsect == 0) return FR_OK;
+#ifdef CTRL_ZERO
+	lba[0] = sect; lba[1] = sect + nsect - 1;
+	if (disk_ioctl(pdrv, CTRL_ZERO, lba) == RES_OK) return FR_OK;
+#endif
+	memset(buf, 0, (size_t)sz_buf * ss);
+	do {
+		n = sz_buf - (DWORD)(sect % sz_buf);	/* Up to the next buffer size boundary */
+		if (n > nsect) n = (DWORD)nsect;
+		if (disk_write(pdrv, buf, sect, n) != RES_OK) return FR_DISK_ERR;
+		sect += n; nsect -= n;
+	} while (nsect);
+	return FR_OK;
+}
+
+
+
 FRESULT f_mkfs (
 	const TCHAR* path,		/* Logical drive number */
 	const MKFS_PARM* opt,	/* Format options */
@@ -5913,6 +7413,15 @@ FRESULT f_mkfs (
 	vol = get_ldnumber(&path);					/* Get target logical drive */
 	if (vol < 0) return FR_INVALID_DRIVE;
 	if (FatFs[vol]) FatFs[vol]->fs_type = 0;	/* Clear the fs object if mounted */
+#if WCACHE
+	wc_reset(0);								/* Cached sectors do not survive formatting */
+#endif
+#if FREEIDX
+	fx_reset(0);
+#endif
+#if DIRIDX
+	dx_reset(0);
+#endif
 	pdrv = LD2PD(vol);		/* Hosting physical drive */
 	ipart = LD2PT(vol);		/* Hosting partition (0:create as new, 1..:existing partition) */
 
@@ -6034,7 +7543,8 @@ FRESULT f_mkfs (
 		UINT j, st;
 
 		if (sz_vol < 0x1000) LEAVE_MKFS(FR_MKFS_ABORTED);	/* Too small volume for exFAT? */
-#if FF_USE_TRIM
+#if FF_USE_TRIM || FF_MKFS_TRIM
+		MKFS_PHASE("trim");
 		lba[0] = b_vol; lba[1] = b_vol + sz_vol - 1;	/* Inform storage device that the volume area may be erased */
 		disk_ioctl(pdrv, CTRL_TRIM, lba);
 #endif
@@ -6056,6 +7566,7 @@ FRESULT f_mkfs (
 		clen[0] = (szb_bit + sz_au * ss - 1) / (sz_au * ss);	/* Number of allocation bitmap clusters */
 
 		/* Create a compressed up-case table */
+		MKFS_PHASE("up-case");
 		sect = b_data + sz_au * clen[0];	/* Table start sector */
 		sum = 0;							/* Table checksum to be stored in the 82 entry */
 		st = 0; si = 0; i = 0; j = 0; szb_case = 0;
@@ -6094,20 +7605,25 @@ FRESULT f_mkfs (
 		clen[2] = 1;	/* Number of root dir clusters */
 
 		/* Initialize the allocation bitmap */
+		MKFS_PHASE("bitmap");
 		sect = b_data; nsect = (szb_bit + ss - 1) / ss;	/* Start of bitmap and number of bitmap sectors */
 		nbit = clen[0] + clen[1] + clen[2];				/* Number of clusters in-use by system (bitmap, up-case and root-dir) */
-		do {
+		do {	/* Write only the sectors with marked bits */
 			memset(buf, 0, sz_buf * ss);				/* Initialize bitmap buffer */
 			for (i = 0; nbit != 0 && i / 8 < sz_buf * ss; buf[i / 8] |= 1 << (i % 8), i++, nbit--) ;	/* Mark used clusters */
-			n = (nsect > sz_buf) ? sz_buf : nsect;		/* Write the buffered data */
+			n = (i + ss * 8 - 1) / (ss * 8);			/* Write the buffered data */
+			if (n > nsect) n = nsect;
 			if (disk_write(pdrv, buf, sect, n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
 			sect += n; nsect -= n;
-		} while (nsect);
+		} while (nsect && nbit);
+		res = mkfs_zero(pdrv, sect, nsect, buf, sz_buf, ss);	/* Clear the rest */
+		if (res != FR_OK) LEAVE_MKFS(res);
 
 		/* Initialize the FAT */
+		MKFS_PHASE("FAT");
 		sect = b_fat; nsect = sz_fat;	/* Start of FAT and number of FAT sectors */
 		j = nbit = clu = 0;
-		do {
+		do {	/* Write only the sectors with the chains */
 			memset(buf, 0, sz_buf * ss); i = 0;	/* Clear work area and reset write offset */
 			if (clu == 0) {	/* Initialize FAT [0] and FAT[1] */
 				st_dword(buf + i, 0xFFFFFFF8); i += 4; clu++;
@@ -6120,13 +7636,17 @@ FRESULT f_mkfs (
 				}
 				if (nbit == 0 && j < 3) nbit = clen[j++];	/* Get next chain length */
 			} while (nbit != 0 && i < sz_buf * ss);
-			n = (nsect > sz_buf) ? sz_buf : nsect;	/* Write the buffered data */
+			n = (i + ss - 1) / ss;	/* Write the buffered data */
+			if (n > nsect) n = nsect;
 			if (disk_write(pdrv, buf, sect, n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
 			sect += n; nsect -= n;
-		} while (nsect);
+		} while (nsect && (nbit != 0 || j < 3));
+		res = mkfs_zero(pdrv, sect, nsect, buf, sz_buf, ss);	/* Clear the rest */
+		if (res != FR_OK) LEAVE_MKFS(res);
 
 		/* Initialize the root directory */
-		memset(buf, 0, sz_buf * ss);
+		MKFS_PHASE("root");
+		memset(buf, 0, ss);
 		buf[SZDIRE * 0 + 0] = ET_VLABEL;				/* Volume label entry (no label) */
 		buf[SZDIRE * 1 + 0] = ET_BITMAP;				/* Bitmap entry */
 		st_dword(buf + SZDIRE * 1 + 20, 2);				/*  cluster */
@@ -6135,15 +7655,13 @@ FRESULT f_mkfs (
 		st_dword(buf + SZDIRE * 2 + 4, sum);			/*  sum */
 		st_dword(buf + SZDIRE * 2 + 20, 2 + clen[0]);	/*  cluster */
 		st_dword(buf + SZDIRE * 2 + 24, szb_case);		/*  size */
-		sect = b_data + sz_au * (clen[0] + clen[1]); nsect = sz_au;	/* Start of the root directory and number of sectors */
-		do {	/* Fill root directory sectors */
-			n = (nsect > sz_buf) ? sz_buf : nsect;
-			if (disk_write(pdrv, buf, sect, n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
-			memset(buf, 0, ss);	/* Rest of entries are filled with zero */
-			sect += n; nsect -= n;
-		} while (nsect);
+		sect = b_data + sz_au * (clen[0] + clen[1]);	/* Start of the root directory */
+		if (disk_write(pdrv, buf, sect, 1) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
+		res = mkfs_zero(pdrv, sect + 1, sz_au - 1, buf, sz_buf, ss);	/* Rest of entries are filled with zero */
+		if (res != FR_OK) LEAVE_MKFS(res);
 
 		/* Create two set of the exFAT VBR blocks */
+		MKFS_PHASE("boot");
 		sect = b_vol;
 		for (n = 0; n < 2; n++) {
 			/* Main record (+0) */
@@ -6263,11 +7781,13 @@ FRESULT f_mkfs (
 			break;
 		} while (1);
 
-#if FF_USE_TRIM
+#if FF_USE_TRIM || FF_MKFS_TRIM
+		MKFS_PHASE("trim");
 		lba[0] = b_vol; lba[1] = b_vol + sz_vol - 1;	/* Inform storage device that the volume area may be erased */
 		disk_ioctl(pdrv, CTRL_TRIM, lba);
 #endif
 		/* Create FAT VBR */
+		MKFS_PHASE("boot");
 		memset(buf, 0, ss);
 		memcpy(buf + BS_JmpBoot, "\xEB\xFE\x90" "MSDOS5.0", 11);	/* Boot jump code (x86), OEM name */
 		st_word(buf + BPB_BytsPerSec, ss);				/* Sector size [byte] */
@@ -6317,9 +7837,10 @@ FRESULT f_mkfs (
 		}
 
 		/* Initialize FAT area */
-		memset(buf, 0, sz_buf * ss);
+		MKFS_PHASE("FAT");
 		sect = b_fat;		/* FAT start sector */
 		for (i = 0; i < n_fat; i++) {			/* Initialize FATs each */
+			memset(buf, 0, ss);
 			if (fsty == FS_FAT32) {
 				st_dword(buf + 0, 0x0FFFFFF8);	/* FAT[0] */
 				st_dword(buf + 4, 0xFFFFFFFF);	/* FAT[1] */
@@ -6327,22 +7848,17 @@ FRESULT f_mkfs (
 			} else {
 				st_dword(buf + 0, (fsty == FS_FAT12) ? 0xFFFFF8 : 0xFFFFFFF8);	/* FAT[0] and FAT[1] */
 			}
-			nsect = sz_fat;		/* Number of FAT sectors */
-			do {	/* Fill FAT sectors */
-				n = (nsect > sz_buf) ? sz_buf : nsect;
-				if (disk_write(pdrv, buf, sect, (UINT)n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
-				memset(buf, 0, ss);	/* Rest of FAT all are cleared */
-				sect += n; nsect -= n;
-			} while (nsect);
+			if (disk_write(pdrv, buf, sect, 1) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
+			res = mkfs_zero(pdrv, sect + 1, sz_fat - 1, buf, sz_buf, ss);	/* Rest of FAT all are cleared */
+			if (res != FR_OK) LEAVE_MKFS(res);
+			sect += sz_fat;
 		}
 
 		/* Initialize root directory (fill with zero) */
+		MKFS_PHASE("root");
 		nsect = (fsty == FS_FAT32) ? pau : sz_dir;	/* Number of root directory sectors */
-		do {
-			n = (nsect > sz_buf) ? sz_buf : nsect;
-			if (disk_write(pdrv, buf, sect, (UINT)n) != RES_OK) LEAVE_MKFS(FR_DISK_ERR);
-			sect += n; nsect -= n;
-		} while (nsect);
+		res = mkfs_zero(pdrv, sect, nsect, buf, sz_buf, ss);
+		if (res != FR_OK) LEAVE_MKFS(res);
 	}
 
 	/* A FAT volume has been created here */
@@ -6361,6 +7877,7 @@ FRESULT f_mkfs (
 	}
 
 	/* Update partition information */
+	MKFS_PHASE("partition");
 	if (FF_MULTI_PARTITION && ipart != 0) {	/* Volume is in the existing partition */
 		if (!FF_LBA64 || !(fsopt & 0x80)) {	/* Is the partition in MBR? */
 			/* Update system ID in the partition table */
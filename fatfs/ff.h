@@ -96,7 +96,8 @@ typedef char TCHAR;
 #define _T(x) u8 ## x
 #define _TEXT(x) u8 ## x
 #elif FF_USE_LFN && FF_LFN_UNICODE == 3	/* Unicode in UTF-32 encoding */
-typedef DWORD TCHAR;
+#include <wchar.h>
+typedef wchar_t TCHAR;	/* fatio: the host wchar_t is UTF-32 */
 #define _T(x) U ## x
 #define _TEXT(x) U ## x
 #elif FF_USE_LFN && (FF_LFN_UNICODE < 0 || FF_LFN_UNICODE > 3)
@@ -136,6 +137,9 @@ typedef struct {
 	BYTE	n_fats;			/* Number of FATs (1 or 2) */
 	BYTE	wflag;			/* win[] status (b0:dirty) */
 	BYTE	fsi_flag;		/* FSINFO status (b7:disabled, b0:dirty) */
+#if FF_FS_EXFAT && FF_FS_EXFATINFO && !FF_FS_READONLY
+	BYTE	xflag;			/* exFAT VolumeDirty status (b7:set before mount, b0:set by FatFs) */
+#endif
 	WORD	id;				/* Volume mount ID */
 	WORD	n_rootdir;		/* Number of root directory entries (FAT12/16) */
 	WORD	csize;			/* Cluster size [sectors] */
@@ -375,6 +379,9 @@ DWORD ff_wtoupper (DWORD uni);			/* Unicode upper-case conversion */
 void* ff_memalloc (UINT msize);		/* Allocate memory block */
 void ff_memfree (void* mblock);		/* Free memory block */
 #endif
+#if FF_USE_MKFS && FF_MKFS_PHASE
+void ff_mkfs_phase (const char* name);	/* Report a step of f_mkfs */
+#endif
 #if FF_FS_REENTRANT	/* Sync functions */
 int ff_mutex_create (int vol);		/* Create a sync object */
 void ff_mutex_delete (int vol);		/* Delete a sync object */
@@ -133,7 +133,11 @@
 /  ff_memfree() exemplified in ffsystem.c, need to be added to the project. */
 
 
+#ifdef _WIN32
 #define FF_LFN_UNICODE	1
+#else
+#define FF_LFN_UNICODE	3
+#endif
 /* This option switches the character encoding on the API when LFN is enabled.
 /
 /   0: ANSI/OEM in current CP (TCHAR = char)
@@ -142,7 +146,8 @@
 /   3: Unicode in UTF-32 (TCHAR = DWORD)
 /
 /  Also behavior of string I/O functions will be affected by this option.
-/  When LFN is not enabled, this option has no effect. */
+/  When LFN is not enabled, this option has no effect.
+/  fatio passes wchar_t strings, UTF-16 on Windows and UTF-32 elsewhere. */
 
 
 #define FF_LFN_BUF		255
@@ -153,7 +158,7 @@
 /  on character encoding. When LFN is not enabled, these options have no effect. */
 
 
-#define FF_FS_RPATH		0
+#define FF_FS_RPATH		1
 /* This option configures support for relative path.
 /
 /   0: Disable relative path and remove related functions.
@@ -219,6 +224,20 @@
 /  disk_ioctl() function. */
 
 
+#define FF_MKFS_TRIM	1
+/* This option switches the trim of the whole volume by f_mkfs before it is
+/  formatted, regardless of FF_USE_TRIM. (0:Disable or 1:Enable)
+/  Freed clusters are trimmed only with FF_USE_TRIM, where the trim can reach the
+/  device before the FAT and the directory that released them. */
+
+
+#define FF_MKFS_PHASE	1
+/* This option switches step reports of f_mkfs. (0:Disable or 1:Enable)
+/  When enabled, f_mkfs calls ff_mkfs_phase() with the name of each step it enters
+/  (trim, up-case, bitmap, FAT, root, boot and partition) and with a null pointer
+/  when it returns, so that the caller can time them. */
+
+
 
 /*---------------------------------------------------------------------------/
 / System Configurations
@@ -231,6 +250,37 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
+#define FF_WCACHE_FAT	64
+#define FF_WCACHE_DIR	64
+#define FF_WCACHE_RUN	16
+/* These options set the number of sectors kept behind the disk access window
+/  (fs->win). FF_WCACHE_FAT holds FAT and exFAT allocation bitmap sectors and
+/  FF_WCACHE_DIR holds directory and other sectors; the pools are separate so that
+/  walking a long cluster chain does not evict directory sectors and vice versa.
+/  Dirty sectors are written back in sorted runs of up to FF_WCACHE_RUN sectors
+/  when the window is synchronized or a dirty sector is evicted, and a miss reads
+/  ahead up to FF_WCACHE_RUN sectors. 0 disables a pool. */
+
+
+#define FF_FREE_EXTENTS	4096
+/* This option sets the number of free cluster extents kept in memory. The index
+/  is built by a bulk scan of the FAT or allocation bitmap at the first allocation
+/  after mount, and create_chain() and f_expand() then take clusters from it with
+/  best-fit instead of scanning the FAT. When a fragmented volume has more free
+/  extents than this, the shortest ones are left out and searched the old way.
+/  0 disables the index. It needs FF_USE_LFN == 3 for its scan buffer. */
+
+
+#define FF_DIR_INDEX	8
+/* This option sets the number of directories that get an in-memory name index.
+/  A directory is indexed at the first dir_find() into it: a hash of the up-cased
+/  name (xname_sum()), a hash of the SFN and the entry offset are kept for every
+/  item, so that a lookup, an SFN collision test of dir_register() and the search
+/  for free entries no longer scan the whole directory. The least recently used
+/  directory is dropped when all slots are taken. 0 disables the index. It needs
+/  FF_USE_LFN == 3 for the index memory. */
+
+
 #define FF_FS_EXFAT		1
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)
@@ -263,6 +313,19 @@
 */
 
 
+#define FF_FS_EXFATINFO	1
+/* exFAT has no FSINFO sector. When this option is 1, the free cluster count is
+/  kept in a vendor record of the OEM parameters sector of both boot regions,
+/  along with the volume serial number and the PercentInUse value written with it.
+/  VolumeDirty is set before the first bitmap change and the record and the boot
+/  checksums are written only when the volume is unmounted, after which the flag
+/  is cleared. At mount the count is trusted only if the volume is clean and
+/  PercentInUse still matches, so a crash or a change made by another driver
+/  discards it. Bit 0 of FF_FS_NOFSINFO applies to it as well.
+/  0: Do not touch the boot region, f_getfree() scans the bitmap on each mount.
+/  1: Keep the free cluster count across mounts. */
+
+
 #define FF_FS_LOCK		0
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when FF_FS_READONLY
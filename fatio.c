@@ -2,8 +2,13 @@
 #include <fatio.h>
 #include <dl.h>
 #include <wchar.h>
-#include <winioctl.h>
 #include <locale.h>
+#ifdef _WIN32
+#include <winioctl.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 #include <grub/disk.h>
 #include <grub/fs.h>
@@ -11,6 +16,8 @@
 #include <grub/partition.h>
 #include <grub/fat.h>
 #include <grub/ntfs.h>
+#include <loopback.h>
+#include <imgdisk.h>
 
 #include "fatfs/ff.h"
 
@@ -19,15 +26,15 @@ int BUFFER_SIZE = 0x4000000; // 64MB
 static void
 print_help(const wchar_t *prog_name)
 {
-    wprintf(L"Usage: %s Command [Options]\n", prog_name);
+    wprintf(L"Usage: %ls Command [Options]\n", prog_name);
     wprintf(L"Command:\n");
     wprintf(L"\tlist        [Disk]\n\t\t\tList supported partitions.\n\t\t\tOptions:\n\t\t\t\t -a\tShow all partitions.\n");
-    wprintf(L"\tls          Disk Part DEST_DIR\n\t\t\tList files in the specified directory.\n");
+    wprintf(L"\tls          Disk Part DEST_DIR\n\t\t\tList files in the specified directory.\n\t\t\tOptions:\n\t\t\t\t -r\tList subdirectories recursively.\n");
     wprintf(L"\tcopy        Disk Part SRC_FILE DEST_FILE\n\t\t\tCopy the file into FAT partition.\n\t\t\tOptions:\n\t\t\t\t -y\tUpdate mode, copy only when the source file is inconsistent.\n");
     wprintf(L"\tmkdir       Disk Part DIR\n\t\t\tCreate a new directory.\n");
     wprintf(L"\tmkfs        Disk Part FORMAT [CLUSTER_SIZE]\n\t\t\tCreate an FAT/exFAT volume.\n\t\t\tSupported format options: FAT, FAT32, EXFAT.\n");
     wprintf(L"\tlabel       Disk Part [STRING]\n\t\t\tSet/remove the label of a volume.\n");
-    wprintf(L"\textract     Disk Part FILE\n\t\t\tExtract the archive file to FAT partition.\n");
+    wprintf(L"\textract     Disk Part FILE\n\t\t\tExtract the archive file to FAT partition.\n\t\t\tThe archive may be compressed with xz or zstd.\n\t\t\tVHD and VHDX virtual disks are also accepted.\n");
     wprintf(L"\tdump        Disk Part SRC_FILE DEST_FILE\n\t\t\tCopy the file from FAT partition.\n");
     wprintf(L"\tremove      Disk Part DEST_FILE\n\t\t\tRemove the file from FAT partition.\n");
     wprintf(L"\tmove        Disk Part SRC_FILE DEST_FILE\n\t\t\tRename/move files from FAT partition.\n");
@@ -39,8 +46,16 @@ print_help(const wchar_t *prog_name)
     wprintf(L"\tgetid       Disk Part\n\t\t\tGet partition type id.\n");
     wprintf(L"\tsetactive   Disk Part\n\t\t\tSet partition active.\n");
     wprintf(L"\tswap        Disk Part\n\t\t\tSwap partition order.\n");
+    wprintf(L"Disk:\n");
+    wprintf(L"\tA disk number, or for file system commands the path of a raw disk image / device node.\n\tFor an image, Part 0 selects a bare volume without partition table.\n");
     wprintf(L"Options:\n");
     wprintf(L"\t-b      BufferSize\n\t\t\tSpecify the buffer size for file operations(default 64MB).\n");
+    wprintf(L"\t-c      CacheSize\n\t\t\tSpecify the disk cache size in KB, more than 0 (default 32MB).\n");
+    wprintf(L"\t-s\n\t\t\tShow disk cache statistics on exit.\n");
+    wprintf(L"\t-j\n\t\t\tPrint elapsed time, disk I/O and peak memory as one JSON line on exit.\n");
+    wprintf(L"\t-m\n\t\t\tMap the archive file into memory instead of reading ahead (extract).\n");
+    wprintf(L"\t-i      Format\n\t\t\tCreate Disk as a new sparse image sized for the content and format it (copy, extract).\n\t\t\tPart 0 makes a bare volume, Part 1 one MBR partition.\n");
+    wprintf(L"\t-k      SectorSize\n\t\t\tSector size of image files, 512 to 4096 (default 512). Device nodes and disks use their own.\n");
 }
 
 void loader(int rate)
@@ -143,122 +158,179 @@ print_list(wchar_t *disk, bool show_all_hard_drive)
 }
 
 static bool
-copy_file(const wchar_t *disk, const wchar_t *part, const wchar_t *src, const wchar_t *dst, bool update)
+open_disk(const wchar_t *disk, const wchar_t *part)
 {
-    FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
+    wchar_t *end = NULL;
+    unsigned long disk_id = wcstoul(disk, &end, 10);
     unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
-    {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
-        return false;
-    }
-    f_mount(&fs, L"0:", 0);
-    bool ret = fatio_copy(src, dst, update);
-    f_unmount(L"0:");
-    fatio_unset_disk();
-    return ret;
-}
 
-static bool
-mkdir(const wchar_t *disk, const wchar_t *part, const wchar_t *dst)
-{
-    FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
+    // Anything that is not a disk number is an image file or device path
+    if (end == disk || *end != L'\0')
     {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
+        if (fatio_set_image(disk, part_id))
+            return true;
+        wprintf(L"Failed to open image %ls part %lu\n", disk, part_id);
         return false;
     }
-    f_mount(&fs, L"0:", 0);
-    bool ret = fatio_mkdir(dst);
-    f_unmount(L"0:");
-    fatio_unset_disk();
-    return ret;
+    if (fatio_set_disk(disk_id, part_id))
+        return true;
+    grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
+    return false;
 }
 
+// Pick the FatFs format for a FORMAT argument
 static bool
-mkfs(const wchar_t *disk, const wchar_t *part, const wchar_t *fmt, const wchar_t *cluster)
+parse_format(const wchar_t *fmt, MKFS_PARM *opt)
 {
-    MKFS_PARM opt = {.au_size = 0, .align = 8, .n_fat = 2};
-
     if (_wcsicmp(fmt, L"FAT") == 0)
-        opt.fmt = FM_FAT | FM_SFD;
+        opt->fmt = FM_FAT | FM_SFD;
     else if (_wcsicmp(fmt, L"FAT32") == 0)
-        opt.fmt = FM_FAT32 | FM_SFD;
+        opt->fmt = FM_FAT32 | FM_SFD;
     else if (_wcsicmp(fmt, L"EXFAT") == 0)
-        opt.fmt = FM_EXFAT | FM_SFD;
+        opt->fmt = FM_EXFAT | FM_SFD;
     else
     {
-        wprintf(L"Unsupported format %s\n", fmt);
+        wprintf(L"Unsupported format %ls\n", fmt);
         return false;
     }
+    return true;
+}
 
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
-    {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
-        return false;
-    }
-
-    if (cluster)
-        opt.au_size = wcstoul(cluster, NULL, 10);
-
-    FRESULT fr = f_mkfs(L"0:", &opt, g_ctx.buffer, BUFFER_SIZE);
+// Create a volume on the opened disk
+static bool
+format_volume(MKFS_PARM *opt)
+{
+    FRESULT fr = f_mkfs(L"0:", opt, g_ctx.buffer, BUFFER_SIZE);
     if (fr != FR_OK)
     {
         grub_printf("Failed to format volume (Error: %d)\n", fr);
-        goto fail;
+        return false;
     }
 
     // Check the file system type and update the number of hidden sectors
-    if ((opt.fmt & (FM_FAT | FM_FAT32)))
+    if ((opt->fmt & (FM_FAT | FM_FAT32)))
     {
         struct grub_fat_bpb bpb;
         if (grub_disk_read(g_ctx.disk, 0, 0, sizeof(bpb), &bpb) != GRUB_ERR_NONE)
-            goto fail;
+            return false;
 
         // If it is in FAT format, check if the partition size exceeds the FAT16 limit
-        if ((opt.fmt & FM_FAT) && _wcsicmp(fmt, L"FAT") == 0)
+        if (opt->fmt & FM_FAT)
         {
             grub_uint32_t total_sectors = (bpb.num_total_sectors_16 == 0) ? bpb.num_total_sectors_32 : bpb.num_total_sectors_16;
 
             if (total_sectors > 65525UL * bpb.sectors_per_cluster)
             {
                 grub_printf("Error: Partition too large for FAT16 format\n");
-                goto fail;
+                return false;
             }
         }
 
         // Update the number of hidden sectors
-        bpb.num_hidden_sectors = (grub_uint32_t)grub_partition_get_start(g_ctx.disk->partition);
+        bpb.num_hidden_sectors = (grub_uint32_t)(grub_partition_get_start(g_ctx.disk->partition)
+            >> (g_ctx.disk->log_sector_size - GRUB_DISK_SECTOR_BITS));
         if (grub_disk_write(g_ctx.disk, 0, 0, sizeof(bpb), &bpb) != GRUB_ERR_NONE)
-            goto fail;
+            return false;
     }
-
-    fatio_unset_disk();
     return true;
-fail:
+}
+
+// Create DISK as a new sparse image just big enough for PLAN and format it.
+// The image is deleted if it cannot be formatted.
+static bool
+create_image(const wchar_t *disk, const wchar_t *part, const wchar_t *fmt, const struct fatio_plan *plan)
+{
+    MKFS_PARM opt = {.au_size = 0, .align = 8, .n_fat = 2};
+    unsigned long part_id = wcstoul(part, NULL, 10);
+    grub_uint64_t size;
+
+    if (!parse_format(fmt, &opt))
+        return false;
+    size = fatio_plan_image(plan, opt.fmt, grub_imgdisk_get_sector_size(), &opt.au_size);
+    if (size == 0)
+    {
+        wprintf(L"Too much data for %ls\n", fmt);
+        return false;
+    }
+    wprintf(L"Create %ls: %u files, %u directories", disk, plan->files, plan->dirs);
+    grub_printf(", %s", grub_get_human_size(size, GRUB_HUMAN_SIZE_SHORT));
+    grub_printf(", %lu byte clusters\n", (unsigned long)opt.au_size);
+
+    if (!fatio_create_image(disk, part_id, size, opt.fmt))
+    {
+        wprintf(L"Failed to create image %ls\n", disk);
+        return false;
+    }
+    if (format_volume(&opt))
+        return true;
     fatio_unset_disk();
+    DeleteFileW(disk);
     return false;
 }
 
 static bool
-set_label(const wchar_t *disk, const wchar_t *part, const wchar_t *str)
+copy_file(const wchar_t *disk, const wchar_t *part, const wchar_t *src, const wchar_t *dst, bool update, const wchar_t *new_fmt)
 {
     FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
+    if (new_fmt)
     {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
-        return false;
+        struct fatio_plan plan = {0};
+        if (!fatio_copy_plan(src, &plan) || !create_image(disk, part, new_fmt, &plan))
+            return false;
     }
+    else if (!open_disk(disk, part))
+        return false;
+    f_mount(&fs, L"0:", 0);
+    bool ret = fatio_copy(src, dst, update);
+    f_unmount(L"0:");
+    fatio_unset_disk();
+    // Do not leave a half-built image behind
+    if (new_fmt && !ret)
+        DeleteFileW(disk);
+    return ret;
+}
+
+static bool
+make_dir(const wchar_t *disk, const wchar_t *part, const wchar_t *dst)
+{
+    FATFS fs;
+    if (!open_disk(disk, part))
+        return false;
+    f_mount(&fs, L"0:", 0);
+    bool ret = fatio_mkdir(dst);
+    f_unmount(L"0:");
+    fatio_unset_disk();
+    return ret;
+}
+
+static bool
+mkfs(const wchar_t *disk, const wchar_t *part, const wchar_t *fmt, const wchar_t *cluster)
+{
+    MKFS_PARM opt = {.au_size = 0, .align = 8, .n_fat = 2};
+
+    if (!parse_format(fmt, &opt))
+        return false;
+
+    if (!open_disk(disk, part))
+        return false;
+
+    if (cluster)
+        opt.au_size = wcstoul(cluster, NULL, 10);
+
+    bool ret = format_volume(&opt);
+    fatio_unset_disk();
+    return ret;
+}
+
+static bool
+set_label(const wchar_t *disk, const wchar_t *part, const wchar_t *str)
+{
+    FATFS fs;
+    if (!open_disk(disk, part))
+        return false;
     f_mount(&fs, L"0:", 0);
     wchar_t label[48] = L"";
-    swprintf_s(label, 48, L"0:%s", str);
+    swprintf_s(label, 48, L"0:%ls", str);
     FRESULT res = f_setlabel(str);
     f_unmount(L"0:");
     fatio_unset_disk();
@@ -266,20 +338,24 @@ set_label(const wchar_t *disk, const wchar_t *part, const wchar_t *str)
 }
 
 static bool
-extract(const wchar_t *disk, const wchar_t *part, const wchar_t *file)
+extract(const wchar_t *disk, const wchar_t *part, const wchar_t *file, const wchar_t *new_fmt)
 {
     FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
+    if (new_fmt)
     {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
-        return false;
+        struct fatio_plan plan = {0};
+        if (!fatio_extract_plan(file, &plan) || !create_image(disk, part, new_fmt, &plan))
+            return false;
     }
+    else if (!open_disk(disk, part))
+        return false;
     f_mount(&fs, L"0:", 0);
     bool ret = fatio_extract(file);
     f_unmount(L"0:");
     fatio_unset_disk();
+    // Do not leave a half-built image behind
+    if (new_fmt && !ret)
+        DeleteFileW(disk);
     return ret;
 }
 
@@ -287,13 +363,8 @@ static bool
 dump_file(const wchar_t *disk, const wchar_t *part, const wchar_t *src, const wchar_t *dst)
 {
     FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
-    {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
+    if (!open_disk(disk, part))
         return false;
-    }
     f_mount(&fs, L"0:", 0);
     bool ret = fatio_dump(src, dst);
     f_unmount(L"0:");
@@ -305,13 +376,8 @@ static bool
 remove_file(const wchar_t *disk, const wchar_t *part, const wchar_t *dst)
 {
     FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
-    {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
+    if (!open_disk(disk, part))
         return false;
-    }
     f_mount(&fs, L"0:", 0);
     bool ret = fatio_remove(dst);
     f_unmount(L"0:");
@@ -320,19 +386,14 @@ remove_file(const wchar_t *disk, const wchar_t *part, const wchar_t *dst)
 }
 
 static bool
-list_file(const wchar_t *disk, const wchar_t *part, const wchar_t *path)
+list_file(const wchar_t *disk, const wchar_t *part, const wchar_t *path, bool recursive)
 {
     FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
-    {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
+    if (!open_disk(disk, part))
         return false;
-    }
     f_mount(&fs, L"0:", 0);
 
-    bool ret = fatio_list(path);
+    bool ret = fatio_list(path, recursive);
 
     f_unmount(L"0:");
     fatio_unset_disk();
@@ -343,13 +404,8 @@ static bool
 move_file(const wchar_t *disk, const wchar_t *part, const wchar_t *src, const wchar_t *dst)
 {
     FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
-    {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
+    if (!open_disk(disk, part))
         return false;
-    }
     f_mount(&fs, L"0:", 0);
     bool ret = fatio_move(src, dst);
     f_unmount(L"0:");
@@ -361,13 +417,8 @@ static bool
 cat_file(const wchar_t *disk, const wchar_t *part, const wchar_t *dst)
 {
     FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
-    {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
+    if (!open_disk(disk, part))
         return false;
-    }
     f_mount(&fs, L"0:", 0);
     bool ret = fatio_cat(dst);
     f_unmount(L"0:");
@@ -379,13 +430,8 @@ static bool
 chmod_file(const wchar_t *disk, const wchar_t *part, const wchar_t *dst, const wchar_t *attributes[])
 {
     FATFS fs;
-    unsigned long disk_id = wcstoul(disk, NULL, 10);
-    unsigned long part_id = wcstoul(part, NULL, 10);
-    if (!fatio_set_disk(disk_id, part_id))
-    {
-        grub_printf("Failed to open disk %lu part %lu\n", disk_id, part_id);
+    if (!open_disk(disk, part))
         return false;
-    }
     f_mount(&fs, L"0:", 0);
     bool ret = fatio_chmod(dst, attributes);
     f_unmount(L"0:");
@@ -429,7 +475,7 @@ write_part_id(const wchar_t *disk, const wchar_t *part, const wchar_t *in_name)
     grub_uint8_t in_value = 0;
     if (convert_to_grub_uint8(in_name, &in_value) != 0)
     {
-        wprintf(L"Invalid part id %s\n", in_name);
+        wprintf(L"Invalid part id %ls\n", in_name);
         return false;
     }
 
@@ -468,18 +514,132 @@ swap_part(const wchar_t *disk, const wchar_t *part1, const wchar_t *part2)
     return ret;
 }
 
+// Disk cache size of -c in KB, digits only: _wtoi would make "-1" huge
+static bool
+parse_cache_size(const wchar_t *arg, grub_size_t *size)
+{
+    unsigned long long kb;
+
+    if (arg[0] == L'\0' || arg[wcsspn(arg, L"0123456789")] != L'\0')
+        return false;
+    kb = wcstoull(arg, NULL, 10);
+    if (kb == 0 || kb > GRUB_SIZE_MAX / 1024)
+        return false;
+    *size = (grub_size_t)kb * 1024;
+    return true;
+}
+
+static void
+print_cache_stats(void)
+{
+    struct grub_disk_cache_stats stats;
+
+    grub_disk_cache_get_stats(&stats);
+    grub_printf("Disk cache: %s, %llu hits, %llu misses, %llu evictions\n",
+                grub_get_human_size(stats.size, GRUB_HUMAN_SIZE_SHORT),
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                (unsigned long long)stats.evictions);
+    grub_printf("Disk I/O: %llu reads (%s), %llu writes",
+                (unsigned long long)stats.reads,
+                grub_get_human_size(stats.read_bytes, GRUB_HUMAN_SIZE_SHORT),
+                (unsigned long long)stats.writes);
+    grub_printf(" (%s)\n", grub_get_human_size(stats.write_bytes, GRUB_HUMAN_SIZE_SHORT));
+}
+
+// Quote a string for JSON, cut short when it does not fit in BUF
+static const wchar_t *
+json_escape(const wchar_t *str, wchar_t *buf, size_t size)
+{
+    size_t n = 0;
+
+    for (; *str && n + 7 < size; str++)
+    {
+        if (*str == L'"' || *str == L'\\')
+        {
+            buf[n++] = L'\\';
+            buf[n++] = *str;
+        }
+        else if (*str < 0x20)
+            n += swprintf(buf + n, size - n, L"\\u%04x", (unsigned)*str);
+        else
+            buf[n++] = *str;
+    }
+    buf[n] = L'\0';
+    return buf;
+}
+
+static void
+print_json_stats(const wchar_t *command, int exit_code, UINT64 elapsed_ms)
+{
+    struct grub_disk_cache_stats stats;
+    wchar_t name[256];
+    unsigned long long peak_rss;
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc = { 0 };
+
+    pmc.cb = sizeof(pmc);
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    peak_rss = pmc.PeakWorkingSetSize;
+#else
+    struct rusage ru = { 0 };
+
+    // ru_maxrss is in KiB on Linux
+    getrusage(RUSAGE_SELF, &ru);
+    peak_rss = (unsigned long long)ru.ru_maxrss * 1024;
+#endif
+
+    grub_disk_cache_get_stats(&stats);
+    wprintf(L"{\"command\":\"%ls\",\"exit_code\":%d,\"elapsed_ms\":%llu,"
+            L"\"disk_reads\":%llu,\"disk_writes\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu,"
+            L"\"cache_hits\":%llu,\"cache_misses\":%llu,\"cache_evictions\":%llu,"
+            L"\"peak_rss\":%llu}\n",
+            json_escape(command, name, sizeof(name) / sizeof(name[0])), exit_code, (unsigned long long)elapsed_ms,
+            (unsigned long long)stats.reads, (unsigned long long)stats.writes,
+            (unsigned long long)stats.read_bytes, (unsigned long long)stats.write_bytes,
+            (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+            (unsigned long long)stats.evictions, peak_rss);
+}
+
 int wmain(int argc, wchar_t *argv[])
 {
     grub_module_init();
+#ifdef _WIN32
     setlocale(LC_ALL, "chs");
+#endif
 
     int exit_code = 0;
+    bool show_cache_stats = false;
+    bool show_json_stats = false;
+    const wchar_t *new_fmt = NULL;
+    UINT64 start = GetTickCount64();
 
     // parse options
     for (int i = 0; i < argc; ++i)
     {
         if (_wcsicmp(argv[i], L"-b") == 0 && i + 1 < argc)
             BUFFER_SIZE = _wtoi(argv[i + 1]) * 1024;
+        else if (_wcsicmp(argv[i], L"-c") == 0 && i + 1 < argc)
+        {
+            grub_size_t cache_size;
+            if (!parse_cache_size(argv[i + 1], &cache_size))
+            {
+                wprintf(L"Invalid cache size %ls\n", argv[i + 1]);
+                print_help(argv[0]);
+                grub_module_fini();
+                return -1;
+            }
+            grub_disk_cache_set_size(cache_size);
+        }
+        else if (_wcsicmp(argv[i], L"-s") == 0)
+            show_cache_stats = true;
+        else if (_wcsicmp(argv[i], L"-j") == 0)
+            show_json_stats = true;
+        else if (_wcsicmp(argv[i], L"-m") == 0)
+            grub_loopback_set_mode(GRUB_LOOPBACK_MODE_MMAP);
+        else if (_wcsicmp(argv[i], L"-i") == 0 && i + 1 < argc)
+            new_fmt = argv[i + 1];
+        else if (_wcsicmp(argv[i], L"-k") == 0 && i + 1 < argc && !grub_imgdisk_set_sector_size(_wtoi(argv[i + 1])))
+            wprintf(L"Unsupported sector size %ls, using %u\n", argv[i + 1], grub_imgdisk_get_sector_size());
     }
 
     // parse cmdline
@@ -520,7 +680,7 @@ int wmain(int argc, wchar_t *argv[])
                 if (_wcsicmp(argv[i], L"-u") == 0)
                     update = true;
             }
-            if (copy_file(argv[2], argv[3], argv[4], argv[5], update))
+            if (copy_file(argv[2], argv[3], argv[4], argv[5], update, new_fmt))
                 grub_printf("File copy successfully\n");
             else
             {
@@ -538,7 +698,7 @@ int wmain(int argc, wchar_t *argv[])
         }
         else
         {
-            if (mkdir(argv[2], argv[3], argv[4]))
+            if (make_dir(argv[2], argv[3], argv[4]))
                 grub_printf("Directory created successfully\n");
             else
             {
@@ -592,7 +752,7 @@ int wmain(int argc, wchar_t *argv[])
         }
         else
         {
-            if (extract(argv[2], argv[3], argv[4]))
+            if (extract(argv[2], argv[3], argv[4], new_fmt))
                 grub_printf("File extract successfully\n");
             else
             {
@@ -645,7 +805,16 @@ int wmain(int argc, wchar_t *argv[])
             exit_code = -1;
         }
         else
-            list_file(argv[2], argv[3], argv[4]);
+        {
+            bool recursive = false;
+            for (int i = 5; i < argc; ++i)
+            {
+                if (_wcsicmp(argv[i], L"-r") == 0)
+                    recursive = true;
+            }
+            if (!list_file(argv[2], argv[3], argv[4], recursive))
+                exit_code = -1;
+        }
     }
     else if (_wcsicmp(argv[1], L"MOVE") == 0)
     {
@@ -817,7 +986,44 @@ int wmain(int argc, wchar_t *argv[])
         print_help(argv[0]);
         exit_code = -1;
     }
+    if (show_cache_stats)
+        print_cache_stats();
+    if (show_json_stats)
+        print_json_stats(argc < 2 ? L"" : argv[1], exit_code, GetTickCount64() - start);
     grub_module_fini();
 
     return exit_code;
 }
+
+#ifndef _WIN32
+// The arguments come in the locale charset, wmain takes them as wchar_t
+int main(int argc, char *argv[])
+{
+    wchar_t **wargv = calloc(argc + 1, sizeof(wchar_t *));
+
+    // Without a locale only ASCII names would convert, take them as UTF-8
+    const char *ctype = setlocale(LC_ALL, "");
+    if (!ctype || strcmp(ctype, "C") == 0 || strcmp(ctype, "POSIX") == 0)
+        setlocale(LC_CTYPE, "C.UTF-8");
+    if (!wargv)
+        return -1;
+    for (int i = 0; i < argc; ++i)
+    {
+        size_t len = mbstowcs(NULL, argv[i], 0);
+        if (len == (size_t)-1)
+        {
+            fprintf(stderr, "Invalid argument %s\n", argv[i]);
+            return -1;
+        }
+        wargv[i] = calloc(len + 1, sizeof(wchar_t));
+        if (!wargv[i])
+            return -1;
+        mbstowcs(wargv[i], argv[i], len + 1);
+    }
+    int exit_code = wmain(argc, wargv);
+    for (int i = 0; i < argc; ++i)
+        free(wargv[i]);
+    free(wargv);
+    return exit_code;
+}
+#endif
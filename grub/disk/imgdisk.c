@@ -0,0 +1,654 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/disk.h>
+#include <grub/mm.h>
+
+#include <imgdisk.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
+#endif
+
+GRUB_MOD_LICENSE("GPLv3+");
+
+/* Largest transfer handed to a single host read or write.  */
+#define IMGDISK_MAX_IO	(1U << 30)
+/* Granule a write to a new image is checked for zeros in.  */
+#define IMGDISK_ZERO_RUN	(1U << 16)
+
+/*
+ * Host file access.  Everything below up to the grub_imgdisk_* functions
+ * is the only part that differs between Windows and POSIX systems.
+ */
+#ifdef _WIN32
+
+typedef HANDLE host_file_t;
+#define HOST_NO_FILE	INVALID_HANDLE_VALUE
+
+static unsigned long
+host_error(void)
+{
+	return GetLastError();
+}
+
+static host_file_t
+host_open(const wchar_t* path, int create)
+{
+	return CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		create ? CREATE_NEW : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+static void
+host_close(host_file_t file)
+{
+	CloseHandle(file);
+}
+
+static void
+host_delete(const wchar_t* path)
+{
+	DeleteFileW(path);
+}
+
+static grub_uint64_t
+host_size(host_file_t file)
+{
+	DWORD dw_bytes;
+	LARGE_INTEGER li = { 0 };
+	GET_LENGTH_INFORMATION LengthInfo = { 0 };
+
+	/* Regular image file.  */
+	if (GetFileSizeEx(file, &li) && li.QuadPart > 0)
+		return (grub_uint64_t)li.QuadPart;
+	/* Raw device node, e.g. \\.\PhysicalDrive1 or \\.\X:  */
+	if (DeviceIoControl(file, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0,
+		&LengthInfo, sizeof(LengthInfo), &dw_bytes, NULL))
+		return (grub_uint64_t)LengthInfo.Length.QuadPart;
+	return 0;
+}
+
+/* Logical sector size of a raw device node in bytes, 0 for anything else.  */
+static unsigned
+host_sector_size(host_file_t file)
+{
+	DWORD dw_bytes;
+	DISK_GEOMETRY geometry = { 0 };
+
+	if (!DeviceIoControl(file, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+		&geometry, sizeof(geometry), &dw_bytes, NULL))
+		return 0;
+	return geometry.BytesPerSector;
+}
+
+static int
+host_is_sparse(host_file_t file)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+
+	if (!GetFileInformationByHandle(file, &info))
+		return 0;
+	return (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) ? 1 : 0;
+}
+
+static int
+host_set_sparse(host_file_t file)
+{
+	DWORD dw = 0;
+
+	return DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &dw, NULL) ? 1 : 0;
+}
+
+static int
+host_resize(host_file_t file, grub_uint64_t size)
+{
+	LARGE_INTEGER li;
+
+	li.QuadPart = (LONGLONG)size;
+	return SetFilePointerEx(file, li, NULL, FILE_BEGIN) && SetEndOfFile(file);
+}
+
+/*
+ * Positioned transfers through OVERLAPPED offsets: the handle's file
+ * pointer is never touched, so there is no seek + read pair per request.
+ * Both return the bytes transferred, short at the end of the file, or -1.
+ */
+static grub_ssize_t
+host_read(host_file_t file, char* buf, grub_uint32_t len, grub_uint64_t ofs)
+{
+	OVERLAPPED ov = { 0 };
+	DWORD done = 0;
+
+	ov.Offset = (DWORD)ofs;
+	ov.OffsetHigh = (DWORD)(ofs >> 32);
+	if (!ReadFile(file, buf, len, &done, &ov) && GetLastError() != ERROR_HANDLE_EOF)
+		return -1;
+	return (grub_ssize_t)done;
+}
+
+static grub_ssize_t
+host_write(host_file_t file, const char* buf, grub_uint32_t len, grub_uint64_t ofs)
+{
+	OVERLAPPED ov = { 0 };
+	DWORD done = 0;
+
+	ov.Offset = (DWORD)ofs;
+	ov.OffsetHigh = (DWORD)(ofs >> 32);
+	if (!WriteFile(file, buf, len, &done, &ov))
+		return -1;
+	return (grub_ssize_t)done;
+}
+
+/* FSCTL_SET_ZERO_DATA deallocates on a sparse file and writes the zeros
+   inside the file system on a plain one.  Raw device nodes do not take it.  */
+static int
+host_zero(host_file_t file, grub_uint64_t ofs, grub_uint64_t len)
+{
+	FILE_ZERO_DATA_INFORMATION fz;
+	DWORD dw = 0;
+
+	fz.FileOffset.QuadPart = (LONGLONG)ofs;
+	fz.BeyondFinalZero.QuadPart = (LONGLONG)(ofs + len);
+	return DeviceIoControl(file, FSCTL_SET_ZERO_DATA, &fz, sizeof(fz), NULL, 0, &dw, NULL) ? 1 : 0;
+}
+
+#else /* !_WIN32 */
+
+typedef int host_file_t;
+#define HOST_NO_FILE	(-1)
+
+static unsigned long
+host_error(void)
+{
+	return (unsigned long)errno;
+}
+
+/* Paths come in as wide strings, the host takes them in the locale charset.  */
+static char*
+host_path(const wchar_t* path)
+{
+	size_t len = wcstombs(NULL, path, 0);
+	char* mb;
+
+	if (len == (size_t)-1)
+	{
+		errno = EILSEQ;
+		return NULL;
+	}
+	mb = grub_malloc(len + 1);
+	if (mb)
+		wcstombs(mb, path, len + 1);
+	return mb;
+}
+
+static host_file_t
+host_open(const wchar_t* path, int create)
+{
+	char* mb = host_path(path);
+	int fd;
+
+	if (!mb)
+		return HOST_NO_FILE;
+	fd = open(mb, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+	grub_free(mb);
+	return fd;
+}
+
+static void
+host_close(host_file_t file)
+{
+	close(file);
+}
+
+static void
+host_delete(const wchar_t* path)
+{
+	char* mb = host_path(path);
+
+	if (mb)
+		unlink(mb);
+	grub_free(mb);
+}
+
+static grub_uint64_t
+host_size(host_file_t file)
+{
+	struct stat st;
+	off_t end;
+
+	if (fstat(file, &st) != 0)
+		return 0;
+	/* Regular image file.  */
+	if (S_ISREG(st.st_mode))
+		return (grub_uint64_t)st.st_size;
+#ifdef BLKGETSIZE64
+	/* Block device node, e.g. /dev/sdb  */
+	{
+		grub_uint64_t bytes;
+
+		if (S_ISBLK(st.st_mode) && ioctl(file, BLKGETSIZE64, &bytes) == 0)
+			return bytes;
+	}
+#endif
+	end = lseek(file, 0, SEEK_END);
+	return (end > 0) ? (grub_uint64_t)end : 0;
+}
+
+/* Logical sector size of a block device node in bytes, 0 for anything else.  */
+static unsigned
+host_sector_size(host_file_t file)
+{
+#ifdef BLKSSZGET
+	struct stat st;
+	int size;
+
+	if (fstat(file, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(file, BLKSSZGET, &size) == 0)
+		return (unsigned)size;
+#else
+	(void)file;
+#endif
+	return 0;
+}
+
+/* A regular file gets holes wherever it is extended or punched.  */
+static int
+host_is_sparse(host_file_t file)
+{
+	struct stat st;
+
+	return fstat(file, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static int
+host_set_sparse(host_file_t file)
+{
+	return host_is_sparse(file);
+}
+
+static int
+host_resize(host_file_t file, grub_uint64_t size)
+{
+	return ftruncate(file, (off_t)size) == 0;
+}
+
+/* Both return the bytes transferred, short at the end of the file, or -1.  */
+static grub_ssize_t
+host_read(host_file_t file, char* buf, grub_uint32_t len, grub_uint64_t ofs)
+{
+	ssize_t done;
+
+	do
+		done = pread(file, buf, len, (off_t)ofs);
+	while (done < 0 && errno == EINTR);
+	return (grub_ssize_t)done;
+}
+
+static grub_ssize_t
+host_write(host_file_t file, const char* buf, grub_uint32_t len, grub_uint64_t ofs)
+{
+	ssize_t done;
+
+	do
+		done = pwrite(file, buf, len, (off_t)ofs);
+	while (done < 0 && errno == EINTR);
+	return (grub_ssize_t)done;
+}
+
+/* Punch the range out of a regular file.  Block device nodes do not take
+   it, like on Windows.  */
+static int
+host_zero(host_file_t file, grub_uint64_t ofs, grub_uint64_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (host_is_sparse(file))
+		return fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)ofs, (off_t)len) == 0;
+#else
+	(void)ofs;
+	(void)len;
+#endif
+	errno = EOPNOTSUPP;
+	(void)file;
+	return 0;
+}
+
+#endif /* _WIN32 */
+
+static struct
+{
+	host_file_t file;
+	grub_uint64_t size;
+	/* Created by grub_imgdisk_create, nothing past WRITTEN has been
+	   written yet and it all reads as zeros.  */
+	int fresh;
+	grub_uint64_t written;
+	/* Sparse image file, freed ranges can be handed back to the host.  */
+	int sparse;
+	/* Sector size of the open image, and the one image files get.  */
+	unsigned log_sector_size;
+	unsigned file_sector_size;
+} m_ctx = { HOST_NO_FILE, 0, 0, 0, 0, GRUB_DISK_SECTOR_BITS, GRUB_DISK_SECTOR_BITS };
+
+/* Log2 of the logical sector size of a raw device node, 0 for anything
+   else or for a size FatFs cannot use.  */
+static unsigned
+get_device_sector_size(host_file_t file)
+{
+	unsigned size = host_sector_size(file);
+	unsigned bits;
+
+	for (bits = GRUB_DISK_SECTOR_BITS; bits <= GRUB_DISK_SECTOR_BITS + 3; bits++)
+	{
+		if (size == 1U << bits)
+			return bits;
+	}
+	return 0;
+}
+/* Sector size of image files opened or created from now on, 512 to 4096.  */
+bool
+grub_imgdisk_set_sector_size(unsigned size)
+{
+	unsigned bits;
+
+	for (bits = GRUB_DISK_SECTOR_BITS; bits <= GRUB_DISK_SECTOR_BITS + 3; bits++)
+	{
+		if (size == 1U << bits)
+		{
+			m_ctx.file_sector_size = bits;
+			return true;
+		}
+	}
+	return false;
+}
+
+unsigned
+grub_imgdisk_get_sector_size(void)
+{
+	return 1U << m_ctx.file_sector_size;
+}
+
+void
+grub_imgdisk_unset(void)
+{
+	if (m_ctx.file != HOST_NO_FILE)
+		host_close(m_ctx.file);
+	m_ctx.file = HOST_NO_FILE;
+	m_ctx.size = 0;
+	m_ctx.fresh = 0;
+	m_ctx.written = 0;
+	m_ctx.sparse = 0;
+	m_ctx.log_sector_size = m_ctx.file_sector_size;
+}
+
+bool
+grub_imgdisk_set(const wchar_t* path)
+{
+	unsigned bits;
+
+	grub_imgdisk_unset();
+
+	m_ctx.file = host_open(path, 0);
+	if (m_ctx.file == HOST_NO_FILE)
+	{
+		grub_printf("image open failed (%lu)\n", host_error());
+		return false;
+	}
+
+	m_ctx.size = host_size(m_ctx.file);
+	/* A device node keeps its own sector size, 4Kn drives included.  */
+	bits = get_device_sector_size(m_ctx.file);
+	if (bits)
+		m_ctx.log_sector_size = bits;
+	else
+		m_ctx.sparse = host_is_sparse(m_ctx.file);
+	if (m_ctx.size < (1ULL << m_ctx.log_sector_size))
+	{
+		grub_imgdisk_unset();
+		grub_printf("invalid image size\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+grub_imgdisk_create(const wchar_t* path, grub_uint64_t size)
+{
+	grub_imgdisk_unset();
+
+	m_ctx.file = host_open(path, 1);
+	if (m_ctx.file == HOST_NO_FILE)
+	{
+		grub_printf("image create failed (%lu)\n", host_error());
+		return false;
+	}
+
+	/* Without sparse support the image still reads as zeros, it only
+	   takes its full size on the host.  */
+	if (host_set_sparse(m_ctx.file))
+		m_ctx.sparse = 1;
+	else
+		grub_printf("image is not sparse (%lu)\n", host_error());
+
+	size = ALIGN_UP(size, 1ULL << m_ctx.log_sector_size);
+	if (!host_resize(m_ctx.file, size))
+	{
+		grub_printf("image resize failed (%lu)\n", host_error());
+		grub_imgdisk_unset();
+		host_delete(path);
+		return false;
+	}
+
+	m_ctx.size = size;
+	m_ctx.fresh = 1;
+	m_ctx.written = 0;
+	return true;
+}
+
+static int
+grub_imgdisk_iterate(grub_disk_dev_iterate_hook_t hook, void* hook_data,
+	grub_disk_pull_t pull)
+{
+	if (pull != GRUB_DISK_PULL_NONE)
+		return 0;
+	if (m_ctx.file == HOST_NO_FILE)
+		return 0;
+	if (hook("img", hook_data))
+		return 1;
+	return 0;
+}
+
+static grub_err_t
+grub_imgdisk_open(const char* name, grub_disk_t disk)
+{
+	if (grub_strcmp(name, "img") != 0 || m_ctx.file == HOST_NO_FILE)
+		return grub_error(GRUB_ERR_UNKNOWN_DEVICE, "not an image disk");
+
+	disk->id = 0;
+	disk->log_sector_size = m_ctx.log_sector_size;
+	disk->total_sectors = m_ctx.size >> m_ctx.log_sector_size;
+	/* Image files have no transfer limit of their own, use 16M.  */
+	disk->max_agglomerate = 1 << (24 - GRUB_DISK_SECTOR_BITS - GRUB_DISK_CACHE_BITS);
+	disk->data = &m_ctx;
+
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+grub_imgdisk_read(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_size_t size, char* buf)
+{
+	grub_uint64_t ofs = sector << disk->log_sector_size;
+	grub_uint64_t len = (grub_uint64_t)size << disk->log_sector_size;
+
+	while (len)
+	{
+		grub_uint32_t chunk = (len > IMGDISK_MAX_IO) ? IMGDISK_MAX_IO : (grub_uint32_t)len;
+		grub_ssize_t done = host_read(m_ctx.file, buf, chunk, ofs);
+
+		if (done < 0)
+			return grub_error(GRUB_ERR_READ_ERROR, "failure reading sector 0x%llx from %s (%lu)",
+				sector, disk->name, host_error());
+		if ((grub_uint64_t)done < chunk)
+		{
+			/* Past the end of the image, same as loopback.  */
+			grub_memset(buf + done, 0, len - done);
+			break;
+		}
+		ofs += done;
+		buf += done;
+		len -= done;
+	}
+
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+imgdisk_pwrite(grub_disk_t disk, grub_uint64_t ofs, const char* buf, grub_uint64_t len)
+{
+	grub_disk_addr_t sector = ofs >> disk->log_sector_size;
+	grub_size_t size = (grub_size_t)(len >> disk->log_sector_size);
+
+	if (ofs + len > m_ctx.written)
+		m_ctx.written = ofs + len;
+	while (len)
+	{
+		grub_uint32_t chunk = (len > IMGDISK_MAX_IO) ? IMGDISK_MAX_IO : (grub_uint32_t)len;
+		grub_ssize_t done = host_write(m_ctx.file, buf, chunk, ofs);
+
+		if (done != (grub_ssize_t)chunk)
+			return grub_error(GRUB_ERR_WRITE_ERROR, "failure writing sector 0x%llx (+%lu) to %s (%lu)",
+				sector, size, disk->name, host_error());
+		ofs += done;
+		buf += done;
+		len -= done;
+	}
+
+	return GRUB_ERR_NONE;
+}
+
+static int
+imgdisk_is_zero(const char* buf, grub_size_t len)
+{
+	const grub_uint64_t* p = (const grub_uint64_t*)buf;
+	grub_size_t i;
+
+	for (i = 0; i < len / sizeof(*p); i++)
+	{
+		if (p[i])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * A new image is sparse and reads as zeros wherever it has not been
+ * written, so zero granules past everything written so far are dropped
+ * instead of allocating space for them.  Anything below that mark may
+ * hold data and is always written.
+ */
+static grub_err_t
+grub_imgdisk_write(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_size_t size, const char* buf)
+{
+	grub_uint64_t ofs = sector << disk->log_sector_size;
+	grub_uint64_t len = (grub_uint64_t)size << disk->log_sector_size;
+	grub_uint64_t pos, start = 0, n;
+
+	if (!m_ctx.fresh)
+		return imgdisk_pwrite(disk, ofs, buf, len);
+
+	for (pos = 0; pos < len; pos += n)
+	{
+		n = (len - pos < IMGDISK_ZERO_RUN) ? len - pos : IMGDISK_ZERO_RUN;
+		if (ofs + pos < m_ctx.written || !imgdisk_is_zero(buf + pos, (grub_size_t)n))
+			continue;
+		if (pos > start && imgdisk_pwrite(disk, ofs + start, buf + start, pos - start))
+			return grub_errno;
+		start = pos + n;
+	}
+	if (len > start)
+		return imgdisk_pwrite(disk, ofs + start, buf + start, len - start);
+	return GRUB_ERR_NONE;
+}
+
+/*
+ * Nothing past the high-water mark of a new image has been written, it
+ * already reads as zeros.  Anything else is punched out of the file, see
+ * host_zero.  Raw device nodes do not take it and get their zeros written
+ * by the caller.
+ *
+ * A discard without ZERO is only a hint: it is taken where it is cheap,
+ * on a sparse file, and refused elsewhere instead of writing zeros.
+ */
+static grub_err_t
+grub_imgdisk_discard(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_uint64_t size, int zero)
+{
+	grub_uint64_t ofs = sector << disk->log_sector_size;
+
+	if (m_ctx.fresh && ofs >= m_ctx.written)
+		return GRUB_ERR_NONE;
+	if (!zero && !m_ctx.sparse)
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "%s is not sparse", disk->name);
+
+	if (!host_zero(m_ctx.file, ofs, size << disk->log_sector_size))
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "cannot zero sector 0x%llx (+%llu) on %s (%lu)",
+			sector, size, disk->name, host_error());
+	return GRUB_ERR_NONE;
+}
+
+static struct grub_disk_dev grub_imgdisk_dev =
+{
+	.name = "imgdisk",
+	.id = GRUB_DISK_DEVICE_IMGDISK_ID,
+	.disk_iterate = grub_imgdisk_iterate,
+	.disk_open = grub_imgdisk_open,
+	.disk_read = grub_imgdisk_read,
+	.disk_write = grub_imgdisk_write,
+	.disk_discard = grub_imgdisk_discard,
+	.next = 0
+};
+
+GRUB_MOD_INIT(imgdisk)
+{
+	grub_disk_dev_register(&grub_imgdisk_dev);
+}
+
+GRUB_MOD_FINI(imgdisk)
+{
+	grub_imgdisk_unset();
+	grub_disk_dev_unregister(&grub_imgdisk_dev);
+}
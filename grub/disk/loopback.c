@@ -20,56 +20,338 @@
 #include <grub/types.h>
 #include <grub/misc.h>
 #include <grub/disk.h>
+#include <grub/file.h>
+#include <grub/fs.h>
 #include <grub/mm.h>
 
 #include <loopback.h>
-#include <stdio.h>
+#include <win32.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "../../fatfs/ff.h"
 
 GRUB_MOD_LICENSE("GPLv3+");
 
+/* Size of one read-ahead window.  */
+#define LOOPBACK_RA_SIZE	(4U << 20)
+/* Largest transfer handed to a single ReadFile or pread call.  */
+#define LOOPBACK_MAX_IO		(1U << 30)
+
+enum loopback_window_state
+{
+	LOOPBACK_WINDOW_EMPTY,
+	LOOPBACK_WINDOW_PENDING,
+	LOOPBACK_WINDOW_READY,
+};
+
+/* An asynchronous read of LOOPBACK_RA_SIZE bytes at OFS.  */
+struct loopback_window
+{
+	char* buf;
+	grub_uint64_t ofs;
+	DWORD len;
+#ifdef _WIN32
+	OVERLAPPED ov;
+#endif
+	enum loopback_window_state state;
+};
+
+#ifdef _WIN32
+typedef HANDLE loopback_file_t;
+#define LOOPBACK_NO_FILE	INVALID_HANDLE_VALUE
+#else
+typedef int loopback_file_t;
+#define LOOPBACK_NO_FILE	(-1)
+#endif
+
 static struct
 {
-	FILE* file;
-	__int64 size;
-} m_ctx;
+	loopback_file_t file;
+	grub_int64_t size;
+	enum grub_loopback_mode mode;
+	/* GRUB_LOOPBACK_MODE_MMAP */
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+	const char* view;
+	/* GRUB_LOOPBACK_MODE_READAHEAD */
+	struct loopback_window window[2];
+	grub_uint64_t next_ofs;
+	/* Decompressing filter on top of the image, if one took it.  */
+	grub_file_t filtered;
+} m_ctx = { LOOPBACK_NO_FILE };
+
+static enum grub_loopback_mode m_mode = GRUB_LOOPBACK_MODE_READAHEAD;
+
+void
+grub_loopback_set_mode(enum grub_loopback_mode mode)
+{
+	m_mode = mode;
+}
+
+static grub_size_t
+loopback_pread(grub_uint64_t ofs, char* buf, grub_size_t len);
+
+/* Wait for an in-flight window, a failed read leaves it empty.  */
+static void
+loopback_window_wait(struct loopback_window* w)
+{
+#ifdef _WIN32
+	DWORD done = 0;
+
+	if (w->state != LOOPBACK_WINDOW_PENDING)
+		return;
+	if (GetOverlappedResult(m_ctx.file, &w->ov, &done, TRUE)
+		|| GetLastError() == ERROR_HANDLE_EOF)
+	{
+		w->len = done;
+		w->state = LOOPBACK_WINDOW_READY;
+	}
+	else
+		w->state = LOOPBACK_WINDOW_EMPTY;
+#else
+	if (w->state != LOOPBACK_WINDOW_PENDING)
+		return;
+	/* The page cache has been filling the window since it was started.  */
+	w->len = (DWORD)loopback_pread(w->ofs, w->buf, LOOPBACK_RA_SIZE);
+	w->state = w->len ? LOOPBACK_WINDOW_READY : LOOPBACK_WINDOW_EMPTY;
+#endif
+}
+
+static void
+loopback_window_start(struct loopback_window* w, grub_uint64_t ofs)
+{
+	loopback_window_wait(w);
+	if (ofs >= (grub_uint64_t)m_ctx.size)
+	{
+		w->state = LOOPBACK_WINDOW_EMPTY;
+		return;
+	}
+	w->ofs = ofs;
+	w->len = 0;
+#ifdef _WIN32
+	w->ov.Internal = w->ov.InternalHigh = 0;
+	w->ov.Offset = (DWORD)ofs;
+	w->ov.OffsetHigh = (DWORD)(ofs >> 32);
+	ResetEvent(w->ov.hEvent);
+	if (ReadFile(m_ctx.file, w->buf, LOOPBACK_RA_SIZE, NULL, &w->ov)
+		|| GetLastError() == ERROR_IO_PENDING)
+		w->state = LOOPBACK_WINDOW_PENDING;
+	else
+		w->state = LOOPBACK_WINDOW_EMPTY;
+#else
+	posix_fadvise(m_ctx.file, (off_t)ofs, LOOPBACK_RA_SIZE, POSIX_FADV_WILLNEED);
+	w->state = LOOPBACK_WINDOW_PENDING;
+#endif
+}
+
+static void
+loopback_release(void)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		struct loopback_window* w = &m_ctx.window[i];
+#ifdef _WIN32
+		if (w->state == LOOPBACK_WINDOW_PENDING)
+		{
+			CancelIo(m_ctx.file);
+			loopback_window_wait(w);
+		}
+		if (w->ov.hEvent)
+			CloseHandle(w->ov.hEvent);
+#endif
+		grub_free(w->buf);
+		grub_memset(w, 0, sizeof(*w));
+	}
+#ifdef _WIN32
+	if (m_ctx.view)
+		UnmapViewOfFile(m_ctx.view);
+	if (m_ctx.mapping)
+		CloseHandle(m_ctx.mapping);
+	m_ctx.mapping = NULL;
+#else
+	if (m_ctx.view)
+		munmap((void*)m_ctx.view, (size_t)m_ctx.size);
+#endif
+	m_ctx.view = NULL;
+}
+
+static bool
+loopback_setup_mmap(void)
+{
+	/* The whole image must fit into the address space.  */
+	if ((grub_uint64_t)m_ctx.size > (grub_uint64_t)(GRUB_SIZE_MAX >> 1))
+		return false;
+#ifdef _WIN32
+	m_ctx.mapping = CreateFileMappingW(m_ctx.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_ctx.mapping == NULL)
+		return false;
+	m_ctx.view = MapViewOfFile(m_ctx.mapping, FILE_MAP_READ, 0, 0, 0);
+	if (m_ctx.view == NULL)
+	{
+		CloseHandle(m_ctx.mapping);
+		m_ctx.mapping = NULL;
+		return false;
+	}
+#else
+	void* view;
+
+	if (m_ctx.size == 0)
+		return false;
+	view = mmap(NULL, (size_t)m_ctx.size, PROT_READ, MAP_SHARED, m_ctx.file, 0);
+	if (view == MAP_FAILED)
+		return false;
+	m_ctx.view = view;
+#endif
+	return true;
+}
+
+static bool
+loopback_setup_readahead(void)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		struct loopback_window* w = &m_ctx.window[i];
+		w->buf = grub_malloc(LOOPBACK_RA_SIZE);
+#ifdef _WIN32
+		w->ov.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!w->buf || !w->ov.hEvent)
+#else
+		if (!w->buf)
+#endif
+		{
+			grub_errno = GRUB_ERR_NONE;
+			return false;
+		}
+	}
+	return true;
+}
+
+static grub_size_t
+loopback_read_raw(grub_uint64_t ofs, char* buf, grub_size_t len);
+
+/* The image as a file, for the filters to read from.  */
+static grub_ssize_t
+loopback_file_read(grub_file_t file, char* buf, grub_size_t len)
+{
+	if (loopback_read_raw(file->offset, buf, len) != len)
+	{
+		grub_error(GRUB_ERR_IO, "read failed");
+		return -1;
+	}
+	return len;
+}
+
+static struct grub_fs loopback_file_fs =
+{
+	.name = "loopback",
+	.fs_read = loopback_file_read,
+	.next = 0
+};
+
+/* Put a decompression filter on top of the image when one recognizes it.  */
+static bool
+loopback_setup_filters(void)
+{
+	grub_file_t file;
+
+	file = grub_zalloc(sizeof(*file));
+	if (!file)
+		return false;
+	file->fs = &loopback_file_fs;
+	file->size = m_ctx.size;
+	file = grub_file_apply_filters(file, GRUB_FILE_TYPE_LOOPBACK | GRUB_FILE_TYPE_FILTER_VDISK);
+	if (!file)
+		return false;
+	if (file->fs == &loopback_file_fs)
+		grub_file_close(file);
+	else
+		m_ctx.filtered = file;
+	return true;
+}
 
 void
 grub_loopback_unset(void)
 {
-	if (m_ctx.file)
-		fclose(m_ctx.file);
-	m_ctx.file = 0;
+	if (m_ctx.filtered)
+		grub_file_close(m_ctx.filtered);
+	m_ctx.filtered = NULL;
+	loopback_release();
+#ifdef _WIN32
+	if (m_ctx.file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_ctx.file);
+#else
+	if (m_ctx.file >= 0)
+		close(m_ctx.file);
+#endif
+	m_ctx.file = LOOPBACK_NO_FILE;
 }
 
 bool
 grub_loopback_set(const wchar_t* path)
 {
-	if (_wfopen_s(&m_ctx.file, path, L"rb") != 0)
+#ifdef _WIN32
+	LARGE_INTEGER li;
+
+	m_ctx.file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_ctx.file == LOOPBACK_NO_FILE)
 	{
-		m_ctx.file = 0;
 		grub_printf("file open failed\n");
 		return false;
 	}
 
-	if (_fseeki64(m_ctx.file, 0, SEEK_END) != 0)
+	if (!GetFileSizeEx(m_ctx.file, &li))
 	{
-		fclose(m_ctx.file);
-		m_ctx.file = 0;
-		grub_printf("fseek failed\n");
+		grub_loopback_unset();
+		grub_printf("get file size failed\n");
 		return false;
 	}
+	m_ctx.size = li.QuadPart;
+#else
+	char* host_path = win32_path(path);
+	struct stat st;
 
-	m_ctx.size = _ftelli64(m_ctx.file);
-	if (m_ctx.size == -1L)
+	m_ctx.file = host_path ? open(host_path, O_RDONLY) : -1;
+	free(host_path);
+	if (m_ctx.file < 0)
 	{
-		fclose(m_ctx.file);
-		m_ctx.file = 0;
-		grub_printf("ftell failed\n");
+		grub_printf("file open failed\n");
 		return false;
 	}
 
+	if (fstat(m_ctx.file, &st) != 0)
+	{
+		grub_loopback_unset();
+		grub_printf("get file size failed\n");
+		return false;
+	}
+	m_ctx.size = st.st_size;
+	posix_fadvise(m_ctx.file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	m_ctx.next_ofs = 0;
+
+	m_ctx.mode = m_mode;
+	if (m_ctx.mode == GRUB_LOOPBACK_MODE_MMAP && !loopback_setup_mmap())
+		m_ctx.mode = GRUB_LOOPBACK_MODE_READAHEAD;
+	if (m_ctx.mode == GRUB_LOOPBACK_MODE_READAHEAD && !loopback_setup_readahead())
+	{
+		loopback_release();
+		m_ctx.mode = GRUB_LOOPBACK_MODE_DIRECT;
+	}
+
+	if (!loopback_setup_filters())
+	{
+		grub_printf("%s\n", grub_errmsg);
+		grub_loopback_unset();
+		return false;
+	}
 
 	return true;
 }
@@ -80,7 +362,7 @@ grub_loopback_iterate(grub_disk_dev_iterate_hook_t hook, void* hook_data,
 {
 	if (pull != GRUB_DISK_PULL_NONE)
 		return 0;
-	if (!m_ctx.file)
+	if (m_ctx.file == LOOPBACK_NO_FILE)
 		return 0;
 	if (hook("loop", hook_data))
 		return 1;
@@ -90,11 +372,16 @@ grub_loopback_iterate(grub_disk_dev_iterate_hook_t hook, void* hook_data,
 static grub_err_t
 grub_loopback_open(const char* name, grub_disk_t disk)
 {
-	if (grub_strcmp(name, "loop") != 0 || !m_ctx.file)
+	grub_uint64_t size = m_ctx.size;
+
+	if (grub_strcmp(name, "loop") != 0 || m_ctx.file == LOOPBACK_NO_FILE)
 		return grub_error(GRUB_ERR_UNKNOWN_DEVICE, "can't open device");
 
+	if (m_ctx.filtered)
+		size = grub_file_size(m_ctx.filtered);
+
 	/* Use the filesize for the disk size, round up to a complete sector.  */
-	disk->total_sectors = ((m_ctx.size + GRUB_DISK_SECTOR_SIZE - 1) / GRUB_DISK_SECTOR_SIZE);
+	disk->total_sectors = ((size + GRUB_DISK_SECTOR_SIZE - 1) / GRUB_DISK_SECTOR_SIZE);
 
 	/* Avoid reading more than 512M.  */
 	disk->max_agglomerate = 1 << (29 - GRUB_DISK_SECTOR_BITS - GRUB_DISK_CACHE_BITS);
@@ -106,27 +393,179 @@ grub_loopback_open(const char* name, grub_disk_t disk)
 	return 0;
 }
 
+/* Synchronous positioned read, returns the number of bytes read.  */
+static grub_size_t
+loopback_pread(grub_uint64_t ofs, char* buf, grub_size_t len)
+{
+	grub_size_t total = 0;
+#ifdef _WIN32
+	/* Without an event of its own GetOverlappedResult waits on the file
+	   handle, which a read-ahead window completing signals as well.  */
+	HANDLE event = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+	if (!event)
+		return 0;
+#endif
+
+	while (len)
+	{
+#ifdef _WIN32
+		OVERLAPPED ov = { 0 };
+		DWORD dwsize = (len > LOOPBACK_MAX_IO) ? LOOPBACK_MAX_IO : (DWORD)len;
+		DWORD done = 0;
+
+		ov.Offset = (DWORD)ofs;
+		ov.OffsetHigh = (DWORD)(ofs >> 32);
+		ov.hEvent = event;
+		if (!ReadFile(m_ctx.file, buf, dwsize, NULL, &ov)
+			&& GetLastError() != ERROR_IO_PENDING)
+			break;
+		if (!GetOverlappedResult(m_ctx.file, &ov, &done, TRUE) || done == 0)
+			break;
+#else
+		ssize_t done = pread(m_ctx.file, buf,
+			(len > LOOPBACK_MAX_IO) ? LOOPBACK_MAX_IO : len, (off_t)ofs);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			break;
+#endif
+		total += done;
+		ofs += done;
+		buf += done;
+		len -= done;
+	}
+#ifdef _WIN32
+	CloseHandle(event);
+#endif
+	return total;
+}
+
+/* Copy what the read-ahead windows hold at OFS, returns the byte count.  */
+static grub_size_t
+loopback_window_copy(grub_uint64_t ofs, char* buf, grub_size_t len, int* hit)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		struct loopback_window* w = &m_ctx.window[i];
+		grub_size_t n;
+
+		if (w->state == LOOPBACK_WINDOW_EMPTY
+			|| ofs < w->ofs || ofs >= w->ofs + LOOPBACK_RA_SIZE)
+			continue;
+		loopback_window_wait(w);
+		if (w->state != LOOPBACK_WINDOW_READY || ofs >= w->ofs + w->len)
+			continue;
+		n = (grub_size_t)(w->ofs + w->len - ofs);
+		if (n > len)
+			n = len;
+		grub_memcpy(buf, w->buf + (ofs - w->ofs), n);
+		*hit = i;
+		return n;
+	}
+	return 0;
+}
+
+static grub_size_t
+loopback_read_ahead(grub_uint64_t ofs, char* buf, grub_size_t len)
+{
+	int sequential = (ofs == m_ctx.next_ofs);
+	grub_size_t total = 0;
+	int hit = -1;
+
+	m_ctx.next_ofs = ofs + len;
+
+	while (len)
+	{
+		grub_size_t n = loopback_window_copy(ofs, buf, len, &hit);
+		if (n == 0)
+		{
+			/* Large or random requests bypass the windows.  */
+			if (!sequential || len >= LOOPBACK_RA_SIZE)
+			{
+				total += loopback_pread(ofs, buf, len);
+				break;
+			}
+			hit = m_ctx.window[0].ofs > m_ctx.window[1].ofs ? 1 : 0;
+			loopback_window_start(&m_ctx.window[hit], ofs);
+			n = loopback_window_copy(ofs, buf, len, &hit);
+			if (n == 0)
+			{
+				total += loopback_pread(ofs, buf, len);
+				break;
+			}
+		}
+		total += n;
+		ofs += n;
+		buf += n;
+		len -= n;
+	}
+
+	/* Keep the window after the one being consumed in flight.  */
+	if (sequential)
+	{
+		grub_uint64_t next = m_ctx.next_ofs;
+		int other;
+
+		if (hit >= 0)
+			next = m_ctx.window[hit].ofs + LOOPBACK_RA_SIZE;
+		other = (hit >= 0) ? !hit : 0;
+		if (m_ctx.window[other].state == LOOPBACK_WINDOW_EMPTY
+			|| m_ctx.window[other].ofs != next)
+			loopback_window_start(&m_ctx.window[other], next);
+	}
+
+	return total;
+}
+
+/* Read from the image file itself, returns the number of bytes read.  */
+static grub_size_t
+loopback_read_raw(grub_uint64_t ofs, char* buf, grub_size_t len)
+{
+	switch (m_ctx.mode)
+	{
+	case GRUB_LOOPBACK_MODE_MMAP:
+		grub_memcpy(buf, m_ctx.view + ofs, len);
+		return len;
+	case GRUB_LOOPBACK_MODE_READAHEAD:
+		return loopback_read_ahead(ofs, buf, len);
+	default:
+		return loopback_pread(ofs, buf, len);
+	}
+}
+
 static grub_err_t
 grub_loopback_read(grub_disk_t disk, grub_disk_addr_t sector,
 	grub_size_t size, char* buf)
 {
-	grub_off_t pos;
+	grub_uint64_t ofs = sector << GRUB_DISK_SECTOR_BITS;
+	grub_size_t len = size << GRUB_DISK_SECTOR_BITS;
+	grub_uint64_t total = m_ctx.size;
+	grub_size_t avail = 0;
 
-	if (_fseeki64(m_ctx.file, sector << GRUB_DISK_SECTOR_BITS, SEEK_SET) != 0)
-		return grub_error(GRUB_ERR_IO, "seek failed");
+	if (m_ctx.filtered)
+		total = grub_file_size(m_ctx.filtered);
+	if (ofs < total)
+	{
+		avail = len;
+		if (ofs + len > total)
+			avail = (grub_size_t)(total - ofs);
+	}
 
-	if (fread(buf, 1, size << GRUB_DISK_SECTOR_BITS, m_ctx.file) != size << GRUB_DISK_SECTOR_BITS)
+	if (m_ctx.filtered)
+	{
+		grub_file_seek(m_ctx.filtered, ofs);
+		if (avail && grub_file_read(m_ctx.filtered, buf, avail) != (grub_ssize_t)avail)
+			return grub_errno ? grub_errno : grub_error(GRUB_ERR_IO, "read failed");
+	}
+	else if (loopback_read_raw(ofs, buf, avail) != avail)
 		return grub_error(GRUB_ERR_IO, "read failed");
 
 	/* In case there is more data read than there is available, in case
 	   of files that are not a multiple of GRUB_DISK_SECTOR_SIZE, fill
 	   the rest with zeros.  */
-	pos = (sector + size) << GRUB_DISK_SECTOR_BITS;
-	if (pos > (grub_off_t)m_ctx.size)
-	{
-		grub_size_t amount = pos - m_ctx.size;
-		grub_memset(buf + (size << GRUB_DISK_SECTOR_BITS) - amount, 0, amount);
-	}
+	if (avail < len)
+		grub_memset(buf + avail, 0, len - avail);
 
 	return 0;
 }
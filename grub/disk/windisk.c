@@ -17,6 +17,7 @@
  */
 
 #include <grub/disk.h>
+#include <stddef.h>
 #include <wchar.h>
 #include <windows.h>
 #include <intsafe.h>
@@ -75,6 +76,27 @@ get_drive_size(HANDLE disk)
 	return size;
 }
 
+/* Log2 of the logical sector size, 4096 on a 4Kn drive.  Anything FatFs
+   cannot use falls back to 512.  */
+static unsigned
+get_drive_sector_size(HANDLE disk)
+{
+	DWORD dw_bytes;
+	DISK_GEOMETRY geometry = { 0 };
+	unsigned bits;
+
+	if (DeviceIoControl(disk, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+		&geometry, sizeof(geometry), &dw_bytes, NULL))
+	{
+		for (bits = GRUB_DISK_SECTOR_BITS; bits <= GRUB_DISK_SECTOR_BITS + 3; bits++)
+		{
+			if (geometry.BytesPerSector == 1U << bits)
+				return bits;
+		}
+	}
+	return GRUB_DISK_SECTOR_BITS;
+}
+
 static int
 hd_call_hook(grub_disk_dev_iterate_hook_t hook, void* hook_data, DWORD drive)
 {
@@ -120,8 +142,8 @@ windisk_open(const char* name, grub_disk_t disk)
 		return grub_error(GRUB_ERR_UNKNOWN_DEVICE, "invalid windisk");
 
 	disk->id = drive;
-	disk->log_sector_size = GRUB_DISK_SECTOR_BITS;
-	disk->total_sectors = get_drive_size(data) >> GRUB_DISK_SECTOR_BITS;
+	disk->log_sector_size = get_drive_sector_size(data);
+	disk->total_sectors = get_drive_size(data) >> disk->log_sector_size;
 	disk->max_agglomerate = 1048576 >> (GRUB_DISK_SECTOR_BITS + GRUB_DISK_CACHE_BITS);
 
 	disk->data = data;
@@ -142,13 +164,13 @@ static grub_err_t
 windisk_read(struct grub_disk* disk, grub_disk_addr_t sector, grub_size_t size, char* buf)
 {
 	HANDLE dh = disk->data;
-	__int64 distance = sector << GRUB_DISK_SECTOR_BITS;
+	__int64 distance = sector << disk->log_sector_size;
 	LARGE_INTEGER li = { 0 };
 	DWORD dwsize;
 	grub_dprintf("windisk", "windisk read %s sector 0x%llx size 0x%llx\n", disk->name, sector, size);
-	if (size > (DWORD_MAX >> GRUB_DISK_SECTOR_BITS))
+	if (size > (DWORD_MAX >> disk->log_sector_size))
 		return grub_error(GRUB_ERR_OUT_OF_RANGE, "attempt to read more than 4GB data");
-	dwsize = (DWORD)(size << GRUB_DISK_SECTOR_BITS);
+	dwsize = (DWORD)(size << disk->log_sector_size);
 	li.QuadPart = distance;
 	li.LowPart = SetFilePointer(dh, li.LowPart, &li.HighPart, FILE_BEGIN);
 	if (li.LowPart == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
@@ -164,12 +186,12 @@ static grub_err_t
 windisk_write(struct grub_disk* disk, grub_disk_addr_t sector, grub_size_t size, const char* buf)
 {
 	HANDLE dh = disk->data;
-	__int64 distance = sector << GRUB_DISK_SECTOR_BITS;
+	__int64 distance = sector << disk->log_sector_size;
 	LARGE_INTEGER li = { 0 };
 	DWORD dwsize;
-	if (size > (DWORD_MAX >> GRUB_DISK_SECTOR_BITS))
+	if (size > (DWORD_MAX >> disk->log_sector_size))
 		return grub_error(GRUB_ERR_OUT_OF_RANGE, "attempt to write more than 4GB data");
-	dwsize = (DWORD)(size << GRUB_DISK_SECTOR_BITS);
+	dwsize = (DWORD)(size << disk->log_sector_size);
 	li.QuadPart = distance;
 	li.LowPart = SetFilePointer(dh, li.LowPart, &li.HighPart, FILE_BEGIN);
 	if (li.LowPart == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
@@ -180,6 +202,40 @@ windisk_write(struct grub_disk* disk, grub_disk_addr_t sector, grub_size_t size,
 	return grub_error(GRUB_ERR_READ_ERROR, "failure writing sector 0x%llx (+%lu) from %s (%lu)", sector, size, disk->name, GetLastError());
 }
 
+/*
+ * ATA TRIM / SCSI UNMAP through the storage stack.  The device is free to
+ * ignore it and to return anything for the range afterwards, so it never
+ * stands in for writing zeros.
+ */
+struct windisk_dsm
+{
+	DEVICE_MANAGE_DATA_SET_ATTRIBUTES attr;
+	DEVICE_DATA_SET_RANGE range;
+};
+
+static grub_err_t
+windisk_discard(struct grub_disk* disk, grub_disk_addr_t sector, grub_uint64_t size, int zero)
+{
+	struct windisk_dsm dsm = { 0 };
+	DWORD dw = 0;
+
+	if (zero)
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "%s cannot zero sectors", disk->name);
+
+	dsm.attr.Size = sizeof(dsm.attr);
+	dsm.attr.Action = DeviceDsmAction_Trim;
+	dsm.attr.DataSetRangesOffset = offsetof(struct windisk_dsm, range);
+	dsm.attr.DataSetRangesLength = sizeof(dsm.range);
+	dsm.range.StartingOffset = (LONGLONG)(sector << disk->log_sector_size);
+	dsm.range.LengthInBytes = size << disk->log_sector_size;
+	grub_dprintf("windisk", "windisk trim %s sector 0x%llx size 0x%llx\n", disk->name, sector, size);
+	if (DeviceIoControl(disk->data, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES,
+		&dsm, sizeof(dsm), NULL, 0, &dw, NULL))
+		return GRUB_ERR_NONE;
+	return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "failure trimming sector 0x%llx (+%llu) on %s (%lu)",
+		sector, size, disk->name, GetLastError());
+}
+
 static struct grub_disk_dev grub_windisk_dev =
 {
 	.name = "windisk",
@@ -189,6 +245,7 @@ static struct grub_disk_dev grub_windisk_dev =
 	.disk_close = windisk_close,
 	.disk_read = windisk_read,
 	.disk_write = windisk_write,
+	.disk_discard = windisk_discard,
 	.next = 0
 };
 
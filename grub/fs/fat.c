@@ -26,11 +26,12 @@
 #include <grub/err.h>
 #include <grub/charset.h>
 #include <grub/datetime.h>
-#ifndef MODE_EXFAT
-#include <grub/fat.h>
-#else
+#ifdef MODE_EXFAT
+/* exfat.c builds this file again, keep its mount out of fat.c's way.  */
+#define grub_fat_mount grub_exfat_mount
 #include <grub/exfat.h>
 #endif
+#include <grub/fat.h>
 #include <grub/fshelp.h>
 
 GRUB_MOD_LICENSE("GPLv3+");
@@ -63,6 +64,9 @@ enum
 		)
 };
 
+/* Bytes of FAT fetched at once while mapping a cluster chain.  */
+#define GRUB_FAT_MAP_WINDOW	4096
+
 #ifdef MODE_EXFAT
 typedef struct grub_exfat_bpb grub_current_fat_bpb_t;
 #else
@@ -180,6 +184,14 @@ typedef struct grub_fat_dir_entry grub_fat_dir_node_t;
 
 #endif
 
+/* A run of contiguous clusters in a cluster chain.  */
+struct grub_fat_extent
+{
+	grub_uint32_t logical;
+	grub_uint32_t cluster;
+	grub_uint32_t count;
+};
+
 struct grub_fshelp_node
 {
 	grub_disk_t disk;
@@ -195,6 +207,14 @@ struct grub_fshelp_node
 	grub_uint32_t cur_cluster_num;
 	grub_uint32_t cur_cluster;
 
+	/* Extent map of an opened file, built as the file is read.  */
+	int use_map;
+	int map_done;
+	grub_uint32_t map_clusters;
+	grub_uint32_t num_extents;
+	grub_uint32_t max_extents;
+	struct grub_fat_extent* extents;
+
 #ifdef MODE_EXFAT
 	int is_contiguous;
 #endif
@@ -443,6 +463,132 @@ fail:
 	return 0;
 }
 
+/* Extend the extent map of NODE until it covers logical cluster UPTO
+   or the end of the chain.  The FAT is read GRUB_FAT_MAP_WINDOW bytes
+   at a time instead of one entry per disk read.  */
+static grub_err_t
+grub_fat_map_extend(grub_disk_t disk, grub_fshelp_node_t node,
+	grub_uint32_t upto)
+{
+	struct grub_fat_data* data = node->data;
+	grub_uint8_t window[GRUB_FAT_MAP_WINDOW + 4];
+	grub_uint32_t window_start = ~0U;
+	struct grub_fat_extent* ext;
+
+	if (node->num_extents == 0)
+	{
+		if (node->file_cluster < 2 || node->file_cluster >= data->num_clusters)
+			return grub_error(GRUB_ERR_BAD_FS, "invalid cluster %u",
+				node->file_cluster);
+		node->extents = grub_malloc(16 * sizeof(*node->extents));
+		if (!node->extents)
+			return grub_errno;
+		node->max_extents = 16;
+		node->extents[0].logical = 0;
+		node->extents[0].cluster = node->file_cluster;
+		node->extents[0].count = 1;
+		node->num_extents = 1;
+		node->map_clusters = 1;
+	}
+
+	while (!node->map_done && node->map_clusters <= upto)
+	{
+		grub_uint32_t cluster, next_cluster, fat_offset;
+
+		ext = &node->extents[node->num_extents - 1];
+		cluster = ext->cluster + ext->count - 1;
+
+		switch (data->fat_size)
+		{
+		case 32:
+			fat_offset = cluster << 2;
+			break;
+		case 16:
+			fat_offset = cluster << 1;
+			break;
+		default:
+			/* case 12: */
+			fat_offset = cluster + (cluster >> 1);
+			break;
+		}
+
+		if (window_start == ~0U || fat_offset - window_start >= GRUB_FAT_MAP_WINDOW)
+		{
+			window_start = fat_offset & ~(GRUB_FAT_MAP_WINDOW - 1);
+			if (grub_disk_read(disk, data->fat_sector, window_start,
+				sizeof(window), window))
+				return grub_errno;
+		}
+		next_cluster = grub_get_unaligned32(window + fat_offset - window_start);
+
+		next_cluster = grub_le_to_cpu32(next_cluster);
+		switch (data->fat_size)
+		{
+		case 16:
+			next_cluster &= 0xFFFF;
+			break;
+		case 12:
+			if (cluster & 1)
+				next_cluster >>= 4;
+
+			next_cluster &= 0x0FFF;
+			break;
+		}
+
+		if (next_cluster >= data->cluster_eof_mark)
+		{
+			node->map_done = 1;
+			break;
+		}
+
+		if (next_cluster < 2 || next_cluster >= data->num_clusters)
+			return grub_error(GRUB_ERR_BAD_FS, "invalid cluster %u", next_cluster);
+
+		/* A chain longer than the volume loops back on itself.  */
+		if (node->map_clusters >= data->num_clusters)
+			return grub_error(GRUB_ERR_BAD_FS, "cluster chain loop");
+
+		if (next_cluster == cluster + 1)
+			ext->count++;
+		else
+		{
+			if (node->num_extents == node->max_extents)
+			{
+				ext = grub_realloc(node->extents,
+					2 * node->max_extents * sizeof(*node->extents));
+				if (!ext)
+					return grub_errno;
+				node->extents = ext;
+				node->max_extents *= 2;
+			}
+			ext = &node->extents[node->num_extents++];
+			ext->logical = node->map_clusters;
+			ext->cluster = next_cluster;
+			ext->count = 1;
+		}
+		node->map_clusters++;
+	}
+
+	return GRUB_ERR_NONE;
+}
+
+/* Find the extent holding logical cluster LCN, the map must cover it.  */
+static struct grub_fat_extent*
+grub_fat_map_find(grub_fshelp_node_t node, grub_uint32_t lcn)
+{
+	grub_uint32_t lo = 0, hi = node->num_extents;
+
+	while (hi - lo > 1)
+	{
+		grub_uint32_t mid = (lo + hi) / 2;
+		if (node->extents[mid].logical <= lcn)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return &node->extents[lo];
+}
+
 static grub_ssize_t
 grub_fat_read_data(grub_disk_t disk, grub_fshelp_node_t node,
 	grub_disk_read_hook_t read_hook, void* read_hook_data,
@@ -496,6 +642,46 @@ grub_fat_read_data(grub_disk_t disk, grub_fshelp_node_t node,
 	logical_cluster = offset >> logical_cluster_bits;
 	offset &= (1ULL << logical_cluster_bits) - 1;
 
+	if (node->use_map)
+	{
+		if (len == 0)
+			return 0;
+
+		if (grub_fat_map_extend(disk, node, (grub_uint32_t)
+			((offset + len - 1) >> logical_cluster_bits) + logical_cluster))
+			return -1;
+
+		/* Each contiguous run is a single disk read.  */
+		while (len && logical_cluster < node->map_clusters)
+		{
+			struct grub_fat_extent* ext = grub_fat_map_find(node, logical_cluster);
+			grub_uint64_t run;
+
+			sector = (node->data->cluster_sector
+				+ ((ext->cluster + (logical_cluster - ext->logical) - 2)
+					<< node->data->cluster_bits));
+			run = ((grub_uint64_t)(ext->logical + ext->count - logical_cluster)
+				<< logical_cluster_bits) - offset;
+			size = (run > len) ? len : (grub_size_t)run;
+
+			disk->read_hook = read_hook;
+			disk->read_hook_data = read_hook_data;
+			grub_disk_read(disk, sector, offset, size, buf);
+			disk->read_hook = 0;
+			if (grub_errno)
+				return -1;
+
+			len -= size;
+			buf += size;
+			ret += size;
+			offset += size;
+			logical_cluster += (grub_uint32_t)(offset >> logical_cluster_bits);
+			offset &= (1ULL << logical_cluster_bits) - 1;
+		}
+
+		return ret;
+	}
+
 	if (logical_cluster < node->cur_cluster_num)
 	{
 		node->cur_cluster_num = 0;
@@ -947,6 +1133,12 @@ static grub_err_t lookup_file(grub_fshelp_node_t node,
 				(*foundnode)->file_cluster = node->data->root_cluster;
 #endif
 			(*foundnode)->cur_cluster_num = ~0U;
+			(*foundnode)->use_map = 0;
+			(*foundnode)->map_done = 0;
+			(*foundnode)->map_clusters = 0;
+			(*foundnode)->num_extents = 0;
+			(*foundnode)->max_extents = 0;
+			(*foundnode)->extents = NULL;
 			(*foundnode)->data = node->data;
 			(*foundnode)->disk = node->disk;
 
@@ -1069,6 +1261,12 @@ grub_fat_open(grub_file_t file, const char* name)
 
 	file->data = found;
 	file->size = found->file_size;
+	/* Files are mapped into extents, directories still walk the FAT.  */
+#ifdef MODE_EXFAT
+	found->use_map = !found->is_contiguous;
+#else
+	found->use_map = 1;
+#endif
 
 	return GRUB_ERR_NONE;
 
@@ -1095,6 +1293,7 @@ grub_fat_close(grub_file_t file)
 {
 	grub_fshelp_node_t node = file->data;
 
+	grub_free(node->extents);
 	grub_free(node->data);
 	grub_free(node);
 
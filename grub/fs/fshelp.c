@@ -343,23 +343,27 @@ grub_fshelp_find_file_lookup(const char* path, grub_fshelp_node_t rootnode,
 
 }
 
-/* Read LEN bytes from the file NODE on disk DISK into the buffer BUF,
-   beginning with the block POS.  READ_HOOK should be set before
-   reading a block from the file.  READ_HOOK_DATA is passed through as
-   the DATA argument to READ_HOOK.  GET_BLOCK is used to translate
-   file blocks to disk blocks.  The file is FILESIZE bytes big and the
-   blocks have a size of LOG2BLOCKSIZE (in log2).  */
-grub_ssize_t
-grub_fshelp_read_file(grub_disk_t disk, grub_fshelp_node_t node,
+/* Read LEN bytes from NODE at POS, mapping blocks with GET_RUN if set,
+   otherwise with GET_BLOCK one block at a time.  Blocks that follow each
+   other on disk, and runs of sparse blocks, are merged so that each
+   contiguous stretch is a single grub_disk_read or grub_memset.  */
+static grub_ssize_t
+grub_fshelp_read_file_real(grub_disk_t disk, grub_fshelp_node_t node,
 	grub_disk_read_hook_t read_hook, void* read_hook_data,
 	grub_off_t pos, grub_size_t len, char* buf,
 	grub_disk_addr_t(*get_block) (grub_fshelp_node_t node,
 		grub_disk_addr_t block),
+	grub_disk_addr_t(*get_run) (grub_fshelp_node_t node,
+		grub_disk_addr_t block, grub_disk_addr_t* run),
 	grub_off_t filesize, int log2blocksize,
 	grub_disk_addr_t blocks_start)
 {
 	grub_disk_addr_t i, blockcnt;
+	grub_disk_addr_t blknr, run, next_blknr = 0, next_run = 0;
+	int have_next = 0;
 	int blocksize = 1 << (log2blocksize + GRUB_DISK_SECTOR_BITS);
+	grub_uint64_t bytes;
+	grub_size_t skip, size, left;
 
 	/*
 	 * Catch blatantly invalid log2blocksize. We could be a lot stricter, but
@@ -385,38 +389,50 @@ grub_fshelp_read_file(grub_disk_t disk, grub_fshelp_node_t node,
 		len = filesize - pos;
 
 	blockcnt = ((len + pos) + blocksize - 1) >> (log2blocksize + GRUB_DISK_SECTOR_BITS);
+	i = pos >> (log2blocksize + GRUB_DISK_SECTOR_BITS);
+	skip = pos & (blocksize - 1);
+	left = len;
 
-	for (i = pos >> (log2blocksize + GRUB_DISK_SECTOR_BITS); i < blockcnt; i++)
+	while (left)
 	{
-		grub_disk_addr_t blknr;
-		int blockoff = pos & (blocksize - 1);
-		int blockend = blocksize;
-
-		int skipfirst = 0;
-
-		blknr = get_block(node, i);
-		if (grub_errno)
-			return -1;
-
-		blknr = blknr << log2blocksize;
-
-		/* Last block.  */
-		if (i == blockcnt - 1)
+		/* Map the next stretch, reusing the lookahead from the last one.  */
+		if (have_next)
 		{
-			blockend = (len + pos) & (blocksize - 1);
-
-			/* The last portion is exactly blocksize.  */
-			if (!blockend)
-				blockend = blocksize;
+			blknr = next_blknr;
+			run = next_run;
+			have_next = 0;
+		}
+		else
+		{
+			run = 1;
+			blknr = get_run ? get_run(node, i, &run) : get_block(node, i);
+			if (grub_errno)
+				return -1;
 		}
+		if (run == 0 || run > blockcnt - i)
+			run = blockcnt - i;
 
-		/* First block.  */
-		if (i == (pos >> (log2blocksize + GRUB_DISK_SECTOR_BITS)))
+		/* Merge following stretches that continue this one on disk.  */
+		while (i + run < blockcnt)
 		{
-			skipfirst = blockoff;
-			blockend -= skipfirst;
+			next_run = 1;
+			next_blknr = get_run ? get_run(node, i + run, &next_run)
+				: get_block(node, i + run);
+			if (grub_errno)
+				return -1;
+			if (next_run == 0 || next_run > blockcnt - i - run)
+				next_run = blockcnt - i - run;
+			if (blknr ? (next_blknr != blknr + run) : (next_blknr != 0))
+			{
+				have_next = 1;
+				break;
+			}
+			run += next_run;
 		}
 
+		bytes = (run << (log2blocksize + GRUB_DISK_SECTOR_BITS)) - skip;
+		size = (bytes > left) ? left : (grub_size_t)bytes;
+
 		/* If the block number is 0 this block is not stored on disk but
 	   is zero filled instead.  */
 		if (blknr)
@@ -424,17 +440,54 @@ grub_fshelp_read_file(grub_disk_t disk, grub_fshelp_node_t node,
 			disk->read_hook = read_hook;
 			disk->read_hook_data = read_hook_data;
 
-			grub_disk_read(disk, blknr + blocks_start, skipfirst,
-				blockend, buf);
+			grub_disk_read(disk, (blknr << log2blocksize) + blocks_start, skip,
+				size, buf);
 			disk->read_hook = 0;
 			if (grub_errno)
 				return -1;
 		}
 		else
-			grub_memset(buf, 0, blockend);
+			grub_memset(buf, 0, size);
 
-		buf += blocksize - skipfirst;
+		buf += size;
+		left -= size;
+		i += run;
+		skip = 0;
 	}
 
 	return len;
 }
+
+/* Read LEN bytes from the file NODE on disk DISK into the buffer BUF,
+   beginning with the block POS.  READ_HOOK should be set before
+   reading a block from the file.  READ_HOOK_DATA is passed through as
+   the DATA argument to READ_HOOK.  GET_BLOCK is used to translate
+   file blocks to disk blocks.  The file is FILESIZE bytes big and the
+   blocks have a size of LOG2BLOCKSIZE (in log2).  */
+grub_ssize_t
+grub_fshelp_read_file(grub_disk_t disk, grub_fshelp_node_t node,
+	grub_disk_read_hook_t read_hook, void* read_hook_data,
+	grub_off_t pos, grub_size_t len, char* buf,
+	grub_disk_addr_t(*get_block) (grub_fshelp_node_t node,
+		grub_disk_addr_t block),
+	grub_off_t filesize, int log2blocksize,
+	grub_disk_addr_t blocks_start)
+{
+	return grub_fshelp_read_file_real(disk, node, read_hook, read_hook_data,
+		pos, len, buf, get_block, NULL, filesize, log2blocksize, blocks_start);
+}
+
+/* Same as grub_fshelp_read_file, but GET_RUN also stores in *RUN how
+   many blocks from BLOCK on are contiguous on disk (or all sparse).  */
+grub_ssize_t
+grub_fshelp_read_file_runs(grub_disk_t disk, grub_fshelp_node_t node,
+	grub_disk_read_hook_t read_hook, void* read_hook_data,
+	grub_off_t pos, grub_size_t len, char* buf,
+	grub_disk_addr_t(*get_run) (grub_fshelp_node_t node,
+		grub_disk_addr_t block, grub_disk_addr_t* run),
+	grub_off_t filesize, int log2blocksize,
+	grub_disk_addr_t blocks_start)
+{
+	return grub_fshelp_read_file_real(disk, node, read_hook, read_hook_data,
+		pos, len, buf, NULL, get_run, filesize, log2blocksize, blocks_start);
+}
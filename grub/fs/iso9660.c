@@ -28,6 +28,7 @@
 #include <grub/charset.h>
 #include <grub/datetime.h>
 #include <grub/safemath.h>
+#include <grub/partition.h>
 
 GRUB_MOD_LICENSE("GPLv3+");
 
@@ -51,6 +52,9 @@ GRUB_MOD_LICENSE("GPLv3+");
 #define GRUB_ISO9660_SUSP_HEADER_SZ	4
 #define GRUB_ISO9660_MAX_CE_HOPS	100000
 
+/* Largest directory index kept in memory.  */
+#define GRUB_ISO9660_INDEX_MAX		(128 << 20)
+
 /* The head of a volume descriptor.  */
 GRUB_PACKED_START
 struct grub_iso9660_voldesc
@@ -779,7 +783,7 @@ susp_iterate_dir(struct grub_iso9660_susp_entry* entry,
 }
 
 static int
-grub_iso9660_iterate_dir(grub_fshelp_node_t dir,
+grub_iso9660_iterate_dir_real(grub_fshelp_node_t dir,
 	grub_fshelp_iterate_dir_hook_t hook, void* hook_data)
 {
 	struct grub_iso9660_dir dirent;
@@ -992,6 +996,449 @@ grub_iso9660_iterate_dir(grub_fshelp_node_t dir,
 }
 
 
+/*
+ * Directory index.  Parsed directory entries of the last mounted volume,
+ * so that listing a directory or looking a name up in it a second time
+ * neither reads nor parses the directory again.  Entries of a directory
+ * are stored one after the other in a single arena in listing order, and
+ * are also chained in a hash table keyed by directory extent and name.
+ */
+struct grub_iso9660_index_ent
+{
+	grub_uint32_t extent;	/* Extent of the directory holding the entry.  */
+	grub_uint32_t hash;
+	grub_uint32_t next;	/* Next entry in the hash chain, offset + 1.  */
+	grub_uint32_t size;	/* Size of the record.  */
+	grub_uint32_t have_dirents;
+	grub_uint16_t namelen;
+	grub_uint16_t symlen;	/* Including the NUL, 0 if not a symlink.  */
+	grub_uint32_t type;
+	/* Followed by the dirents, the name and the symlink target.  */
+};
+
+struct grub_iso9660_index_dir
+{
+	grub_uint32_t extent;
+	grub_uint32_t first;	/* Offset of the first entry.  */
+	grub_uint32_t end;	/* Offset past the last entry.  */
+	grub_uint32_t next;	/* Next directory in the hash chain, index + 1.  */
+};
+
+static struct
+{
+	/* The volume the index belongs to.  */
+	unsigned long dev_id;
+	unsigned long disk_id;
+	grub_disk_addr_t start;
+	struct grub_iso9660_primary_voldesc voldesc;
+	int rockridge;
+	int joliet;
+	int susp_skip;
+	int valid;
+	int disabled;
+
+	char* arena;
+	grub_uint32_t arena_len;
+	grub_uint32_t arena_alloc;
+	grub_uint32_t num_ents;
+
+	grub_uint32_t* ent_hash;
+	grub_uint32_t ent_buckets;
+
+	struct grub_iso9660_index_dir* dirs;
+	grub_uint32_t num_dirs;
+	grub_uint32_t alloc_dirs;
+	grub_uint32_t* dir_hash;
+	grub_uint32_t dir_buckets;
+} m_index;
+
+static void
+grub_iso9660_index_free(void)
+{
+	grub_free(m_index.arena);
+	grub_free(m_index.ent_hash);
+	grub_free(m_index.dirs);
+	grub_free(m_index.dir_hash);
+	grub_memset(&m_index, 0, sizeof(m_index));
+}
+
+/* Make sure the index describes the volume DATA is mounted from.  */
+static void
+grub_iso9660_index_attach(struct grub_iso9660_data* data)
+{
+	grub_disk_addr_t start = grub_partition_get_start(data->disk->partition);
+
+	if (m_index.valid
+		&& m_index.dev_id == data->disk->dev->id
+		&& m_index.disk_id == data->disk->id
+		&& m_index.start == start
+		&& m_index.rockridge == data->rockridge
+		&& m_index.joliet == data->joliet
+		&& m_index.susp_skip == data->susp_skip
+		&& grub_memcmp(&m_index.voldesc, &data->voldesc, sizeof(data->voldesc)) == 0)
+		return;
+
+	grub_iso9660_index_free();
+	m_index.dev_id = data->disk->dev->id;
+	m_index.disk_id = data->disk->id;
+	m_index.start = start;
+	m_index.voldesc = data->voldesc;
+	m_index.rockridge = data->rockridge;
+	m_index.joliet = data->joliet;
+	m_index.susp_skip = data->susp_skip;
+	m_index.valid = 1;
+}
+
+static grub_uint32_t
+grub_iso9660_index_hash(grub_uint32_t extent, const char* name)
+{
+	grub_uint32_t h = 2166136261U ^ extent;
+
+	for (; *name; name++)
+		h = (h ^ (grub_uint8_t)grub_tolower(*name)) * 16777619U;
+	return h;
+}
+
+static struct grub_iso9660_index_ent*
+grub_iso9660_index_ent(grub_uint32_t off)
+{
+	return (struct grub_iso9660_index_ent*)(m_index.arena + off);
+}
+
+static const char*
+grub_iso9660_index_name(struct grub_iso9660_index_ent* ent)
+{
+	return (const char*)(ent + 1) + ent->have_dirents * sizeof(struct grub_iso9660_dir);
+}
+
+/* Link directory I and its entries into the hash chains.  */
+static void
+grub_iso9660_index_link(grub_uint32_t i)
+{
+	struct grub_iso9660_index_dir* idir = &m_index.dirs[i];
+	grub_uint32_t off;
+
+	idir->next = m_index.dir_hash[idir->extent & (m_index.dir_buckets - 1)];
+	m_index.dir_hash[idir->extent & (m_index.dir_buckets - 1)] = i + 1;
+	for (off = idir->first; off < idir->end; off += grub_iso9660_index_ent(off)->size)
+	{
+		struct grub_iso9660_index_ent* ent = grub_iso9660_index_ent(off);
+		ent->next = m_index.ent_hash[ent->hash & (m_index.ent_buckets - 1)];
+		m_index.ent_hash[ent->hash & (m_index.ent_buckets - 1)] = off + 1;
+	}
+}
+
+/* Grow the bucket arrays to keep chains short and relink everything.  */
+static grub_err_t
+grub_iso9660_index_rehash(void)
+{
+	grub_uint32_t i, n;
+
+	n = m_index.ent_buckets ? m_index.ent_buckets : 1024;
+	while (n < m_index.num_ents)
+		n *= 2;
+	grub_free(m_index.ent_hash);
+	m_index.ent_hash = grub_calloc(n, sizeof(grub_uint32_t));
+	if (!m_index.ent_hash)
+		return grub_errno;
+	m_index.ent_buckets = n;
+
+	n = m_index.dir_buckets ? m_index.dir_buckets : 256;
+	while (n < m_index.num_dirs)
+		n *= 2;
+	grub_free(m_index.dir_hash);
+	m_index.dir_hash = grub_calloc(n, sizeof(grub_uint32_t));
+	if (!m_index.dir_hash)
+		return grub_errno;
+	m_index.dir_buckets = n;
+
+	for (i = 0; i < m_index.num_dirs; i++)
+		grub_iso9660_index_link(i);
+	return GRUB_ERR_NONE;
+}
+
+static struct grub_iso9660_index_dir*
+grub_iso9660_index_find_dir(grub_uint32_t extent)
+{
+	grub_uint32_t i;
+
+	if (!m_index.dir_buckets)
+		return NULL;
+	for (i = m_index.dir_hash[extent & (m_index.dir_buckets - 1)]; i;
+		i = m_index.dirs[i - 1].next)
+		if (m_index.dirs[i - 1].extent == extent)
+			return &m_index.dirs[i - 1];
+	return NULL;
+}
+
+struct grub_iso9660_index_ctx
+{
+	grub_uint32_t extent;
+	int failed;
+};
+
+/* Helper for grub_iso9660_index_dir, appends one entry to the arena.  */
+static int
+grub_iso9660_index_add(const char* filename,
+	enum grub_fshelp_filetype filetype,
+	grub_fshelp_node_t node, void* data)
+{
+	struct grub_iso9660_index_ctx* ctx = data;
+	struct grub_iso9660_index_ent* ent;
+	grub_size_t namelen = grub_strlen(filename);
+	grub_size_t symlen = 0;
+	grub_size_t dsize = node->have_dirents * sizeof(node->dirents[0]);
+	grub_size_t size;
+	char* p;
+
+	if (node->have_symlink)
+		symlen = grub_strlen(node->symlink + dsize - sizeof(node->dirents)) + 1;
+	size = ALIGN_UP(sizeof(*ent) + dsize + namelen + 1 + symlen, 4);
+
+	if (namelen > 0xffff || symlen > 0xffff
+		|| m_index.arena_len + size > GRUB_ISO9660_INDEX_MAX)
+		goto fail;
+	if (m_index.arena_len + size > m_index.arena_alloc)
+	{
+		grub_uint32_t n = m_index.arena_alloc ? m_index.arena_alloc : 65536;
+		char* arena;
+
+		while (n < m_index.arena_len + size)
+			n *= 2;
+		arena = grub_realloc(m_index.arena, n);
+		if (!arena)
+			goto fail;
+		m_index.arena = arena;
+		m_index.arena_alloc = n;
+	}
+
+	ent = grub_iso9660_index_ent(m_index.arena_len);
+	ent->extent = ctx->extent;
+	ent->hash = grub_iso9660_index_hash(ctx->extent, filename);
+	ent->next = 0;
+	ent->size = (grub_uint32_t)size;
+	ent->have_dirents = (grub_uint32_t)node->have_dirents;
+	ent->namelen = (grub_uint16_t)namelen;
+	ent->symlen = (grub_uint16_t)symlen;
+	ent->type = filetype;
+	p = (char*)(ent + 1);
+	grub_memcpy(p, node->dirents, dsize);
+	grub_memcpy(p + dsize, filename, namelen + 1);
+	if (symlen)
+		grub_memcpy(p + dsize + namelen + 1, node->symlink + dsize - sizeof(node->dirents), symlen);
+	m_index.arena_len += (grub_uint32_t)size;
+
+	grub_free(node);
+	return 0;
+
+fail:
+	grub_free(node);
+	ctx->failed = 1;
+	return 1;
+}
+
+/* Return the index of directory DIR, parsing it first if needed.
+   NULL means the directory is served without the index.  */
+static struct grub_iso9660_index_dir*
+grub_iso9660_index_dir(grub_fshelp_node_t dir)
+{
+	struct grub_iso9660_index_ctx ctx;
+	struct grub_iso9660_index_dir* idir;
+	grub_uint32_t start, off;
+
+	grub_iso9660_index_attach(dir->data);
+	if (m_index.disabled)
+		return NULL;
+
+	ctx.extent = grub_le_to_cpu32(dir->dirents[0].first_sector);
+	ctx.failed = 0;
+	idir = grub_iso9660_index_find_dir(ctx.extent);
+	if (idir)
+		return idir;
+
+	if (m_index.num_dirs == m_index.alloc_dirs)
+	{
+		grub_uint32_t n = m_index.alloc_dirs ? m_index.alloc_dirs * 2 : 256;
+		idir = grub_realloc(m_index.dirs, n * sizeof(*idir));
+		if (!idir)
+			goto disable;
+		m_index.dirs = idir;
+		m_index.alloc_dirs = n;
+	}
+
+	start = m_index.arena_len;
+	grub_iso9660_iterate_dir_real(dir, grub_iso9660_index_add, &ctx);
+	if (ctx.failed)
+		goto disable;
+	if (grub_errno)
+	{
+		/* Read error, keep the index as it was.  */
+		m_index.arena_len = start;
+		return NULL;
+	}
+
+	idir = &m_index.dirs[m_index.num_dirs++];
+	idir->extent = ctx.extent;
+	idir->first = start;
+	idir->end = m_index.arena_len;
+	idir->next = 0;
+	for (off = start; off < idir->end; off += grub_iso9660_index_ent(off)->size)
+		m_index.num_ents++;
+	if (m_index.num_ents > m_index.ent_buckets || m_index.num_dirs > m_index.dir_buckets)
+	{
+		if (grub_iso9660_index_rehash())
+			goto disable;
+	}
+	else
+		grub_iso9660_index_link(m_index.num_dirs - 1);
+	return idir;
+
+disable:
+	/* Too big or out of memory, go on without an index for this volume.  */
+	grub_iso9660_index_free();
+	grub_iso9660_index_attach(dir->data);
+	m_index.disabled = 1;
+	grub_errno = GRUB_ERR_NONE;
+	return NULL;
+}
+
+/* Rebuild the node an index entry was made from.  */
+static grub_fshelp_node_t
+grub_iso9660_index_node(struct grub_iso9660_data* data,
+	struct grub_iso9660_index_ent* ent)
+{
+	struct grub_fshelp_node* node;
+	grub_size_t dsize = ent->have_dirents * sizeof(node->dirents[0]);
+	grub_size_t size = dsize + ent->symlen;
+
+	if (size < sizeof(node->dirents))
+		size = sizeof(node->dirents);
+	node = grub_malloc(sizeof(*node) - sizeof(node->dirents) + size);
+	if (!node)
+		return NULL;
+	node->data = data;
+	node->have_dirents = ent->have_dirents;
+	node->alloc_dirents = size / sizeof(node->dirents[0]);
+	node->have_symlink = !!ent->symlen;
+	grub_memcpy(node->dirents, ent + 1, dsize);
+	if (ent->symlen)
+		grub_memcpy((char*)node->dirents + dsize,
+			grub_iso9660_index_name(ent) + ent->namelen + 1, ent->symlen);
+	return node;
+}
+
+static int
+grub_iso9660_iterate_dir(grub_fshelp_node_t dir,
+	grub_fshelp_iterate_dir_hook_t hook, void* hook_data)
+{
+	struct grub_iso9660_index_dir* idir;
+	grub_uint32_t off, len;
+	char* copy;
+	int ret = 0;
+
+	idir = grub_iso9660_index_dir(dir);
+	if (!idir)
+		return grub_iso9660_iterate_dir_real(dir, hook, hook_data);
+
+	/* HOOK may mount the volume again and grow or drop the index.  */
+	len = idir->end - idir->first;
+	copy = grub_malloc(len);
+	if (!copy)
+		return 0;
+	grub_memcpy(copy, m_index.arena + idir->first, len);
+
+	for (off = 0; off < len; off += ((struct grub_iso9660_index_ent*)(copy + off))->size)
+	{
+		struct grub_iso9660_index_ent* ent = (struct grub_iso9660_index_ent*)(copy + off);
+		grub_fshelp_node_t node = grub_iso9660_index_node(dir->data, ent);
+
+		if (!node)
+			break;
+		if (hook(grub_iso9660_index_name(ent), ent->type, node, hook_data))
+		{
+			ret = 1;
+			break;
+		}
+	}
+	grub_free(copy);
+	return ret;
+}
+
+/* Context for grub_iso9660_lookup.  */
+struct grub_iso9660_lookup_ctx
+{
+	const char* name;
+	grub_fshelp_node_t* foundnode;
+	enum grub_fshelp_filetype* foundtype;
+};
+
+/* Helper for grub_iso9660_lookup.  */
+static int
+grub_iso9660_lookup_iter(const char* filename,
+	enum grub_fshelp_filetype filetype,
+	grub_fshelp_node_t node, void* data)
+{
+	struct grub_iso9660_lookup_ctx* ctx = data;
+
+	if (filetype == GRUB_FSHELP_UNKNOWN ||
+		((filetype & GRUB_FSHELP_CASE_INSENSITIVE)
+			? grub_strcasecmp(ctx->name, filename)
+			: grub_strcmp(ctx->name, filename)))
+	{
+		grub_free(node);
+		return 0;
+	}
+
+	*ctx->foundnode = node;
+	*ctx->foundtype = filetype;
+	return 1;
+}
+
+/* Find NAME in DIR through the hash chains of the index.  */
+static grub_err_t
+grub_iso9660_lookup(grub_fshelp_node_t dir, const char* name,
+	grub_fshelp_node_t* foundnode, enum grub_fshelp_filetype* foundtype)
+{
+	struct grub_iso9660_index_dir* idir;
+	struct grub_iso9660_index_ent* found = NULL;
+	grub_uint32_t extent, hash, off;
+
+	*foundnode = NULL;
+	idir = grub_iso9660_index_dir(dir);
+	if (!idir)
+	{
+		struct grub_iso9660_lookup_ctx ctx = { name, foundnode, foundtype };
+
+		grub_iso9660_iterate_dir_real(dir, grub_iso9660_lookup_iter, &ctx);
+		return grub_errno;
+	}
+
+	extent = idir->extent;
+	hash = grub_iso9660_index_hash(extent, name);
+	/* Keep the first match in listing order, like a directory scan.  */
+	for (off = m_index.ent_hash[hash & (m_index.ent_buckets - 1)]; off;
+		off = grub_iso9660_index_ent(off - 1)->next)
+	{
+		struct grub_iso9660_index_ent* ent = grub_iso9660_index_ent(off - 1);
+
+		if (ent->hash != hash || ent->extent != extent
+			|| ent->type == GRUB_FSHELP_UNKNOWN
+			|| (found && (char*)ent > (char*)found))
+			continue;
+		if ((ent->type & GRUB_FSHELP_CASE_INSENSITIVE)
+			? grub_strcasecmp(name, grub_iso9660_index_name(ent))
+			: grub_strcmp(name, grub_iso9660_index_name(ent)))
+			continue;
+		found = ent;
+	}
+
+	if (!found)
+		return GRUB_ERR_NONE;
+	*foundnode = grub_iso9660_index_node(dir->data, found);
+	*foundtype = found->type;
+	return grub_errno;
+}
+
 
 /* Context for grub_iso9660_dir.  */
 struct grub_iso9660_dir_ctx
@@ -1008,14 +1455,17 @@ grub_iso9660_dir_iter(const char* filename,
 {
 	struct grub_iso9660_dir_ctx* ctx = data;
 	struct grub_dirhook_info info;
+	int ret;
 
 	grub_memset(&info, 0, sizeof(info));
 	info.dir = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_DIR);
 	info.symlink = ((filetype & GRUB_FSHELP_TYPE_MASK) == GRUB_FSHELP_SYMLINK);
 	info.mtimeset = !!iso9660_to_unixtime2(&node->dirents[0].mtime, &info.mtime);
+	info.entry = node;
 
+	ret = ctx->hook(filename, &info, ctx->hook_data);
 	grub_free(node);
-	return ctx->hook(filename, &info, ctx->hook_data);
+	return ret;
 }
 
 static grub_err_t
@@ -1038,9 +1488,9 @@ grub_iso9660_dir(grub_disk_t disk, const char* path,
 	rootnode.dirents[0] = data->voldesc.rootdir;
 
 	/* Use the fshelp function to traverse the path.  */
-	if (grub_fshelp_find_file(path, &rootnode,
+	if (grub_fshelp_find_file_lookup(path, &rootnode,
 		&foundnode,
-		grub_iso9660_iterate_dir,
+		grub_iso9660_lookup,
 		grub_iso9660_read_symlink,
 		GRUB_FSHELP_DIR))
 		goto fail;
@@ -1077,9 +1527,9 @@ grub_iso9660_open(struct grub_file* file, const char* name)
 	rootnode.dirents[0] = data->voldesc.rootdir;
 
 	/* Use the fshelp function to traverse the path.  */
-	if (grub_fshelp_find_file(name, &rootnode,
+	if (grub_fshelp_find_file_lookup(name, &rootnode,
 		&foundnode,
-		grub_iso9660_iterate_dir,
+		grub_iso9660_lookup,
 		grub_iso9660_read_symlink,
 		GRUB_FSHELP_REG))
 		goto fail;
@@ -1097,6 +1547,42 @@ fail:
 	return grub_errno;
 }
 
+/* Open a node handed to a grub_iso9660_dir hook.  The file gets its own
+   copies of the node and the mount data.  */
+static grub_err_t
+grub_iso9660_open_entry(struct grub_file* file, const void* entry)
+{
+	const struct grub_fshelp_node* node = entry;
+	struct grub_iso9660_data* data;
+	grub_size_t size = node->have_dirents * sizeof(node->dirents[0]);
+
+	if (node->have_symlink)
+		size += grub_strlen(node->symlink + size - sizeof(node->dirents)) + 1;
+	if (size < sizeof(node->dirents))
+		size = sizeof(node->dirents);
+	size += sizeof(*node) - sizeof(node->dirents);
+
+	data = grub_malloc(sizeof(*data));
+	if (!data)
+		return grub_errno;
+	grub_memcpy(data, node->data, sizeof(*data));
+	data->disk = file->disk;
+	data->node = grub_malloc(size);
+	if (!data->node)
+	{
+		grub_free(data);
+		return grub_errno;
+	}
+	grub_memcpy(data->node, node, size);
+	data->node->data = data;
+
+	file->data = data;
+	file->size = get_node_size(data->node);
+	file->offset = 0;
+
+	return GRUB_ERR_NONE;
+}
+
 
 static grub_ssize_t
 grub_iso9660_read(grub_file_t file, char* buf, grub_size_t len)
@@ -1238,6 +1724,7 @@ static struct grub_fs grub_iso9660_fs =
 	.fs_open = grub_iso9660_open,
 	.fs_read = grub_iso9660_read,
 	.fs_close = grub_iso9660_close,
+	.fs_open_entry = grub_iso9660_open_entry,
 	.fs_label = grub_iso9660_label,
 	.fs_uuid = grub_iso9660_uuid,
 	.fs_mtime = grub_iso9660_mtime,
@@ -1251,5 +1738,6 @@ GRUB_MOD_INIT(iso9660)
 
 GRUB_MOD_FINI(iso9660)
 {
+	grub_iso9660_index_free();
 	grub_fs_unregister(&grub_iso9660_fs);
 }
@@ -713,20 +713,21 @@ retry:
 }
 
 static grub_disk_addr_t
-grub_ntfs_read_block(grub_fshelp_node_t node, grub_disk_addr_t block)
+grub_ntfs_read_run(grub_fshelp_node_t node, grub_disk_addr_t block,
+	grub_disk_addr_t* run)
 {
 	struct grub_ntfs_rlst* ctx;
 
 	ctx = (struct grub_ntfs_rlst*)node;
-	if (block >= ctx->next_vcn)
+	while (block >= ctx->next_vcn)
 	{
 		if (grub_ntfs_read_run_list(ctx))
 			return (grub_disk_addr_t)-1;
-		return ctx->curr_lcn;
 	}
-	else
-		return (ctx->flags & GRUB_NTFS_RF_BLNK) ? 0 : (block -
-			ctx->curr_vcn + ctx->curr_lcn);
+	/* The rest of the current run is contiguous (or all sparse).  */
+	*run = ctx->next_vcn - block;
+	return (ctx->flags & GRUB_NTFS_RF_BLNK) ? 0 : (block -
+		ctx->curr_vcn + ctx->curr_lcn);
 }
 
 static grub_err_t
@@ -796,10 +797,10 @@ read_data(struct grub_ntfs_attr* at, grub_uint8_t* pa, grub_uint8_t* dest,
 		return 0;
 	}
 
-	grub_fshelp_read_file(ctx->comp.disk, (grub_fshelp_node_t)ctx,
+	grub_fshelp_read_file_runs(ctx->comp.disk, (grub_fshelp_node_t)ctx,
 		read_hook, read_hook_data, ofs, len,
 		(char*)dest,
-		grub_ntfs_read_block, ofs + len,
+		grub_ntfs_read_run, ofs + len,
 		ctx->comp.log_spc, 0);
 	return grub_errno;
 }
@@ -1001,7 +1002,7 @@ list_file(struct grub_ntfs_file* diro, grub_uint8_t* pos,
 	return 0;
 }
 
-PRAGMA_BEGIN_PACKED;
+GRUB_PACKED_START
 struct symlink_descriptor
 {
 	grub_uint32_t type;
@@ -1011,7 +1012,7 @@ struct symlink_descriptor
 	grub_uint16_t off2;
 	grub_uint16_t len2;
 };
-PRAGMA_END_PACKED;
+GRUB_PACKED_END
 
 static char*
 grub_ntfs_read_symlink(grub_fshelp_node_t node)
@@ -493,7 +493,8 @@ grub_udf_read_icb(struct grub_udf_data* data,
 }
 
 static grub_disk_addr_t
-grub_udf_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
+grub_udf_read_run(grub_fshelp_node_t node, grub_disk_addr_t fileblock,
+	grub_disk_addr_t* run)
 {
 	char* buf = NULL;
 	char* ptr;
@@ -583,6 +584,8 @@ grub_udf_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 			{
 				grub_uint32_t ad_pos = ad->position;
 				grub_free(buf);
+				*run = (adlen - filebytes + U32(node->data->lvd.bsize) - 1)
+					/ U32(node->data->lvd.bsize);
 				return ((U32(ad_pos) & GRUB_UDF_EXT_MASK) ? 0 :
 					(grub_udf_get_block(node->data, node->part_ref, ad_pos)
 						+ (filebytes >> (GRUB_DISK_SECTOR_BITS
@@ -663,6 +666,8 @@ grub_udf_read_block(grub_fshelp_node_t node, grub_disk_addr_t fileblock)
 				grub_uint32_t ad_block_num = ad->block.block_num;
 				grub_uint32_t ad_part_ref = ad->block.part_ref;
 				grub_free(buf);
+				*run = (adlen - filebytes + U32(node->data->lvd.bsize) - 1)
+					/ U32(node->data->lvd.bsize);
 				return ((U32(ad_block_num) & GRUB_UDF_EXT_MASK) ? 0 :
 					(grub_udf_get_block(node->data, ad_part_ref,
 						ad_block_num)
@@ -722,9 +727,9 @@ grub_udf_read_file(grub_fshelp_node_t node,
 		return 0;
 	}
 
-	return grub_fshelp_read_file(node->data->disk, node,
+	return grub_fshelp_read_file_runs(node->data->disk, node,
 		read_hook, read_hook_data,
-		pos, len, buf, grub_udf_read_block,
+		pos, len, buf, grub_udf_read_run,
 		U64(node->block.fe.file_size),
 		node->data->lbshift, 0);
 }
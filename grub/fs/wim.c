@@ -27,6 +27,8 @@
 
 #include "../lib/mscompress/mscompress.h"
 
+#include <win32.h>
+
 GRUB_MOD_LICENSE("GPLv3+");
 
 // todo: support big endian
@@ -68,6 +70,14 @@ GRUB_PACKED_END
 
 #define WIM_CHUNK_LEN 32768
 
+/* Decompressed chunks kept per mounted image (2M).  */
+#define WIM_CACHE_CHUNKS 64
+/* Chunks decompressed together by one batch, at most half the cache
+ * so that a batch never evicts its own chunks.  */
+#define WIM_BATCH_CHUNKS (WIM_CACHE_CHUNKS / 2)
+/* Upper bound on decompression threads.  */
+#define WIM_MAX_WORKERS 16
+
 GRUB_PACKED_START
 struct wim_header
 {
@@ -205,13 +215,49 @@ struct wim_lookup_entry
 };
 GRUB_PACKED_END
 
+struct wim_chunk
+{
+	grub_uint64_t res_offset;
+	grub_uint64_t chunk;
+	grub_uint64_t last_use;
+	int valid;
+	grub_uint8_t* buf;
+};
+
+typedef grub_ssize_t(*wim_decompress_t) (const void* src, grub_size_t len,
+	void* dest, grub_size_t max_len);
+
+/* One chunk worth of work handed to the decompression pool.  */
+struct wim_task
+{
+	wim_decompress_t decompress;
+	const grub_uint8_t* src;
+	grub_size_t len;
+	grub_uint8_t* dest;
+	grub_size_t expected;
+	int rc;
+};
+
 struct grub_wim_data
 {
 	grub_disk_t disk;
 	grub_off_t size;
-	grub_uint64_t cached_chunk;
-	grub_uint64_t cached_res_offset;
-	grub_uint8_t chunk_data[WIM_CHUNK_LEN];
+	/* LRU of decompressed chunks, keyed by (resource offset, chunk).  */
+	grub_uint64_t tick;
+	struct wim_chunk* cache;
+	grub_uint8_t* cache_buf;
+	/* Compressed data of the batch being decompressed.  */
+	grub_uint8_t* zbuf;
+	/* Chunk offset table of the opened file's resource:
+	 * table[i] is where chunk i starts, table[table_chunks] is zlen.  */
+	grub_uint64_t table_res_offset;
+	grub_uint64_t table_chunks;
+	grub_uint64_t* table;
+	/* Lookup table in memory, hashed by the first bytes of the SHA-1.  */
+	struct wim_lookup_entry* lookup;
+	grub_uint32_t* lookup_hash;
+	grub_uint32_t lookup_count;
+	grub_uint32_t lookup_buckets;
 	struct wim_header header;
 	grub_uint32_t index;
 	grub_uint32_t count;
@@ -228,6 +274,8 @@ struct grub_fshelp_node
 	struct wim_directory_entry direntry;
 	struct wim_security_header security;
 	struct wim_lookup_entry entry;
+	/* Opened from a directory entry, DATA belongs to grub_wimfs_dir.  */
+	int shared;
 };
 
 static char*
@@ -275,6 +323,15 @@ grub_wim_get_chunk_offset(struct grub_wim_data* data,
 		return 0;
 	}
 
+	/* Preloaded table, already validated */
+	if (data->table && res->offset == data->table_res_offset)
+	{
+		if (chunk > data->table_chunks)
+			chunk = data->table_chunks;
+		*offset = (grub_size_t)data->table[chunk];
+		return 0;
+	}
+
 	/* Calculate chunk parameters */
 	chunks = (res->len + WIM_CHUNK_LEN - 1) / WIM_CHUNK_LEN;
 	offset_len = res->len > 0xffffffffULL ?
@@ -314,73 +371,412 @@ grub_wim_get_chunk_offset(struct grub_wim_data* data,
 	return 0;
 }
 
-// Read chunk from a compressed resource
+/*
+ * Read the whole chunk offset table of a compressed resource with a
+ * single disk read, validate it and keep it for the life of the file,
+ * so that chunk lookups no longer cost two tiny disk reads each.
+ */
 static int
-grub_wim_get_chunk(struct grub_wim_data* data,
-	struct wim_resource_header* res, grub_uint64_t chunk)
+grub_wim_load_chunk_table(struct grub_wim_data* data,
+	const struct wim_resource_header* res)
 {
+	grub_uint64_t zlen = res->zlen__flags & WIM_RESHDR_ZLEN_MASK;
 	grub_uint64_t chunks;
-	grub_size_t offset;
-	grub_size_t next_offset;
-	grub_size_t len;
-	grub_size_t expected_out_len;
-	grub_ssize_t out_len;
+	grub_uint64_t expected;
+	grub_uint64_t i;
+	grub_size_t offset_len;
+	grub_size_t chunks_len;
+	grub_uint8_t* raw = NULL;
+	grub_uint64_t* table = NULL;
 
-	/* Get chunk compressed data offset and length */
-	if (grub_wim_get_chunk_offset(data, res, chunk, &offset) != 0)
+	if (!(res->zlen__flags & (WIM_RESHDR_COMPRESSED | WIM_RESHDR_PACKED_STREAMS))
+		|| !res->len)
+		return 0;
+
+	/* Calculate chunk parameters */
+	chunks = (res->len + WIM_CHUNK_LEN - 1) / WIM_CHUNK_LEN;
+	offset_len = res->len > 0xffffffffULL ?
+		sizeof(grub_uint64_t) : sizeof(grub_uint32_t);
+	chunks_len = (chunks - 1) * offset_len;
+	if (chunks_len > zlen)
 		return -1;
-	if (grub_wim_get_chunk_offset(data, res, chunk + 1, &next_offset) != 0)
+	if (res->offset + zlen > data->size)
 		return -1;
-	len = next_offset - offset;
 
-	/* Calculate uncompressed length */
-	chunks = (res->len + WIM_CHUNK_LEN - 1) / WIM_CHUNK_LEN;
-	expected_out_len = WIM_CHUNK_LEN;
-	if (chunk >= (chunks - 1))
-		expected_out_len -= -res->len & (WIM_CHUNK_LEN - 1);
+	table = grub_calloc(chunks + 1, sizeof(table[0]));
+	if (!table)
+		return -1;
+	if (chunks_len)
+	{
+		raw = grub_malloc(chunks_len);
+		if (!raw)
+			goto fail;
+		if (grub_disk_read(data->disk, 0, res->offset, chunks_len, raw) != GRUB_ERR_NONE)
+			goto fail;
+	}
 
-	/* Read possibly-compressed data */
-	if (len == expected_out_len)
+	/* Chunk 0 has no offset field, the end of the last chunk is zlen */
+	table[0] = chunks_len;
+	for (i = 1; i < chunks; i++)
 	{
-		/* Chunk did not compress; read raw data */
-		if (grub_disk_read(data->disk, 0,
-			res->offset + offset, len, data->chunk_data) != GRUB_ERR_NONE)
-			return -1;
+		if (offset_len == sizeof(grub_uint64_t))
+			table[i] = grub_le_to_cpu64(grub_get_unaligned64(raw + (i - 1) * offset_len));
+		else
+			table[i] = grub_le_to_cpu32(grub_get_unaligned32(raw + (i - 1) * offset_len));
+		table[i] += chunks_len;
 	}
+	table[chunks] = zlen;
+
+	/* Offsets must be ordered, within the resource, and no chunk may
+	 * be larger than its uncompressed size */
+	for (i = 0; i < chunks; i++)
+	{
+		expected = WIM_CHUNK_LEN;
+		if (i == chunks - 1)
+			expected -= -res->len & (WIM_CHUNK_LEN - 1);
+		if (table[i + 1] < table[i] || table[i + 1] > zlen
+			|| table[i + 1] - table[i] > expected)
+			goto fail;
+	}
+
+	grub_free(raw);
+	grub_free(data->table);
+	data->table = table;
+	data->table_chunks = chunks;
+	data->table_res_offset = res->offset;
+	return 0;
+fail:
+	grub_free(raw);
+	grub_free(table);
+	return -1;
+}
+
+/*
+ * Decompression pool.  Workers only ever run wim_run_task(): every disk
+ * read, the chunk cache and grub_errno stay on the calling thread.
+ */
+static struct
+{
+	int init;
+	int quit;
+	unsigned nr_threads;
+	HANDLE threads[WIM_MAX_WORKERS];
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE work;
+	CONDITION_VARIABLE done;
+	struct wim_task* tasks;
+	unsigned nr_tasks;
+	unsigned next_task;
+	unsigned pending;
+} m_pool;
+
+static void
+wim_run_task(struct wim_task* task)
+{
+	grub_ssize_t out_len;
+
+	if (!task->decompress)
+	{
+		/* Chunk did not compress; raw data */
+		grub_memcpy(task->dest, task->src, task->len);
+		task->rc = 0;
+		return;
+	}
+	out_len = task->decompress(task->src, task->len, task->dest, task->expected);
+	if (out_len < 0 || (grub_size_t)out_len != task->expected)
+		task->rc = -1;
 	else
+		task->rc = 0;
+}
+
+static DWORD WINAPI
+wim_worker(void* param)
+{
+	(void)param;
+	EnterCriticalSection(&m_pool.lock);
+	for (;;)
 	{
-		/* Read compressed data into a temporary buffer */
-		int rc = -1;
-		grub_ssize_t(*decompress) (const void* src, grub_size_t len, void* dest);
-		grub_uint8_t* zbuf = grub_malloc(len);
-		if (!zbuf)
-			return -1;
-		if (grub_disk_read(data->disk, 0,
-			res->offset + offset, len, zbuf) != GRUB_ERR_NONE)
-			goto end;
-		/* Identify decompressor */
-		if (data->header.flags & WIM_HDR_COMPRESS_LZX)
-			decompress = grub_lzx_decompress;
-		else if (data->header.flags & WIM_HDR_COMPRESS_XPRESS)
-			decompress = grub_xca_decompress;
-		else
-			goto end;
-		/* Decompress data */
-		out_len = decompress(zbuf, len, NULL);
-		if (out_len < 0)
-			goto end;
-		if ((grub_size_t)out_len != expected_out_len)
-			goto end;
-		decompress(zbuf, len, data->chunk_data);
-		rc = 0;
-	end:
-		grub_free(zbuf);
-		return rc;
+		struct wim_task* task;
+		while (!m_pool.quit && m_pool.next_task >= m_pool.nr_tasks)
+			SleepConditionVariableCS(&m_pool.work, &m_pool.lock, INFINITE);
+		if (m_pool.quit)
+			break;
+		task = &m_pool.tasks[m_pool.next_task++];
+		LeaveCriticalSection(&m_pool.lock);
+		wim_run_task(task);
+		EnterCriticalSection(&m_pool.lock);
+		if (--m_pool.pending == 0)
+			WakeConditionVariable(&m_pool.done);
+	}
+	LeaveCriticalSection(&m_pool.lock);
+	return 0;
+}
+
+static void
+wim_pool_init(void)
+{
+	SYSTEM_INFO si;
+	unsigned i, n;
+
+	if (m_pool.init)
+		return;
+	m_pool.init = 1;
+	InitializeCriticalSection(&m_pool.lock);
+	InitializeConditionVariable(&m_pool.work);
+	InitializeConditionVariable(&m_pool.done);
+
+	/* The calling thread decompresses too.  */
+	GetSystemInfo(&si);
+	n = si.dwNumberOfProcessors > 1 ? si.dwNumberOfProcessors - 1 : 0;
+	if (n > WIM_MAX_WORKERS)
+		n = WIM_MAX_WORKERS;
+	for (i = 0; i < n; i++)
+	{
+		m_pool.threads[i] = CreateThread(NULL, 0, wim_worker, NULL, 0, NULL);
+		if (!m_pool.threads[i])
+			break;
+	}
+	m_pool.nr_threads = i;
+}
+
+static void
+wim_pool_fini(void)
+{
+	unsigned i;
+
+	if (!m_pool.init)
+		return;
+	EnterCriticalSection(&m_pool.lock);
+	m_pool.quit = 1;
+	WakeAllConditionVariable(&m_pool.work);
+	LeaveCriticalSection(&m_pool.lock);
+	for (i = 0; i < m_pool.nr_threads; i++)
+	{
+		WaitForSingleObject(m_pool.threads[i], INFINITE);
+		CloseHandle(m_pool.threads[i]);
+	}
+	DeleteCriticalSection(&m_pool.lock);
+	grub_memset(&m_pool, 0, sizeof(m_pool));
+}
+
+static void
+wim_pool_run(struct wim_task* tasks, unsigned count)
+{
+	unsigned i;
+
+	if (count > 1)
+		wim_pool_init();
+	if (count <= 1 || !m_pool.nr_threads)
+	{
+		for (i = 0; i < count; i++)
+			wim_run_task(&tasks[i]);
+		return;
 	}
 
+	EnterCriticalSection(&m_pool.lock);
+	m_pool.tasks = tasks;
+	m_pool.nr_tasks = count;
+	m_pool.next_task = 0;
+	m_pool.pending = count;
+	WakeAllConditionVariable(&m_pool.work);
+	while (m_pool.next_task < m_pool.nr_tasks)
+	{
+		struct wim_task* task = &m_pool.tasks[m_pool.next_task++];
+		LeaveCriticalSection(&m_pool.lock);
+		wim_run_task(task);
+		EnterCriticalSection(&m_pool.lock);
+		m_pool.pending--;
+	}
+	while (m_pool.pending)
+		SleepConditionVariableCS(&m_pool.done, &m_pool.lock, INFINITE);
+	m_pool.tasks = NULL;
+	m_pool.nr_tasks = 0;
+	m_pool.next_task = 0;
+	LeaveCriticalSection(&m_pool.lock);
+}
+
+static int
+grub_wim_cache_init(struct grub_wim_data* data)
+{
+	unsigned i;
+
+	if (data->cache)
+		return 0;
+	data->cache = grub_calloc(WIM_CACHE_CHUNKS, sizeof(data->cache[0]));
+	data->cache_buf = grub_malloc(WIM_CACHE_CHUNKS * WIM_CHUNK_LEN);
+	data->zbuf = grub_malloc(WIM_BATCH_CHUNKS * WIM_CHUNK_LEN);
+	if (!data->cache || !data->cache_buf || !data->zbuf)
+	{
+		grub_free(data->cache);
+		grub_free(data->cache_buf);
+		grub_free(data->zbuf);
+		data->cache = NULL;
+		data->cache_buf = NULL;
+		data->zbuf = NULL;
+		return -1;
+	}
+	for (i = 0; i < WIM_CACHE_CHUNKS; i++)
+		data->cache[i].buf = data->cache_buf + i * WIM_CHUNK_LEN;
 	return 0;
 }
 
+static void
+grub_wim_free(struct grub_wim_data* data)
+{
+	if (!data)
+		return;
+	grub_free(data->cache);
+	grub_free(data->cache_buf);
+	grub_free(data->zbuf);
+	grub_free(data->table);
+	grub_free(data->lookup);
+	grub_free(data->lookup_hash);
+	grub_free(data);
+}
+
+static struct wim_chunk*
+grub_wim_cache_find(struct grub_wim_data* data,
+	grub_uint64_t res_offset, grub_uint64_t chunk)
+{
+	unsigned i;
+
+	for (i = 0; i < WIM_CACHE_CHUNKS; i++)
+	{
+		struct wim_chunk* e = &data->cache[i];
+		if (e->valid && e->chunk == chunk && e->res_offset == res_offset)
+		{
+			e->last_use = ++data->tick;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static struct wim_chunk*
+grub_wim_cache_reserve(struct grub_wim_data* data,
+	grub_uint64_t res_offset, grub_uint64_t chunk)
+{
+	unsigned i;
+	struct wim_chunk* victim = &data->cache[0];
+
+	for (i = 0; i < WIM_CACHE_CHUNKS; i++)
+	{
+		struct wim_chunk* e = &data->cache[i];
+		if (!e->valid)
+		{
+			victim = e;
+			break;
+		}
+		if (e->last_use < victim->last_use)
+			victim = e;
+	}
+	victim->res_offset = res_offset;
+	victim->chunk = chunk;
+	victim->last_use = ++data->tick;
+	victim->valid = 1;
+	return victim;
+}
+
+/*
+ * Make chunks [first, last] of a compressed resource present in the cache.
+ * The missing chunks are contiguous on disk, so their compressed data is
+ * fetched with a single read and then decompressed in parallel, each
+ * chunk exactly once.
+ */
+static int
+grub_wim_fill_chunks(struct grub_wim_data* data,
+	struct wim_resource_header* res, grub_uint64_t first, grub_uint64_t last)
+{
+	struct wim_task tasks[WIM_BATCH_CHUNKS];
+	struct wim_chunk* slots[WIM_BATCH_CHUNKS];
+	grub_uint64_t missing[WIM_BATCH_CHUNKS];
+	grub_uint64_t chunks;
+	grub_uint64_t chunk;
+	grub_size_t zstart;
+	grub_size_t zend;
+	wim_decompress_t decompress = NULL;
+	unsigned i, count = 0;
+	int rc = 0;
+
+	if (grub_wim_cache_init(data) != 0)
+		return -1;
+
+	/* Touch cached chunks first so that reserving cannot evict them */
+	for (chunk = first; chunk <= last; chunk++)
+	{
+		if (!grub_wim_cache_find(data, res->offset, chunk))
+			missing[count++] = chunk;
+	}
+	if (!count)
+		return 0;
+
+	/* Read compressed data of all missing chunks */
+	if (grub_wim_get_chunk_offset(data, res, missing[0], &zstart) != 0)
+		return -1;
+	if (grub_wim_get_chunk_offset(data, res, missing[count - 1] + 1, &zend) != 0)
+		return -1;
+	if (zend < zstart || zend - zstart > WIM_BATCH_CHUNKS * WIM_CHUNK_LEN)
+		return -1;
+	if (grub_disk_read(data->disk, 0,
+		res->offset + zstart, zend - zstart, data->zbuf) != GRUB_ERR_NONE)
+		return -1;
+
+	/* Identify decompressor */
+	if (data->header.flags & WIM_HDR_COMPRESS_LZX)
+		decompress = grub_lzx_decompress;
+	else if (data->header.flags & WIM_HDR_COMPRESS_XPRESS)
+		decompress = grub_xca_decompress;
+
+	chunks = (res->len + WIM_CHUNK_LEN - 1) / WIM_CHUNK_LEN;
+	for (i = 0; i < count; i++)
+	{
+		grub_size_t offset;
+		grub_size_t next_offset;
+		struct wim_task* task = &tasks[i];
+
+		/* Get chunk compressed data offset and length */
+		if (grub_wim_get_chunk_offset(data, res, missing[i], &offset) != 0)
+			return -1;
+		if (grub_wim_get_chunk_offset(data, res, missing[i] + 1, &next_offset) != 0)
+			return -1;
+		if (offset < zstart || next_offset < offset || next_offset > zend)
+			return -1;
+
+		/* Calculate uncompressed length */
+		task->expected = WIM_CHUNK_LEN;
+		if (missing[i] >= (chunks - 1))
+			task->expected -= -res->len & (WIM_CHUNK_LEN - 1);
+
+		task->src = data->zbuf + (offset - zstart);
+		task->len = next_offset - offset;
+		if (task->len > task->expected)
+			return -1;
+		/* Chunk did not compress when lengths match */
+		task->decompress = (task->len == task->expected) ? NULL : decompress;
+		if (task->len != task->expected && !decompress)
+			return -1;
+		task->rc = -1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		slots[i] = grub_wim_cache_reserve(data, res->offset, missing[i]);
+		tasks[i].dest = slots[i]->buf;
+	}
+
+	wim_pool_run(tasks, count);
+
+	for (i = 0; i < count; i++)
+	{
+		if (tasks[i].rc != 0)
+		{
+			slots[i]->valid = 0;
+			rc = -1;
+		}
+	}
+	return rc;
+}
+
 static int
 grub_wim_get_resource(struct grub_wim_data* data,
 	struct wim_resource_header* res, void* buf,
@@ -405,35 +801,35 @@ grub_wim_get_resource(struct grub_wim_data* data,
 	/* Read from each chunk overlapping the target region */
 	while (len)
 	{
-		/* Calculate chunk number */
-		grub_size_t skip_len;
-		grub_size_t frag_len;
 		grub_uint64_t chunk = offset / WIM_CHUNK_LEN;
-		
-		/* Read chunk, if not already cached */
-		if (res->offset != data->cached_res_offset
-			|| chunk != data->cached_chunk)
+		grub_uint64_t last = (offset + len - 1) / WIM_CHUNK_LEN;
+
+		/* Decompress up to one batch of chunks, if not already cached */
+		if (last - chunk >= WIM_BATCH_CHUNKS)
+			last = chunk + WIM_BATCH_CHUNKS - 1;
+		if (grub_wim_fill_chunks(data, res, chunk, last) != 0)
+			return -1;
+
+		for (; chunk <= last; chunk++)
 		{
-			/* Read chunk */
-			if (grub_wim_get_chunk(data, res, chunk) != 0)
+			grub_size_t skip_len;
+			grub_size_t frag_len;
+			struct wim_chunk* e = grub_wim_cache_find(data, res->offset, chunk);
+			if (!e)
 				return -1;
 
-			/* Update cache */
-			data->cached_res_offset = res->offset;
-			data->cached_chunk = chunk;
+			/* Copy fragment from this chunk */
+			skip_len = offset % WIM_CHUNK_LEN;
+			frag_len = WIM_CHUNK_LEN - skip_len;
+			if (frag_len > len)
+				frag_len = len;
+			grub_memcpy(buf, e->buf + skip_len, frag_len);
+
+			/* Move to next chunk */
+			buf = (grub_uint8_t*)buf + frag_len;
+			offset += frag_len;
+			len -= frag_len;
 		}
-
-		/* Copy fragment from this chunk */
-		skip_len = offset % WIM_CHUNK_LEN;
-		frag_len = WIM_CHUNK_LEN - skip_len;
-		if (frag_len > len)
-			frag_len = len;
-		grub_memcpy(buf, data->chunk_data + skip_len, frag_len);
-
-		/* Move to next chunk */
-		buf = (grub_uint8_t*)buf + frag_len;
-		offset += frag_len;
-		len -= frag_len;
 	}
 
 	return 0;
@@ -515,7 +911,7 @@ grub_wim_mount(grub_disk_t disk)
 	}
 	return data;
 fail:
-	grub_free(data);
+	grub_wim_free(data);
 	grub_error(GRUB_ERR_BAD_FS, "not a wim filesystem");
 	return NULL;
 }
@@ -577,6 +973,7 @@ grub_wim_iterate_dir(grub_fshelp_node_t dir,
 		node->data = data;
 		node->offset = dir->direntry.subdir;
 		node->mtime = dir->direntry.mtime;
+		node->shared = 0;
 
 		grub_memcpy(&node->direntry, &dir->direntry, sizeof(struct wim_directory_entry));
 		grub_memcpy(&node->security, &dir->security, sizeof(struct wim_security_header));
@@ -610,6 +1007,7 @@ grub_wim_dir_iter(const char* filename, enum grub_fshelp_filetype filetype,
 {
 	struct grub_wim_dir_ctx* ctx = data;
 	struct grub_dirhook_info info;
+	int ret;
 
 	grub_memset(&info, 0, sizeof(info));
 
@@ -619,8 +1017,10 @@ grub_wim_dir_iter(const char* filename, enum grub_fshelp_filetype filetype,
 	info.mtime = grub_divmod64(node->mtime, 10000000, 0)
 		- 86400ULL * 365 * (1970 - 1601)
 		- 86400ULL * ((1970 - 1601) / 4) + 86400ULL * ((1970 - 1601) / 100);
+	info.entry = node;
+	ret = ctx->hook(filename, &info, ctx->hook_data);
 	grub_free(node);
-	return ctx->hook(filename, &info, ctx->hook_data);
+	return ret;
 }
 
 static grub_err_t
@@ -698,18 +1098,98 @@ grub_wimfs_dir(grub_disk_t disk, const char* path,
 	grub_wim_iterate_dir(fdiro, grub_wim_dir_iter, &ctx);
 
 fail:
-	grub_free(data);
+	grub_wim_free(data);
 
 	return grub_errno;
 }
 
+static grub_uint32_t
+grub_wim_lookup_slot(const struct wim_hash* hash)
+{
+	return grub_get_unaligned32(hash->sha1);
+}
+
+/* Read the whole lookup table once and hash it.  */
+static int
+grub_wim_load_lookup(struct grub_wim_data* data)
+{
+	grub_uint32_t i, n, mask;
+
+	n = (grub_uint32_t)(data->header.lookup.len / sizeof(struct wim_lookup_entry));
+	if (!n || data->header.lookup.len / sizeof(struct wim_lookup_entry) > 0x1000000)
+		return -1;
+	for (mask = 1; mask < 2 * n; mask <<= 1)
+		;
+	data->lookup = grub_malloc(n * sizeof(struct wim_lookup_entry));
+	data->lookup_hash = grub_calloc(mask, sizeof(grub_uint32_t));
+	if (!data->lookup || !data->lookup_hash
+		|| grub_wim_get_resource(data, &data->header.lookup, data->lookup,
+			0, n * sizeof(struct wim_lookup_entry)) != 0)
+	{
+		grub_free(data->lookup);
+		grub_free(data->lookup_hash);
+		data->lookup = NULL;
+		data->lookup_hash = NULL;
+		grub_errno = GRUB_ERR_NONE;
+		return -1;
+	}
+	mask--;
+	for (i = 0; i < n; i++)
+	{
+		grub_uint32_t slot = grub_wim_lookup_slot(&data->lookup[i].hash) & mask;
+		while (data->lookup_hash[slot])
+			slot = (slot + 1) & mask;
+		data->lookup_hash[slot] = i + 1;
+	}
+	data->lookup_count = n;
+	data->lookup_buckets = mask + 1;
+	return 0;
+}
+
+/* Find the lookup table entry of the stream with hash HASH.  */
+static int
+grub_wim_find_lookup(struct grub_wim_data* data, const struct wim_hash* hash,
+	struct wim_lookup_entry* entry)
+{
+	grub_uint64_t offset;
+
+	if (data->lookup || grub_wim_load_lookup(data) == 0)
+	{
+		grub_uint32_t mask = data->lookup_buckets - 1;
+		grub_uint32_t slot = grub_wim_lookup_slot(hash) & mask;
+
+		for (; data->lookup_hash[slot]; slot = (slot + 1) & mask)
+		{
+			struct wim_lookup_entry* e = &data->lookup[data->lookup_hash[slot] - 1];
+			if (grub_memcmp(&e->hash, hash, sizeof(*hash)) == 0)
+			{
+				grub_memcpy(entry, e, sizeof(*entry));
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	/* No memory for the table, scan it on disk.  */
+	for (offset = 0;
+		offset + sizeof(struct wim_lookup_entry) <= data->header.lookup.len;
+		offset += sizeof(struct wim_lookup_entry))
+	{
+		if (grub_wim_get_resource(data, &data->header.lookup, entry,
+			offset, sizeof(struct wim_lookup_entry)) != 0)
+			return -1;
+		if (grub_memcmp(&entry->hash, hash, sizeof(*hash)) == 0)
+			return 0;
+	}
+	return -1;
+}
+
 static grub_err_t
 grub_wimfs_open(struct grub_file* file, const char* name)
 {
 	struct grub_wim_data* data = NULL;
 	struct grub_fshelp_node* fdiro = NULL;
 	struct grub_fshelp_node start;
-	grub_uint64_t offset;
 
 	data = grub_wim_mount(file->disk);
 	if (!data)
@@ -731,38 +1211,60 @@ grub_wimfs_open(struct grub_file* file, const char* name)
 	if (grub_errno)
 		goto fail;
 
-	for (offset = 0;
-		offset + sizeof(struct wim_lookup_entry) <= data->header.lookup.len;
-		offset += sizeof(struct wim_lookup_entry))
+	if (grub_wim_find_lookup(data, &fdiro->direntry.hash, &fdiro->entry) == 0)
 	{
-		/* Read entry */
-		if (grub_wim_get_resource(data, &data->header.lookup, &fdiro->entry,
-			offset, sizeof(struct wim_lookup_entry)) != 0)
-			goto fail;
-
-		/* Look for our target entry */
-		if (grub_memcmp(&fdiro->entry.hash, &fdiro->direntry.hash,
-			sizeof(fdiro->entry.hash)) == 0)
+		if (grub_wim_load_chunk_table(data, &fdiro->entry.resource) != 0)
 		{
-			file->size = fdiro->entry.resource.len;
-			file->data = fdiro;
-			return GRUB_ERR_NONE;
+			grub_error(GRUB_ERR_BAD_FS, "invalid chunk table");
+			goto fail;
 		}
+		file->size = fdiro->entry.resource.len;
+		file->data = fdiro;
+		return GRUB_ERR_NONE;
 	}
 
 	grub_error(GRUB_ERR_FILE_NOT_FOUND, "file not found");
 
 fail:
-	grub_free(data);
+	grub_wim_free(data);
 	return grub_errno;
 }
 
+/* Open a node handed to a grub_wimfs_dir hook.  It shares the mount of
+   the directory listing, with its chunk cache and lookup table.  */
+static grub_err_t
+grub_wimfs_open_entry(struct grub_file* file, const void* entry)
+{
+	struct grub_fshelp_node* fdiro;
+
+	fdiro = grub_malloc(sizeof(*fdiro));
+	if (!fdiro)
+		return grub_errno;
+	grub_memcpy(fdiro, entry, sizeof(*fdiro));
+	fdiro->shared = 1;
+
+	if (grub_wim_find_lookup(fdiro->data, &fdiro->direntry.hash, &fdiro->entry) != 0)
+	{
+		grub_free(fdiro);
+		return grub_error(GRUB_ERR_FILE_NOT_FOUND, "file not found");
+	}
+	if (grub_wim_load_chunk_table(fdiro->data, &fdiro->entry.resource) != 0)
+	{
+		grub_free(fdiro);
+		return grub_error(GRUB_ERR_BAD_FS, "invalid chunk table");
+	}
+	file->size = fdiro->entry.resource.len;
+	file->data = fdiro;
+	return GRUB_ERR_NONE;
+}
+
 static grub_err_t
 grub_wimfs_close(grub_file_t file)
 {
 	struct grub_fshelp_node* data = file->data;
 
-	grub_free(data->data);
+	if (!data->shared)
+		grub_wim_free(data->data);
 	grub_free(data);
 
 	return GRUB_ERR_NONE;
@@ -816,6 +1318,7 @@ static struct grub_fs grub_wim_fs =
 	.fs_open = grub_wimfs_open,
 	.fs_read = grub_wimfs_read,
 	.fs_close = grub_wimfs_close,
+	.fs_open_entry = grub_wimfs_open_entry,
 	.fs_uuid = grub_wimfs_uuid,
 	.next = 0
 };
@@ -828,4 +1331,5 @@ GRUB_MOD_INIT(wim)
 GRUB_MOD_FINI(wim)
 {
 	grub_fs_unregister(&grub_wim_fs);
+	wim_pool_fini();
 }
@@ -0,0 +1,166 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/err.h>
+#include <grub/seekpt.h>
+
+void
+grub_seekpt_init(struct grub_seekpt_list* list)
+{
+	grub_memset(list, 0, sizeof(*list));
+	list->spacing = GRUB_SEEKPT_SPACING;
+}
+
+void
+grub_seekpt_free(struct grub_seekpt_list* list)
+{
+	grub_size_t i;
+
+	for (i = 0; i < list->count; i++)
+		grub_free(list->pt[i].state);
+	grub_free(list->pt);
+	grub_seekpt_init(list);
+}
+
+/* Index of the first point past UOFF.  */
+static grub_size_t
+seekpt_upper(const struct grub_seekpt_list* list, grub_uint64_t uoff)
+{
+	grub_size_t lo = 0, hi = list->count, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (list->pt[mid].uoff <= uoff)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Double the spacing and drop every other snapshot until they fit.  */
+static void
+seekpt_thin(struct grub_seekpt_list* list)
+{
+	grub_size_t i, n;
+	int drop;
+
+	while (list->mem > GRUB_SEEKPT_MEM)
+	{
+		list->spacing *= 2;
+		drop = 0;
+		for (i = n = 0; i < list->count; i++)
+		{
+			struct grub_seekpt* pt = &list->pt[i];
+
+			if (pt->state && (drop = !drop))
+			{
+				list->mem -= pt->state_size;
+				grub_free(pt->state);
+				continue;
+			}
+			list->pt[n++] = *pt;
+		}
+		list->count = n;
+	}
+}
+
+grub_err_t
+grub_seekpt_add(struct grub_seekpt_list* list, grub_uint64_t uoff,
+	grub_uint64_t coff, void* state, grub_size_t state_size)
+{
+	grub_size_t i;
+
+	i = seekpt_upper(list, uoff);
+	if (i > 0 && list->pt[i - 1].uoff == uoff)
+	{
+		/* Already known, a format restart point beats a snapshot.  */
+		grub_free(state);
+		return GRUB_ERR_NONE;
+	}
+
+	if (list->count == list->max)
+	{
+		grub_size_t max = list->max ? list->max * 2 : 64;
+		struct grub_seekpt* pt;
+
+		pt = grub_realloc(list->pt, max * sizeof(*pt));
+		if (!pt)
+		{
+			grub_free(state);
+			return grub_errno;
+		}
+		list->pt = pt;
+		list->max = max;
+	}
+
+	grub_memmove(&list->pt[i + 1], &list->pt[i],
+		(list->count - i) * sizeof(list->pt[0]));
+	list->pt[i].uoff = uoff;
+	list->pt[i].coff = coff;
+	list->pt[i].state = state;
+	list->pt[i].state_size = state ? state_size : 0;
+	list->count++;
+
+	if (state)
+	{
+		list->mem += state_size;
+		seekpt_thin(list);
+	}
+	return GRUB_ERR_NONE;
+}
+
+int
+grub_seekpt_want(const struct grub_seekpt_list* list, grub_uint64_t uoff,
+	grub_size_t state_size)
+{
+	grub_size_t i;
+
+	/* A single snapshot must leave room for a few others.  */
+	if (state_size > GRUB_SEEKPT_MEM / 4)
+		return 0;
+	i = seekpt_upper(list, uoff);
+	if (i > 0 && uoff - list->pt[i - 1].uoff < list->spacing)
+		return 0;
+	if (i < list->count && list->pt[i].uoff - uoff < list->spacing / 2)
+		return 0;
+	return 1;
+}
+
+const struct grub_seekpt*
+grub_seekpt_lookup(const struct grub_seekpt_list* list, grub_uint64_t cur,
+	grub_uint64_t target)
+{
+	const struct grub_seekpt* pt;
+	grub_size_t i;
+
+	i = seekpt_upper(list, target);
+	if (i == 0)
+		return NULL;
+	pt = &list->pt[i - 1];
+	/* Behind the decoder there is no choice but to resume.  */
+	if (target < cur)
+		return pt;
+	if (pt->uoff > cur && pt->uoff - cur >= GRUB_SEEKPT_MIN_SKIP)
+		return pt;
+	return NULL;
+}
@@ -0,0 +1,359 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fixed and dynamic VHD images.  The block allocation table is read
+ * once at open, blocks it does not map read as zeros without any I/O,
+ * and runs of blocks laid out back to back are fetched in one request
+ * with the sector bitmaps between them dropped afterwards.  Differencing
+ * images are not supported.
+ */
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/err.h>
+#include <grub/file.h>
+#include <grub/fs.h>
+
+GRUB_MOD_LICENSE("GPLv3+");
+
+#define VHD_FOOTER_SIZE		512
+#define VHD_SECTOR_SIZE		512
+#define VHD_TYPE_FIXED		2
+#define VHD_TYPE_DYNAMIC	3
+#define VHD_TYPE_DIFF		4
+#define VHD_BAT_UNUSED		0xffffffff
+/* Largest table read at open, enough for 2040GB in 512K blocks.  */
+#define VHD_BAT_MAX		(1U << 22)
+
+GRUB_PACKED_START
+struct vhd_footer
+{
+	char cookie[8];
+	grub_uint32_t features;
+	grub_uint32_t version;
+	grub_uint64_t data_offset;
+	grub_uint32_t timestamp;
+	char creator_app[4];
+	grub_uint32_t creator_version;
+	grub_uint32_t creator_os;
+	grub_uint64_t original_size;
+	grub_uint64_t current_size;
+	grub_uint32_t geometry;
+	grub_uint32_t disk_type;
+	grub_uint32_t checksum;
+	grub_uint8_t uuid[16];
+	grub_uint8_t saved_state;
+	grub_uint8_t reserved[427];
+};
+
+struct vhd_dyn_header
+{
+	char cookie[8];
+	grub_uint64_t data_offset;
+	grub_uint64_t table_offset;
+	grub_uint32_t version;
+	grub_uint32_t max_entries;
+	grub_uint32_t block_size;
+	grub_uint32_t checksum;
+	grub_uint8_t parent_uuid[16];
+	grub_uint32_t parent_timestamp;
+	grub_uint32_t reserved;
+	grub_uint16_t parent_name[256];
+	grub_uint8_t parent_locator[8][24];
+	grub_uint8_t reserved2[256];
+};
+GRUB_PACKED_END
+
+struct grub_vhd
+{
+	grub_file_t file;
+	/* Sector of each block in FILE, VHD_BAT_UNUSED when not allocated.
+	   NULL for a fixed image.  */
+	grub_uint32_t* bat;
+	grub_uint32_t nblocks;
+	grub_uint32_t block_size;
+	/* Sector bitmap in front of the data of each block.  */
+	grub_uint32_t bitmap_size;
+	/* Scratch space a run of several blocks is read into.  */
+	char* run;
+	grub_size_t run_size;
+};
+
+static struct grub_fs grub_vhd_fs;
+
+/* One's complement of the byte sum, the checksum field counting as 0.  */
+static grub_uint32_t
+vhd_checksum(const void* buf, grub_size_t size, const grub_uint32_t* field)
+{
+	const grub_uint8_t* p = buf;
+	grub_uint32_t sum = 0;
+	grub_size_t i;
+
+	for (i = 0; i < size; i++)
+		sum += p[i];
+	p = (const grub_uint8_t*)field;
+	for (i = 0; i < sizeof(*field); i++)
+		sum -= p[i];
+	return ~sum;
+}
+
+static grub_err_t
+vhd_pread(grub_file_t file, grub_uint64_t ofs, void* buf, grub_size_t len)
+{
+	grub_file_seek(file, ofs);
+	if (grub_file_read(file, buf, len) != (grub_ssize_t)len)
+	{
+		if (!grub_errno)
+			grub_error(GRUB_ERR_BAD_FS, "vhd: unexpected end of file");
+		return grub_errno;
+	}
+	return GRUB_ERR_NONE;
+}
+
+static int
+vhd_footer_valid(const struct vhd_footer* f)
+{
+	return grub_memcmp(f->cookie, "conectix", 8) == 0
+		&& vhd_checksum(f, sizeof(*f), &f->checksum) == grub_be_to_cpu32(f->checksum);
+}
+
+static grub_err_t
+vhd_load_bat(struct grub_vhd* v, const struct vhd_footer* f)
+{
+	struct vhd_dyn_header h;
+	grub_uint64_t vsize = grub_be_to_cpu64(f->current_size);
+	grub_uint32_t i;
+
+	if (vhd_pread(v->file, grub_be_to_cpu64(f->data_offset), &h, sizeof(h)))
+		return grub_errno;
+	if (grub_memcmp(h.cookie, "cxsparse", 8) != 0
+		|| vhd_checksum(&h, sizeof(h), &h.checksum) != grub_be_to_cpu32(h.checksum))
+		return grub_error(GRUB_ERR_BAD_FS, "vhd: bad dynamic disk header");
+
+	v->block_size = grub_be_to_cpu32(h.block_size);
+	v->nblocks = grub_be_to_cpu32(h.max_entries);
+	if (v->block_size < VHD_SECTOR_SIZE || (v->block_size & (v->block_size - 1))
+		|| v->nblocks > VHD_BAT_MAX
+		|| (grub_uint64_t)v->nblocks * v->block_size < vsize)
+		return grub_error(GRUB_ERR_BAD_FS, "vhd: bad dynamic disk header");
+	v->bitmap_size = ALIGN_UP(v->block_size / VHD_SECTOR_SIZE / 8, VHD_SECTOR_SIZE);
+
+	v->bat = grub_malloc((grub_size_t)v->nblocks * sizeof(v->bat[0]));
+	if (!v->bat)
+		return grub_errno;
+	if (vhd_pread(v->file, grub_be_to_cpu64(h.table_offset), v->bat,
+		(grub_size_t)v->nblocks * sizeof(v->bat[0])))
+		return grub_errno;
+	for (i = 0; i < v->nblocks; i++)
+		v->bat[i] = grub_be_to_cpu32(v->bat[i]);
+	return GRUB_ERR_NONE;
+}
+
+/* Read N bytes of blocks that follow each other in the image with one
+   request, from OFS on with FIRST of them in the first block.  The
+   bitmap in front of each further block is read along and dropped.  */
+static grub_err_t
+vhd_read_run(struct grub_vhd* v, grub_uint64_t ofs, char* buf, grub_size_t n,
+	grub_size_t first, grub_uint32_t count)
+{
+	grub_size_t size = n + (grub_size_t)(count - 1) * v->bitmap_size;
+	grub_size_t m, done, from;
+	char* p;
+
+	if (size > v->run_size)
+	{
+		p = grub_realloc(v->run, size);
+		if (!p)
+			return grub_errno;
+		v->run = p;
+		v->run_size = size;
+	}
+	if (vhd_pread(v->file, ofs, v->run, size))
+		return grub_errno;
+	grub_memcpy(buf, v->run, first);
+	for (done = first, from = first; done < n; done += m, from += m)
+	{
+		from += v->bitmap_size;
+		m = (n - done < v->block_size) ? n - done : v->block_size;
+		grub_memcpy(buf + done, v->run + from, m);
+	}
+	return GRUB_ERR_NONE;
+}
+
+static grub_ssize_t
+grub_vhd_read(grub_file_t file, char* buf, grub_size_t len)
+{
+	struct grub_vhd* v = file->data;
+	grub_uint64_t ofs = file->offset;
+	grub_size_t done = 0, n;
+	grub_uint32_t blk, in, pos, count;
+
+	if (!v->bat)
+	{
+		if (vhd_pread(v->file, ofs, buf, len))
+			return -1;
+		return len;
+	}
+
+	while (done < len)
+	{
+		blk = (grub_uint32_t)(ofs / v->block_size);
+		in = (grub_uint32_t)(ofs % v->block_size);
+		pos = v->bat[blk];
+		n = v->block_size - in;
+		if (n > len - done)
+			n = len - done;
+		/* Extend over following blocks that sit right after this one and
+		   their own bitmap in the image, or that read as zeros just like
+		   it.  */
+		for (count = 1; done + n < len && blk + 1 < v->nblocks
+			&& (pos == VHD_BAT_UNUSED ? v->bat[blk + 1] == VHD_BAT_UNUSED
+				: v->bat[blk + 1] == (grub_uint64_t)v->bat[blk]
+					+ (v->bitmap_size + v->block_size) / VHD_SECTOR_SIZE); count++)
+		{
+			blk++;
+			n += (len - done - n < v->block_size) ? len - done - n : v->block_size;
+		}
+		if (pos == VHD_BAT_UNUSED)
+			grub_memset(buf + done, 0, n);
+		else if (count == 1)
+		{
+			if (vhd_pread(v->file, (grub_uint64_t)pos * VHD_SECTOR_SIZE
+				+ v->bitmap_size + in, buf + done, n))
+				return -1;
+		}
+		else if (vhd_read_run(v, (grub_uint64_t)pos * VHD_SECTOR_SIZE
+			+ v->bitmap_size + in, buf + done, n, v->block_size - in, count))
+			return -1;
+		done += n;
+		ofs += n;
+	}
+	return done;
+}
+
+static void
+vhd_free(struct grub_vhd* v)
+{
+	grub_free(v->run);
+	grub_free(v->bat);
+	grub_free(v);
+}
+
+static grub_err_t
+grub_vhd_close(grub_file_t file)
+{
+	struct grub_vhd* v = file->data;
+
+	grub_file_close(v->file);
+	vhd_free(v);
+	file->disk = 0;
+	return grub_errno;
+}
+
+static grub_file_t
+grub_vhd_open(grub_file_t io, enum grub_file_type type)
+{
+	struct vhd_footer f;
+	struct grub_vhd* v;
+	grub_file_t file;
+	grub_uint64_t size = grub_file_size(io);
+
+	if (!(type & GRUB_FILE_TYPE_FILTER_VDISK)
+		|| size == GRUB_FILE_SIZE_UNKNOWN || size < VHD_FOOTER_SIZE)
+		return io;
+	if (vhd_pread(io, size - VHD_FOOTER_SIZE, &f, sizeof(f))
+		|| grub_memcmp(f.cookie, "conectix", 8) != 0)
+	{
+		grub_file_seek(io, 0);
+		grub_errno = GRUB_ERR_NONE;
+		return io;
+	}
+	/* A dynamic image keeps a copy of the footer at the start.  */
+	if (!vhd_footer_valid(&f)
+		&& (vhd_pread(io, 0, &f, sizeof(f)) || !vhd_footer_valid(&f)))
+	{
+		grub_error(GRUB_ERR_BAD_FS, "vhd: bad footer checksum");
+		return 0;
+	}
+
+	switch (grub_be_to_cpu32(f.disk_type))
+	{
+	case VHD_TYPE_FIXED:
+		if (grub_be_to_cpu64(f.current_size) > size - VHD_FOOTER_SIZE)
+		{
+			grub_error(GRUB_ERR_BAD_FS, "vhd: image is truncated");
+			return 0;
+		}
+		break;
+	case VHD_TYPE_DYNAMIC:
+		break;
+	case VHD_TYPE_DIFF:
+		grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "vhd: differencing images are not supported");
+		return 0;
+	default:
+		grub_error(GRUB_ERR_BAD_FS, "vhd: unknown disk type");
+		return 0;
+	}
+
+	v = grub_zalloc(sizeof(*v));
+	file = grub_zalloc(sizeof(*file));
+	if (!v || !file)
+	{
+		grub_free(v);
+		grub_free(file);
+		return 0;
+	}
+	v->file = io;
+	if (grub_be_to_cpu32(f.disk_type) == VHD_TYPE_DYNAMIC && vhd_load_bat(v, &f))
+	{
+		vhd_free(v);
+		grub_free(file);
+		return 0;
+	}
+
+	file->disk = io->disk;
+	file->borrowed_disk = 1;
+	file->data = v;
+	file->fs = &grub_vhd_fs;
+	file->size = grub_be_to_cpu64(f.current_size);
+	file->not_easily_seekable = io->not_easily_seekable;
+	return file;
+}
+
+static struct grub_fs grub_vhd_fs =
+{
+	.name = "vhd",
+	.fs_dir = 0,
+	.fs_open = 0,
+	.fs_read = grub_vhd_read,
+	.fs_close = grub_vhd_close,
+	.fs_label = 0,
+	.next = 0
+};
+
+GRUB_MOD_INIT(vhd)
+{
+	grub_file_filter_register(GRUB_FILE_FILTER_VHD, grub_vhd_open);
+}
+
+GRUB_MOD_FINI(vhd)
+{
+	grub_file_filter_unregister(GRUB_FILE_FILTER_VHD);
+}
@@ -0,0 +1,518 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fixed and dynamic VHDX images.  The payload entries of the block
+ * allocation table are turned into a flat map at open, so a read only
+ * touches the image for blocks that hold data and runs of blocks laid
+ * out back to back are fetched in one request.  Differencing images and
+ * images with a pending log are refused.
+ */
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/err.h>
+#include <grub/file.h>
+#include <grub/fs.h>
+
+GRUB_MOD_LICENSE("GPLv3+");
+
+#define VHDX_HEADER1_OFFSET	0x10000
+#define VHDX_HEADER2_OFFSET	0x20000
+#define VHDX_HEADER_SIZE	0x1000
+#define VHDX_REGION1_OFFSET	0x30000
+#define VHDX_REGION2_OFFSET	0x40000
+#define VHDX_REGION_SIZE	0x10000
+#define VHDX_REGION_MAX		((VHDX_REGION_SIZE - sizeof(struct vhdx_region_header)) / sizeof(struct vhdx_region_entry))
+#define VHDX_METADATA_MAX	2047
+
+#define VHDX_BAT_STATE_MASK	7
+#define VHDX_BAT_FULLY_PRESENT	6
+#define VHDX_BAT_OFFSET_MASK	0xfffffffffff00000ULL
+#define VHDX_PARAM_HAS_PARENT	2
+#define VHDX_CHUNK_BYTES	(1ULL << 23)
+
+GRUB_PACKED_START
+struct vhdx_header
+{
+	char signature[4];
+	grub_uint32_t checksum;
+	grub_uint64_t sequence;
+	grub_uint8_t file_write_guid[16];
+	grub_uint8_t data_write_guid[16];
+	grub_uint8_t log_guid[16];
+	grub_uint16_t log_version;
+	grub_uint16_t version;
+	grub_uint32_t log_length;
+	grub_uint64_t log_offset;
+};
+
+struct vhdx_region_header
+{
+	char signature[4];
+	grub_uint32_t checksum;
+	grub_uint32_t count;
+	grub_uint32_t reserved;
+};
+
+struct vhdx_region_entry
+{
+	grub_uint8_t guid[16];
+	grub_uint64_t offset;
+	grub_uint32_t length;
+	grub_uint32_t required;
+};
+
+struct vhdx_metadata_header
+{
+	char signature[8];
+	grub_uint16_t reserved;
+	grub_uint16_t count;
+	grub_uint32_t reserved2[5];
+};
+
+struct vhdx_metadata_entry
+{
+	grub_uint8_t guid[16];
+	grub_uint32_t offset;
+	grub_uint32_t length;
+	grub_uint32_t flags;
+	grub_uint32_t reserved;
+};
+
+struct vhdx_file_params
+{
+	grub_uint32_t block_size;
+	grub_uint32_t flags;
+};
+GRUB_PACKED_END
+
+static const grub_uint8_t vhdx_bat_guid[16] =
+{
+	0x66, 0x77, 0xc2, 0x2d, 0x23, 0xf6, 0x00, 0x42,
+	0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08
+};
+
+static const grub_uint8_t vhdx_metadata_guid[16] =
+{
+	0x06, 0xa2, 0x7c, 0x8b, 0x90, 0x47, 0x9a, 0x4b,
+	0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e
+};
+
+static const grub_uint8_t vhdx_file_params_guid[16] =
+{
+	0x37, 0x67, 0xa1, 0xca, 0x36, 0xfa, 0x43, 0x4d,
+	0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b
+};
+
+static const grub_uint8_t vhdx_disk_size_guid[16] =
+{
+	0x24, 0x42, 0xa5, 0x2f, 0x1b, 0xcd, 0x76, 0x48,
+	0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8
+};
+
+static const grub_uint8_t vhdx_sector_size_guid[16] =
+{
+	0x1d, 0xbf, 0x41, 0x81, 0x6f, 0xa9, 0x09, 0x47,
+	0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f
+};
+
+struct grub_vhdx
+{
+	grub_file_t file;
+	/* Image offset of each data block, 0 when it reads as zeros.  */
+	grub_uint64_t* map;
+	grub_uint64_t nblocks;
+	grub_uint32_t block_size;
+};
+
+static struct grub_fs grub_vhdx_fs;
+
+static grub_uint32_t crc32c_table[256];
+
+static void
+init_crc32c_table(void)
+{
+	grub_uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc32c_table[i] = c;
+	}
+}
+
+/* CRC-32C of BUF with the checksum at offset 4 taken as zero.  */
+static grub_uint32_t
+vhdx_checksum(const void* buf, grub_size_t size)
+{
+	const grub_uint8_t* p = buf;
+	grub_uint32_t crc = 0xffffffff;
+	grub_size_t i;
+
+	for (i = 0; i < size; i++)
+		crc = crc32c_table[(crc ^ ((i >= 4 && i < 8) ? 0 : p[i])) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static grub_err_t
+vhdx_pread(grub_file_t file, grub_uint64_t ofs, void* buf, grub_size_t len)
+{
+	grub_file_seek(file, ofs);
+	if (grub_file_read(file, buf, len) != (grub_ssize_t)len)
+	{
+		if (!grub_errno)
+			grub_error(GRUB_ERR_BAD_FS, "vhdx: unexpected end of file");
+		return grub_errno;
+	}
+	return GRUB_ERR_NONE;
+}
+
+/* Read a checksummed structure, 1 if it is there and intact.  */
+static int
+vhdx_read_checked(grub_file_t file, grub_uint64_t ofs, void* buf,
+	grub_size_t size, const char* signature)
+{
+	grub_uint32_t sum;
+
+	if (vhdx_pread(file, ofs, buf, size))
+	{
+		grub_errno = GRUB_ERR_NONE;
+		return 0;
+	}
+	grub_memcpy(&sum, (char*)buf + 4, sizeof(sum));
+	return grub_memcmp(buf, signature, 4) == 0
+		&& vhdx_checksum(buf, size) == grub_le_to_cpu32(sum);
+}
+
+static grub_err_t
+vhdx_check_header(grub_file_t file, void* buf)
+{
+	struct vhdx_header* h = buf;
+	grub_uint64_t seq = 0;
+	int i, found = 0;
+	static const grub_uint8_t zero[16];
+
+	for (i = 0; i < 2; i++)
+	{
+		struct vhdx_header* cur = (struct vhdx_header*)((char*)buf + VHDX_HEADER_SIZE);
+
+		if (!vhdx_read_checked(file, i ? VHDX_HEADER2_OFFSET : VHDX_HEADER1_OFFSET,
+			cur, VHDX_HEADER_SIZE, "head")
+			|| grub_le_to_cpu16(cur->version) != 1)
+			continue;
+		if (!found || grub_le_to_cpu64(cur->sequence) > seq)
+		{
+			grub_memcpy(h, cur, sizeof(*h));
+			seq = grub_le_to_cpu64(cur->sequence);
+			found = 1;
+		}
+	}
+	if (!found)
+		return grub_error(GRUB_ERR_BAD_FS, "vhdx: no valid header");
+	if (grub_memcmp(h->log_guid, zero, sizeof(zero)) != 0)
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET,
+			"vhdx: image has a pending log, attach it once to replay it");
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+vhdx_find_regions(grub_file_t file, void* buf,
+	struct vhdx_region_entry* bat, struct vhdx_region_entry* meta)
+{
+	struct vhdx_region_header* h = buf;
+	struct vhdx_region_entry* e = (struct vhdx_region_entry*)(h + 1);
+	grub_uint32_t i, count;
+
+	if (!vhdx_read_checked(file, VHDX_REGION1_OFFSET, buf, VHDX_REGION_SIZE, "regi")
+		&& !vhdx_read_checked(file, VHDX_REGION2_OFFSET, buf, VHDX_REGION_SIZE, "regi"))
+		return grub_error(GRUB_ERR_BAD_FS, "vhdx: no valid region table");
+
+	count = grub_le_to_cpu32(h->count);
+	if (count > VHDX_REGION_MAX)
+		return grub_error(GRUB_ERR_BAD_FS, "vhdx: bad region table");
+	grub_memset(bat, 0, sizeof(*bat));
+	grub_memset(meta, 0, sizeof(*meta));
+	for (i = 0; i < count; i++, e++)
+	{
+		if (grub_memcmp(e->guid, vhdx_bat_guid, 16) == 0)
+			grub_memcpy(bat, e, sizeof(*e));
+		else if (grub_memcmp(e->guid, vhdx_metadata_guid, 16) == 0)
+			grub_memcpy(meta, e, sizeof(*e));
+		else if (grub_le_to_cpu32(e->required) & 1)
+			return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "vhdx: unknown required region");
+	}
+	if (!bat->length || !meta->length)
+		return grub_error(GRUB_ERR_BAD_FS, "vhdx: missing region");
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+vhdx_read_metadata(grub_file_t file, const struct vhdx_region_entry* meta,
+	grub_uint32_t* block_size, grub_uint64_t* disk_size, grub_uint32_t* sector_size)
+{
+	struct vhdx_metadata_header h;
+	struct vhdx_metadata_entry* e;
+	struct vhdx_file_params params;
+	grub_uint64_t base = grub_le_to_cpu64(meta->offset);
+	grub_uint16_t i, count;
+	int found = 0;
+
+	if (vhdx_pread(file, base, &h, sizeof(h)))
+		return grub_errno;
+	count = grub_le_to_cpu16(h.count);
+	if (grub_memcmp(h.signature, "metadata", 8) != 0 || count > VHDX_METADATA_MAX)
+		return grub_error(GRUB_ERR_BAD_FS, "vhdx: bad metadata table");
+
+	e = grub_malloc(count * sizeof(*e));
+	if (!e)
+		return grub_errno;
+	if (vhdx_pread(file, base + sizeof(h), e, count * sizeof(*e)))
+		goto fail;
+
+	for (i = 0; i < count; i++)
+	{
+		grub_uint64_t ofs = base + grub_le_to_cpu32(e[i].offset);
+
+		if (grub_memcmp(e[i].guid, vhdx_file_params_guid, 16) == 0)
+		{
+			if (vhdx_pread(file, ofs, &params, sizeof(params)))
+				goto fail;
+			if (grub_le_to_cpu32(params.flags) & VHDX_PARAM_HAS_PARENT)
+			{
+				grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "vhdx: differencing images are not supported");
+				goto fail;
+			}
+			*block_size = grub_le_to_cpu32(params.block_size);
+			found |= 1;
+		}
+		else if (grub_memcmp(e[i].guid, vhdx_disk_size_guid, 16) == 0)
+		{
+			if (vhdx_pread(file, ofs, disk_size, sizeof(*disk_size)))
+				goto fail;
+			*disk_size = grub_le_to_cpu64(*disk_size);
+			found |= 2;
+		}
+		else if (grub_memcmp(e[i].guid, vhdx_sector_size_guid, 16) == 0)
+		{
+			if (vhdx_pread(file, ofs, sector_size, sizeof(*sector_size)))
+				goto fail;
+			*sector_size = grub_le_to_cpu32(*sector_size);
+			found |= 4;
+		}
+		else if (grub_le_to_cpu32(e[i].flags) & 4)
+		{
+			grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "vhdx: unknown required metadata");
+			goto fail;
+		}
+	}
+	grub_free(e);
+	if (found != 7)
+		return grub_error(GRUB_ERR_BAD_FS, "vhdx: missing metadata");
+	return GRUB_ERR_NONE;
+
+fail:
+	grub_free(e);
+	return grub_errno;
+}
+
+/* Payload entries are interleaved with one sector bitmap entry
+   after every CHUNK_RATIO of them.  */
+static grub_err_t
+vhdx_load_bat(struct grub_vhdx* v, const struct vhdx_region_entry* region,
+	grub_uint64_t disk_size, grub_uint32_t sector_size)
+{
+	grub_uint64_t chunk_ratio, nentries, i, e;
+	grub_uint64_t* bat;
+	grub_size_t size;
+
+	if (v->block_size < (1U << 20) || v->block_size > (256U << 20)
+		|| (v->block_size & (v->block_size - 1))
+		|| (sector_size != 512 && sector_size != 4096))
+		return grub_error(GRUB_ERR_BAD_FS, "vhdx: bad disk parameters");
+	chunk_ratio = VHDX_CHUNK_BYTES * sector_size / v->block_size;
+	v->nblocks = (disk_size + v->block_size - 1) / v->block_size;
+	if (!v->nblocks)
+		return GRUB_ERR_NONE;
+	nentries = v->nblocks + (v->nblocks - 1) / chunk_ratio;
+	if (nentries > grub_le_to_cpu32(region->length) / sizeof(grub_uint64_t))
+		return grub_error(GRUB_ERR_BAD_FS, "vhdx: block allocation table is too small");
+
+	size = (grub_size_t)nentries * sizeof(grub_uint64_t);
+	bat = grub_malloc(size);
+	v->map = grub_malloc((grub_size_t)v->nblocks * sizeof(v->map[0]));
+	if (!bat || !v->map)
+		goto fail;
+	if (vhdx_pread(v->file, grub_le_to_cpu64(region->offset), bat, size))
+		goto fail;
+
+	for (i = 0; i < v->nblocks; i++)
+	{
+		e = grub_le_to_cpu64(bat[i + i / chunk_ratio]);
+		switch (e & VHDX_BAT_STATE_MASK)
+		{
+		case VHDX_BAT_FULLY_PRESENT:
+			v->map[i] = e & VHDX_BAT_OFFSET_MASK;
+			if (v->map[i])
+				break;
+			/* fallthrough */
+		case 4:
+		case 5:
+		case 7:
+			grub_error(GRUB_ERR_BAD_FS, "vhdx: bad block allocation table entry");
+			goto fail;
+		default:
+			/* Not present, undefined, zero or unmapped.  */
+			v->map[i] = 0;
+		}
+	}
+	grub_free(bat);
+	return GRUB_ERR_NONE;
+
+fail:
+	grub_free(bat);
+	return grub_errno;
+}
+
+static grub_ssize_t
+grub_vhdx_read(grub_file_t file, char* buf, grub_size_t len)
+{
+	struct grub_vhdx* v = file->data;
+	grub_uint64_t ofs = file->offset, blk, pos;
+	grub_size_t done = 0, n;
+	grub_uint32_t in;
+
+	while (done < len)
+	{
+		blk = ofs / v->block_size;
+		in = (grub_uint32_t)(ofs % v->block_size);
+		pos = v->map[blk];
+		n = v->block_size - in;
+		if (n > len - done)
+			n = len - done;
+		/* Extend over following blocks that sit right after this one
+		   in the image, or that read as zeros just like it.  */
+		while (done + n < len && blk + 1 < v->nblocks
+			&& (pos ? v->map[blk + 1] == v->map[blk] + v->block_size : !v->map[blk + 1]))
+		{
+			blk++;
+			n += (len - done - n < v->block_size) ? len - done - n : v->block_size;
+		}
+		if (!pos)
+			grub_memset(buf + done, 0, n);
+		else if (vhdx_pread(v->file, pos + in, buf + done, n))
+			return -1;
+		done += n;
+		ofs += n;
+	}
+	return done;
+}
+
+static void
+vhdx_free(struct grub_vhdx* v)
+{
+	grub_free(v->map);
+	grub_free(v);
+}
+
+static grub_err_t
+grub_vhdx_close(grub_file_t file)
+{
+	struct grub_vhdx* v = file->data;
+
+	grub_file_close(v->file);
+	vhdx_free(v);
+	file->disk = 0;
+	return grub_errno;
+}
+
+static grub_file_t
+grub_vhdx_open(grub_file_t io, enum grub_file_type type)
+{
+	struct vhdx_region_entry bat, meta;
+	struct grub_vhdx* v;
+	grub_file_t file;
+	char magic[8];
+	char* buf;
+	grub_uint32_t sector_size = 0;
+	grub_uint64_t disk_size = 0;
+
+	if (!(type & GRUB_FILE_TYPE_FILTER_VDISK))
+		return io;
+	grub_file_seek(io, 0);
+	if (grub_file_read(io, magic, sizeof(magic)) != sizeof(magic)
+		|| grub_memcmp(magic, "vhdxfile", sizeof(magic)) != 0)
+	{
+		grub_file_seek(io, 0);
+		grub_errno = GRUB_ERR_NONE;
+		return io;
+	}
+
+	v = grub_zalloc(sizeof(*v));
+	file = grub_zalloc(sizeof(*file));
+	buf = grub_malloc(VHDX_REGION_SIZE);
+	if (!v || !file || !buf)
+		goto fail;
+	v->file = io;
+	if (vhdx_check_header(io, buf)
+		|| vhdx_find_regions(io, buf, &bat, &meta)
+		|| vhdx_read_metadata(io, &meta, &v->block_size, &disk_size, &sector_size)
+		|| vhdx_load_bat(v, &bat, disk_size, sector_size))
+		goto fail;
+	grub_free(buf);
+
+	file->disk = io->disk;
+	file->borrowed_disk = 1;
+	file->data = v;
+	file->fs = &grub_vhdx_fs;
+	file->size = disk_size;
+	file->not_easily_seekable = io->not_easily_seekable;
+	return file;
+
+fail:
+	if (v)
+		vhdx_free(v);
+	grub_free(file);
+	grub_free(buf);
+	return 0;
+}
+
+static struct grub_fs grub_vhdx_fs =
+{
+	.name = "vhdx",
+	.fs_dir = 0,
+	.fs_open = 0,
+	.fs_read = grub_vhdx_read,
+	.fs_close = grub_vhdx_close,
+	.fs_label = 0,
+	.next = 0
+};
+
+GRUB_MOD_INIT(vhdx)
+{
+	init_crc32c_table();
+	grub_file_filter_register(GRUB_FILE_FILTER_VHDX, grub_vhdx_open);
+}
+
+GRUB_MOD_FINI(vhdx)
+{
+	grub_file_filter_unregister(GRUB_FILE_FILTER_VHDX);
+}
@@ -0,0 +1,1449 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Streaming .xz decompression with random access.
+ *
+ * The stream index at the end of the file is read at open, so the size is
+ * known without decoding and every block is a restart point.  Within a
+ * block the LZMA2 decoder is snapshotted at chunk boundaries (see seekpt.h),
+ * so a seek backwards does not go back further than the last snapshot.
+ * Only LZMA2 blocks are supported.  The CRC32, CRC64 and SHA-256 checks
+ * of a block are verified when its end is decoded; the running check is
+ * part of a snapshot, so reads that seek are verified as well.
+ */
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/err.h>
+#include <grub/file.h>
+#include <grub/fs.h>
+#include <grub/seekpt.h>
+
+GRUB_MOD_LICENSE("GPLv3+");
+
+#define XZ_HEADER_SIZE		12
+#define XZ_FOOTER_SIZE		12
+#define XZ_FILTER_LZMA2		0x21
+/* Largest dictionary allocated for a block.  */
+#define XZ_DICT_MAX		(256U << 20)
+/* Input buffer.  */
+#define XZ_IN_SIZE		(64U << 10)
+
+static const grub_uint8_t xz_magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+/* Bytes of the integrity check of each check type.  */
+static const grub_uint8_t xz_check_size[16] =
+{
+	0, 4, 4, 4, 8, 8, 8, 16, 16, 16, 32, 32, 32, 64, 64, 64
+};
+
+#define XZ_CHECK_NONE		0x00
+#define XZ_CHECK_CRC32		0x01
+#define XZ_CHECK_CRC64		0x04
+#define XZ_CHECK_SHA256		0x0a
+
+#define LZMA_STATES		12
+#define LZMA_LIT_STATES		7
+#define LZMA_POS_STATES_MAX	16
+#define LZMA_MATCH_LEN_MIN	2
+#define LZMA_LEN_LOW		8
+#define LZMA_LEN_MID		8
+#define LZMA_LEN_HIGH		256
+#define LZMA_DIST_STATES	4
+#define LZMA_DIST_SLOTS		64
+#define LZMA_DIST_MODEL_START	4
+#define LZMA_DIST_MODEL_END	14
+#define LZMA_FULL_DISTANCES	128
+#define LZMA_ALIGN_BITS		4
+#define LZMA_ALIGN_SIZE		16
+#define LZMA_LITERAL_CODERS	16
+#define LZMA_LITERAL_SIZE	0x300
+#define LZMA_PROB_INIT		1024
+
+/* Largest compressed LZMA2 chunk.  */
+#define LZMA2_CHUNK_MAX		(64U << 10)
+
+#define RC_TOP			(1U << 24)
+#define RC_MODEL_BITS		11
+#define RC_MODEL_TOTAL		(1U << RC_MODEL_BITS)
+#define RC_MOVE_BITS		5
+
+struct lzma_len_dec
+{
+	grub_uint16_t choice;
+	grub_uint16_t choice2;
+	grub_uint16_t low[LZMA_POS_STATES_MAX][LZMA_LEN_LOW];
+	grub_uint16_t mid[LZMA_POS_STATES_MAX][LZMA_LEN_MID];
+	grub_uint16_t high[LZMA_LEN_HIGH];
+};
+
+/* Adaptive probabilities, all reset to LZMA_PROB_INIT together.  */
+struct lzma_probs
+{
+	grub_uint16_t is_match[LZMA_STATES][LZMA_POS_STATES_MAX];
+	grub_uint16_t is_rep[LZMA_STATES];
+	grub_uint16_t is_rep0[LZMA_STATES];
+	grub_uint16_t is_rep1[LZMA_STATES];
+	grub_uint16_t is_rep2[LZMA_STATES];
+	grub_uint16_t is_rep0_long[LZMA_STATES][LZMA_POS_STATES_MAX];
+	grub_uint16_t dist_slot[LZMA_DIST_STATES][LZMA_DIST_SLOTS];
+	grub_uint16_t dist_special[LZMA_FULL_DISTANCES - LZMA_DIST_MODEL_END];
+	grub_uint16_t dist_align[LZMA_ALIGN_SIZE];
+	struct lzma_len_dec match_len;
+	struct lzma_len_dec rep_len;
+	grub_uint16_t literal[LZMA_LITERAL_CODERS][LZMA_LITERAL_SIZE];
+};
+
+/* LZMA2 decoder state between chunks, what a snapshot saves.  */
+struct lzma_dec
+{
+	grub_uint32_t state;
+	grub_uint32_t rep0;
+	grub_uint32_t rep1;
+	grub_uint32_t rep2;
+	grub_uint32_t rep3;
+	grub_uint32_t lc;
+	grub_uint32_t literal_pos_mask;
+	grub_uint32_t pos_mask;
+	int need_props;
+	int need_dict_reset;
+	struct lzma_probs probs;
+};
+
+struct lzma_rc
+{
+	const grub_uint8_t* in;
+	grub_size_t in_pos;
+	grub_size_t in_size;
+	grub_uint32_t range;
+	grub_uint32_t code;
+};
+
+/* Circular dictionary, [START, POS) is decoded but not handed out yet.  */
+struct lzma_dict
+{
+	grub_uint8_t* buf;
+	grub_size_t start;
+	grub_size_t pos;
+	grub_size_t full;
+	grub_size_t limit;
+	grub_size_t size;
+	grub_size_t alloc;
+};
+
+struct xz_sha256
+{
+	grub_uint32_t h[8];
+	grub_uint64_t len;
+	grub_uint8_t buf[64];
+};
+
+/* Running integrity check of the block being decoded.  */
+struct xz_check
+{
+	/* Check type of the stream, the check is skipped for unknown ones.  */
+	int type;
+	union
+	{
+		grub_uint32_t crc32;
+		grub_uint64_t crc64;
+		struct xz_sha256 sha256;
+	} u;
+};
+
+struct xz_block
+{
+	/* Block header in the file.  */
+	grub_uint64_t coff;
+	/* Offset of its data in the decompressed file.  */
+	grub_uint64_t uoff;
+	grub_uint64_t usize;
+	/* Check type of its stream.  */
+	int check;
+};
+
+/* A stream of the file, found walking backwards from the end.  */
+struct xz_stream
+{
+	grub_uint64_t start;
+	grub_uint64_t index;
+	grub_uint32_t index_size;
+	int check;
+};
+
+struct xz_snapshot
+{
+	grub_size_t block;
+	grub_size_t dict_size;
+	grub_size_t dict_pos;
+	grub_size_t dict_full;
+	struct lzma_dec lzma;
+	struct xz_check check;
+	/* Followed by DICT_FULL bytes of dictionary.  */
+};
+
+struct grub_xzio
+{
+	grub_file_t file;
+	struct xz_block* blocks;
+	grub_size_t nblocks;
+	grub_size_t block;
+	int block_done;
+	/* Decompressed offset of DICT.START.  */
+	grub_uint64_t uoff;
+
+	/* Next byte of FILE to decode, IBUF holds ILEN bytes from IBASE.  */
+	grub_uint64_t coff;
+	grub_uint8_t* ibuf;
+	grub_uint64_t ibase;
+	grub_size_t ilen;
+
+	/* Current LZMA2 chunk.  */
+	grub_uint8_t* chunk;
+	grub_uint32_t chunk_left;
+	int chunk_lzma;
+	grub_uint32_t len;
+
+	struct lzma_rc rc;
+	struct lzma_dict dict;
+	struct lzma_dec lzma;
+	struct xz_check check;
+	struct grub_seekpt_list points;
+};
+
+static struct grub_fs grub_xzio_fs;
+
+static grub_uint32_t crc32_table[256];
+static grub_uint64_t crc64_table[256];
+
+static void
+xz_crc_init(void)
+{
+	grub_uint32_t i, j, r;
+	grub_uint64_t q;
+
+	for (i = 0; i < 256; i++)
+	{
+		r = i;
+		for (j = 0; j < 8; j++)
+			r = (r >> 1) ^ (0xedb88320 & ((grub_uint32_t)0 - (r & 1)));
+		crc32_table[i] = r;
+		q = i;
+		for (j = 0; j < 8; j++)
+			q = (q >> 1) ^ (0xc96c5795d7870f42ULL & ((grub_uint64_t)0 - (q & 1)));
+		crc64_table[i] = q;
+	}
+}
+
+/* CRC of BUF continued from CRC, 0 to start.  */
+static grub_uint32_t
+xz_crc32_update(grub_uint32_t crc, const grub_uint8_t* buf, grub_size_t size)
+{
+	crc = ~crc;
+	while (size--)
+		crc = crc32_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static grub_uint32_t
+xz_crc32(const grub_uint8_t* buf, grub_size_t size)
+{
+	return xz_crc32_update(0, buf, size);
+}
+
+static grub_uint64_t
+xz_crc64_update(grub_uint64_t crc, const grub_uint8_t* buf, grub_size_t size)
+{
+	crc = ~crc;
+	while (size--)
+		crc = crc64_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static const grub_uint32_t sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(grub_uint32_t* h, const grub_uint8_t* p)
+{
+	grub_uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = grub_be_to_cpu32(grub_get_unaligned32(p + i * 4));
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7]
+			+ (SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+			+ (SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 64; i++)
+	{
+		t1 = k + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25))
+			+ ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void
+sha256_init(struct xz_sha256* s)
+{
+	static const grub_uint32_t iv[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	grub_memcpy(s->h, iv, sizeof(iv));
+	s->len = 0;
+}
+
+static void
+sha256_update(struct xz_sha256* s, const grub_uint8_t* buf, grub_size_t size)
+{
+	grub_size_t fill = (grub_size_t)(s->len & 63), n;
+
+	s->len += size;
+	if (fill)
+	{
+		n = 64 - fill;
+		if (n > size)
+			n = size;
+		grub_memcpy(s->buf + fill, buf, n);
+		buf += n;
+		size -= n;
+		if (fill + n < 64)
+			return;
+		sha256_block(s->h, s->buf);
+	}
+	for (; size >= 64; buf += 64, size -= 64)
+		sha256_block(s->h, buf);
+	grub_memcpy(s->buf, buf, size);
+}
+
+static void
+sha256_final(struct xz_sha256* s, grub_uint8_t* out)
+{
+	grub_uint64_t bits = s->len * 8;
+	grub_size_t fill = (grub_size_t)(s->len & 63);
+	int i;
+
+	s->buf[fill++] = 0x80;
+	if (fill > 56)
+	{
+		grub_memset(s->buf + fill, 0, 64 - fill);
+		sha256_block(s->h, s->buf);
+		fill = 0;
+	}
+	grub_memset(s->buf + fill, 0, 56 - fill);
+	for (i = 0; i < 8; i++)
+		s->buf[56 + i] = (grub_uint8_t)(bits >> (56 - i * 8));
+	sha256_block(s->h, s->buf);
+	for (i = 0; i < 8; i++)
+	{
+		grub_uint32_t v = grub_cpu_to_be32(s->h[i]);
+
+		grub_memcpy(out + i * 4, &v, 4);
+	}
+}
+
+static void
+xz_check_init(struct xz_check* c, int type)
+{
+	c->type = type;
+	switch (type)
+	{
+	case XZ_CHECK_CRC32:
+		c->u.crc32 = 0;
+		break;
+	case XZ_CHECK_CRC64:
+		c->u.crc64 = 0;
+		break;
+	case XZ_CHECK_SHA256:
+		sha256_init(&c->u.sha256);
+		break;
+	}
+}
+
+static void
+xz_check_update(struct xz_check* c, const grub_uint8_t* buf, grub_size_t size)
+{
+	switch (c->type)
+	{
+	case XZ_CHECK_CRC32:
+		c->u.crc32 = xz_crc32_update(c->u.crc32, buf, size);
+		break;
+	case XZ_CHECK_CRC64:
+		c->u.crc64 = xz_crc64_update(c->u.crc64, buf, size);
+		break;
+	case XZ_CHECK_SHA256:
+		sha256_update(&c->u.sha256, buf, size);
+		break;
+	}
+}
+
+static grub_err_t
+xz_corrupt(void)
+{
+	return grub_error(GRUB_ERR_BAD_COMPRESSED_DATA, "xz: corrupted data");
+}
+
+/* Variable-length integer at BUF[*POS], within SIZE bytes.  */
+static int
+xz_vli(const grub_uint8_t* buf, grub_size_t size, grub_size_t* pos,
+	grub_uint64_t* val)
+{
+	int i;
+
+	*val = 0;
+	for (i = 0; i < 9 && *pos < size; i++)
+	{
+		grub_uint8_t b = buf[(*pos)++];
+		*val |= (grub_uint64_t)(b & 0x7f) << (i * 7);
+		if (!(b & 0x80))
+			return (b == 0 && i > 0) ? 0 : 1;
+	}
+	return 0;
+}
+
+static grub_err_t
+xz_pread(grub_file_t file, grub_uint64_t ofs, void* buf, grub_size_t len)
+{
+	grub_file_seek(file, ofs);
+	if (grub_file_read(file, buf, len) != (grub_ssize_t)len)
+	{
+		if (!grub_errno)
+			grub_error(GRUB_ERR_BAD_COMPRESSED_DATA, "xz: unexpected end of file");
+		return grub_errno;
+	}
+	return GRUB_ERR_NONE;
+}
+
+/* Read LEN bytes at X->COFF through the input buffer.  */
+static grub_err_t
+xz_read_in(struct grub_xzio* x, void* buf, grub_size_t len)
+{
+	grub_uint8_t* p = buf;
+	grub_size_t n;
+
+	while (len)
+	{
+		if (x->coff < x->ibase || x->coff >= x->ibase + x->ilen)
+		{
+			grub_ssize_t got;
+
+			grub_file_seek(x->file, x->coff);
+			got = grub_file_read(x->file, x->ibuf, XZ_IN_SIZE);
+			if (got <= 0)
+			{
+				if (!grub_errno)
+					grub_error(GRUB_ERR_BAD_COMPRESSED_DATA, "xz: unexpected end of file");
+				return grub_errno;
+			}
+			x->ibase = x->coff;
+			x->ilen = got;
+		}
+		n = (grub_size_t)(x->ibase + x->ilen - x->coff);
+		if (n > len)
+			n = len;
+		grub_memcpy(p, x->ibuf + (x->coff - x->ibase), n);
+		p += n;
+		len -= n;
+		x->coff += n;
+	}
+	return GRUB_ERR_NONE;
+}
+
+/* Stream header or footer flags, the check type in the low bits.  */
+static int
+xz_flags_valid(const grub_uint8_t* flags)
+{
+	return flags[0] == 0 && (flags[1] & 0xf0) == 0;
+}
+
+/* Walk the streams from the end of the file, oldest first in STREAMS.  */
+static grub_err_t
+xz_find_streams(grub_file_t file, struct xz_stream** streams, grub_size_t* count)
+{
+	grub_uint64_t pos = grub_file_size(file);
+	grub_uint8_t buf[XZ_FOOTER_SIZE];
+	grub_size_t n = 0, max = 0;
+
+	*streams = NULL;
+	while (pos > 0)
+	{
+		struct xz_stream* st;
+		grub_uint32_t index_size;
+
+		/* Stream padding, in units of four zero bytes.  */
+		if (pos < XZ_HEADER_SIZE + XZ_FOOTER_SIZE || (pos & 3))
+			return xz_corrupt();
+		if (xz_pread(file, pos - 4, buf, 4))
+			return grub_errno;
+		if (grub_get_unaligned32(buf) == 0)
+		{
+			pos -= 4;
+			continue;
+		}
+
+		if (xz_pread(file, pos - XZ_FOOTER_SIZE, buf, XZ_FOOTER_SIZE))
+			return grub_errno;
+		if (buf[10] != 'Y' || buf[11] != 'Z' || !xz_flags_valid(buf + 8)
+			|| xz_crc32(buf + 4, 6) != grub_le_to_cpu32(grub_get_unaligned32(buf)))
+			return xz_corrupt();
+		index_size = (grub_le_to_cpu32(grub_get_unaligned32(buf + 4)) + 1) * 4;
+		if (pos < XZ_HEADER_SIZE + XZ_FOOTER_SIZE + (grub_uint64_t)index_size)
+			return xz_corrupt();
+
+		if (n == max)
+		{
+			max = max ? max * 2 : 4;
+			st = grub_realloc(*streams, max * sizeof(*st));
+			if (!st)
+				return grub_errno;
+			*streams = st;
+		}
+		/* Newer streams move up, this one goes first.  */
+		grub_memmove(*streams + 1, *streams, n * sizeof(**streams));
+		st = *streams;
+		st->index = pos - XZ_FOOTER_SIZE - index_size;
+		st->index_size = index_size;
+		n++;
+
+		/* The index tells where the stream starts.  */
+		{
+			grub_uint8_t* index = grub_malloc(index_size);
+			grub_uint64_t records, unpadded, usize, blocks = 0;
+			grub_size_t i = 1;
+
+			if (!index)
+				return grub_errno;
+			if (xz_pread(file, st->index, index, index_size)
+				|| index[0] != 0 || !xz_vli(index, index_size - 4, &i, &records))
+			{
+				grub_free(index);
+				return grub_errno ? grub_errno : xz_corrupt();
+			}
+			while (records--)
+			{
+				if (!xz_vli(index, index_size - 4, &i, &unpadded)
+					|| !xz_vli(index, index_size - 4, &i, &usize))
+				{
+					grub_free(index);
+					return xz_corrupt();
+				}
+				blocks += (unpadded + 3) & ~3ULL;
+			}
+			if (xz_crc32(index, index_size - 4)
+				!= grub_le_to_cpu32(grub_get_unaligned32(index + index_size - 4)))
+			{
+				grub_free(index);
+				return xz_corrupt();
+			}
+			grub_free(index);
+			if (st->index < XZ_HEADER_SIZE + blocks)
+				return xz_corrupt();
+			st->start = st->index - blocks - XZ_HEADER_SIZE;
+		}
+
+		st->check = buf[9] & 0x0f;
+		if (xz_pread(file, st->start, buf, XZ_HEADER_SIZE))
+			return grub_errno;
+		if (grub_memcmp(buf, xz_magic, sizeof(xz_magic)) != 0 || !xz_flags_valid(buf + 6)
+			|| xz_crc32(buf + 6, 2) != grub_le_to_cpu32(grub_get_unaligned32(buf + 8))
+			|| (buf[7] & 0x0f) != st->check)
+			return xz_corrupt();
+		pos = st->start;
+	}
+	*count = n;
+	return GRUB_ERR_NONE;
+}
+
+/* Build the block list from the stream indexes.  */
+static grub_err_t
+xz_load_index(struct grub_xzio* x)
+{
+	struct xz_stream* streams;
+	grub_size_t nstreams, s, max = 0;
+	grub_uint64_t uoff = 0;
+
+	if (xz_find_streams(x->file, &streams, &nstreams))
+	{
+		grub_free(streams);
+		return grub_errno;
+	}
+
+	for (s = 0; s < nstreams; s++)
+	{
+		grub_uint8_t* index;
+		grub_uint64_t records, unpadded, usize, coff;
+		grub_size_t i = 1;
+
+		index = grub_malloc(streams[s].index_size);
+		if (!index || xz_pread(x->file, streams[s].index, index, streams[s].index_size))
+			break;
+		xz_vli(index, streams[s].index_size, &i, &records);
+		coff = streams[s].start + XZ_HEADER_SIZE;
+		while (records--)
+		{
+			if (x->nblocks == max)
+			{
+				struct xz_block* b;
+
+				max = max ? max * 2 : 64;
+				b = grub_realloc(x->blocks, max * sizeof(*b));
+				if (!b)
+					break;
+				x->blocks = b;
+			}
+			xz_vli(index, streams[s].index_size, &i, &unpadded);
+			xz_vli(index, streams[s].index_size, &i, &usize);
+			x->blocks[x->nblocks].coff = coff;
+			x->blocks[x->nblocks].uoff = uoff;
+			x->blocks[x->nblocks].usize = usize;
+			x->blocks[x->nblocks].check = streams[s].check;
+			x->nblocks++;
+			coff += (unpadded + 3) & ~3ULL;
+			uoff += usize;
+		}
+		grub_free(index);
+		if (grub_errno)
+			break;
+	}
+	grub_free(streams);
+	return grub_errno;
+}
+
+static void
+lzma_reset(struct lzma_dec* s)
+{
+	grub_uint16_t* probs = (grub_uint16_t*)&s->probs;
+	grub_size_t i;
+
+	s->state = 0;
+	s->rep0 = s->rep1 = s->rep2 = s->rep3 = 0;
+	for (i = 0; i < sizeof(s->probs) / sizeof(probs[0]); i++)
+		probs[i] = LZMA_PROB_INIT;
+}
+
+static int
+lzma_props(struct lzma_dec* s, grub_uint8_t props)
+{
+	grub_uint32_t pb, lp;
+
+	if (props > (4 * 5 + 4) * 9 + 8)
+		return 0;
+	pb = props / (9 * 5);
+	props -= pb * 9 * 5;
+	lp = props / 9;
+	s->lc = props - lp * 9;
+	if (s->lc + lp > 4)
+		return 0;
+	s->pos_mask = (1U << pb) - 1;
+	s->literal_pos_mask = (1U << lp) - 1;
+	return 1;
+}
+
+static inline void
+rc_normalize(struct lzma_rc* rc)
+{
+	if (rc->range < RC_TOP)
+	{
+		rc->range <<= 8;
+		rc->code = (rc->code << 8) | (rc->in_pos < rc->in_size ? rc->in[rc->in_pos] : 0);
+		rc->in_pos++;
+	}
+}
+
+static inline int
+rc_bit(struct lzma_rc* rc, grub_uint16_t* prob)
+{
+	grub_uint32_t bound;
+
+	rc_normalize(rc);
+	bound = (rc->range >> RC_MODEL_BITS) * *prob;
+	if (rc->code < bound)
+	{
+		rc->range = bound;
+		*prob += (RC_MODEL_TOTAL - *prob) >> RC_MOVE_BITS;
+		return 0;
+	}
+	rc->range -= bound;
+	rc->code -= bound;
+	*prob -= *prob >> RC_MOVE_BITS;
+	return 1;
+}
+
+static inline grub_uint32_t
+rc_bittree(struct lzma_rc* rc, grub_uint16_t* probs, grub_uint32_t limit)
+{
+	grub_uint32_t symbol = 1;
+
+	do
+		symbol = (symbol << 1) + rc_bit(rc, &probs[symbol]);
+	while (symbol < limit);
+	return symbol;
+}
+
+static inline void
+rc_bittree_reverse(struct lzma_rc* rc, grub_uint16_t* probs,
+	grub_uint32_t* dest, grub_uint32_t limit)
+{
+	grub_uint32_t symbol = 1, i = 0;
+
+	do
+	{
+		if (rc_bit(rc, &probs[symbol]))
+		{
+			symbol = (symbol << 1) + 1;
+			*dest += 1U << i;
+		}
+		else
+			symbol <<= 1;
+	} while (++i < limit);
+}
+
+static inline void
+rc_direct(struct lzma_rc* rc, grub_uint32_t* dest, grub_uint32_t limit)
+{
+	grub_uint32_t mask;
+
+	do
+	{
+		rc_normalize(rc);
+		rc->range >>= 1;
+		rc->code -= rc->range;
+		mask = (grub_uint32_t)0 - (rc->code >> 31);
+		rc->code += rc->range & mask;
+		*dest = (*dest << 1) + (mask + 1);
+	} while (--limit > 0);
+}
+
+static inline grub_uint32_t
+dict_get(const struct lzma_dict* dict, grub_uint32_t dist)
+{
+	grub_size_t offset = dict->pos - dist - 1;
+
+	if (dist >= dict->pos)
+		offset += dict->size;
+	return dict->full > 0 ? dict->buf[offset] : 0;
+}
+
+static inline void
+dict_put(struct lzma_dict* dict, grub_uint8_t byte)
+{
+	dict->buf[dict->pos++] = byte;
+	if (dict->full < dict->pos)
+		dict->full = dict->pos;
+}
+
+/* Copy up to *LEN bytes from DIST + 1 back, the rest stays pending.  */
+static void
+dict_repeat(struct lzma_dict* dict, grub_uint32_t* len, grub_uint32_t dist)
+{
+	grub_size_t back, left;
+
+	left = dict->limit - dict->pos;
+	if (left > *len)
+		left = *len;
+	*len -= (grub_uint32_t)left;
+	back = dict->pos - dist - 1;
+	if (dist >= dict->pos)
+		back += dict->size;
+	do
+	{
+		dict->buf[dict->pos++] = dict->buf[back++];
+		if (back == dict->size)
+			back = 0;
+	} while (--left > 0);
+	if (dict->full < dict->pos)
+		dict->full = dict->pos;
+}
+
+static void
+lzma_literal(struct grub_xzio* x)
+{
+	struct lzma_dec* s = &x->lzma;
+	grub_uint16_t* probs;
+	grub_uint32_t symbol, match_byte, match_bit, offset, i;
+
+	i = (dict_get(&x->dict, 0) >> (8 - s->lc))
+		+ (((grub_uint32_t)x->dict.pos & s->literal_pos_mask) << s->lc);
+	probs = s->probs.literal[i];
+	if (s->state < LZMA_LIT_STATES)
+		symbol = rc_bittree(&x->rc, probs, 0x100);
+	else
+	{
+		symbol = 1;
+		match_byte = dict_get(&x->dict, s->rep0) << 1;
+		offset = 0x100;
+		do
+		{
+			match_bit = match_byte & offset;
+			match_byte <<= 1;
+			i = offset + match_bit + symbol;
+			if (rc_bit(&x->rc, &probs[i]))
+			{
+				symbol = (symbol << 1) + 1;
+				offset = match_bit;
+			}
+			else
+			{
+				symbol <<= 1;
+				offset &= ~match_bit;
+			}
+		} while (symbol < 0x100);
+	}
+	dict_put(&x->dict, (grub_uint8_t)symbol);
+
+	if (s->state <= 3)
+		s->state = 0;
+	else if (s->state <= 9)
+		s->state -= 3;
+	else
+		s->state -= 6;
+}
+
+static grub_uint32_t
+lzma_len(struct grub_xzio* x, struct lzma_len_dec* l, grub_uint32_t pos_state)
+{
+	grub_uint16_t* probs;
+	grub_uint32_t limit, len;
+
+	if (!rc_bit(&x->rc, &l->choice))
+	{
+		probs = l->low[pos_state];
+		limit = LZMA_LEN_LOW;
+		len = LZMA_MATCH_LEN_MIN;
+	}
+	else if (!rc_bit(&x->rc, &l->choice2))
+	{
+		probs = l->mid[pos_state];
+		limit = LZMA_LEN_MID;
+		len = LZMA_MATCH_LEN_MIN + LZMA_LEN_LOW;
+	}
+	else
+	{
+		probs = l->high;
+		limit = LZMA_LEN_HIGH;
+		len = LZMA_MATCH_LEN_MIN + LZMA_LEN_LOW + LZMA_LEN_MID;
+	}
+	return len + rc_bittree(&x->rc, probs, limit) - limit;
+}
+
+static void
+lzma_match(struct grub_xzio* x, grub_uint32_t pos_state)
+{
+	struct lzma_dec* s = &x->lzma;
+	grub_uint16_t* probs;
+	grub_uint32_t dist_slot, limit;
+
+	s->state = (s->state < LZMA_LIT_STATES) ? 7 : 10;
+	s->rep3 = s->rep2;
+	s->rep2 = s->rep1;
+	s->rep1 = s->rep0;
+	x->len = lzma_len(x, &s->probs.match_len, pos_state);
+
+	probs = s->probs.dist_slot[(x->len < LZMA_DIST_STATES + LZMA_MATCH_LEN_MIN)
+		? x->len - LZMA_MATCH_LEN_MIN : LZMA_DIST_STATES - 1];
+	dist_slot = rc_bittree(&x->rc, probs, LZMA_DIST_SLOTS) - LZMA_DIST_SLOTS;
+	if (dist_slot < LZMA_DIST_MODEL_START)
+	{
+		s->rep0 = dist_slot;
+		return;
+	}
+	limit = (dist_slot >> 1) - 1;
+	s->rep0 = 2 + (dist_slot & 1);
+	if (dist_slot < LZMA_DIST_MODEL_END)
+	{
+		s->rep0 <<= limit;
+		rc_bittree_reverse(&x->rc, s->probs.dist_special + s->rep0 - dist_slot - 1,
+			&s->rep0, limit);
+	}
+	else
+	{
+		rc_direct(&x->rc, &s->rep0, limit - LZMA_ALIGN_BITS);
+		s->rep0 <<= LZMA_ALIGN_BITS;
+		rc_bittree_reverse(&x->rc, s->probs.dist_align, &s->rep0, LZMA_ALIGN_BITS);
+	}
+}
+
+static void
+lzma_rep_match(struct grub_xzio* x, grub_uint32_t pos_state)
+{
+	struct lzma_dec* s = &x->lzma;
+	grub_uint32_t tmp;
+
+	if (!rc_bit(&x->rc, &s->probs.is_rep0[s->state]))
+	{
+		if (!rc_bit(&x->rc, &s->probs.is_rep0_long[s->state][pos_state]))
+		{
+			s->state = (s->state < LZMA_LIT_STATES) ? 9 : 11;
+			x->len = 1;
+			return;
+		}
+	}
+	else
+	{
+		if (!rc_bit(&x->rc, &s->probs.is_rep1[s->state]))
+			tmp = s->rep1;
+		else
+		{
+			if (!rc_bit(&x->rc, &s->probs.is_rep2[s->state]))
+				tmp = s->rep2;
+			else
+			{
+				tmp = s->rep3;
+				s->rep3 = s->rep2;
+			}
+			s->rep2 = s->rep1;
+		}
+		s->rep1 = s->rep0;
+		s->rep0 = tmp;
+	}
+	s->state = (s->state < LZMA_LIT_STATES) ? 8 : 11;
+	x->len = lzma_len(x, &s->probs.rep_len, pos_state);
+}
+
+/* Decode the current LZMA chunk until DICT.LIMIT.  */
+static grub_err_t
+lzma_main(struct grub_xzio* x)
+{
+	struct lzma_dec* s = &x->lzma;
+	struct lzma_dict* dict = &x->dict;
+	grub_uint32_t pos_state;
+
+	if (x->len)
+		dict_repeat(dict, &x->len, s->rep0);
+
+	while (dict->pos < dict->limit)
+	{
+		if (x->rc.in_pos > x->rc.in_size)
+			return xz_corrupt();
+		pos_state = (grub_uint32_t)dict->pos & s->pos_mask;
+		if (!rc_bit(&x->rc, &s->probs.is_match[s->state][pos_state]))
+		{
+			lzma_literal(x);
+			continue;
+		}
+		if (rc_bit(&x->rc, &s->probs.is_rep[s->state]))
+			lzma_rep_match(x, pos_state);
+		else
+			lzma_match(x, pos_state);
+		if (s->rep0 >= dict->full)
+			return xz_corrupt();
+		dict_repeat(dict, &x->len, s->rep0);
+	}
+	/* The last byte of a chunk is only read by normalizing.  */
+	rc_normalize(&x->rc);
+	return GRUB_ERR_NONE;
+}
+
+/* Parse the header of block X->BLOCK and get ready for its first chunk.  */
+static grub_err_t
+xz_start_block(struct grub_xzio* x)
+{
+	struct xz_block* b = &x->blocks[x->block];
+	grub_uint8_t hdr[1024];
+	grub_uint64_t val, id, props_size;
+	grub_size_t size, pos = 2, need;
+	grub_uint8_t d;
+
+	x->coff = b->coff;
+	x->uoff = b->uoff;
+	if (xz_read_in(x, hdr, 1))
+		return grub_errno;
+	size = ((grub_size_t)hdr[0] + 1) * 4;
+	if (hdr[0] == 0 || xz_read_in(x, hdr + 1, size - 1))
+		return grub_errno ? grub_errno : xz_corrupt();
+	if (xz_crc32(hdr, size - 4) != grub_le_to_cpu32(grub_get_unaligned32(hdr + size - 4))
+		|| (hdr[1] & 0x3c))
+		return xz_corrupt();
+	if ((hdr[1] & 0x40) && !xz_vli(hdr, size - 4, &pos, &val))
+		return xz_corrupt();
+	if ((hdr[1] & 0x80) && !xz_vli(hdr, size - 4, &pos, &val))
+		return xz_corrupt();
+	if ((hdr[1] & 0x03) != 0 || !xz_vli(hdr, size - 4, &pos, &id)
+		|| !xz_vli(hdr, size - 4, &pos, &props_size))
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "xz: only plain LZMA2 blocks are supported");
+	if (id != XZ_FILTER_LZMA2 || props_size != 1 || pos >= size - 4 || hdr[pos] > 40)
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "xz: only plain LZMA2 blocks are supported");
+	d = hdr[pos];
+
+	/* No need for a dictionary larger than the block, rounded to keep
+	   the position bits of the ring position right.  */
+	val = (d == 40) ? 0xffffffff : ((grub_uint64_t)(2 | (d & 1)) << (d / 2 + 11));
+	if (val > b->usize)
+		val = b->usize;
+	need = ((grub_size_t)val + 4095) & ~(grub_size_t)4095;
+	if (need == 0)
+		need = 4096;
+	if (need > XZ_DICT_MAX)
+		return grub_error(GRUB_ERR_OUT_OF_MEMORY, "xz: dictionary too large");
+	if (need > x->dict.alloc)
+	{
+		grub_free(x->dict.buf);
+		x->dict.alloc = 0;
+		x->dict.buf = grub_malloc(need);
+		if (!x->dict.buf)
+			return grub_errno;
+		x->dict.alloc = need;
+	}
+	x->dict.size = need;
+	x->dict.start = x->dict.pos = x->dict.full = 0;
+
+	x->coff = b->coff + size;
+	x->block_done = 0;
+	x->chunk_left = 0;
+	x->len = 0;
+	x->lzma.need_dict_reset = 1;
+	x->lzma.need_props = 1;
+	xz_check_init(&x->check, b->check);
+	return GRUB_ERR_NONE;
+}
+
+/* Compare the check after the block padding with what was decoded.  */
+static grub_err_t
+xz_verify_block(struct grub_xzio* x)
+{
+	struct xz_block* b = &x->blocks[x->block];
+	grub_uint8_t field[64];
+	grub_uint8_t pad[3];
+	grub_size_t npad = (grub_size_t)((4 - ((x->coff - b->coff) & 3)) & 3);
+	grub_size_t size = xz_check_size[b->check];
+	grub_uint8_t sum[32];
+	grub_uint32_t v32;
+	grub_uint64_t v64;
+
+	if (xz_read_in(x, pad, npad) || xz_read_in(x, field, size))
+		return grub_errno;
+	while (npad--)
+	{
+		if (pad[npad])
+			return xz_corrupt();
+	}
+	switch (x->check.type)
+	{
+	case XZ_CHECK_CRC32:
+		v32 = grub_cpu_to_le32(x->check.u.crc32);
+		grub_memcpy(sum, &v32, 4);
+		break;
+	case XZ_CHECK_CRC64:
+		v64 = grub_cpu_to_le64(x->check.u.crc64);
+		grub_memcpy(sum, &v64, 8);
+		break;
+	case XZ_CHECK_SHA256:
+		sha256_final(&x->check.u.sha256, sum);
+		break;
+	default:
+		/* None, or a type this reader cannot compute.  */
+		return GRUB_ERR_NONE;
+	}
+	if (grub_memcmp(sum, field, size) != 0)
+		return grub_error(GRUB_ERR_BAD_COMPRESSED_DATA, "xz: check mismatch in block %llu",
+			(unsigned long long)x->block);
+	return GRUB_ERR_NONE;
+}
+
+/* Read the next LZMA2 chunk header, and the data of an LZMA chunk.  */
+static grub_err_t
+xz_next_chunk(struct grub_xzio* x)
+{
+	struct lzma_dec* s = &x->lzma;
+	grub_uint8_t hdr[5];
+	grub_uint8_t control;
+	grub_uint32_t csize;
+
+	if (xz_read_in(x, &control, 1))
+		return grub_errno;
+	if (control == 0x00)
+	{
+		x->block_done = 1;
+		if (x->uoff + (x->dict.pos - x->dict.start)
+			!= x->blocks[x->block].uoff + x->blocks[x->block].usize)
+			return xz_corrupt();
+		return xz_verify_block(x);
+	}
+
+	if (control >= 0xe0 || control == 0x01)
+	{
+		s->need_props = 1;
+		s->need_dict_reset = 0;
+		x->dict.start = x->dict.pos = x->dict.full = 0;
+	}
+	else if (s->need_dict_reset)
+		return xz_corrupt();
+
+	if (control < 0x80)
+	{
+		if (control > 0x02 || xz_read_in(x, hdr, 2))
+			return grub_errno ? grub_errno : xz_corrupt();
+		x->chunk_left = ((grub_uint32_t)hdr[0] << 8) + hdr[1] + 1;
+		x->chunk_lzma = 0;
+		return GRUB_ERR_NONE;
+	}
+
+	if (xz_read_in(x, hdr, (control >= 0xc0) ? 5 : 4))
+		return grub_errno;
+	x->chunk_left = ((grub_uint32_t)(control & 0x1f) << 16) + ((grub_uint32_t)hdr[0] << 8) + hdr[1] + 1;
+	csize = ((grub_uint32_t)hdr[2] << 8) + hdr[3] + 1;
+	if (control >= 0xc0)
+	{
+		if (!lzma_props(s, hdr[4]))
+			return xz_corrupt();
+		s->need_props = 0;
+		lzma_reset(s);
+	}
+	else if (s->need_props)
+		return xz_corrupt();
+	else if (control >= 0xa0)
+		lzma_reset(s);
+
+	if (csize < 5 || xz_read_in(x, x->chunk, csize))
+		return grub_errno ? grub_errno : xz_corrupt();
+	if (x->chunk[0] != 0)
+		return xz_corrupt();
+	x->rc.in = x->chunk;
+	x->rc.in_size = csize;
+	x->rc.in_pos = 5;
+	x->rc.range = 0xffffffff;
+	x->rc.code = grub_be_to_cpu32(grub_get_unaligned32(x->chunk + 1));
+	x->chunk_lzma = 1;
+	return GRUB_ERR_NONE;
+}
+
+/* Remember the state between two chunks.  */
+static void
+xz_snapshot(struct grub_xzio* x)
+{
+	struct xz_snapshot* snap;
+	grub_size_t size = sizeof(*snap) + x->dict.full;
+
+	if (!grub_seekpt_want(&x->points, x->uoff, size))
+		return;
+	snap = grub_malloc(size);
+	if (!snap)
+	{
+		grub_errno = GRUB_ERR_NONE;
+		return;
+	}
+	snap->block = x->block;
+	snap->dict_size = x->dict.size;
+	snap->dict_pos = x->dict.pos;
+	snap->dict_full = x->dict.full;
+	snap->lzma = x->lzma;
+	snap->check = x->check;
+	grub_memcpy(snap + 1, x->dict.buf, x->dict.full);
+	grub_seekpt_add(&x->points, x->uoff, x->coff, snap, size);
+	grub_errno = GRUB_ERR_NONE;
+}
+
+static grub_err_t
+xz_restore(struct grub_xzio* x, const struct grub_seekpt* pt)
+{
+	const struct xz_snapshot* snap = pt->state;
+	grub_size_t lo = 0, hi = x->nblocks, mid;
+
+	if (!snap)
+	{
+		/* Start of a block.  */
+		while (hi - lo > 1)
+		{
+			mid = (lo + hi) / 2;
+			if (x->blocks[mid].coff <= pt->coff)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		x->block = lo;
+		return xz_start_block(x);
+	}
+
+	if (snap->dict_size > x->dict.alloc)
+	{
+		grub_free(x->dict.buf);
+		x->dict.alloc = 0;
+		x->dict.buf = grub_malloc(snap->dict_size);
+		if (!x->dict.buf)
+			return grub_errno;
+		x->dict.alloc = snap->dict_size;
+	}
+	x->block = snap->block;
+	x->block_done = 0;
+	x->dict.size = snap->dict_size;
+	x->dict.start = x->dict.pos = snap->dict_pos;
+	x->dict.full = snap->dict_full;
+	grub_memcpy(x->dict.buf, snap + 1, snap->dict_full);
+	x->lzma = snap->lzma;
+	x->check = snap->check;
+	x->chunk_left = 0;
+	x->len = 0;
+	x->coff = pt->coff;
+	x->uoff = pt->uoff;
+	return GRUB_ERR_NONE;
+}
+
+/* Decode more data, called when everything decoded has been handed out.  */
+static grub_err_t
+xz_fill(struct grub_xzio* x)
+{
+	struct lzma_dict* dict = &x->dict;
+	grub_size_t old;
+
+	while (dict->pos == dict->start)
+	{
+		if (dict->pos == dict->size)
+			dict->start = dict->pos = 0;
+
+		if (x->chunk_left == 0)
+		{
+			if (x->block_done)
+			{
+				if (x->block + 1 >= x->nblocks)
+					return grub_error(GRUB_ERR_OUT_OF_RANGE, "xz: read past the end");
+				x->block++;
+				if (xz_start_block(x))
+					return grub_errno;
+				continue;
+			}
+			xz_snapshot(x);
+			if (xz_next_chunk(x))
+				return grub_errno;
+			continue;
+		}
+
+		old = dict->pos;
+		dict->limit = dict->size;
+		if (dict->limit - dict->pos > x->chunk_left)
+			dict->limit = dict->pos + x->chunk_left;
+		if (x->chunk_lzma)
+		{
+			if (lzma_main(x))
+				return grub_errno;
+		}
+		else
+		{
+			if (xz_read_in(x, dict->buf + dict->pos, dict->limit - dict->pos))
+				return grub_errno;
+			dict->pos = dict->limit;
+			if (dict->full < dict->pos)
+				dict->full = dict->pos;
+		}
+		xz_check_update(&x->check, dict->buf + old, dict->pos - old);
+		x->chunk_left -= (grub_uint32_t)(dict->pos - old);
+
+		if (x->chunk_left == 0 && x->chunk_lzma
+			&& (x->len || x->rc.code || x->rc.in_pos != x->rc.in_size))
+			return xz_corrupt();
+	}
+
+	/* Finish the block as soon as its last byte is decoded, a read that
+	   ends with the file still gets the check of the last block.  */
+	if (x->chunk_left == 0 && !x->block_done
+		&& x->uoff + (dict->pos - dict->start) == x->blocks[x->block].uoff + x->blocks[x->block].usize)
+		return xz_next_chunk(x);
+	return GRUB_ERR_NONE;
+}
+
+/* Make TARGET the next decompressed byte handed out.  */
+static grub_err_t
+xz_seek(struct grub_xzio* x, grub_uint64_t target)
+{
+	const struct grub_seekpt* pt;
+	grub_size_t n;
+
+	if (target == x->uoff)
+		return GRUB_ERR_NONE;
+	pt = grub_seekpt_lookup(&x->points, x->uoff, target);
+	if (pt && xz_restore(x, pt))
+		return grub_errno;
+	while (x->uoff < target)
+	{
+		n = x->dict.pos - x->dict.start;
+		if (n == 0)
+		{
+			if (xz_fill(x))
+				return grub_errno;
+			continue;
+		}
+		if (n > target - x->uoff)
+			n = (grub_size_t)(target - x->uoff);
+		x->dict.start += n;
+		x->uoff += n;
+	}
+	return GRUB_ERR_NONE;
+}
+
+static grub_ssize_t
+grub_xzio_read(grub_file_t file, char* buf, grub_size_t len)
+{
+	struct grub_xzio* x = file->data;
+	grub_ssize_t ret = 0;
+	grub_size_t n;
+
+	if (xz_seek(x, file->offset))
+		goto fail;
+	while (len)
+	{
+		n = x->dict.pos - x->dict.start;
+		if (n == 0)
+		{
+			if (xz_fill(x))
+				goto fail;
+			continue;
+		}
+		if (n > len)
+			n = len;
+		grub_memcpy(buf, x->dict.buf + x->dict.start, n);
+		x->dict.start += n;
+		x->uoff += n;
+		buf += n;
+		len -= n;
+		ret += n;
+	}
+	return ret;
+
+fail:
+	/* The decoder state is unknown, resume from a point next time.  */
+	x->dict.start = x->dict.pos;
+	x->uoff = ~(grub_uint64_t)0;
+	return -1;
+}
+
+static void
+xz_free(struct grub_xzio* x)
+{
+	grub_seekpt_free(&x->points);
+	grub_free(x->blocks);
+	grub_free(x->ibuf);
+	grub_free(x->chunk);
+	grub_free(x->dict.buf);
+	grub_free(x);
+}
+
+static grub_err_t
+grub_xzio_close(grub_file_t file)
+{
+	struct grub_xzio* x = file->data;
+
+	grub_file_close(x->file);
+	xz_free(x);
+	file->disk = 0;
+	return grub_errno;
+}
+
+static grub_file_t
+grub_xzio_open(grub_file_t io, enum grub_file_type type)
+{
+	struct grub_xzio* x;
+	grub_file_t file;
+	grub_uint8_t magic[sizeof(xz_magic)];
+	grub_size_t i;
+
+	if (type & GRUB_FILE_TYPE_NO_DECOMPRESS)
+		return io;
+	grub_file_seek(io, 0);
+	if (grub_file_read(io, magic, sizeof(magic)) != sizeof(magic)
+		|| grub_memcmp(magic, xz_magic, sizeof(magic)) != 0)
+	{
+		grub_file_seek(io, 0);
+		grub_errno = GRUB_ERR_NONE;
+		return io;
+	}
+	if (grub_file_size(io) == GRUB_FILE_SIZE_UNKNOWN)
+	{
+		grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "xz: input size unknown");
+		return 0;
+	}
+
+	x = grub_zalloc(sizeof(*x));
+	file = grub_zalloc(sizeof(*file));
+	if (!x || !file)
+	{
+		grub_free(x);
+		grub_free(file);
+		return 0;
+	}
+	x->file = io;
+	grub_seekpt_init(&x->points);
+	x->ibuf = grub_malloc(XZ_IN_SIZE);
+	x->chunk = grub_malloc(LZMA2_CHUNK_MAX);
+	if (!x->ibuf || !x->chunk || xz_load_index(x))
+		goto fail;
+
+	/* Every block starts afresh.  */
+	for (i = 0; i < x->nblocks; i++)
+	{
+		if (grub_seekpt_add(&x->points, x->blocks[i].uoff, x->blocks[i].coff, NULL, 0))
+			goto fail;
+	}
+	x->uoff = ~(grub_uint64_t)0;
+
+	file->disk = io->disk;
+	file->borrowed_disk = 1;
+	file->data = x;
+	file->fs = &grub_xzio_fs;
+	file->size = x->nblocks ? x->blocks[x->nblocks - 1].uoff + x->blocks[x->nblocks - 1].usize : 0;
+	file->not_easily_seekable = 0;
+	return file;
+
+fail:
+	xz_free(x);
+	grub_free(file);
+	return 0;
+}
+
+static struct grub_fs grub_xzio_fs =
+{
+	.name = "xzio",
+	.fs_dir = 0,
+	.fs_open = 0,
+	.fs_read = grub_xzio_read,
+	.fs_close = grub_xzio_close,
+	.fs_label = 0,
+	.next = 0
+};
+
+GRUB_MOD_INIT(xzio)
+{
+	xz_crc_init();
+	grub_file_filter_register(GRUB_FILE_FILTER_XZIO, grub_xzio_open);
+}
+
+GRUB_MOD_FINI(xzio)
+{
+	grub_file_filter_unregister(GRUB_FILE_FILTER_XZIO);
+}
@@ -0,0 +1,1522 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Streaming .zst decompression with random access.
+ *
+ * Frames are found at open, from the seek table of the seekable format
+ * when there is one and by walking the block headers otherwise, and every
+ * frame is a restart point.  Within a frame the decoder is snapshotted at
+ * block boundaries (see seekpt.h).  Dictionaries are not supported.  The
+ * content checksum of a frame is verified when its last block is decoded;
+ * the running hash is part of a snapshot, so reads that seek are verified
+ * as well.
+ */
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/err.h>
+#include <grub/file.h>
+#include <grub/fs.h>
+#include <grub/seekpt.h>
+
+GRUB_MOD_LICENSE("GPLv3+");
+
+#define ZSTD_MAGIC		0xfd2fb528
+#define ZSTD_SKIP_MAGIC		0x184d2a50
+#define ZSTD_SKIP_MASK		0xfffffff0
+#define ZSTD_SEEKABLE_MAGIC	0x8f92eab1
+#define ZSTD_SEEKTABLE_MAGIC	0x184d2a5e
+
+#define ZSTD_BLOCK_MAX		(128U << 10)
+/* Largest window allocated for a frame.  */
+#define ZSTD_WINDOW_MAX		(128U << 20)
+/* Room decoded past the window before it is moved back.  */
+#define ZSTD_SLIDE_MAX		(16U << 20)
+/* Input buffer.  */
+#define ZSTD_IN_SIZE		(64U << 10)
+
+#define ZSTD_HUF_LOG_MAX	11
+#define ZSTD_FSE_LOG_MAX	9
+#define ZSTD_LL_LOG_MAX		9
+#define ZSTD_OF_LOG_MAX		8
+#define ZSTD_ML_LOG_MAX		9
+#define ZSTD_LL_MAX		35
+#define ZSTD_OF_MAX		31
+#define ZSTD_ML_MAX		52
+
+static const grub_int16_t ll_default[ZSTD_LL_MAX + 1] =
+{
+	4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+	-1, -1, -1, -1
+};
+
+static const grub_int16_t of_default[ZSTD_OF_MAX - 2] =
+{
+	1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+static const grub_int16_t ml_default[ZSTD_ML_MAX + 1] =
+{
+	1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+	-1, -1, -1, -1, -1
+};
+
+static const grub_uint32_t ll_base[ZSTD_LL_MAX + 1] =
+{
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+	8192, 16384, 32768, 65536
+};
+
+static const grub_uint8_t ll_bits[ZSTD_LL_MAX + 1] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+	13, 14, 15, 16
+};
+
+static const grub_uint32_t ml_base[ZSTD_ML_MAX + 1] =
+{
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+	19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+	35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+	4099, 8195, 16387, 32771, 65539
+};
+
+static const grub_uint8_t ml_bits[ZSTD_ML_MAX + 1] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+	12, 13, 14, 15, 16
+};
+
+struct zstd_huf
+{
+	grub_uint8_t sym[1 << ZSTD_HUF_LOG_MAX];
+	grub_uint8_t bits[1 << ZSTD_HUF_LOG_MAX];
+	int log;
+};
+
+struct zstd_fse
+{
+	grub_uint8_t sym[1 << ZSTD_FSE_LOG_MAX];
+	grub_uint8_t bits[1 << ZSTD_FSE_LOG_MAX];
+	grub_uint16_t base[1 << ZSTD_FSE_LOG_MAX];
+	int log;
+	int valid;
+};
+
+/* Entropy state carried from block to block, what a snapshot saves.  */
+struct zstd_state
+{
+	grub_uint32_t rep[3];
+	int have_huf;
+	struct zstd_huf huf;
+	struct zstd_fse ll;
+	struct zstd_fse of;
+	struct zstd_fse ml;
+};
+
+/* Running XXH64 of the frame content, seed 0.  */
+struct zstd_xxh64
+{
+	grub_uint64_t v[4];
+	grub_uint64_t len;
+	grub_uint8_t buf[32];
+};
+
+struct zstd_frame
+{
+	grub_uint64_t coff;
+	grub_uint64_t uoff;
+	grub_uint64_t usize;
+};
+
+struct zstd_header
+{
+	grub_size_t size;
+	grub_uint64_t window;
+	grub_uint64_t content;
+	int has_content;
+	int checksum;
+};
+
+struct zstd_snapshot
+{
+	grub_size_t frame;
+	grub_size_t window;
+	grub_uint64_t frame_pos;
+	int checksum;
+	grub_size_t hist;
+	struct zstd_state st;
+	struct zstd_xxh64 xxh;
+	/* Followed by HIST bytes of window.  */
+};
+
+/* Backward bit stream, POS bits left.  */
+struct zstd_bits
+{
+	const grub_uint8_t* buf;
+	grub_size_t len;
+	grub_int64_t pos;
+};
+
+struct grub_zstdio
+{
+	grub_file_t file;
+	struct zstd_frame* frames;
+	grub_size_t nframes;
+	grub_size_t frame;
+	int frame_done;
+	int checksum;
+	grub_uint64_t content;
+	grub_uint64_t frame_pos;
+	/* Decompressed offset of START.  */
+	grub_uint64_t uoff;
+
+	/* Next byte of FILE to decode, IBUF holds ILEN bytes from IBASE.  */
+	grub_uint64_t coff;
+	grub_uint8_t* ibuf;
+	grub_uint64_t ibase;
+	grub_size_t ilen;
+
+	grub_uint8_t* block;
+	grub_uint8_t* lit;
+	grub_size_t lit_len;
+
+	/* Output, [START, POS) is decoded but not handed out yet, the frame
+	   history before POS goes back to BASE.  */
+	grub_uint8_t* buf;
+	grub_size_t size;
+	grub_size_t window;
+	grub_size_t base;
+	grub_size_t start;
+	grub_size_t pos;
+
+	struct zstd_state st;
+	struct zstd_xxh64 xxh;
+	struct grub_seekpt_list points;
+};
+
+static struct grub_fs grub_zstdio_fs;
+
+static grub_err_t
+zstd_corrupt(void)
+{
+	return grub_error(GRUB_ERR_BAD_COMPRESSED_DATA, "zstd: corrupted data");
+}
+
+static inline int
+zstd_highbit(grub_uint32_t v)
+{
+	int n = 0;
+
+	while (v >>= 1)
+		n++;
+	return n;
+}
+
+static inline grub_uint32_t
+zstd_le24(const grub_uint8_t* p)
+{
+	return p[0] | ((grub_uint32_t)p[1] << 8) | ((grub_uint32_t)p[2] << 16);
+}
+
+static grub_err_t
+zstd_pread(grub_file_t file, grub_uint64_t ofs, void* buf, grub_size_t len)
+{
+	grub_file_seek(file, ofs);
+	if (grub_file_read(file, buf, len) != (grub_ssize_t)len)
+	{
+		if (!grub_errno)
+			grub_error(GRUB_ERR_BAD_COMPRESSED_DATA, "zstd: unexpected end of file");
+		return grub_errno;
+	}
+	return GRUB_ERR_NONE;
+}
+
+/* Read LEN bytes at Z->COFF through the input buffer.  */
+static grub_err_t
+zstd_read_in(struct grub_zstdio* z, void* buf, grub_size_t len)
+{
+	grub_uint8_t* p = buf;
+	grub_size_t n;
+
+	while (len)
+	{
+		if (z->coff < z->ibase || z->coff >= z->ibase + z->ilen)
+		{
+			grub_ssize_t got;
+
+			grub_file_seek(z->file, z->coff);
+			got = grub_file_read(z->file, z->ibuf, ZSTD_IN_SIZE);
+			if (got <= 0)
+			{
+				if (!grub_errno)
+					grub_error(GRUB_ERR_BAD_COMPRESSED_DATA, "zstd: unexpected end of file");
+				return grub_errno;
+			}
+			z->ibase = z->coff;
+			z->ilen = got;
+		}
+		n = (grub_size_t)(z->ibase + z->ilen - z->coff);
+		if (n > len)
+			n = len;
+		grub_memcpy(p, z->ibuf + (z->coff - z->ibase), n);
+		p += n;
+		len -= n;
+		z->coff += n;
+	}
+	return GRUB_ERR_NONE;
+}
+
+#define XXH_P1	0x9e3779b185ebca87ULL
+#define XXH_P2	0xc2b2ae3d27d4eb4fULL
+#define XXH_P3	0x165667b19e3779f9ULL
+#define XXH_P4	0x85ebca77c2b2ae63ULL
+#define XXH_P5	0x27d4eb2f165667c5ULL
+
+#define XXH_ROL(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline grub_uint64_t
+xxh64_round(grub_uint64_t acc, grub_uint64_t input)
+{
+	acc += input * XXH_P2;
+	return XXH_ROL(acc, 31) * XXH_P1;
+}
+
+static inline grub_uint64_t
+xxh64_merge(grub_uint64_t acc, grub_uint64_t v)
+{
+	acc ^= xxh64_round(0, v);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static void
+xxh64_init(struct zstd_xxh64* s)
+{
+	s->v[0] = XXH_P1 + XXH_P2;
+	s->v[1] = XXH_P2;
+	s->v[2] = 0;
+	s->v[3] = (grub_uint64_t)0 - XXH_P1;
+	s->len = 0;
+}
+
+static void
+xxh64_stripe(struct zstd_xxh64* s, const grub_uint8_t* p)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		s->v[i] = xxh64_round(s->v[i], grub_le_to_cpu64(grub_get_unaligned64(p + i * 8)));
+}
+
+static void
+xxh64_update(struct zstd_xxh64* s, const grub_uint8_t* buf, grub_size_t size)
+{
+	grub_size_t fill = (grub_size_t)(s->len & 31), n;
+
+	s->len += size;
+	if (fill)
+	{
+		n = 32 - fill;
+		if (n > size)
+			n = size;
+		grub_memcpy(s->buf + fill, buf, n);
+		buf += n;
+		size -= n;
+		if (fill + n < 32)
+			return;
+		xxh64_stripe(s, s->buf);
+	}
+	for (; size >= 32; buf += 32, size -= 32)
+		xxh64_stripe(s, buf);
+	grub_memcpy(s->buf, buf, size);
+}
+
+static grub_uint64_t
+xxh64_digest(const struct zstd_xxh64* s)
+{
+	const grub_uint8_t* p = s->buf;
+	grub_size_t left = (grub_size_t)(s->len & 31);
+	grub_uint64_t h;
+	int i;
+
+	if (s->len >= 32)
+	{
+		h = XXH_ROL(s->v[0], 1) + XXH_ROL(s->v[1], 7)
+			+ XXH_ROL(s->v[2], 12) + XXH_ROL(s->v[3], 18);
+		for (i = 0; i < 4; i++)
+			h = xxh64_merge(h, s->v[i]);
+	}
+	else
+		h = XXH_P5;
+	h += s->len;
+	for (; left >= 8; p += 8, left -= 8)
+	{
+		h ^= xxh64_round(0, grub_le_to_cpu64(grub_get_unaligned64(p)));
+		h = XXH_ROL(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (left >= 4)
+	{
+		h ^= grub_le_to_cpu32(grub_get_unaligned32(p)) * XXH_P1;
+		h = XXH_ROL(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+		left -= 4;
+	}
+	while (left--)
+	{
+		h ^= *p++ * XXH_P5;
+		h = XXH_ROL(h, 11) * XXH_P1;
+	}
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	return h ^ (h >> 32);
+}
+
+/* Eight bytes from BUF[I], zero past the end.  */
+static inline grub_uint64_t
+zstd_load(const grub_uint8_t* buf, grub_size_t len, grub_size_t i)
+{
+	grub_uint64_t v = 0;
+	grub_size_t k;
+
+	if (i + 8 <= len)
+		return grub_le_to_cpu64(grub_get_unaligned64(buf + i));
+	for (k = 0; i + k < len; k++)
+		v |= (grub_uint64_t)buf[i + k] << (8 * k);
+	return v;
+}
+
+/* N bits forward from bit *POS.  */
+static inline grub_uint32_t
+zstd_fwd(const grub_uint8_t* buf, grub_size_t len, grub_size_t* pos, int n)
+{
+	grub_uint64_t v = zstd_load(buf, len, *pos >> 3) >> (*pos & 7);
+
+	*pos += n;
+	return (grub_uint32_t)(v & ((1ULL << n) - 1));
+}
+
+/* Start a backward stream, the last byte holds a padding marker.  */
+static int
+zstd_bits_init(struct zstd_bits* b, const grub_uint8_t* buf, grub_size_t len)
+{
+	if (len == 0 || buf[len - 1] == 0)
+		return 0;
+	b->buf = buf;
+	b->len = len;
+	b->pos = (grub_int64_t)len * 8 - (8 - zstd_highbit(buf[len - 1]));
+	return 1;
+}
+
+/* N bits backward, zero bits past the start.  */
+static inline grub_uint32_t
+zstd_bits(struct zstd_bits* b, int n)
+{
+	grub_uint64_t v;
+
+	if (n == 0)
+		return 0;
+	b->pos -= n;
+	if (b->pos < 0)
+	{
+		if (b->pos + n <= 0)
+			return 0;
+		v = zstd_load(b->buf, b->len, 0) & ((1ULL << (n + b->pos)) - 1);
+		return (grub_uint32_t)(v << -b->pos);
+	}
+	v = zstd_load(b->buf, b->len, (grub_size_t)(b->pos >> 3)) >> (b->pos & 7);
+	return (grub_uint32_t)(v & ((1ULL << n) - 1));
+}
+
+static void
+zstd_fse_build(struct zstd_fse* t, const grub_int16_t* freq, int nsym, int log)
+{
+	grub_uint16_t next[256];
+	grub_uint32_t size = 1U << log, high = size, pos = 0, i, step, mask;
+	int s, k;
+
+	for (s = 0; s < nsym; s++)
+	{
+		if (freq[s] == -1)
+		{
+			t->sym[--high] = (grub_uint8_t)s;
+			next[s] = 1;
+		}
+	}
+	step = (size >> 1) + (size >> 3) + 3;
+	mask = size - 1;
+	for (s = 0; s < nsym; s++)
+	{
+		if (freq[s] <= 0)
+			continue;
+		for (k = 0; k < freq[s]; k++)
+		{
+			t->sym[pos] = (grub_uint8_t)s;
+			do
+				pos = (pos + step) & mask;
+			while (pos >= high);
+		}
+		next[s] = freq[s];
+	}
+	for (i = 0; i < size; i++)
+	{
+		grub_uint16_t n = next[t->sym[i]]++;
+
+		t->bits[i] = (grub_uint8_t)(log - zstd_highbit(n));
+		t->base[i] = (grub_uint16_t)((n << t->bits[i]) - size);
+	}
+	t->log = log;
+	t->valid = 1;
+}
+
+/* Read an FSE table description, returns the bytes used or 0.  */
+static grub_size_t
+zstd_fse_header(struct zstd_fse* t, const grub_uint8_t* src, grub_size_t len,
+	int max_log, int max_sym)
+{
+	grub_int16_t freq[256];
+	grub_size_t pos = 0;
+	grub_int32_t remaining;
+	int log, nsym = 0;
+
+	if (len == 0)
+		return 0;
+	log = zstd_fwd(src, len, &pos, 4) + 5;
+	if (log > max_log)
+		return 0;
+	remaining = 1 << log;
+	while (remaining > 0 && nsym <= max_sym)
+	{
+		int bits = zstd_highbit(remaining + 1) + 1;
+		grub_uint32_t val = zstd_fwd(src, len, &pos, bits);
+		grub_uint32_t lower = (1U << (bits - 1)) - 1;
+		grub_uint32_t threshold = (1U << bits) - 1 - (remaining + 1);
+		grub_int32_t proba;
+
+		if ((val & lower) < threshold)
+		{
+			pos--;
+			val &= lower;
+		}
+		else if (val > lower)
+			val -= threshold;
+		proba = (grub_int32_t)val - 1;
+		remaining -= proba < 0 ? -proba : proba;
+		freq[nsym++] = (grub_int16_t)proba;
+		if (proba == 0)
+		{
+			grub_uint32_t repeat, k;
+
+			do
+			{
+				repeat = zstd_fwd(src, len, &pos, 2);
+				for (k = 0; k < repeat && nsym <= max_sym; k++)
+					freq[nsym++] = 0;
+			} while (repeat == 3);
+		}
+	}
+	pos = (pos + 7) / 8;
+	if (remaining != 0 || pos > len)
+		return 0;
+	zstd_fse_build(t, freq, nsym, log);
+	return pos;
+}
+
+/* Huffman weights compressed with FSE, returns their count or 0.  */
+static grub_size_t
+zstd_huf_weights(const grub_uint8_t* src, grub_size_t len, grub_uint8_t* w)
+{
+	struct zstd_fse t;
+	struct zstd_bits b;
+	grub_uint32_t s1, s2;
+	grub_size_t used, n = 0;
+
+	used = zstd_fse_header(&t, src, len, 6, 255);
+	if (!used || !zstd_bits_init(&b, src + used, len - used))
+		return 0;
+	s1 = zstd_bits(&b, t.log);
+	s2 = zstd_bits(&b, t.log);
+	while (n < 254)
+	{
+		w[n++] = t.sym[s1];
+		s1 = t.base[s1] + zstd_bits(&b, t.bits[s1]);
+		if (b.pos < 0)
+		{
+			w[n++] = t.sym[s2];
+			return n;
+		}
+		w[n++] = t.sym[s2];
+		s2 = t.base[s2] + zstd_bits(&b, t.bits[s2]);
+		if (b.pos < 0)
+		{
+			w[n++] = t.sym[s1];
+			return n;
+		}
+	}
+	return 0;
+}
+
+/* Read a Huffman tree description, returns the bytes used or 0.  */
+static grub_size_t
+zstd_huf_table(struct zstd_huf* h, const grub_uint8_t* src, grub_size_t len)
+{
+	grub_uint8_t w[256], bits[256];
+	grub_uint32_t rank_count[ZSTD_HUF_LOG_MAX + 1], rank[ZSTD_HUF_LOG_MAX + 1];
+	grub_uint32_t sum = 0, left, code, n;
+	grub_size_t used, count, i;
+	int log;
+
+	if (len == 0)
+		return 0;
+	if (src[0] >= 128)
+	{
+		count = src[0] - 127;
+		used = 1 + (count + 1) / 2;
+		if (used > len)
+			return 0;
+		for (i = 0; i < count; i++)
+			w[i] = (i & 1) ? (src[1 + i / 2] & 0x0f) : (src[1 + i / 2] >> 4);
+	}
+	else
+	{
+		used = 1 + (grub_size_t)src[0];
+		if (used > len)
+			return 0;
+		count = zstd_huf_weights(src + 1, src[0], w);
+		if (!count)
+			return 0;
+	}
+
+	/* The weight of the last symbol makes the sum a power of two.  */
+	for (i = 0; i < count; i++)
+	{
+		if (w[i] > ZSTD_HUF_LOG_MAX)
+			return 0;
+		if (w[i])
+			sum += 1U << (w[i] - 1);
+	}
+	if (sum == 0)
+		return 0;
+	log = zstd_highbit(sum) + 1;
+	left = (1U << log) - sum;
+	if (log > ZSTD_HUF_LOG_MAX || (left & (left - 1)))
+		return 0;
+	w[count++] = (grub_uint8_t)(zstd_highbit(left) + 1);
+
+	grub_memset(rank_count, 0, sizeof(rank_count));
+	for (i = 0; i < count; i++)
+	{
+		bits[i] = w[i] ? (grub_uint8_t)(log + 1 - w[i]) : 0;
+		rank_count[bits[i]]++;
+	}
+	rank[log] = 0;
+	for (n = log; n >= 1; n--)
+	{
+		grub_uint32_t end = rank[n] + rank_count[n] * (1U << (log - n));
+
+		if (n > 1)
+			rank[n - 1] = end;
+		grub_memset(h->bits + rank[n], (int)n, end - rank[n]);
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (!bits[i])
+			continue;
+		code = rank[bits[i]];
+		n = 1U << (log - bits[i]);
+		grub_memset(h->sym + code, (int)i, n);
+		rank[bits[i]] += n;
+	}
+	h->log = log;
+	return used;
+}
+
+static int
+zstd_huf_stream(const struct zstd_huf* h, const grub_uint8_t* src, grub_size_t len,
+	grub_uint8_t* out, grub_size_t count)
+{
+	struct zstd_bits b;
+	grub_uint32_t state, mask = (1U << h->log) - 1, n;
+
+	if (!zstd_bits_init(&b, src, len))
+		return 0;
+	state = zstd_bits(&b, h->log);
+	while (count--)
+	{
+		n = h->bits[state];
+		*out++ = h->sym[state];
+		state = ((state << n) | zstd_bits(&b, n)) & mask;
+	}
+	return b.pos == -(grub_int64_t)h->log;
+}
+
+/* Decode the literals section into Z->LIT, returns the bytes used or 0.  */
+static grub_size_t
+zstd_literals(struct grub_zstdio* z, const grub_uint8_t* src, grub_size_t len)
+{
+	grub_uint32_t type = src[0] & 3, fmt = (src[0] >> 2) & 3;
+	grub_size_t hs, regen, csize, used, n;
+
+	if (type < 2)
+	{
+		switch (fmt)
+		{
+		case 1:
+			hs = 2;
+			regen = (src[0] >> 4) + ((grub_size_t)src[1] << 4);
+			break;
+		case 3:
+			hs = 3;
+			regen = (src[0] >> 4) + ((grub_size_t)src[1] << 4) + ((grub_size_t)src[2] << 12);
+			break;
+		default:
+			hs = 1;
+			regen = src[0] >> 3;
+		}
+		used = hs + (type == 0 ? regen : 1);
+		if (used > len || regen > ZSTD_BLOCK_MAX)
+			return 0;
+		if (type == 0)
+			grub_memcpy(z->lit, src + hs, regen);
+		else
+			grub_memset(z->lit, src[hs], regen);
+		z->lit_len = regen;
+		return used;
+	}
+
+	if (fmt <= 1)
+	{
+		grub_uint32_t h = zstd_le24(src);
+
+		hs = 3;
+		regen = (h >> 4) & 0x3ff;
+		csize = (h >> 14) & 0x3ff;
+	}
+	else if (fmt == 2)
+	{
+		grub_uint32_t h = grub_le_to_cpu32(grub_get_unaligned32(src));
+
+		hs = 4;
+		regen = (h >> 4) & 0x3fff;
+		csize = h >> 18;
+	}
+	else
+	{
+		grub_uint64_t h = grub_le_to_cpu32(grub_get_unaligned32(src)) | ((grub_uint64_t)src[4] << 32);
+
+		hs = 5;
+		regen = (grub_size_t)(h >> 4) & 0x3ffff;
+		csize = (grub_size_t)(h >> 22) & 0x3ffff;
+	}
+	if (hs + csize > len || regen > ZSTD_BLOCK_MAX)
+		return 0;
+	used = hs + csize;
+	src += hs;
+
+	if (type == 2)
+	{
+		n = zstd_huf_table(&z->st.huf, src, csize);
+		if (!n)
+			return 0;
+		z->st.have_huf = 1;
+		src += n;
+		csize -= n;
+	}
+	else if (!z->st.have_huf)
+		return 0;
+
+	if (fmt == 0)
+	{
+		if (!zstd_huf_stream(&z->st.huf, src, csize, z->lit, regen))
+			return 0;
+	}
+	else
+	{
+		grub_size_t size[4], seg = (regen + 3) / 4, i;
+		grub_uint8_t* out = z->lit;
+
+		if (csize < 6 || regen < 3 * seg)
+			return 0;
+		size[0] = grub_le_to_cpu16(grub_get_unaligned16(src));
+		size[1] = grub_le_to_cpu16(grub_get_unaligned16(src + 2));
+		size[2] = grub_le_to_cpu16(grub_get_unaligned16(src + 4));
+		if (size[0] + size[1] + size[2] > csize - 6)
+			return 0;
+		size[3] = csize - 6 - size[0] - size[1] - size[2];
+		src += 6;
+		for (i = 0; i < 4; i++)
+		{
+			n = (i < 3) ? seg : regen - 3 * seg;
+			if (!zstd_huf_stream(&z->st.huf, src, size[i], out, n))
+				return 0;
+			src += size[i];
+			out += n;
+		}
+	}
+	z->lit_len = regen;
+	return used;
+}
+
+/* Set up a sequence table of the given mode.  */
+static int
+zstd_seq_table(struct zstd_fse* t, grub_uint32_t mode, const grub_uint8_t* src,
+	grub_size_t len, grub_size_t* pos, const grub_int16_t* def, int ndef, int def_log,
+	int max_log, int max_sym)
+{
+	grub_size_t n;
+
+	switch (mode)
+	{
+	case 0:
+		zstd_fse_build(t, def, ndef, def_log);
+		return 1;
+	case 1:
+		if (*pos >= len || src[*pos] > max_sym)
+			return 0;
+		t->sym[0] = src[(*pos)++];
+		t->bits[0] = 0;
+		t->base[0] = 0;
+		t->log = 0;
+		t->valid = 1;
+		return 1;
+	case 2:
+		n = zstd_fse_header(t, src + *pos, len - *pos, max_log, max_sym);
+		*pos += n;
+		return n != 0;
+	default:
+		return t->valid;
+	}
+}
+
+/* Decode the sequences and build the block from them and the literals.  */
+static grub_err_t
+zstd_sequences(struct grub_zstdio* z, const grub_uint8_t* src, grub_size_t len)
+{
+	struct zstd_state* st = &z->st;
+	struct zstd_bits b;
+	const grub_uint8_t* lit = z->lit;
+	const grub_uint8_t* lit_end = z->lit + z->lit_len;
+	grub_uint8_t* out = z->buf + z->pos;
+	grub_uint8_t* end = out + ZSTD_BLOCK_MAX;
+	grub_uint8_t* hist = z->buf + z->base;
+	grub_uint32_t nseq, ll_state, of_state, ml_state, i;
+	grub_size_t pos = 0;
+
+	if (len == 0)
+		return zstd_corrupt();
+	nseq = src[pos++];
+	if (nseq >= 128)
+	{
+		if (nseq == 255)
+		{
+			if (pos + 2 > len)
+				return zstd_corrupt();
+			nseq = src[pos] + ((grub_uint32_t)src[pos + 1] << 8) + 0x7f00;
+			pos += 2;
+		}
+		else
+		{
+			if (pos + 1 > len)
+				return zstd_corrupt();
+			nseq = ((nseq - 128) << 8) + src[pos++];
+		}
+	}
+
+	if (nseq)
+	{
+		grub_uint32_t modes;
+
+		if (pos >= len || (src[pos] & 3))
+			return zstd_corrupt();
+		modes = src[pos++];
+		if (!zstd_seq_table(&st->ll, modes >> 6, src, len, &pos, ll_default,
+				ZSTD_LL_MAX + 1, 6, ZSTD_LL_LOG_MAX, ZSTD_LL_MAX)
+			|| !zstd_seq_table(&st->of, (modes >> 4) & 3, src, len, &pos, of_default,
+				ZSTD_OF_MAX - 2, 5, ZSTD_OF_LOG_MAX, ZSTD_OF_MAX)
+			|| !zstd_seq_table(&st->ml, (modes >> 2) & 3, src, len, &pos, ml_default,
+				ZSTD_ML_MAX + 1, 6, ZSTD_ML_LOG_MAX, ZSTD_ML_MAX)
+			|| !zstd_bits_init(&b, src + pos, len - pos))
+			return zstd_corrupt();
+
+		ll_state = zstd_bits(&b, st->ll.log);
+		of_state = zstd_bits(&b, st->of.log);
+		ml_state = zstd_bits(&b, st->ml.log);
+	}
+
+	for (i = 0; i < nseq; i++)
+	{
+		grub_uint32_t of_code = st->of.sym[of_state];
+		grub_uint32_t ml_code = st->ml.sym[ml_state];
+		grub_uint32_t ll_code = st->ll.sym[ll_state];
+		grub_uint32_t offset, ml, ll;
+
+		if (of_code > ZSTD_OF_MAX || ml_code > ZSTD_ML_MAX || ll_code > ZSTD_LL_MAX)
+			return zstd_corrupt();
+		offset = (1U << of_code) + zstd_bits(&b, of_code);
+		ml = ml_base[ml_code] + zstd_bits(&b, ml_bits[ml_code]);
+		ll = ll_base[ll_code] + zstd_bits(&b, ll_bits[ll_code]);
+
+		if (offset > 3)
+		{
+			offset -= 3;
+			st->rep[2] = st->rep[1];
+			st->rep[1] = st->rep[0];
+			st->rep[0] = offset;
+		}
+		else
+		{
+			grub_uint32_t idx = offset - 1 + (ll == 0);
+
+			if (idx == 0)
+				offset = st->rep[0];
+			else
+			{
+				offset = (idx < 3) ? st->rep[idx] : st->rep[0] - 1;
+				if (idx > 1)
+					st->rep[2] = st->rep[1];
+				st->rep[1] = st->rep[0];
+				st->rep[0] = offset;
+			}
+		}
+
+		if (i + 1 < nseq)
+		{
+			ll_state = st->ll.base[ll_state] + zstd_bits(&b, st->ll.bits[ll_state]);
+			ml_state = st->ml.base[ml_state] + zstd_bits(&b, st->ml.bits[ml_state]);
+			of_state = st->of.base[of_state] + zstd_bits(&b, st->of.bits[of_state]);
+		}
+
+		if (ll > (grub_size_t)(lit_end - lit) || (grub_size_t)ll + ml > (grub_size_t)(end - out))
+			return zstd_corrupt();
+		grub_memcpy(out, lit, ll);
+		out += ll;
+		lit += ll;
+		if (offset == 0 || offset > (grub_size_t)(out - hist))
+			return zstd_corrupt();
+		if (offset >= ml)
+		{
+			grub_memcpy(out, out - offset, ml);
+			out += ml;
+		}
+		else
+		{
+			const grub_uint8_t* from = out - offset;
+
+			while (ml--)
+				*out++ = *from++;
+		}
+	}
+
+	if (nseq && b.pos != 0)
+		return zstd_corrupt();
+	if ((grub_size_t)(lit_end - lit) > (grub_size_t)(end - out))
+		return zstd_corrupt();
+	grub_memcpy(out, lit, lit_end - lit);
+	out += lit_end - lit;
+	z->pos = out - z->buf;
+	return GRUB_ERR_NONE;
+}
+
+/* Parse a frame header, returns 0 when it is not a valid one.  */
+static int
+zstd_parse_header(const grub_uint8_t* hdr, grub_size_t len, struct zstd_header* h)
+{
+	static const grub_uint8_t fcs_size[4] = { 0, 2, 4, 8 };
+	static const grub_uint8_t did_size[4] = { 0, 1, 2, 4 };
+	grub_uint8_t fhd;
+	grub_size_t pos = 5, i, n;
+	int single;
+
+	if (len < 5 || grub_le_to_cpu32(grub_get_unaligned32(hdr)) != ZSTD_MAGIC)
+		return 0;
+	fhd = hdr[4];
+	single = (fhd >> 5) & 1;
+	if (fhd & 0x08)
+		return 0;
+	h->checksum = (fhd >> 2) & 1;
+	n = fcs_size[fhd >> 6];
+	if (n == 0 && single)
+		n = 1;
+	h->size = pos + !single + did_size[fhd & 3] + n;
+	if (h->size > len)
+		return 0;
+
+	if (!single)
+	{
+		grub_uint8_t wd = hdr[pos++];
+		grub_uint64_t base = 1ULL << (10 + (wd >> 3));
+
+		h->window = base + (base / 8) * (wd & 7);
+	}
+	for (i = 0; i < did_size[fhd & 3]; i++)
+	{
+		if (hdr[pos++])
+		{
+			grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "zstd: dictionaries are not supported");
+			return 0;
+		}
+	}
+	h->has_content = (n != 0);
+	h->content = 0;
+	for (i = 0; i < n; i++)
+		h->content |= (grub_uint64_t)hdr[pos + i] << (8 * i);
+	if (n == 2)
+		h->content += 256;
+	if (single)
+		h->window = h->content;
+	return 1;
+}
+
+/* Get ready to decode frame Z->FRAME.  */
+static grub_err_t
+zstd_start_frame(struct grub_zstdio* z)
+{
+	struct zstd_frame* f = &z->frames[z->frame];
+	struct zstd_header h;
+	grub_uint8_t hdr[18];
+	grub_uint64_t avail = grub_file_size(z->file) - f->coff;
+	grub_size_t len = avail < sizeof(hdr) ? (grub_size_t)avail : sizeof(hdr);
+	grub_size_t window, extra, need;
+
+	z->coff = f->coff;
+	if (zstd_read_in(z, hdr, len))
+		return grub_errno;
+	if (!zstd_parse_header(hdr, len, &h))
+		return grub_errno ? grub_errno : zstd_corrupt();
+
+	if (h.has_content && h.window > h.content)
+		h.window = h.content;
+	if (h.window > ZSTD_WINDOW_MAX)
+		return grub_error(GRUB_ERR_OUT_OF_MEMORY, "zstd: window too large");
+	window = (grub_size_t)h.window;
+	extra = window < ZSTD_SLIDE_MAX ? window : ZSTD_SLIDE_MAX;
+	need = window + extra + ZSTD_BLOCK_MAX;
+	if (need > z->size)
+	{
+		grub_free(z->buf);
+		z->size = 0;
+		z->buf = grub_malloc(need);
+		if (!z->buf)
+			return grub_errno;
+		z->size = need;
+	}
+
+	z->coff = f->coff + h.size;
+	z->uoff = f->uoff;
+	z->window = window;
+	z->checksum = h.checksum;
+	if (z->checksum)
+		xxh64_init(&z->xxh);
+	z->content = h.has_content ? h.content : ~(grub_uint64_t)0;
+	z->frame_pos = 0;
+	z->frame_done = 0;
+	z->base = z->start = z->pos = 0;
+
+	z->st.rep[0] = 1;
+	z->st.rep[1] = 4;
+	z->st.rep[2] = 8;
+	z->st.have_huf = 0;
+	z->st.ll.valid = z->st.of.valid = z->st.ml.valid = 0;
+	return GRUB_ERR_NONE;
+}
+
+/* Decode the next block, called when everything decoded has been handed out.  */
+static grub_err_t
+zstd_block(struct grub_zstdio* z)
+{
+	grub_uint8_t hdr[4];
+	grub_uint32_t h, type, size;
+	grub_size_t start, n;
+
+	if (zstd_read_in(z, hdr, 3))
+		return grub_errno;
+	h = zstd_le24(hdr);
+	type = (h >> 1) & 3;
+	size = h >> 3;
+	if (type == 3 || size > ZSTD_BLOCK_MAX)
+		return zstd_corrupt();
+
+	/* Move the window back to make room for the block.  */
+	if (z->pos + ZSTD_BLOCK_MAX > z->size)
+	{
+		grub_size_t keep = z->pos - z->base, shift;
+
+		if (keep > z->window)
+			keep = z->window;
+		shift = z->pos - keep;
+		grub_memmove(z->buf, z->buf + shift, keep);
+		z->start = z->pos = keep;
+		z->base = 0;
+	}
+	start = z->pos;
+
+	switch (type)
+	{
+	case 0:
+		if (zstd_read_in(z, z->buf + z->pos, size))
+			return grub_errno;
+		z->pos += size;
+		break;
+	case 1:
+		if (zstd_read_in(z, hdr, 1))
+			return grub_errno;
+		grub_memset(z->buf + z->pos, hdr[0], size);
+		z->pos += size;
+		break;
+	default:
+		if (zstd_read_in(z, z->block, size))
+			return grub_errno;
+		n = size ? zstd_literals(z, z->block, size) : 0;
+		if (!n)
+			return zstd_corrupt();
+		if (zstd_sequences(z, z->block + n, size - n))
+			return grub_errno;
+	}
+	z->frame_pos += z->pos - start;
+	if (z->checksum)
+		xxh64_update(&z->xxh, z->buf + start, z->pos - start);
+
+	if (h & 1)
+	{
+		if (z->checksum)
+		{
+			if (zstd_read_in(z, hdr, 4))
+				return grub_errno;
+			if (grub_le_to_cpu32(grub_get_unaligned32(hdr))
+				!= (grub_uint32_t)xxh64_digest(&z->xxh))
+				return grub_error(GRUB_ERR_BAD_COMPRESSED_DATA,
+					"zstd: checksum mismatch in frame %llu", (unsigned long long)z->frame);
+		}
+		if (z->content != ~(grub_uint64_t)0 && z->frame_pos != z->content)
+			return zstd_corrupt();
+		z->frame_done = 1;
+	}
+	return GRUB_ERR_NONE;
+}
+
+/* Remember the state between two blocks.  */
+static void
+zstd_snapshot(struct grub_zstdio* z)
+{
+	struct zstd_snapshot* snap;
+	grub_size_t hist = z->pos - z->base, size;
+
+	if (hist > z->window)
+		hist = z->window;
+	size = sizeof(*snap) + hist;
+	if (!grub_seekpt_want(&z->points, z->uoff, size))
+		return;
+	snap = grub_malloc(size);
+	if (!snap)
+	{
+		grub_errno = GRUB_ERR_NONE;
+		return;
+	}
+	snap->frame = z->frame;
+	snap->window = z->window;
+	snap->frame_pos = z->frame_pos;
+	snap->checksum = z->checksum;
+	snap->hist = hist;
+	snap->st = z->st;
+	snap->xxh = z->xxh;
+	grub_memcpy(snap + 1, z->buf + z->pos - hist, hist);
+	grub_seekpt_add(&z->points, z->uoff, z->coff, snap, size);
+	grub_errno = GRUB_ERR_NONE;
+}
+
+static grub_err_t
+zstd_restore(struct grub_zstdio* z, const struct grub_seekpt* pt)
+{
+	const struct zstd_snapshot* snap = pt->state;
+	grub_size_t lo = 0, hi = z->nframes, mid;
+
+	if (!snap)
+	{
+		/* Start of a frame.  */
+		while (hi - lo > 1)
+		{
+			mid = (lo + hi) / 2;
+			if (z->frames[mid].coff <= pt->coff)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		z->frame = lo;
+		return zstd_start_frame(z);
+	}
+
+	/* Sets up the buffer for the window of the frame.  */
+	z->frame = snap->frame;
+	if (zstd_start_frame(z))
+		return grub_errno;
+	z->frame_pos = snap->frame_pos;
+	z->st = snap->st;
+	z->xxh = snap->xxh;
+	grub_memcpy(z->buf, snap + 1, snap->hist);
+	z->start = z->pos = snap->hist;
+	z->coff = pt->coff;
+	z->uoff = pt->uoff;
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+zstd_fill(struct grub_zstdio* z)
+{
+	while (z->pos == z->start)
+	{
+		if (z->frame_done)
+		{
+			if (z->frame + 1 >= z->nframes)
+				return grub_error(GRUB_ERR_OUT_OF_RANGE, "zstd: read past the end");
+			z->frame++;
+			if (zstd_start_frame(z))
+				return grub_errno;
+			continue;
+		}
+		zstd_snapshot(z);
+		if (zstd_block(z))
+			return grub_errno;
+	}
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+zstd_add_frame(struct grub_zstdio* z, grub_size_t* max, grub_uint64_t coff,
+	grub_uint64_t usize)
+{
+	if (z->nframes == *max)
+	{
+		struct zstd_frame* f;
+
+		*max = *max ? *max * 2 : 16;
+		f = grub_realloc(z->frames, *max * sizeof(*f));
+		if (!f)
+			return grub_errno;
+		z->frames = f;
+	}
+	z->frames[z->nframes].coff = coff;
+	z->frames[z->nframes].uoff = 0;
+	z->frames[z->nframes].usize = usize;
+	z->nframes++;
+	return GRUB_ERR_NONE;
+}
+
+/* Take the frames from the seek table of the seekable format.  */
+static int
+zstd_seek_table(struct grub_zstdio* z)
+{
+	grub_uint64_t size = grub_file_size(z->file), coff = 0, tsize;
+	grub_uint8_t foot[9], hdr[8];
+	grub_uint8_t* table;
+	grub_uint32_t n, i, esize;
+	grub_size_t max = 0;
+
+	if (size < sizeof(foot) + sizeof(hdr)
+		|| zstd_pread(z->file, size - sizeof(foot), foot, sizeof(foot))
+		|| grub_le_to_cpu32(grub_get_unaligned32(foot + 5)) != ZSTD_SEEKABLE_MAGIC
+		|| (foot[4] & 0x7c))
+		goto no;
+	n = grub_le_to_cpu32(grub_get_unaligned32(foot));
+	esize = (foot[4] & 0x80) ? 12 : 8;
+	tsize = (grub_uint64_t)n * esize + sizeof(foot);
+	if (tsize + sizeof(hdr) > size
+		|| zstd_pread(z->file, size - tsize - sizeof(hdr), hdr, sizeof(hdr))
+		|| grub_le_to_cpu32(grub_get_unaligned32(hdr)) != ZSTD_SEEKTABLE_MAGIC
+		|| grub_le_to_cpu32(grub_get_unaligned32(hdr + 4)) != tsize)
+		goto no;
+
+	table = grub_malloc((grub_size_t)tsize);
+	if (!table || zstd_pread(z->file, size - tsize, table, (grub_size_t)tsize))
+	{
+		grub_free(table);
+		goto no;
+	}
+	for (i = 0; i < n; i++)
+	{
+		const grub_uint8_t* e = table + (grub_size_t)i * esize;
+
+		if (zstd_add_frame(z, &max, coff, grub_le_to_cpu32(grub_get_unaligned32(e + 4))))
+			break;
+		coff += grub_le_to_cpu32(grub_get_unaligned32(e));
+	}
+	grub_free(table);
+	if (i == n && coff == size - tsize - sizeof(hdr))
+		return 1;
+
+	z->nframes = 0;
+no:
+	grub_errno = GRUB_ERR_NONE;
+	return 0;
+}
+
+/* Find the frames by walking the block headers.  */
+static grub_err_t
+zstd_walk_frames(struct grub_zstdio* z)
+{
+	grub_uint64_t size = grub_file_size(z->file), coff = 0, pos;
+	grub_uint8_t hdr[18];
+	grub_size_t max = 0, len;
+	struct zstd_header h;
+
+	while (coff < size)
+	{
+		len = (size - coff < sizeof(hdr)) ? (grub_size_t)(size - coff) : sizeof(hdr);
+		if (len < 8 || zstd_pread(z->file, coff, hdr, len))
+			return grub_errno ? grub_errno : zstd_corrupt();
+		if ((grub_le_to_cpu32(grub_get_unaligned32(hdr)) & ZSTD_SKIP_MASK) == ZSTD_SKIP_MAGIC)
+		{
+			coff += 8 + (grub_uint64_t)grub_le_to_cpu32(grub_get_unaligned32(hdr + 4));
+			continue;
+		}
+		if (!zstd_parse_header(hdr, len, &h))
+			return grub_errno ? grub_errno : zstd_corrupt();
+
+		for (pos = coff + h.size; ; )
+		{
+			grub_uint32_t b;
+
+			if (zstd_pread(z->file, pos, hdr, 3))
+				return grub_errno;
+			b = zstd_le24(hdr);
+			pos += 3 + ((((b >> 1) & 3) == 1) ? 1 : (b >> 3));
+			if (b & 1)
+				break;
+		}
+		if (h.checksum)
+			pos += 4;
+		if (zstd_add_frame(z, &max, coff, h.has_content ? h.content : ~(grub_uint64_t)0))
+			return grub_errno;
+		coff = pos;
+	}
+	if (coff != size)
+		return zstd_corrupt();
+	return GRUB_ERR_NONE;
+}
+
+static grub_err_t
+zstd_load_index(struct grub_zstdio* z)
+{
+	grub_uint64_t uoff = 0;
+	grub_size_t i;
+
+	if (!zstd_seek_table(z) && zstd_walk_frames(z))
+		return grub_errno;
+
+	for (i = 0; i < z->nframes; i++)
+	{
+		z->frames[i].uoff = uoff;
+		if (z->frames[i].usize == ~(grub_uint64_t)0)
+		{
+			/* No content size, decode the frame to learn it.  */
+			z->frame = i;
+			if (zstd_start_frame(z))
+				return grub_errno;
+			while (!z->frame_done)
+			{
+				z->start = z->pos;
+				if (zstd_block(z))
+					return grub_errno;
+			}
+			z->frames[i].usize = z->frame_pos;
+		}
+		uoff += z->frames[i].usize;
+	}
+	return GRUB_ERR_NONE;
+}
+
+/* Make TARGET the next decompressed byte handed out.  */
+static grub_err_t
+zstd_seek(struct grub_zstdio* z, grub_uint64_t target)
+{
+	const struct grub_seekpt* pt;
+	grub_size_t n;
+
+	if (target == z->uoff)
+		return GRUB_ERR_NONE;
+	pt = grub_seekpt_lookup(&z->points, z->uoff, target);
+	if (pt && zstd_restore(z, pt))
+		return grub_errno;
+	while (z->uoff < target)
+	{
+		n = z->pos - z->start;
+		if (n == 0)
+		{
+			if (zstd_fill(z))
+				return grub_errno;
+			continue;
+		}
+		if (n > target - z->uoff)
+			n = (grub_size_t)(target - z->uoff);
+		z->start += n;
+		z->uoff += n;
+	}
+	return GRUB_ERR_NONE;
+}
+
+static grub_ssize_t
+grub_zstdio_read(grub_file_t file, char* buf, grub_size_t len)
+{
+	struct grub_zstdio* z = file->data;
+	grub_ssize_t ret = 0;
+	grub_size_t n;
+
+	if (zstd_seek(z, file->offset))
+		goto fail;
+	while (len)
+	{
+		n = z->pos - z->start;
+		if (n == 0)
+		{
+			if (zstd_fill(z))
+				goto fail;
+			continue;
+		}
+		if (n > len)
+			n = len;
+		grub_memcpy(buf, z->buf + z->start, n);
+		z->start += n;
+		z->uoff += n;
+		buf += n;
+		len -= n;
+		ret += n;
+	}
+	return ret;
+
+fail:
+	/* The decoder state is unknown, resume from a point next time.  */
+	z->start = z->pos;
+	z->uoff = ~(grub_uint64_t)0;
+	return -1;
+}
+
+static void
+zstd_free(struct grub_zstdio* z)
+{
+	grub_seekpt_free(&z->points);
+	grub_free(z->frames);
+	grub_free(z->ibuf);
+	grub_free(z->block);
+	grub_free(z->lit);
+	grub_free(z->buf);
+	grub_free(z);
+}
+
+static grub_err_t
+grub_zstdio_close(grub_file_t file)
+{
+	struct grub_zstdio* z = file->data;
+
+	grub_file_close(z->file);
+	zstd_free(z);
+	file->disk = 0;
+	return grub_errno;
+}
+
+static grub_file_t
+grub_zstdio_open(grub_file_t io, enum grub_file_type type)
+{
+	struct grub_zstdio* z;
+	grub_file_t file;
+	grub_uint8_t magic[4];
+	grub_size_t i;
+
+	if (type & GRUB_FILE_TYPE_NO_DECOMPRESS)
+		return io;
+	grub_file_seek(io, 0);
+	if (grub_file_read(io, magic, sizeof(magic)) != sizeof(magic)
+		|| grub_le_to_cpu32(grub_get_unaligned32(magic)) != ZSTD_MAGIC)
+	{
+		grub_file_seek(io, 0);
+		grub_errno = GRUB_ERR_NONE;
+		return io;
+	}
+	if (grub_file_size(io) == GRUB_FILE_SIZE_UNKNOWN)
+	{
+		grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET, "zstd: input size unknown");
+		return 0;
+	}
+
+	z = grub_zalloc(sizeof(*z));
+	file = grub_zalloc(sizeof(*file));
+	if (!z || !file)
+	{
+		grub_free(z);
+		grub_free(file);
+		return 0;
+	}
+	z->file = io;
+	grub_seekpt_init(&z->points);
+	z->ibuf = grub_malloc(ZSTD_IN_SIZE);
+	z->block = grub_malloc(ZSTD_BLOCK_MAX);
+	z->lit = grub_malloc(ZSTD_BLOCK_MAX);
+	if (!z->ibuf || !z->block || !z->lit || zstd_load_index(z))
+		goto fail;
+
+	/* Every frame starts afresh.  */
+	for (i = 0; i < z->nframes; i++)
+	{
+		if (grub_seekpt_add(&z->points, z->frames[i].uoff, z->frames[i].coff, NULL, 0))
+			goto fail;
+	}
+	z->uoff = ~(grub_uint64_t)0;
+
+	file->disk = io->disk;
+	file->borrowed_disk = 1;
+	file->data = z;
+	file->fs = &grub_zstdio_fs;
+	file->size = z->nframes ? z->frames[z->nframes - 1].uoff + z->frames[z->nframes - 1].usize : 0;
+	file->not_easily_seekable = 0;
+	return file;
+
+fail:
+	zstd_free(z);
+	grub_free(file);
+	return 0;
+}
+
+static struct grub_fs grub_zstdio_fs =
+{
+	.name = "zstdio",
+	.fs_dir = 0,
+	.fs_open = 0,
+	.fs_read = grub_zstdio_read,
+	.fs_close = grub_zstdio_close,
+	.fs_label = 0,
+	.next = 0
+};
+
+GRUB_MOD_INIT(zstdio)
+{
+	grub_file_filter_register(GRUB_FILE_FILTER_ZSTDIO, grub_zstdio_open);
+}
+
+GRUB_MOD_FINI(zstdio)
+{
+	grub_file_filter_unregister(GRUB_FILE_FILTER_ZSTDIO);
+}
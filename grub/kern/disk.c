@@ -26,10 +26,20 @@
 
 #define	GRUB_CACHE_TIMEOUT	2
 
+/* Reads of at least this many cache blocks bypass the cache.  */
+#define GRUB_DISK_BYPASS_BLOCKS	8
+
  /* The last time the disk was used.  */
 static grub_uint64_t grub_last_time = 0;
 
-struct grub_disk_cache grub_disk_cache_table[GRUB_DISK_CACHE_NUM];
+/* The set-associative disk cache. Blocks live in one preallocated slab,
+   entry I of the table owns the I-th block of the slab.  */
+static struct grub_disk_cache* grub_disk_cache_table;
+static char* grub_disk_cache_slab;
+static unsigned grub_disk_cache_num = GRUB_DISK_CACHE_NUM;
+static unsigned grub_disk_cache_sets;
+static grub_uint64_t grub_disk_cache_tick;
+static struct grub_disk_cache_stats grub_disk_cache_stats;
 
 /* This function performs three tasks:
    - Make sectors disk relative from partition relative.
@@ -83,32 +93,138 @@ grub_disk_adjust_range(grub_disk_t disk, grub_disk_addr_t* sector,
 	return GRUB_ERR_NONE;
 }
 
-static unsigned
-grub_disk_cache_get_index(unsigned long dev_id, unsigned long disk_id,
+static void
+grub_disk_cache_release(void)
+{
+	grub_free(grub_disk_cache_table);
+	grub_free(grub_disk_cache_slab);
+	grub_disk_cache_table = 0;
+	grub_disk_cache_slab = 0;
+	grub_disk_cache_sets = 0;
+}
+
+/* Allocate the table and the slab on first use.  */
+static int
+grub_disk_cache_setup(void)
+{
+	unsigned i;
+
+	if (grub_disk_cache_table)
+		return 1;
+	if (grub_disk_cache_num == 0)
+		return 0;
+
+	grub_disk_cache_table = grub_calloc(grub_disk_cache_num, sizeof(struct grub_disk_cache));
+	grub_disk_cache_slab = grub_malloc((grub_size_t)grub_disk_cache_num
+		<< (GRUB_DISK_SECTOR_BITS + GRUB_DISK_CACHE_BITS));
+	if (!grub_disk_cache_table || !grub_disk_cache_slab)
+	{
+		/* Run uncached rather than fail the read.  */
+		grub_disk_cache_release();
+		grub_disk_cache_num = 0;
+		grub_errno = GRUB_ERR_NONE;
+		return 0;
+	}
+
+	for (i = 0; i < grub_disk_cache_num; i++)
+		grub_disk_cache_table[i].data = grub_disk_cache_slab
+			+ ((grub_size_t)i << (GRUB_DISK_SECTOR_BITS + GRUB_DISK_CACHE_BITS));
+	grub_disk_cache_sets = grub_disk_cache_num / GRUB_DISK_CACHE_WAYS;
+	return 1;
+}
+
+grub_err_t
+grub_disk_cache_set_size(grub_size_t size)
+{
+	unsigned num;
+
+	num = (unsigned)(size >> (GRUB_DISK_SECTOR_BITS + GRUB_DISK_CACHE_BITS));
+	num &= ~(GRUB_DISK_CACHE_WAYS - 1);
+	if (size && num == 0)
+		num = GRUB_DISK_CACHE_WAYS;
+
+	for (unsigned i = 0; grub_disk_cache_table && i < grub_disk_cache_num; i++)
+		if (grub_disk_cache_table[i].lock)
+			return grub_error(GRUB_ERR_BUG, "disk cache is in use");
+
+	grub_disk_cache_release();
+	grub_disk_cache_num = num;
+	return GRUB_ERR_NONE;
+}
+
+void
+grub_disk_cache_get_stats(struct grub_disk_cache_stats* stats)
+{
+	*stats = grub_disk_cache_stats;
+	stats->size = (grub_size_t)grub_disk_cache_num
+		<< (GRUB_DISK_SECTOR_BITS + GRUB_DISK_CACHE_BITS);
+}
+
+/* Device transfers, counted for grub_disk_cache_get_stats.  */
+static grub_err_t
+grub_disk_dev_read(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_size_t size, char* buf)
+{
+	grub_disk_cache_stats.reads++;
+	grub_disk_cache_stats.read_bytes += (grub_uint64_t)size << disk->log_sector_size;
+	return (disk->dev->disk_read) (disk, sector, size, buf);
+}
+
+static grub_err_t
+grub_disk_dev_write(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_size_t size, const char* buf)
+{
+	grub_disk_cache_stats.writes++;
+	grub_disk_cache_stats.write_bytes += (grub_uint64_t)size << disk->log_sector_size;
+	return (disk->dev->disk_write) (disk, sector, size, buf);
+}
+
+/* Return the first way of the set SECTOR belongs to.  */
+static struct grub_disk_cache*
+grub_disk_cache_get_set(unsigned long dev_id, unsigned long disk_id,
 	grub_disk_addr_t sector)
 {
-	return ((dev_id * 524287UL + disk_id * 2606459UL
+	unsigned set_index;
+
+	if (!grub_disk_cache_setup())
+		return 0;
+
+	set_index = ((dev_id * 524287UL + disk_id * 2606459UL
 		+ ((unsigned)(sector >> GRUB_DISK_CACHE_BITS)))
-		% GRUB_DISK_CACHE_NUM);
+		% grub_disk_cache_sets);
+	return grub_disk_cache_table + set_index * GRUB_DISK_CACHE_WAYS;
+}
+
+static struct grub_disk_cache*
+grub_disk_cache_find(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
+{
+	struct grub_disk_cache* set;
+	unsigned i;
+
+	set = grub_disk_cache_get_set(dev_id, disk_id, sector);
+	if (!set)
+		return 0;
+
+	for (i = 0; i < GRUB_DISK_CACHE_WAYS; i++)
+		if (set[i].valid && set[i].dev_id == dev_id
+			&& set[i].disk_id == disk_id && set[i].sector == sector)
+			return set + i;
+
+	return 0;
 }
 
 static void
 grub_disk_cache_invalidate(unsigned long dev_id, unsigned long disk_id,
 	grub_disk_addr_t sector)
 {
-	unsigned cache_index;
 	struct grub_disk_cache* cache;
 
 	sector &= ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1);
-	cache_index = grub_disk_cache_get_index(dev_id, disk_id, sector);
-	cache = grub_disk_cache_table + cache_index;
-
-	if (cache->dev_id == dev_id && cache->disk_id == disk_id
-		&& cache->sector == sector && cache->data)
+	cache = grub_disk_cache_find(dev_id, disk_id, sector);
+	if (cache)
 	{
-		cache->lock = 1;
-		grub_free(cache->data);
-		cache->data = 0;
+		cache->valid = 0;
 		cache->lock = 0;
 	}
 }
@@ -118,15 +234,15 @@ grub_disk_cache_invalidate_all(void)
 {
 	unsigned i;
 
-	for (i = 0; i < GRUB_DISK_CACHE_NUM; i++)
+	if (!grub_disk_cache_table)
+		return;
+
+	for (i = 0; i < grub_disk_cache_num; i++)
 	{
 		struct grub_disk_cache* cache = grub_disk_cache_table + i;
 
-		if (cache->data && !cache->lock)
-		{
-			grub_free(cache->data);
-			cache->data = 0;
-		}
+		if (!cache->lock)
+			cache->valid = 0;
 	}
 }
 
@@ -135,18 +251,17 @@ grub_disk_cache_fetch(unsigned long dev_id, unsigned long disk_id,
 	grub_disk_addr_t sector)
 {
 	struct grub_disk_cache* cache;
-	unsigned cache_index;
 
-	cache_index = grub_disk_cache_get_index(dev_id, disk_id, sector);
-	cache = grub_disk_cache_table + cache_index;
-
-	if (cache->dev_id == dev_id && cache->disk_id == disk_id
-		&& cache->sector == sector)
+	cache = grub_disk_cache_find(dev_id, disk_id, sector);
+	if (cache)
 	{
+		grub_disk_cache_stats.hits++;
+		cache->last_use = ++grub_disk_cache_tick;
 		cache->lock = 1;
 		return cache->data;
 	}
 
+	grub_disk_cache_stats.misses++;
 	return 0;
 }
 
@@ -155,40 +270,82 @@ grub_disk_cache_unlock(unsigned long dev_id, unsigned long disk_id,
 	grub_disk_addr_t sector)
 {
 	struct grub_disk_cache* cache;
-	unsigned cache_index;
-
-	cache_index = grub_disk_cache_get_index(dev_id, disk_id, sector);
-	cache = grub_disk_cache_table + cache_index;
 
-	if (cache->dev_id == dev_id && cache->disk_id == disk_id
-		&& cache->sector == sector)
+	cache = grub_disk_cache_find(dev_id, disk_id, sector);
+	if (cache)
 		cache->lock = 0;
 }
 
+/* Claim the least recently used unlocked way of SECTOR's set for it. The
+   entry is returned invalid and locked, the caller fills DATA and then
+   calls grub_disk_cache_commit().  */
+static struct grub_disk_cache*
+grub_disk_cache_reserve(unsigned long dev_id, unsigned long disk_id,
+	grub_disk_addr_t sector)
+{
+	struct grub_disk_cache* set;
+	struct grub_disk_cache* victim = 0;
+	unsigned i;
+
+	set = grub_disk_cache_get_set(dev_id, disk_id, sector);
+	if (!set)
+		return 0;
+
+	for (i = 0; i < GRUB_DISK_CACHE_WAYS; i++)
+	{
+		struct grub_disk_cache* cache = set + i;
+
+		if (cache->valid && cache->dev_id == dev_id
+			&& cache->disk_id == disk_id && cache->sector == sector)
+		{
+			/* Never keep two copies of one block.  */
+			if (cache->lock)
+				return 0;
+			victim = cache;
+			break;
+		}
+		if (cache->lock)
+			continue;
+		if (!victim || (victim->valid && (!cache->valid
+			|| cache->last_use < victim->last_use)))
+			victim = cache;
+	}
+	if (!victim)
+		return 0;
+
+	if (victim->valid && (victim->dev_id != dev_id
+		|| victim->disk_id != disk_id || victim->sector != sector))
+		grub_disk_cache_stats.evictions++;
+
+	victim->valid = 0;
+	victim->lock = 1;
+	victim->dev_id = dev_id;
+	victim->disk_id = disk_id;
+	victim->sector = sector;
+	return victim;
+}
+
+static void
+grub_disk_cache_commit(struct grub_disk_cache* cache, int valid)
+{
+	cache->valid = valid;
+	cache->last_use = ++grub_disk_cache_tick;
+	cache->lock = 0;
+}
+
 static grub_err_t
 grub_disk_cache_store(unsigned long dev_id, unsigned long disk_id,
 	grub_disk_addr_t sector, const char* data)
 {
-	unsigned cache_index;
 	struct grub_disk_cache* cache;
 
-	cache_index = grub_disk_cache_get_index(dev_id, disk_id, sector);
-	cache = grub_disk_cache_table + cache_index;
-
-	cache->lock = 1;
-	grub_free(cache->data);
-	cache->data = 0;
-	cache->lock = 0;
-
-	cache->data = grub_malloc(GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS);
-	if (!cache->data)
-		return grub_errno;
+	cache = grub_disk_cache_reserve(dev_id, disk_id, sector);
+	if (!cache)
+		return GRUB_ERR_NONE;
 
 	grub_memcpy(cache->data, data,
 		GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS);
-	cache->dev_id = dev_id;
-	cache->disk_id = disk_id;
-	cache->sector = sector;
+	grub_disk_cache_commit(cache, 1);
 
 	return GRUB_ERR_NONE;
 }
@@ -383,33 +540,39 @@ grub_disk_read_small_real(grub_disk_t disk, grub_disk_addr_t sector,
 		return GRUB_ERR_NONE;
 	}
 
-	/* Allocate a temporary buffer.  */
-	tmp_buf = grub_malloc(GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS);
-	if (!tmp_buf)
-		return grub_errno;
-
-	/* Otherwise read data from the disk actually.  */
+	/* Otherwise read data from the disk actually, straight into the cache
+	   block that is going to hold it.  */
 	if (disk->total_sectors == GRUB_DISK_SIZE_UNKNOWN
 		|| sector + GRUB_DISK_CACHE_SIZE
 		< (disk->total_sectors << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS)))
 	{
+		struct grub_disk_cache* cache;
 		grub_err_t err;
-		err = (disk->dev->disk_read) (disk, grub_disk_to_native_sector(disk, sector),
+
+		cache = grub_disk_cache_reserve(disk->dev->id, disk->id, sector);
+		if (cache)
+			tmp_buf = cache->data;
+		else
+		{
+			tmp_buf = grub_malloc(GRUB_DISK_SECTOR_SIZE << GRUB_DISK_CACHE_BITS);
+			if (!tmp_buf)
+				return grub_errno;
+		}
+
+		err = grub_disk_dev_read(disk, grub_disk_to_native_sector(disk, sector),
 			1U << (GRUB_DISK_CACHE_BITS
 				+ GRUB_DISK_SECTOR_BITS
 				- disk->log_sector_size), tmp_buf);
 		if (!err)
-		{
-			/* Copy it and store it in the disk cache.  */
 			grub_memcpy(buf, tmp_buf + offset, size);
-			grub_disk_cache_store(disk->dev->id, disk->id,
-				sector, tmp_buf);
+		if (cache)
+			grub_disk_cache_commit(cache, !err);
+		else
 			grub_free(tmp_buf);
+		if (!err)
 			return GRUB_ERR_NONE;
-		}
 	}
 
-	grub_free(tmp_buf);
 	grub_errno = GRUB_ERR_NONE;
 
 	{
@@ -430,7 +593,7 @@ grub_disk_read_small_real(grub_disk_t disk, grub_disk_addr_t sector,
 		if (!tmp_buf)
 			return grub_errno;
 
-		if ((disk->dev->disk_read) (disk, grub_disk_to_native_sector(disk, aligned_sector),
+		if (grub_disk_dev_read(disk, grub_disk_to_native_sector(disk, aligned_sector),
 			num, tmp_buf))
 		{
 			grub_error_push();
@@ -501,6 +664,42 @@ grub_disk_read(grub_disk_t disk, grub_disk_addr_t sector,
 		offset &= ((1 << GRUB_DISK_SECTOR_BITS) - 1);
 	}
 
+	/* Large reads go straight from the device into BUF, split only at
+	   max_agglomerate.  Cached copies of the range are dropped, the
+	   caller is not going to read them again and their ways are better
+	   spent on metadata.  */
+	while (size >= (GRUB_DISK_BYPASS_BLOCKS
+		<< (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS)))
+	{
+		grub_disk_addr_t blocks, i;
+		grub_err_t err;
+
+		blocks = size >> (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS);
+		if (disk->max_agglomerate && blocks > disk->max_agglomerate)
+			blocks = disk->max_agglomerate;
+
+		for (i = 0; i < blocks; i++)
+			grub_disk_cache_invalidate(disk->dev->id, disk->id,
+				sector + (i << GRUB_DISK_CACHE_BITS));
+
+		err = grub_disk_dev_read(disk, grub_disk_to_native_sector(disk, sector),
+			blocks << (GRUB_DISK_CACHE_BITS
+				+ GRUB_DISK_SECTOR_BITS
+				- disk->log_sector_size),
+			buf);
+		if (err)
+			return err;
+
+		if (disk->read_hook)
+			(disk->read_hook) (sector, 0, blocks << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS),
+				buf, disk->read_hook_data);
+
+		sector += blocks << GRUB_DISK_CACHE_BITS;
+		size -= blocks << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS);
+		buf = (char*)buf
+			+ (blocks << (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS));
+	}
+
 	/* Until SIZE is zero...  */
 	while (size >= (GRUB_DISK_CACHE_SIZE << GRUB_DISK_SECTOR_BITS))
 	{
@@ -536,7 +735,7 @@ grub_disk_read(grub_disk_t disk, grub_disk_addr_t sector,
 		{
 			grub_disk_addr_t i;
 
-			err = (disk->dev->disk_read) (disk, grub_disk_to_native_sector(disk, sector),
+			err = grub_disk_dev_read(disk, grub_disk_to_native_sector(disk, sector),
 				agglomerate << (GRUB_DISK_CACHE_BITS
 					+ GRUB_DISK_SECTOR_BITS
 					- disk->log_sector_size),
@@ -646,7 +845,7 @@ grub_disk_write(grub_disk_t disk, grub_disk_addr_t sector,
 
 			grub_disk_cache_invalidate(disk->dev->id, disk->id, sector);
 
-			if ((disk->dev->disk_write) (disk, grub_disk_to_native_sector(disk, sector),
+			if (grub_disk_dev_write(disk, grub_disk_to_native_sector(disk, sector),
 				1, tmp_buf) != GRUB_ERR_NONE)
 			{
 				grub_free(tmp_buf);
@@ -675,7 +874,7 @@ grub_disk_write(grub_disk_t disk, grub_disk_addr_t sector,
 					<< (GRUB_DISK_CACHE_BITS + GRUB_DISK_SECTOR_BITS
 						- disk->log_sector_size));
 
-			if ((disk->dev->disk_write) (disk, grub_disk_to_native_sector(disk, sector),
+			if (grub_disk_dev_write(disk, grub_disk_to_native_sector(disk, sector),
 				n, buf) != GRUB_ERR_NONE)
 				goto finish;
 
@@ -694,6 +893,55 @@ finish:
 	return grub_errno;
 }
 
+/*
+ * Release COUNT sectors starting at SECTOR.  Without ZERO this is only a
+ * hint and partial native sectors at either end are left alone.  With
+ * ZERO the range reads as zeros on success, the caller falls back to
+ * writing zeros when the device cannot do it.
+ */
+grub_err_t
+grub_disk_discard(grub_disk_t disk, grub_disk_addr_t sector,
+	grub_uint64_t count, int zero)
+{
+	grub_partition_t part;
+	grub_disk_addr_t total_sectors, end, s;
+	grub_uint64_t mask = (1ULL << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS)) - 1;
+
+	if (!disk->dev->disk_discard)
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET,
+			"discard is not supported by `%s'", disk->name);
+
+	for (part = disk->partition; part; part = part->parent)
+	{
+		if (sector >= part->len || part->len - sector < count)
+			return grub_error(GRUB_ERR_OUT_OF_RANGE,
+				N_("attempt to read or write outside of partition"));
+		sector += part->start;
+	}
+
+	total_sectors = disk->total_sectors << (disk->log_sector_size - GRUB_DISK_SECTOR_BITS);
+	if (total_sectors <= sector || count > total_sectors - sector)
+		return grub_error(GRUB_ERR_OUT_OF_RANGE,
+			N_("attempt to read or write outside of disk `%s'"), disk->name);
+
+	end = (sector + count) & ~mask;
+	if (zero && ((sector | count) & mask))
+		return grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET,
+			"unaligned discard on `%s'", disk->name);
+	sector = (sector + mask) & ~mask;
+	if (end <= sector)
+		return GRUB_ERR_NONE;
+
+	if (((end - sector) >> GRUB_DISK_CACHE_BITS) >= grub_disk_cache_num)
+		grub_disk_cache_invalidate_all();
+	else
+		for (s = sector & ~((grub_disk_addr_t)GRUB_DISK_CACHE_SIZE - 1); s < end; s += GRUB_DISK_CACHE_SIZE)
+			grub_disk_cache_invalidate(disk->dev->id, disk->id, s);
+
+	return (disk->dev->disk_discard) (disk, grub_disk_to_native_sector(disk, sector),
+		grub_disk_to_native_sector(disk, end - sector), zero);
+}
+
 struct part_ent
 {
 	struct part_ent* next;
@@ -22,6 +22,12 @@
 
 void grub_module_init_windisk(void);
 void grub_module_init_loopback(void);
+void grub_module_init_imgdisk(void);
+
+void grub_module_init_xzio(void);
+void grub_module_init_zstdio(void);
+void grub_module_init_vhd(void);
+void grub_module_init_vhdx(void);
 
 void grub_module_init_part_gpt(void);
 void grub_module_init_part_msdos(void);
@@ -36,8 +42,16 @@ void grub_module_init_wim(void);
 void
 grub_module_init(void)
 {
+#ifdef _WIN32
 	grub_module_init_windisk();
+#endif
 	grub_module_init_loopback();
+	grub_module_init_imgdisk();
+
+	grub_module_init_xzio();
+	grub_module_init_zstdio();
+	grub_module_init_vhd();
+	grub_module_init_vhdx();
 
 	grub_module_init_part_gpt();
 	grub_module_init_part_msdos();
@@ -52,6 +66,12 @@ grub_module_init(void)
 
 void grub_module_fini_windisk(void);
 void grub_module_fini_loopback(void);
+void grub_module_fini_imgdisk(void);
+
+void grub_module_fini_xzio(void);
+void grub_module_fini_zstdio(void);
+void grub_module_fini_vhd(void);
+void grub_module_fini_vhdx(void);
 
 void grub_module_fini_part_gpt(void);
 void grub_module_fini_part_msdos(void);
@@ -66,8 +86,16 @@ void grub_module_fini_wim(void);
 void
 grub_module_fini(void)
 {
+#ifdef _WIN32
 	grub_module_fini_windisk();
+#endif
 	grub_module_fini_loopback();
+	grub_module_fini_imgdisk();
+
+	grub_module_fini_xzio();
+	grub_module_fini_zstdio();
+	grub_module_fini_vhd();
+	grub_module_fini_vhdx();
 
 	grub_module_fini_part_gpt();
 	grub_module_fini_part_msdos();
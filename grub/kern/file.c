@@ -53,14 +53,61 @@ grub_file_get_disk_name(const char* name)
 	return 0;
 }
 
+/* Stack the first matching decompression filter and then the first
+   matching disk image filter on top of FILE.  Returns the file to use
+   instead of FILE, or 0 with FILE closed when a filter fails.  */
+grub_file_t
+grub_file_apply_filters(grub_file_t file, enum grub_file_type type)
+{
+	grub_file_t last_file = 0;
+	grub_file_filter_id_t filter;
+
+	for (filter = GRUB_FILE_FILTER_COMPRESSION_FIRST;
+		file && filter <= GRUB_FILE_FILTER_COMPRESSION_LAST;
+		filter++)
+	{
+		if (grub_file_filters[filter])
+		{
+			last_file = file;
+			file = grub_file_filters[filter](file, type);
+			if (file && file != last_file)
+			{
+				if (last_file->name)
+					file->name = grub_strdup(last_file->name);
+				grub_errno = GRUB_ERR_NONE;
+				break;
+			}
+		}
+	}
+	for (filter = GRUB_FILE_FILTER_VDISK_FIRST;
+		file && filter <= GRUB_FILE_FILTER_VDISK_LAST; filter++)
+	{
+		if (grub_file_filters[filter])
+		{
+			last_file = file;
+			file = grub_file_filters[filter](file, type);
+			if (file && file != last_file)
+			{
+				if (last_file->name)
+					file->name = grub_strdup(last_file->name);
+				grub_errno = GRUB_ERR_NONE;
+				break;
+			}
+		}
+	}
+	if (!file)
+		grub_file_close(last_file);
+
+	return file;
+}
+
 grub_file_t
 grub_file_open(const char* name, enum grub_file_type type)
 {
 	grub_disk_t disk = 0;
-	grub_file_t file = 0, last_file = 0;
+	grub_file_t file = 0;
 	char* disk_name;
 	const char* file_name;
-	grub_file_filter_id_t filter;
 
 	/* Reset grub_errno before we start. */
 	grub_errno = GRUB_ERR_NONE;
@@ -109,41 +156,7 @@ grub_file_open(const char* name, enum grub_file_type type)
 	file->name = grub_strdup(name);
 	grub_errno = GRUB_ERR_NONE;
 
-	for (filter = GRUB_FILE_FILTER_COMPRESSION_FIRST;
-		file && filter <= GRUB_FILE_FILTER_COMPRESSION_LAST;
-		filter++)
-	{
-		if (grub_file_filters[filter])
-		{
-			last_file = file;
-			file = grub_file_filters[filter](file, type);
-			if (file && file != last_file)
-			{
-				file->name = grub_strdup(name);
-				grub_errno = GRUB_ERR_NONE;
-				break;
-			}
-		}
-	}
-	for (filter = GRUB_FILE_FILTER_VDISK_FIRST;
-		file && filter <= GRUB_FILE_FILTER_VDISK_LAST; filter++)
-	{
-		if (grub_file_filters[filter])
-		{
-			last_file = file;
-			file = grub_file_filters[filter](file, type);
-			if (file && file != last_file)
-			{
-				file->name = grub_strdup(name);
-				grub_errno = GRUB_ERR_NONE;
-				break;
-			}
-		}
-	}
-	if (!file)
-		grub_file_close(last_file);
-
-	return file;
+	return grub_file_apply_filters(file, type);
 
 fail:
 	grub_free(disk_name);
@@ -157,6 +170,41 @@ fail:
 	return 0;
 }
 
+/* Open the entry described by INFO, as passed to a fs_dir hook of FS on
+   DISK.  The file must be closed before the hook returns and DISK stays
+   open when it is.  No filters are applied.  */
+grub_file_t
+grub_file_open_entry(grub_disk_t disk, grub_fs_t fs,
+	const struct grub_dirhook_info* info)
+{
+	grub_file_t file;
+
+	grub_errno = GRUB_ERR_NONE;
+
+	if (!fs->fs_open_entry || !info->entry)
+	{
+		grub_error(GRUB_ERR_NOT_IMPLEMENTED_YET,
+			"%s cannot open directory entries", fs->name);
+		return 0;
+	}
+
+	file = (grub_file_t)grub_zalloc(sizeof(*file));
+	if (!file)
+		return 0;
+
+	file->disk = disk;
+	file->borrowed_disk = 1;
+	file->fs = fs;
+
+	if ((fs->fs_open_entry) (file, info->entry) != GRUB_ERR_NONE)
+	{
+		grub_free(file);
+		return 0;
+	}
+
+	return file;
+}
+
 grub_disk_read_hook_t grub_file_progress_hook;
 
 grub_ssize_t
@@ -208,7 +256,7 @@ grub_file_close(grub_file_t file)
 	if (file->fs->fs_close)
 		(file->fs->fs_close) (file);
 
-	if (file->disk)
+	if (file->disk && !file->borrowed_disk)
 		grub_disk_close(file->disk);
 	grub_free(file->name);
 	grub_free(file);
@@ -21,11 +21,14 @@
 #include <grub/err.h>
 #include <grub/mm.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <grub/types.h>
 #include <grub/charset.h>
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 
 union printf_arg
 {
@@ -179,7 +182,11 @@ grub_real_dprintf(const char* file, const int line, const char* condition,
 		va_start(args, fmt);
 		grub_vsnprintf(debug_info, 512, fmt, args);
 		va_end(args);
+#ifdef _WIN32
 		MessageBoxA(NULL, debug_info, debug_title, MB_OK);
+#else
+		fprintf(stderr, "%s: %s", debug_title, debug_info);
+#endif
 	}
 }
 
@@ -1096,7 +1103,11 @@ grub_fatal(const char* fmt, ...)
 	grub_vsnprintf(buf, 256, fmt, ap);
 	va_end(ap);
 
+#ifdef _WIN32
 	MessageBoxA(NULL, buf, "GRUB Fatal Error", MB_OK | MB_ICONERROR);
+#else
+	fprintf(stderr, "GRUB Fatal Error: %s\n", buf);
+#endif
 	exit(-1);
 }
 
@@ -21,7 +21,15 @@
 #include <grub/time.h>
 #include <time.h>
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define gmtime_s(tm, t)	(gmtime_r(t, tm) ? 0 : -1)
+#endif
 
 grub_err_t
 grub_get_datetime(struct grub_datetime* datetime)
@@ -52,6 +60,7 @@ grub_set_datetime(struct grub_datetime* datetime __attribute__((unused)))
 		"no clock setting routine available");
 }
 
+#ifdef _WIN32
 grub_uint64_t
 grub_get_time_ms(void)
 {
@@ -70,3 +79,19 @@ grub_millisleep(grub_uint32_t ms)
 {
 	Sleep(ms);
 }
+#else
+grub_uint64_t
+grub_get_time_ms(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (grub_uint64_t)ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
+}
+
+void
+grub_millisleep(grub_uint32_t ms)
+{
+	usleep((useconds_t)ms * 1000);
+}
+#endif
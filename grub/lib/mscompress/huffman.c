@@ -125,6 +125,28 @@ grub_huffman_alphabet(struct huffman_alphabet* alphabet,
 		return -1;
 	}
 
+	/* Populate direct decode table with every code short enough to
+	 * be resolved by a single index; longer codes are left as zero
+	 * and fall back to grub_huffman_sym().
+	 */
+	grub_memset(alphabet->fast, 0, sizeof(alphabet->fast));
+	if (empty)
+		return 0;
+	for (bits = 1; bits <= HUFFMAN_FAST_BITS; bits++)
+	{
+		sym = &alphabet->huf[bits - 1];
+		for (huf = (sym->start >> sym->shift);
+			huf < (sym->start >> sym->shift) + sym->freq; huf++)
+		{
+			grub_uint16_t entry = ((sym->raw[huf] << HUFFMAN_FAST_LEN_BITS) | bits);
+			for (prefix = (huf << (HUFFMAN_FAST_BITS - bits));
+				prefix < ((huf + 1) << (HUFFMAN_FAST_BITS - bits)); prefix++)
+			{
+				alphabet->fast[prefix] = entry;
+			}
+		}
+	}
+
 	return 0;
 }
 
@@ -88,6 +88,8 @@ struct lzx_output_stream
 	grub_size_t offset;
 	/** End of current block within stream */
 	grub_size_t threshold;
+	/** Capacity of output buffer */
+	grub_size_t max_len;
 };
 
 /** LZX decompressor */
@@ -97,9 +99,18 @@ struct lzx
 	struct lzx_input_stream input;
 	/** Output stream */
 	struct lzx_output_stream output;
-	/** Accumulator */
-	grub_uint32_t accumulator;
-	/** Number of bits in accumulator */
+	/** Bit buffer, refilled up to 64 bits at a time */
+	grub_uint64_t buffer;
+	/** Number of valid bits in bit buffer */
+	unsigned int buffer_bits;
+	/** Input offset of next word to load into bit buffer */
+	grub_size_t buffer_offset;
+	/** Number of bits a 16-bit accumulator would hold
+	 *
+	 * The stream position seen by lzx_align() and lzx_getbytes()
+	 * (input.offset) keeps the word-at-a-time semantics of the
+	 * format, independently of how far ahead the bit buffer reads.
+	 */
 	unsigned int bits;
 	/** Block type */
 	enum lzx_block_type block_type;
@@ -155,8 +166,17 @@ struct lzx
 	grub_uint8_t length_lengths[LZX_LENGTH_CODES];
 };
 
- /** Base positions, indexed by position slot */
-static unsigned int lzx_position_base[LZX_POSITION_SLOTS];
+ /** Base positions, indexed by position slot
+  *
+  * Precomputed so that concurrent decompressors never race on a
+  * lazily initialised table.
+  */
+static const unsigned int lzx_position_base[LZX_POSITION_SLOTS] =
+{
+	0, 1, 2, 3, 4, 6, 8, 12, 16, 24,
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+	1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576,
+};
 
 /**
  * Calculate number of footer bits for a given position slot
@@ -174,6 +194,38 @@ static inline unsigned int lzx_footer_bits(unsigned int position_slot)
 		return 17;
 }
 
+/**
+ * Refill LZX bit buffer
+ *
+ * @v lzx    Decompressor
+ */
+static inline void
+lzx_refill(struct lzx* lzx)
+{
+	while ((lzx->buffer_bits <= 48) &&
+		((lzx->buffer_offset + sizeof(grub_uint16_t)) <= lzx->input.len))
+	{
+		grub_uint64_t word = grub_le_to_cpu16(grub_get_unaligned16(
+			lzx->input.data + lzx->buffer_offset));
+		lzx->buffer |= (word << (48 - lzx->buffer_bits));
+		lzx->buffer_bits += 16;
+		lzx->buffer_offset += sizeof(grub_uint16_t);
+	}
+}
+
+/**
+ * Restart LZX bit buffer at the current input offset
+ *
+ * @v lzx    Decompressor
+ */
+static inline void
+lzx_resync(struct lzx* lzx)
+{
+	lzx->buffer = 0;
+	lzx->buffer_bits = 0;
+	lzx->buffer_offset = lzx->input.offset;
+}
+
 /**
  * Attempt to accumulate bits from LZX bitstream
  *
@@ -185,21 +237,21 @@ static inline unsigned int lzx_footer_bits(unsigned int position_slot)
  * bitstream; callers must check that sufficient bits are available
  * before using the value.
  */
-static int
+static inline int
 lzx_accumulate(struct lzx* lzx, unsigned int bits)
 {
-	const grub_uint16_t* src16;
-
-	/* Accumulate more bits if required */
+	/* Account for bits as a 16-bit accumulator would */
 	if ((lzx->bits < bits) && (lzx->input.offset < lzx->input.len))
 	{
-		src16 = (void*)((char*)lzx->input.data + lzx->input.offset);
-		lzx->input.offset += sizeof(*src16);
-		lzx->accumulator |= (*src16 << (16 - lzx->bits));
+		lzx->input.offset += sizeof(grub_uint16_t);
 		lzx->bits += 16;
 	}
 
-	return (lzx->accumulator >> 16);
+	/* Keep the bit buffer ahead of the accounted bits */
+	if (lzx->buffer_bits < 32)
+		lzx_refill(lzx);
+
+	return (int)(lzx->buffer >> 48);
 }
 
 /**
@@ -209,7 +261,7 @@ lzx_accumulate(struct lzx* lzx, unsigned int bits)
  * @v bits    Number of bits to consume
  * @ret rc    Return status code
  */
-static int lzx_consume(struct lzx* lzx, unsigned int bits)
+static inline int lzx_consume(struct lzx* lzx, unsigned int bits)
 {
 	/* Fail if insufficient bits are available */
 	if (lzx->bits < bits)
@@ -218,7 +270,8 @@ static int lzx_consume(struct lzx* lzx, unsigned int bits)
 	}
 
 	/* Consume bits */
-	lzx->accumulator <<= bits;
+	lzx->buffer <<= bits;
+	lzx->buffer_bits -= bits;
 	lzx->bits -= bits;
 
 	return 0;
@@ -262,8 +315,11 @@ static int lzx_align(struct lzx* lzx, unsigned int bits)
 	if (pad < 0)
 		return pad;
 
-	/* Consume all accumulated bits */
+	/* Drop the rest of the current word, whole words read ahead of it
+	 * go back to the input */
+	lzx->input.offset -= ((lzx->bits / 16) * sizeof(grub_uint16_t));
 	lzx_consume(lzx, lzx->bits);
+	lzx_resync(lzx);
 
 	return 0;
 }
@@ -288,6 +344,7 @@ static int lzx_getbytes(struct lzx* lzx, void* data, grub_size_t len)
 	if (data)
 		grub_memmove(data, (lzx->input.data + lzx->input.offset), len);
 	lzx->input.offset += len;
+	lzx_resync(lzx);
 
 	return 0;
 }
@@ -299,9 +356,10 @@ static int lzx_getbytes(struct lzx* lzx, void* data, grub_size_t len)
  * @v alphabet    Huffman alphabet
  * @ret raw    Raw symbol, or negative error
  */
-static int lzx_decode(struct lzx* lzx, struct huffman_alphabet* alphabet)
+static inline int lzx_decode(struct lzx* lzx, struct huffman_alphabet* alphabet)
 {
 	struct huffman_symbols* sym;
+	unsigned int entry;
 	int huf;
 	int rc;
 
@@ -310,6 +368,15 @@ static int lzx_decode(struct lzx* lzx, struct huffman_alphabet* alphabet)
 	if (huf < 0)
 		return huf;
 
+	/* Decode short symbol with a single lookup */
+	entry = grub_huffman_fast(alphabet, huf);
+	if (entry)
+	{
+		if ((rc = lzx_consume(lzx, entry & ((1 << HUFFMAN_FAST_LEN_BITS) - 1))) != 0)
+			return rc;
+		return (entry >> HUFFMAN_FAST_LEN_BITS);
+	}
+
 	/* Decode symbol */
 	sym = grub_huffman_sym(alphabet, huf);
 
@@ -560,6 +627,8 @@ static int lzx_block_header(struct lzx* lzx)
 		block_len = ((len_high << 8) | len_low);
 	}
 	lzx->output.threshold = (lzx->output.offset + block_len);
+	if (lzx->output.threshold > lzx->output.max_len)
+		return -1;
 
 	/* Handle block type */
 	switch (block_type)
@@ -610,10 +679,14 @@ static int lzx_uncompressed(struct lzx* lzx)
 	len = (lzx->output.threshold - lzx->output.offset);
 	if ((rc = lzx_getbytes(lzx, data, len)) != 0)
 		return rc;
+	lzx->output.offset += len;
 
 	/* Align input stream */
 	if (len % 2)
+	{
 		lzx->input.offset++;
+		lzx_resync(lzx);
+	}
 
 	return 0;
 }
@@ -715,6 +788,10 @@ static int lzx_token(struct lzx* lzx)
 	{
 		return -1;
 	}
+	if (match_length > lzx->output.max_len - lzx->output.offset)
+	{
+		return -1;
+	}
 	if (lzx->output.data)
 	{
 		copy = &lzx->output.data[lzx->output.offset];
@@ -769,10 +846,12 @@ static void lzx_translate_jumps(struct lzx* lzx)
  * @v data    Compressed data
  * @v len    Length of compressed data
  * @v buf    Decompression buffer, or NULL
+ * @v max_len    Capacity of decompression buffer
  * @ret out_len    Length of decompressed data, or negative error
  */
 grub_ssize_t
-grub_lzx_decompress(const void* data, grub_size_t len, void* buf)
+grub_lzx_decompress(const void* data, grub_size_t len, void* buf,
+	grub_size_t max_len)
 {
 	struct lzx lzx;
 	unsigned int i;
@@ -784,21 +863,12 @@ grub_lzx_decompress(const void* data, grub_size_t len, void* buf)
 		return -1;
 	}
 
-	/* Initialise global state, if required */
-	if (!lzx_position_base[LZX_POSITION_SLOTS - 1])
-	{
-		for (i = 1; i < LZX_POSITION_SLOTS; i++)
-		{
-			lzx_position_base[i] = lzx_position_base[i - 1]
-				+ (1 << lzx_footer_bits(i - 1));
-		}
-	}
-
 	/* Initialise decompressor */
 	grub_memset(&lzx, 0, sizeof(lzx));
 	lzx.input.data = data;
 	lzx.input.len = len;
 	lzx.output.data = buf;
+	lzx.output.max_len = max_len;
 	for (i = 0; i < LZX_REPEATED_OFFSETS; i++)
 		lzx.repeated_offset[i] = 1;
 
@@ -37,6 +37,18 @@ typedef grub_uint16_t huffman_raw_symbol_t;
  /** Quick lookup shift */
 #define HUFFMAN_QL_SHIFT (HUFFMAN_BITS - HUFFMAN_QL_BITS)
 
+/** Direct decode length for a Huffman symbol (in bits)
+ *
+ * Codes no longer than this are resolved with a single table index.
+ */
+#define HUFFMAN_FAST_BITS 10
+
+/** Direct decode shift */
+#define HUFFMAN_FAST_SHIFT (HUFFMAN_BITS - HUFFMAN_FAST_BITS)
+
+/** Bits used for the code length in a direct decode entry */
+#define HUFFMAN_FAST_LEN_BITS 5
+
 /** A Huffman-coded set of symbols of a given length */
 struct huffman_symbols
 {
@@ -64,6 +76,13 @@ struct huffman_alphabet
 	struct huffman_symbols huf[HUFFMAN_BITS];
 	/** Quick lookup table */
 	grub_uint8_t lookup[1 << HUFFMAN_QL_BITS];
+	/** Direct decode table
+	 *
+	 * Each entry holds (raw symbol << HUFFMAN_FAST_LEN_BITS) | length
+	 * for codes of at most HUFFMAN_FAST_BITS bits, or zero if the
+	 * prefix belongs to a longer code.
+	 */
+	grub_uint16_t fast[1 << HUFFMAN_FAST_BITS];
 	/** Raw symbols
 	 *
 	 * Ordered by Huffman-coded symbol length, then by symbol
@@ -97,6 +116,19 @@ grub_huffman_raw(struct huffman_symbols* sym, unsigned int huf)
 	return sym->raw[huf >> sym->shift];
 }
 
+/**
+ * Look up Huffman symbol in the direct decode table
+ *
+ * @v alphabet    Huffman alphabet
+ * @v huf     Raw input value (normalised to HUFFMAN_BITS bits)
+ * @ret entry    Direct decode entry, or zero for a long code
+ */
+static inline __attribute__((always_inline)) unsigned int
+grub_huffman_fast(struct huffman_alphabet* alphabet, unsigned int huf)
+{
+	return alphabet->fast[huf >> HUFFMAN_FAST_SHIFT];
+}
+
 int
 grub_huffman_alphabet(struct huffman_alphabet* alphabet,
 	grub_uint8_t* lengths, unsigned int count);
@@ -105,9 +137,11 @@ struct huffman_symbols*
 grub_huffman_sym(struct huffman_alphabet* alphabet, unsigned int huf);
 
 grub_ssize_t
-grub_lzx_decompress(const void* data, grub_size_t len, void* buf);
+grub_lzx_decompress(const void* data, grub_size_t len, void* buf,
+	grub_size_t max_len);
 
 grub_ssize_t
-grub_xca_decompress(const void* data, grub_size_t len, void* buf);
+grub_xca_decompress(const void* data, grub_size_t len, void* buf,
+	grub_size_t max_len);
 
 #endif /* ! GRUB_MSCOMPRESS_HEADER */
@@ -45,21 +45,21 @@ struct xca_huf_len
 };
 GRUB_PACKED_END
 
-/** Get word from source data stream */
+/** Get word from source data stream, advancing the stream */
 static inline grub_uint16_t
-XCA_GET16(const void* src)
+XCA_GET16(const void** src)
 {
-	const grub_uint16_t* src16 = src;
-	src = (const grub_uint8_t*)src + sizeof(*src16);
-	return *src16;
+	const grub_uint8_t* src8 = *src;
+	*src = src8 + sizeof(grub_uint16_t);
+	return grub_le_to_cpu16(grub_get_unaligned16(src8));
 }
 
-/** Get byte from source data stream */
+/** Get byte from source data stream, advancing the stream */
 static inline grub_uint8_t
-XCA_GET8(const void* src)
+XCA_GET8(const void** src)
 {
-	const grub_uint8_t* src8 = src;
-	src = (const grub_uint8_t*)src + sizeof(*src8);
+	const grub_uint8_t* src8 = *src;
+	*src = src8 + sizeof(grub_uint8_t);
 	return *src8;
 }
 
@@ -88,10 +88,12 @@ xca_huf_len(const struct xca_huf_len* lengths, unsigned int symbol)
  * @v data    Compressed data
  * @v len    Length of compressed data
  * @v buf    Decompression buffer, or NULL
+ * @v max_len    Capacity of decompression buffer
  * @ret out_len    Length of decompressed data, or negative error
  */
 grub_ssize_t
-grub_xca_decompress(const void* data, grub_size_t len, void* buf)
+grub_xca_decompress(const void* data, grub_size_t len, void* buf,
+	grub_size_t max_len)
 {
 	const void* src = data;
 	const void* end = (grub_uint8_t*)src + len;
@@ -103,6 +105,7 @@ grub_xca_decompress(const void* data, grub_size_t len, void* buf)
 	grub_uint32_t accum = 0;
 	int extra_bits = 0;
 	unsigned int huf;
+	unsigned int bits;
 	struct huffman_symbols* sym;
 	unsigned int raw;
 	unsigned int match_len;
@@ -132,24 +135,34 @@ grub_xca_decompress(const void* data, grub_size_t len, void* buf)
 				return rc;
 
 			/* Initialise state */
-			accum = XCA_GET16(src);
+			accum = XCA_GET16(&src);
 			accum <<= 16;
-			accum |= XCA_GET16(src);
+			accum |= XCA_GET16(&src);
 			extra_bits = 16;
 
 			/* Determine next threshold */
 			out_len_threshold = (out_len + XCA_BLOCK_SIZE);
 		}
 
-		/* Determine symbol */
+		/* Determine symbol, short codes with a single lookup */
 		huf = (accum >> (32 - HUFFMAN_BITS));
-		sym = grub_huffman_sym(&xca.alphabet, huf);
-		raw = grub_huffman_raw(sym, huf);
-		accum <<= grub_huffman_len(sym);
-		extra_bits -= grub_huffman_len(sym);
+		raw = grub_huffman_fast(&xca.alphabet, huf);
+		if (raw)
+		{
+			bits = (raw & ((1 << HUFFMAN_FAST_LEN_BITS) - 1));
+			raw >>= HUFFMAN_FAST_LEN_BITS;
+		}
+		else
+		{
+			sym = grub_huffman_sym(&xca.alphabet, huf);
+			raw = grub_huffman_raw(sym, huf);
+			bits = grub_huffman_len(sym);
+		}
+		accum <<= bits;
+		extra_bits -= bits;
 		if (extra_bits < 0)
 		{
-			accum |= (XCA_GET16(src) << (-extra_bits));
+			accum |= (XCA_GET16(&src) << (-extra_bits));
 			extra_bits += 16;
 		}
 
@@ -157,6 +170,8 @@ grub_xca_decompress(const void* data, grub_size_t len, void* buf)
 		if (raw < XCA_END_MARKER)
 		{
 			/* Literal symbol - add to output stream */
+			if (out_len >= max_len)
+				return -1;
 			if (buf)
 				*(out++) = raw;
 			out_len++;
@@ -175,10 +190,10 @@ grub_xca_decompress(const void* data, grub_size_t len, void* buf)
 			match_len = (raw & 0x0f);
 			if (match_len == 0x0f)
 			{
-				match_len = XCA_GET8(src);
+				match_len = XCA_GET8(&src);
 				if (match_len == 0xff)
 				{
-					match_len = XCA_GET16(src);
+					match_len = XCA_GET16(&src);
 				}
 				else
 				{
@@ -200,11 +215,15 @@ grub_xca_decompress(const void* data, grub_size_t len, void* buf)
 			extra_bits -= match_offset_bits;
 			if (extra_bits < 0)
 			{
-				accum |= (XCA_GET16(src) << (-extra_bits));
+				accum |= (XCA_GET16(&src) << (-extra_bits));
 				extra_bits += 16;
 			}
 
 			/* Copy data */
+			if (match_offset > out_len)
+				return -1;
+			if (match_len > max_len - out_len)
+				return -1;
 			out_len += match_len;
 			if (buf)
 			{
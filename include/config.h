@@ -1,9 +1,11 @@
 #pragma once
 
+#ifdef _MSC_VER
 #pragma warning(disable: 4146)	// "unary minus operator applied to unsigned type, result still unsigned"
 #pragma warning(disable: 4244)	// "Conversion from X to Y, possible loss of data"
 #pragma warning(disable: 4267)	// "Conversion from X to Y, possible loss of data"
 #pragma warning(disable: 4334)	// "Result of 32-bit shift implicitly converted to 64 bits"
+#endif
 
 #if defined(_M_X64) || defined(__x86_64__)
 #define GRUB_TARGET_CPU "x86_64"
@@ -34,8 +36,15 @@
 #define N_(x) x
 #define _(x) x
 
+#ifdef _MSC_VER
 #define __attribute__(x)
 #define __attribute(x)
+#else
+// MSVC keywords and SAL annotations the grub headers use
+#define __pragma(x)			_Pragma(#x)
+#define _Check_return_
+#define _Printf_format_string_
+#endif
 
 #define GRUB_MOD_LICENSE(x)
 
@@ -9,6 +9,80 @@
 #ifndef DIRENT_H
 #define DIRENT_H
 
+#ifndef _WIN32
+/*
+ * Outside Windows the system has dirent.h, only the wide character calls
+ * fatio walks host directories with are added on top of it.
+ */
+/* fatfs/ff.h has a DIR of its own */
+#define DIR host_DIR
+#include_next <dirent.h>
+#undef DIR
+#include <win32.h>
+
+struct _wdirent {
+	/* File type */
+	int d_type;
+
+	/* File name */
+	wchar_t d_name[PATH_MAX+1];
+};
+typedef struct _wdirent _wdirent;
+
+struct _WDIR {
+	host_DIR *dir;
+	struct _wdirent ent;
+};
+typedef struct _WDIR _WDIR;
+
+static inline _WDIR *
+_wopendir(const wchar_t *dirname)
+{
+	char *mb = win32_path(dirname);
+	_WDIR *dirp = malloc(sizeof(_WDIR));
+
+	if (mb && dirp && (dirp->dir = opendir(mb)) != NULL) {
+		free(mb);
+		return dirp;
+	}
+	free(mb);
+	free(dirp);
+	return NULL;
+}
+
+static inline struct _wdirent *
+_wreaddir(_WDIR *dirp)
+{
+	struct dirent *ent;
+
+	/* Names that do not convert to the locale charset are skipped */
+	while ((ent = readdir(dirp->dir)) != NULL) {
+		size_t n = mbstowcs(dirp->ent.d_name, ent->d_name, PATH_MAX);
+		if (n == (size_t)-1 || n == PATH_MAX)
+			continue;
+		dirp->ent.d_type = ent->d_type;
+		return &dirp->ent;
+	}
+	return NULL;
+}
+
+static inline int
+_wclosedir(_WDIR *dirp)
+{
+	int rc = closedir(dirp->dir);
+
+	free(dirp);
+	return rc;
+}
+
+#define wdirent _wdirent
+#define WDIR _WDIR
+#define wopendir _wopendir
+#define wreaddir _wreaddir
+#define wclosedir _wclosedir
+
+#else
+
 /* Hide warnings about unreferenced local functions */
 #if defined(__clang__)
 #	pragma clang diagnostic ignored "-Wunused-function"
@@ -1236,4 +1310,5 @@ dirent_set_errno(int error)
 #ifdef __cplusplus
 }
 #endif
+#endif /* _WIN32 */
 #endif /*DIRENT_H*/
@@ -1,7 +1,6 @@
 #pragma once
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include <win32.h>
 
 #include <grub/disk.h>
 
@@ -13,6 +12,21 @@ struct fatio_ctx
 	grub_uint64_t total_sectors;
 	HANDLE volume;
 	BYTE* buffer;
+	// The volume was created empty by this run, see fatio_create_image
+	bool fresh;
+};
+
+// Number of cluster sizes a plan is kept for, 512 bytes to 128 KB
+#define FATIO_PLAN_CLUSTERS 9
+
+// Space a tree of files takes on a new volume
+struct fatio_plan
+{
+	UINT64 bytes;
+	// Allocated bytes with 512 << i byte clusters
+	UINT64 used[FATIO_PLAN_CLUSTERS];
+	UINT32 files;
+	UINT32 dirs;
 };
 
 extern struct fatio_ctx g_ctx;
@@ -30,18 +44,42 @@ fatio_remove_trailing_backslash(wchar_t* path);
 bool
 fatio_set_disk(unsigned disk_id, unsigned part_id);
 
+bool
+fatio_set_image(const wchar_t* path, unsigned part_id);
+
+bool
+fatio_create_image(const wchar_t* path, unsigned part_id, grub_uint64_t size, BYTE fmt);
+
+UINT64
+fatio_plan_name(size_t len);
+
+void
+fatio_plan_file(struct fatio_plan* plan, UINT64 size);
+
+void
+fatio_plan_dir(struct fatio_plan* plan, UINT64 entry_bytes);
+
+grub_uint64_t
+fatio_plan_image(const struct fatio_plan* plan, BYTE fmt, UINT sector_size, DWORD* au_size);
+
 void
 fatio_unset_disk(void);
 
 bool
 fatio_copy(const wchar_t* in_name, const wchar_t* out_name, bool update);
 
+bool
+fatio_copy_plan(const wchar_t* in_name, struct fatio_plan* plan);
+
 bool
 fatio_mkdir(const wchar_t* path);
 
 bool
 fatio_extract(const wchar_t* src);
 
+bool
+fatio_extract_plan(const wchar_t* src, struct fatio_plan* plan);
+
 bool
 fatio_dump(const wchar_t* in_name, const wchar_t* out_name);
 
@@ -49,7 +87,7 @@ bool
 fatio_remove(const wchar_t* path);
 
 bool
-fatio_list(const wchar_t* path);
+fatio_list(const wchar_t* path, bool recursive);
 
 bool
 fatio_move(const wchar_t* in_name, const wchar_t* out_name);
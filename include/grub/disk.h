@@ -39,6 +39,7 @@ enum grub_disk_dev_id
 	GRUB_DISK_DEVICE_CRYPTODISK_ID,
 	GRUB_DISK_DEVICE_PROCFS_ID,
 	GRUB_DISK_DEVICE_UEFI_ID,
+	GRUB_DISK_DEVICE_IMGDISK_ID,
 };
 
 struct grub_disk;
@@ -80,6 +81,12 @@ struct grub_disk_dev
 	grub_err_t(*disk_write) (struct grub_disk* disk, grub_disk_addr_t sector,
 		grub_size_t size, const char* buf);
 
+	/* Release SIZE sectors from the sector SECTOR of the disk DISK.  With
+	   ZERO set they must read as zeros afterwards, a device that cannot
+	   promise that fails with GRUB_ERR_NOT_IMPLEMENTED_YET.  Optional.  */
+	grub_err_t(*disk_discard) (struct grub_disk* disk, grub_disk_addr_t sector,
+		grub_uint64_t size, int zero);
+
 	/* The next disk device.  */
 	struct grub_disk_dev* next;
 };
@@ -139,8 +146,11 @@ typedef struct grub_disk* grub_disk_t;
  */
 #define GRUB_DISK_MAX_SECTORS	(1ULL << (60 - GRUB_DISK_SECTOR_BITS))
 
- /* The maximum number of disk caches.  */
-#define GRUB_DISK_CACHE_NUM	1021
+ /* The default number of disk cache blocks (32MiB), see grub_disk_cache_set_size().  */
+#define GRUB_DISK_CACHE_NUM	1024
+
+/* The number of blocks in one set of the set-associative disk cache.  */
+#define GRUB_DISK_CACHE_WAYS	8
 
 /*
  * The maximum number of disks in an mdraid device.
@@ -233,6 +243,10 @@ grub_err_t grub_disk_write(grub_disk_t disk,
 	grub_off_t offset,
 	grub_size_t size,
 	const void* buf);
+grub_err_t grub_disk_discard(grub_disk_t disk,
+	grub_disk_addr_t sector,
+	grub_uint64_t count,
+	int zero);
 
 grub_uint64_t EXPORT_FUNC(grub_disk_native_sectors) (grub_disk_t disk);
 
@@ -244,8 +258,25 @@ struct grub_disk_cache
 	grub_disk_addr_t sector;
 	char* data;
 	int lock;
+	int valid;
+	grub_uint64_t last_use;
+};
+
+struct grub_disk_cache_stats
+{
+	grub_uint64_t hits;
+	grub_uint64_t misses;
+	grub_uint64_t evictions;
+	grub_size_t size;
+	/* Requests that reached the disk device.  */
+	grub_uint64_t reads;
+	grub_uint64_t writes;
+	grub_uint64_t read_bytes;
+	grub_uint64_t write_bytes;
 };
 
-extern struct grub_disk_cache EXPORT_VAR(grub_disk_cache_table)[GRUB_DISK_CACHE_NUM];
+/* Resize the disk cache to SIZE bytes, 0 disables it.  */
+grub_err_t grub_disk_cache_set_size(grub_size_t size);
+void grub_disk_cache_get_stats(struct grub_disk_cache_stats* stats);
 
 #endif /* ! GRUB_DISK_HEADER */
@@ -20,7 +20,9 @@
 #ifndef GRUB_ERR_HEADER
 #define GRUB_ERR_HEADER	1
 
+#ifdef _MSC_VER
 #include <sal.h>
+#endif
 #include <grub/symbol.h>
 
 #define GRUB_MAX_ERRMSG		256
@@ -176,6 +176,9 @@ struct grub_file
 
 	/* Caller-specific data passed to the read hook.  */
 	void* read_hook_data;
+
+	/* The disk belongs to the caller and is not closed with the file.  */
+	int borrowed_disk;
 };
 typedef struct grub_file* grub_file_t;
 
@@ -222,7 +225,11 @@ grub_file_filter_unregister(grub_file_filter_id_t id)
 /* Get a disk name from NAME.  */
 char* EXPORT_FUNC(grub_file_get_disk_name) (const char* name);
 
+grub_file_t EXPORT_FUNC(grub_file_apply_filters) (grub_file_t file,
+	enum grub_file_type type);
 grub_file_t EXPORT_FUNC(grub_file_open) (const char* name, enum grub_file_type type);
+grub_file_t EXPORT_FUNC(grub_file_open_entry) (grub_disk_t disk, grub_fs_t fs,
+	const struct grub_dirhook_info* info);
 grub_ssize_t EXPORT_FUNC(grub_file_read) (grub_file_t file, void* buf,
 	grub_size_t len);
 grub_off_t EXPORT_FUNC(grub_file_seek) (grub_file_t file, grub_off_t offset);
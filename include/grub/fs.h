@@ -37,6 +37,9 @@ struct grub_dirhook_info
 	unsigned symlink : 1;
 	grub_int64_t mtime;
 	grub_uint64_t inode;
+	/* Filesystem handle of the entry, valid only while the hook runs.
+	   See grub_file_open_entry.  */
+	const void* entry;
 };
 
 typedef int (*grub_fs_dir_hook_t) (const char* filename,
@@ -66,6 +69,10 @@ struct grub_fs
 	/* Close the file FILE.  */
 	grub_err_t(*fs_close) (struct grub_file* file);
 
+	/* Open the entry ENTRY handed to a fs_dir hook and initialize FILE,
+	   without resolving its path again.  Optional.  */
+	grub_err_t(*fs_open_entry) (struct grub_file* file, const void* entry);
+
 	/* Return the label of the disk DISK in LABEL.  The label is
 	   returned in a grub_malloc'ed buffer and should be freed by the
 	   caller.  */
@@ -88,4 +88,17 @@ EXPORT_FUNC(grub_fshelp_read_file) (grub_disk_t disk, grub_fshelp_node_t node,
 	grub_off_t filesize, int log2blocksize,
 	grub_disk_addr_t blocks_start);
 
+/* Like grub_fshelp_read_file, but GET_RUN also returns in *RUN the
+   number of blocks from BLOCK on that are contiguous on disk, or all
+   sparse when it returns 0.  Each such run is read at once.  */
+grub_ssize_t
+EXPORT_FUNC(grub_fshelp_read_file_runs) (grub_disk_t disk, grub_fshelp_node_t node,
+	grub_disk_read_hook_t read_hook,
+	void* read_hook_data,
+	grub_off_t pos, grub_size_t len, char* buf,
+	grub_disk_addr_t(*get_run) (grub_fshelp_node_t node,
+		grub_disk_addr_t block, grub_disk_addr_t* run),
+	grub_off_t filesize, int log2blocksize,
+	grub_disk_addr_t blocks_start);
+
 #endif /* ! GRUB_FSHELP_HEADER */
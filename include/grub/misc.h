@@ -25,7 +25,9 @@
 #include <grub/symbol.h>
 #include <grub/err.h>
 
+#ifdef _MSC_VER
 #include <intrin.h>
+#endif
 
 #define ALIGN_UP(addr, align) \
 	(((addr) + (align) - 1) & ~((align) - 1))
@@ -105,7 +105,7 @@ enum
 	GRUB_NTFS_RF_BLNK = 1
 };
 
-PRAGMA_BEGIN_PACKED;
+GRUB_PACKED_START
 struct grub_ntfs_bpb
 {
 	grub_uint8_t jmp_boot[3];
@@ -131,7 +131,7 @@ struct grub_ntfs_bpb
 	grub_uint64_t num_serial; /* 0x48 */
 	grub_uint32_t checksum; /* 0x50 */
 };
-PRAGMA_END_PACKED;
+GRUB_PACKED_END
 
 struct grub_ntfs_attr
 {
@@ -193,5 +193,5 @@ struct grub_ntfs_rlst
 };
 
 grub_err_t grub_ntfs_read_run_list(struct grub_ntfs_rlst* ctx);
-struct grub_fs grub_ntfs_fs;
+extern struct grub_fs grub_ntfs_fs;
 #endif /* ! GRUB_NTFS_H */
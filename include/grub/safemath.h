@@ -21,10 +21,16 @@
 #ifndef GRUB_SAFEMATH_H
 #define GRUB_SAFEMATH_H 1
 
+#ifdef _MSC_VER
 #include <intsafe.h>
 
 #define grub_add(a, b, res)	(UIntPtrAdd(a, b, (UINT_PTR *)res) != S_OK)
 #define grub_sub(a, b, res)	(UIntPtrSub(a, b, (UINT_PTR *)res) != S_OK)
 #define grub_mul(a, b, res)	(UIntPtrMult(a, b, (UINT_PTR *)res) != S_OK)
+#else
+#define grub_add(a, b, res)	__builtin_add_overflow(a, b, res)
+#define grub_sub(a, b, res)	__builtin_sub_overflow(a, b, res)
+#define grub_mul(a, b, res)	__builtin_mul_overflow(a, b, res)
+#endif
 
 #endif /* GRUB_SAFEMATH_H */
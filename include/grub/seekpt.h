@@ -0,0 +1,80 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GRUB_SEEKPT_HEADER
+#define GRUB_SEEKPT_HEADER	1
+
+#include <grub/types.h>
+#include <grub/err.h>
+
+/* Memory all snapshots of one file may hold.  When it is exceeded the
+   distance between snapshots is doubled and every other one dropped.  */
+#define GRUB_SEEKPT_MEM		(128U << 20)
+
+/* Initial distance between snapshots in the decompressed data.  */
+#define GRUB_SEEKPT_SPACING	(32ULL << 20)
+
+/* Going forward, decode rather than resume when the point is closer.  */
+#define GRUB_SEEKPT_MIN_SKIP	(1ULL << 20)
+
+/* A place a decompressor can resume from.  */
+struct grub_seekpt
+{
+	/* Offset in the decompressed data.  */
+	grub_uint64_t uoff;
+	/* Offset of the next block, frame or chunk in the compressed file.  */
+	grub_uint64_t coff;
+	/* Decoder snapshot, NULL where the format itself starts afresh.  */
+	void* state;
+	grub_size_t state_size;
+};
+
+/* Restart points of one file, sorted by UOFF.  */
+struct grub_seekpt_list
+{
+	struct grub_seekpt* pt;
+	grub_size_t count;
+	grub_size_t max;
+	grub_uint64_t spacing;
+	grub_size_t mem;
+};
+
+void
+grub_seekpt_init(struct grub_seekpt_list* list);
+
+void
+grub_seekpt_free(struct grub_seekpt_list* list);
+
+/* Add a point, LIST takes over STATE (a grub_malloc'ed buffer) even
+   when this fails.  */
+grub_err_t
+grub_seekpt_add(struct grub_seekpt_list* list, grub_uint64_t uoff,
+	grub_uint64_t coff, void* state, grub_size_t state_size);
+
+/* Whether a snapshot of STATE_SIZE bytes taken at UOFF is worth keeping.  */
+int
+grub_seekpt_want(const struct grub_seekpt_list* list, grub_uint64_t uoff,
+	grub_size_t state_size);
+
+/* The point to resume from to get to TARGET when the decoder stands at
+   CUR, NULL when decoding on from CUR is the better way.  */
+const struct grub_seekpt*
+grub_seekpt_lookup(const struct grub_seekpt_list* list, grub_uint64_t cur,
+	grub_uint64_t target);
+
+#endif /* ! GRUB_SEEKPT_HEADER */
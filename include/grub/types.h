@@ -30,6 +30,10 @@
 #define GRUB_CPU_SIZEOF_VOID_P	8
 #define GRUB_CPU_SIZEOF_LONG	4
 #define GRUB_TARGET_WORDSIZE	64
+#elif defined(__LP64__)
+#define GRUB_CPU_SIZEOF_VOID_P	8
+#define GRUB_CPU_SIZEOF_LONG	8
+#define GRUB_TARGET_WORDSIZE	64
 #else
 #define GRUB_CPU_SIZEOF_VOID_P	4
 #define GRUB_CPU_SIZEOF_LONG	4
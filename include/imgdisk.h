@@ -0,0 +1,37 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <wchar.h>
+#include <grub/types.h>
+
+bool
+grub_imgdisk_set_sector_size(unsigned size);
+
+unsigned
+grub_imgdisk_get_sector_size(void);
+
+void
+grub_imgdisk_unset(void);
+
+bool
+grub_imgdisk_set(const wchar_t* path);
+
+bool
+grub_imgdisk_create(const wchar_t* path, grub_uint64_t size);
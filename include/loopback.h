@@ -18,6 +18,22 @@
 
 #pragma once
 
+#include <wchar.h>
+#include <grub/types.h>
+
+enum grub_loopback_mode
+{
+	/* One positioned read per request.  */
+	GRUB_LOOPBACK_MODE_DIRECT,
+	/* Detect sequential access and keep the next window in flight.  */
+	GRUB_LOOPBACK_MODE_READAHEAD,
+	/* Map the whole image and copy straight from the mapping.  */
+	GRUB_LOOPBACK_MODE_MMAP,
+};
+
+void
+grub_loopback_set_mode(enum grub_loopback_mode mode);
+
 void
 grub_loopback_unset(void);
 
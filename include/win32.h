@@ -0,0 +1,332 @@
+#pragma once
+
+/*
+ * The Win32 calls fatio uses outside of the Windows-only disk code. On
+ * Windows this is windows.h, elsewhere the same names are provided on top
+ * of libc and pthreads: threads, locks and condition variables, tick
+ * counts, and the wide character CRT calls that take paths.
+ */
+
+#ifdef _WIN32
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+
+// Separator of host paths, FatFs paths always take a backslash
+#define HOST_PATH_SEP	L"\\"
+
+#else
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/stat.h>
+
+// Same types as fatfs/ff.h gives them outside Windows
+typedef int BOOL;
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef unsigned int UINT;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int64_t LONGLONG;
+typedef void* HANDLE;
+
+typedef union
+{
+	struct
+	{
+		DWORD LowPart;
+		int32_t HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#ifndef TRUE
+#define TRUE	1
+#define FALSE	0
+#endif
+#define INFINITE	0xFFFFFFFF
+#define INVALID_HANDLE_VALUE	((HANDLE)(intptr_t)-1)
+#define MAX_PATH	PATH_MAX
+#define WINAPI
+
+#define HOST_PATH_SEP	L"/"
+
+// Host paths come in as wide strings, the host takes them in the locale
+// charset. The result is malloc'd, NULL when it cannot be converted.
+static inline char*
+win32_path(const wchar_t* path)
+{
+	size_t len = wcstombs(NULL, path, 0);
+	char* mb;
+
+	if (len == (size_t)-1)
+	{
+		errno = EILSEQ;
+		return NULL;
+	}
+	mb = malloc(len + 1);
+	if (mb)
+		wcstombs(mb, path, len + 1);
+	return mb;
+}
+
+/* Threads, locks and condition variables */
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+typedef pthread_cond_t CONDITION_VARIABLE;
+typedef DWORD (WINAPI* LPTHREAD_START_ROUTINE)(void* param);
+
+struct win32_thread
+{
+	pthread_t id;
+	LPTHREAD_START_ROUTINE start;
+	void* param;
+	bool joined;
+};
+
+static inline void
+InitializeCriticalSection(CRITICAL_SECTION* cs)
+{
+	pthread_mutex_init(cs, NULL);
+}
+
+static inline void
+DeleteCriticalSection(CRITICAL_SECTION* cs)
+{
+	pthread_mutex_destroy(cs);
+}
+
+static inline void
+EnterCriticalSection(CRITICAL_SECTION* cs)
+{
+	pthread_mutex_lock(cs);
+}
+
+static inline void
+LeaveCriticalSection(CRITICAL_SECTION* cs)
+{
+	pthread_mutex_unlock(cs);
+}
+
+static inline void
+InitializeConditionVariable(CONDITION_VARIABLE* cv)
+{
+	pthread_cond_init(cv, NULL);
+}
+
+// fatio only ever waits without a timeout
+static inline BOOL
+SleepConditionVariableCS(CONDITION_VARIABLE* cv, CRITICAL_SECTION* cs, DWORD ms)
+{
+	(void)ms;
+	return pthread_cond_wait(cv, cs) == 0;
+}
+
+static inline void
+WakeConditionVariable(CONDITION_VARIABLE* cv)
+{
+	pthread_cond_signal(cv);
+}
+
+static inline void
+WakeAllConditionVariable(CONDITION_VARIABLE* cv)
+{
+	pthread_cond_broadcast(cv);
+}
+
+static inline void*
+win32_thread_start(void* param)
+{
+	struct win32_thread* thread = param;
+
+	thread->start(thread->param);
+	return NULL;
+}
+
+static inline HANDLE
+CreateThread(void* attr, size_t stack, LPTHREAD_START_ROUTINE start, void* param, DWORD flags, DWORD* id)
+{
+	struct win32_thread* thread = calloc(1, sizeof(*thread));
+
+	(void)attr;
+	(void)stack;
+	(void)flags;
+	(void)id;
+	if (!thread)
+		return NULL;
+	thread->start = start;
+	thread->param = param;
+	if (pthread_create(&thread->id, NULL, win32_thread_start, thread) != 0)
+	{
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+static inline DWORD
+WaitForSingleObject(HANDLE handle, DWORD ms)
+{
+	struct win32_thread* thread = handle;
+
+	(void)ms;
+	if (!thread->joined)
+		pthread_join(thread->id, NULL);
+	thread->joined = true;
+	return 0;
+}
+
+static inline DWORD
+WaitForMultipleObjects(DWORD count, const HANDLE* handles, BOOL all, DWORD ms)
+{
+	(void)all;
+	for (DWORD i = 0; i < count; i++)
+		WaitForSingleObject(handles[i], ms);
+	return 0;
+}
+
+// Threads are the only handles fatio opens outside the Windows-only code
+static inline BOOL
+CloseHandle(HANDLE handle)
+{
+	struct win32_thread* thread = handle;
+
+	if (!thread->joined)
+		pthread_detach(thread->id);
+	free(thread);
+	return TRUE;
+}
+
+typedef struct
+{
+	DWORD dwPageSize;
+	DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+static inline void
+GetSystemInfo(SYSTEM_INFO* si)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	si->dwPageSize = (DWORD)sysconf(_SC_PAGESIZE);
+	si->dwNumberOfProcessors = (n > 0) ? (DWORD)n : 1;
+}
+
+/* Time */
+
+static inline UINT64
+GetTickCount64(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline DWORD
+GetTickCount(void)
+{
+	return (DWORD)GetTickCount64();
+}
+
+static inline BOOL
+QueryPerformanceFrequency(LARGE_INTEGER* freq)
+{
+	freq->QuadPart = 1000000000;
+	return TRUE;
+}
+
+static inline BOOL
+QueryPerformanceCounter(LARGE_INTEGER* count)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	count->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return TRUE;
+}
+
+/* Files and the wide character CRT */
+
+#define _wcsicmp	wcscasecmp
+#define _wcsdup		wcsdup
+#define _wtoi(s)	((int)wcstol(s, NULL, 10))
+#define swprintf_s	swprintf
+#define _fseeki64	fseeko
+#define _ftelli64	ftello
+#define _stat		stat
+
+static inline BOOL
+DeleteFileW(const wchar_t* path)
+{
+	char* mb = win32_path(path);
+	int rc = mb ? unlink(mb) : -1;
+
+	free(mb);
+	return rc == 0;
+}
+
+static inline int
+_wstat(const wchar_t* path, struct stat* st)
+{
+	char* mb = win32_path(path);
+	int rc = mb ? stat(mb, st) : -1;
+
+	free(mb);
+	return rc;
+}
+
+static inline FILE*
+_wfopen(const wchar_t* path, const wchar_t* mode)
+{
+	char* mb = win32_path(path);
+	char* mb_mode = win32_path(mode);
+	FILE* file = NULL;
+
+	if (mb && mb_mode)
+		file = fopen(mb, mb_mode);
+	free(mb);
+	free(mb_mode);
+	return file;
+}
+
+static inline int
+_wfopen_s(FILE** file, const wchar_t* path, const wchar_t* mode)
+{
+	*file = _wfopen(path, mode);
+	return *file ? 0 : errno;
+}
+
+// stdout stays byte oriented, so grub_printf and printf can be mixed with
+// wprintf like on Windows
+static inline int
+win32_wprintf(const wchar_t* fmt, ...)
+{
+	wchar_t buf[4096];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vswprintf(buf, sizeof(buf) / sizeof(buf[0]), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return n;
+	return printf("%ls", buf);
+}
+#define wprintf		win32_wprintf
+
+#endif /* _WIN32 */
@@ -26,7 +26,7 @@ wchar_t* formatTimeFromFtime(WORD ftime) {
 
 wchar_t* getAttributes(BYTE fattrib) {
 	static wchar_t attributes[100];
-	swprintf(attributes, 100, L"%s%s%s%s%s%s",
+	swprintf(attributes, 100, L"%ls%ls%ls%ls%ls%ls",
 		(fattrib & AM_RDO) ? L"Read-only " : L"",
 		(fattrib & AM_HID) ? L"Hidden " : L"",
 		(fattrib & AM_SYS) ? L"System " : L"",
@@ -37,45 +37,56 @@ wchar_t* getAttributes(BYTE fattrib) {
 }
 
 static
-FRESULT list_dir(const wchar_t* path)
+FRESULT list_dir(const wchar_t* path, bool recursive, int* ndir, int* nfile)
 {
 	FRESULT res;
 	DIR dir;
 	FILINFO fno;
-	int nfile, ndir;
-
-	wprintf(L"%-10s %-10s%-25s%-15s%s\n", L"Date", L"Time", L"Attributes", L"Size", L"Name");
+	wchar_t new_path[MAX_PATH];
+	size_t len = wcslen(path);
 
 	res = f_opendir(&dir, path);
 	if (res == FR_OK) {
-		nfile = ndir = 0;
 		for (;;) {
 			res = f_readdir(&dir, &fno);
 			if (res != FR_OK || fno.fname[0] == 0) break;  /* Error or end of dir */
+			/* Recursive listings name each entry by its path */
+			if (recursive)
+				swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%ls%ls%ls",
+					path, (len > 0 && path[len - 1] == L'\\') ? L"" : L"\\", fno.fname);
 			if (fno.fattrib & AM_DIR) {					   /* Directory */
-				wprintf(L"%-10s %-10s%-25s%-15s%s\n", formatDateFromFdate(fno.fdate), formatTimeFromFtime(fno.ftime), getAttributes(fno.fattrib), L"-", fno.fname);
-				ndir++;
+				wprintf(L"%-10ls %-10ls%-25ls%-15ls%ls\n", formatDateFromFdate(fno.fdate), formatTimeFromFtime(fno.ftime), getAttributes(fno.fattrib), L"-", recursive ? new_path : fno.fname);
+				(*ndir)++;
+				if (recursive) {
+					res = list_dir(new_path, recursive, ndir, nfile);  /* Enter the directory */
+					if (res != FR_OK) break;
+				}
 			}
 			else {										   /* File */
-				wprintf(L"%-10s %-10s%-25s%-15llu%s\n", formatDateFromFdate(fno.fdate), formatTimeFromFtime(fno.ftime), getAttributes(fno.fattrib), fno.fsize, fno.fname);
-				nfile++;
+				wprintf(L"%-10ls %-10ls%-25ls%-15llu%ls\n", formatDateFromFdate(fno.fdate), formatTimeFromFtime(fno.ftime), getAttributes(fno.fattrib), fno.fsize, recursive ? new_path : fno.fname);
+				(*nfile)++;
 			}
 		}
 		f_closedir(&dir);
-		wprintf(L"%d dirs, %d files.\n", ndir, nfile);
 	}
 	else {
-		wprintf(L"Failed to open \"%s\". (%u)\n", path, res);
+		wprintf(L"Failed to open \"%ls\". (%u)\n", path, res);
 	}
 	return res;
 }
 
 bool
-fatio_list(const wchar_t* path)
+fatio_list(const wchar_t* path, bool recursive)
 {
-	FRESULT rc = list_dir(path);
+	FRESULT rc;
+	int nfile = 0, ndir = 0;
+
+	wprintf(L"%-10ls %-10ls%-25ls%-15ls%ls\n", L"Date", L"Time", L"Attributes", L"Size", L"Name");
+	rc = list_dir(path, recursive, &ndir, &nfile);
+	if (rc == FR_OK)
+		wprintf(L"%d dirs, %d files.\n", ndir, nfile);
 	if (rc == FR_OK || rc == FR_EXIST)
 		return true;
-	wprintf(L"list %s failed %d\n", path, rc);
+	wprintf(L"list %ls failed %d\n", path, rc);
 	return false;
 }
@@ -11,6 +11,6 @@ fatio_mkdir(const wchar_t* path)
 
 	if (rc == FR_OK || rc == FR_EXIST)
 		return true;
-	wprintf(L"mkdir %s failed %d\n", path, rc);
+	wprintf(L"mkdir %ls failed %d\n", path, rc);
 	return false;
 }
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <fatio.h>
+
+#include "fatfs/ff.h"
+
+// FAT32 needs more than 65525 clusters, FAT16 at most 65524
+#define PLAN_FAT32_MIN_CLUSTERS 66000
+#define PLAN_FAT16_MIN_CLUSTERS 4200
+#define PLAN_FAT16_MAX_CLUSTERS 65000
+
+#define PLAN_MB 0x100000ULL
+#define PLAN_GB 0x40000000ULL
+
+// Directory entry bytes of a name: short name and LFN entries on FAT,
+// file, stream and name entries on exFAT, whichever is more
+UINT64
+fatio_plan_name(size_t len)
+{
+	return 32 * (2 + (len + 12) / 13);
+}
+
+void
+fatio_plan_file(struct fatio_plan* plan, UINT64 size)
+{
+	plan->bytes += size;
+	plan->files++;
+	for (int i = 0; i < FATIO_PLAN_CLUSTERS; i++)
+	{
+		UINT64 au = 512ULL << i;
+		plan->used[i] += (size + au - 1) / au * au;
+	}
+}
+
+// A directory holding ENTRY_BYTES of fatio_plan_name entries
+void
+fatio_plan_dir(struct fatio_plan* plan, UINT64 entry_bytes)
+{
+	// "." and ".."
+	entry_bytes += 64;
+	plan->dirs++;
+	for (int i = 0; i < FATIO_PLAN_CLUSTERS; i++)
+	{
+		UINT64 au = 512ULL << i;
+		plan->used[i] += (entry_bytes + au - 1) / au * au;
+	}
+}
+
+// Size of a new image with SECTOR_SIZE byte sectors that holds PLAN as a
+// volume of format FMT, 0 if it cannot. The cluster size follows the
+// Windows defaults for the content size, never below a sector, and is
+// returned in AU_SIZE.
+grub_uint64_t
+fatio_plan_image(const struct fatio_plan* plan, BYTE fmt, UINT sector_size, DWORD* au_size)
+{
+	UINT64 c = plan->bytes, clusters, meta;
+	int i, min = 0;
+
+	while ((512U << min) < sector_size)
+		min++;
+
+	if (fmt & FM_EXFAT)
+		i = (c < 256 * PLAN_MB) ? 3 : (c < 32 * PLAN_GB) ? 6 : 8;
+	else if (fmt & FM_FAT32)
+		i = (c < 64 * PLAN_MB) ? 0 : (c < 128 * PLAN_MB) ? 1 : (c < 256 * PLAN_MB) ? 2
+			: (c < 8 * PLAN_GB) ? 3 : (c < 16 * PLAN_GB) ? 4 : (c < 32 * PLAN_GB) ? 5 : 6;
+	else
+	{
+		// Smallest cluster that keeps FAT16 under its cluster limit
+		for (i = (min > 2) ? min : 2; i < 8; i++)
+		{
+			clusters = plan->used[i] >> (9 + i);
+			if (clusters + clusters / 32 + 64 <= PLAN_FAT16_MAX_CLUSTERS)
+				break;
+		}
+		if (i == 8)
+			return 0;
+	}
+	if (i < min)
+		i = min;
+	*au_size = 512U << i;
+
+	// Room for what the estimate misses and a little to spare
+	clusters = plan->used[i] >> (9 + i);
+	clusters += clusters / 32 + 64;
+	if ((fmt & FM_FAT32) && clusters < PLAN_FAT32_MIN_CLUSTERS)
+		clusters = PLAN_FAT32_MIN_CLUSTERS;
+	if ((fmt & FM_FAT) && clusters < PLAN_FAT16_MIN_CLUSTERS)
+		clusters = PLAN_FAT16_MIN_CLUSTERS;
+
+	if (fmt & FM_EXFAT)
+		meta = clusters * 4 + clusters / 8 + 0x20000;	// FAT, bitmap and up-case table
+	else if (fmt & FM_FAT32)
+		meta = clusters * 4 * 2;
+	else
+		meta = clusters * 2 * 2 + 512 * 32;	// Two FATs and the fixed root directory
+
+	// Reserved sectors, alignment and the partition gap
+	return ALIGN_UP((clusters << (9 + i)) + meta + 2 * PLAN_MB, PLAN_MB);
+}
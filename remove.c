@@ -19,14 +19,14 @@ FRESULT remove_files(const wchar_t* path)
             if (res != FR_OK || fno.fname[0] == 0) break;  /* Break on error or end of dir */
             if (fno.fattrib & AM_DIR)                      /* It is a directory */
             {
-                swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%s\\%s", path, fno.fname);
+                swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%ls\\%ls", path, fno.fname);
                 res = remove_files(new_path);                    /* Enter the directory */
                 if (res != FR_OK) break;
                 f_unlink(new_path);
             }
             else                                           /* It is a file. */
             {
-                swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%s\\%s", path, fno.fname);
+                swprintf(new_path, sizeof(new_path) / sizeof(new_path[0]), L"%ls\\%ls", path, fno.fname);
                 f_chmod(new_path, 0, AM_RDO);
                 res = f_unlink(new_path);
             }
@@ -60,6 +60,6 @@ fatio_remove(const wchar_t* path)
         if (rc == FR_OK || rc == FR_EXIST)
             return true;
     }
-    wprintf(L"remove %s failed %d\n", path, rc);
+    wprintf(L"remove %ls failed %d\n", path, rc);
     return false;
 }
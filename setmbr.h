@@ -4,8 +4,6 @@
 #include <grub/disk.h>
 #include <grub/partition.h>
 
-int probe_partmap_hook(grub_disk_t* disk, grub_partition_t partition, void* data);
-
 grub_partition_map_t grub_partmap_probe(grub_disk_t disk);
 
 static grub_uint8_t empty_mbr[446] = { 0 };
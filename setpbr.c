@@ -2,7 +2,9 @@
 #include <fatio.h>
 #include <wchar.h>
 #include <stdint.h>
+#ifdef _WIN32
 #include <winioctl.h>
+#endif
 
 #include "setpbr.h"
 #include "fatfs/ff.h"
@@ -111,35 +113,39 @@ static uint32_t exfat_boot_checksum(const void *sector, size_t size)
 	return sum;
 }
 
-void grub_br_write_exfat_checksum(grub_disk_t disk)
+/* The boot region is counted in sectors of the disk, 11 of them are summed
+ * and the checksum sector is filled with the sum.  */
+grub_err_t grub_br_write_exfat_checksum(grub_disk_t disk)
 {
 	uint32_t checksum = 0;
+	grub_size_t ss = (grub_size_t)1 << disk->log_sector_size;
+	unsigned shift = disk->log_sector_size - GRUB_DISK_SECTOR_BITS;
+	grub_uint8_t *vbr_buf = NULL;
+	grub_uint8_t *sum_buf = NULL;
 	unsigned i;
 
-	grub_uint8_t *vbr_buf = NULL;
-	vbr_buf = grub_calloc(11, GRUB_DISK_SECTOR_SIZE);
-	if (!vbr_buf)
-		return;
-	if (grub_disk_read(disk, 0, 0, 11 << GRUB_DISK_SECTOR_BITS, vbr_buf))
+	vbr_buf = grub_calloc(11, ss);
+	sum_buf = grub_malloc(ss);
+	if (!vbr_buf || !sum_buf)
+		goto fail;
+	if (grub_disk_read(disk, 0, 0, 11 * ss, vbr_buf))
 		goto fail;
 
-	checksum = exfat_boot_checksum(vbr_buf, GRUB_DISK_SECTOR_SIZE);
+	checksum = exfat_boot_checksum(vbr_buf, ss);
+	for (i = 0; i < ss / sizeof(checksum); i++)
+		grub_memcpy(sum_buf + i * sizeof(checksum), &checksum, sizeof(checksum));
 	/* Write new main VBR checksum */
-	for (i = 0; i < (GRUB_DISK_SECTOR_SIZE / sizeof(checksum)); i++)
-	{
-		if (grub_disk_write(disk, 11, i * sizeof(checksum), sizeof(checksum), &checksum))
-			break;
-	}
+	if (grub_disk_write(disk, 11ULL << shift, 0, ss, sum_buf))
+		goto fail;
 	/* Write new backup VBR */
-	grub_disk_write(disk, 12, 0, 11 << GRUB_DISK_SECTOR_BITS, vbr_buf);
+	if (grub_disk_write(disk, 12ULL << shift, 0, 11 * ss, vbr_buf))
+		goto fail;
 	/* Write new backup VBR checksum */
-	for (i = 0; i < (GRUB_DISK_SECTOR_SIZE / sizeof(checksum)); i++)
-	{
-		if (grub_disk_write(disk, 23, i * sizeof(checksum), sizeof(checksum), &checksum))
-			break;
-	}
+	grub_disk_write(disk, 23ULL << shift, 0, ss, sum_buf);
 fail:
+	grub_free(sum_buf);
 	grub_free(vbr_buf);
+	return grub_errno;
 }
 
 bool fatio_setpbr(unsigned disk_id, unsigned part_id, const wchar_t *in_name)
@@ -224,6 +230,12 @@ bool fatio_setpbr(unsigned disk_id, unsigned part_id, const wchar_t *in_name)
 			if (rc1 != GRUB_ERR_NONE || rc2 != GRUB_ERR_NONE)
 				rc = -1;
 		}
+		else if (grub_strcmp(fs_name, "exfat") == 0 && disk->log_sector_size != GRUB_DISK_SECTOR_BITS)
+		{
+			/* The boot code lays out its sectors 512 bytes apart */
+			rc = -1;
+			grub_printf("exfat boot code needs 512-byte sectors\n");
+		}
 		else if (grub_strcmp(fs_name, "exfat") == 0)
 		{
 			grub_err_t rc1 = 0, rc2 = 0;
@@ -233,7 +245,8 @@ bool fatio_setpbr(unsigned disk_id, unsigned part_id, const wchar_t *in_name)
 				return grub_error(GRUB_ERR_BAD_DEVICE, "unsupported reserved sectors");
 			rc1 = grub_disk_write(disk, 0, 0, 3, bootmgr_exfat); // jmp_boot[3]
 			rc2 = grub_disk_write(disk, 0, 0x78, 0x600 - 0x78, bootmgr_exfat + 0x78);
-			grub_br_write_exfat_checksum(disk);
+			if (grub_br_write_exfat_checksum(disk) != GRUB_ERR_NONE)
+				rc = -1;
 			if (rc1 != GRUB_ERR_NONE || rc2 != GRUB_ERR_NONE)
 				rc = -1;
 		}
@@ -280,6 +293,12 @@ bool fatio_setpbr(unsigned disk_id, unsigned part_id, const wchar_t *in_name)
 			if (rc1 != GRUB_ERR_NONE || rc2 != GRUB_ERR_NONE || rc3 != GRUB_ERR_NONE)
 				rc = -1;
 		}
+		else if (grub_strcmp(fs_name, "exfat") == 0 && disk->log_sector_size != GRUB_DISK_SECTOR_BITS)
+		{
+			/* The boot code lays out its sectors 512 bytes apart */
+			rc = -1;
+			grub_printf("exfat boot code needs 512-byte sectors\n");
+		}
 		else if (grub_strcmp(fs_name, "exfat") == 0)
 		{
 			grub_err_t rc1 = 0, rc2 = 0, rc3 = 0;
@@ -290,7 +309,7 @@ bool fatio_setpbr(unsigned disk_id, unsigned part_id, const wchar_t *in_name)
 			rc1 = grub_disk_write(disk, 0, 0, 3, grldr_exfat); // jmp_boot[3]
 			rc3 = grub_disk_write(disk, 0, 0x78, 0x400 - 0x78, grldr_exfat + 0x78);
 			rc3 = grub_disk_write(disk, 0, 0x1e3, 5, grldr);
-			grub_br_write_exfat_checksum(disk);
+			rc2 = grub_br_write_exfat_checksum(disk);
 			if (rc1 != GRUB_ERR_NONE || rc2 != GRUB_ERR_NONE || rc3 != GRUB_ERR_NONE)
 				rc = -1;
 		}
@@ -73,6 +73,7 @@ fatio_swap_partitions(unsigned disk_id, unsigned partno1, unsigned partno2)
     // refresh disk cache
     grub_disk_cache_invalidate_all();
 
+#ifdef _WIN32
     // Force refresh of system cache under Windows
     char diskPath[MAX_PATH];
     snprintf(diskPath, sizeof(diskPath), "\\\\.\\PhysicalDrive%u", disk_id);
@@ -81,6 +82,7 @@ fatio_swap_partitions(unsigned disk_id, unsigned partno1, unsigned partno2)
         FlushFileBuffers(hDisk);
         CloseHandle(hDisk);
     }
+#endif
 
     grub_disk_close(disk);
     grub_free(name);
@@ -0,0 +1,167 @@
+<#
+.SYNOPSIS
+Time fatio on FAT32 and exFAT image files and print the results as JSON.
+
+.DESCRIPTION
+For each format an image file of SizeMB is formatted with mkfs, then a tree
+of small files and one large file are copied in, the tree is listed
+recursively, the large file is dumped back and the tree is removed. Last an
+archive is extracted into a new image made with -i. Every step runs fatio
+with -j, the elapsed time, disk reads/writes and peak working set come from
+that line.
+Nothing is shown and no disk other than the image files is touched.
+
+.EXAMPLE
+powershell -NoProfile -ExecutionPolicy Bypass -File tests\bench.ps1 > bench.json
+.EXAMPLE
+tests\bench.ps1 -SizeMB 4096 -Files 20000 -Archive D:\windows.iso
+#>
+param(
+	[string]$Fatio = "x64\Release\fatio.exe",
+	[string[]]$Formats = @("FAT32", "EXFAT"),
+	# Size of the image that mkfs formats
+	[int]$SizeMB = 1024,
+	# Number and size of the small files
+	[int]$Files = 2000,
+	[int]$FileKB = 4,
+	# Directories the small files are nested in
+	[int]$Depth = 4,
+	[int]$LargeMB = 256,
+	# ISO, WIM, VHD(X) or disk image, optionally xz or zstd compressed. A
+	# FAT32 image of the generated files is made with copy -i when it is not
+	# given.
+	[string]$Archive = "",
+	[string]$WorkDir = (Join-Path ([IO.Path]::GetTempPath()) "fatio-bench"),
+	[switch]$Keep
+)
+
+$ErrorActionPreference = "Stop"
+$Fatio = (Resolve-Path $Fatio).Path
+
+function New-RandomFile([string]$Path, [long]$Bytes, [Random]$Rng)
+{
+	$buf = New-Object byte[] ([Math]::Min($Bytes, 1MB))
+	$fs = [IO.File]::Create($Path)
+	try
+	{
+		for ($left = $Bytes; $left -gt 0; $left -= $n)
+		{
+			$n = [Math]::Min($left, $buf.Length)
+			$Rng.NextBytes($buf)
+			$fs.Write($buf, 0, $n)
+		}
+	}
+	finally
+	{
+		$fs.Close()
+	}
+}
+
+# Run one fatio command and return its -j line as an object
+function Invoke-Fatio([string[]]$Arguments)
+{
+	$out = & $Fatio @Arguments -j | ForEach-Object { "$_" }
+	$json = $out | Where-Object { $_.StartsWith("{") } | Select-Object -Last 1
+	if (-not $json)
+	{
+		throw "fatio $($Arguments -join ' ') printed no statistics:`n$($out -join "`n")"
+	}
+	$r = $json | ConvertFrom-Json
+	if ($r.exit_code -ne 0)
+	{
+		throw "fatio $($Arguments -join ' ') failed with $($r.exit_code):`n$($out -join "`n")"
+	}
+	return $r
+}
+
+function Measure-Step([string]$Format, [string]$Step, [long]$Bytes, [int]$Count, [string[]]$Arguments)
+{
+	$r = Invoke-Fatio $Arguments
+	$sec = [Math]::Max($r.elapsed_ms, 1) / 1000.0
+	[ordered]@{
+		format       = $Format
+		step         = $Step
+		bytes        = $Bytes
+		files        = $Count
+		elapsed_ms   = $r.elapsed_ms
+		mb_per_s     = [Math]::Round($Bytes / 1MB / $sec, 2)
+		files_per_s  = [Math]::Round($Count / $sec, 2)
+		disk_reads   = $r.disk_reads
+		disk_writes  = $r.disk_writes
+		read_bytes   = $r.read_bytes
+		write_bytes  = $r.write_bytes
+		cache_hits   = $r.cache_hits
+		cache_misses = $r.cache_misses
+		peak_rss     = $r.peak_rss
+	}
+}
+
+if (Test-Path $WorkDir)
+{
+	Remove-Item -Recurse -Force $WorkDir
+}
+$src = Join-Path $WorkDir "src"
+$small = Join-Path $src "small"
+$deep = $small
+for ($i = 1; $i -le $Depth; $i++)
+{
+	$deep = Join-Path $deep "d$i"
+}
+New-Item -ItemType Directory -Force $deep | Out-Null
+
+# The same seed gives the same content on every run
+$rng = New-Object Random 20231
+for ($i = 0; $i -lt $Files; $i++)
+{
+	New-RandomFile (Join-Path $deep ("f{0:d6}.bin" -f $i)) ($FileKB * 1KB) $rng
+}
+$large = Join-Path $src "large.bin"
+New-RandomFile $large ($LargeMB * 1MB) $rng
+
+if (-not $Archive)
+{
+	$Archive = Join-Path $WorkDir "src.img"
+	Invoke-Fatio @("copy", $Archive, "0", $src, "\", "-i", "FAT32") | Out-Null
+}
+$archiveBytes = (Get-Item $Archive).Length
+
+$smallBytes = [long]$Files * $FileKB * 1KB
+$largeBytes = [long]$LargeMB * 1MB
+
+$results = @()
+foreach ($fmt in $Formats)
+{
+	$img = Join-Path $WorkDir "$fmt.img"
+	$fs = [IO.File]::Create($img)
+	$fs.SetLength([long]$SizeMB * 1MB)
+	$fs.Close()
+
+	$results += Measure-Step $fmt "mkfs" 0 0 @("mkfs", $img, "0", $fmt)
+	$results += Measure-Step $fmt "copy_small" $smallBytes $Files @("copy", $img, "0", $small, "\small")
+	$results += Measure-Step $fmt "copy_large" $largeBytes 1 @("copy", $img, "0", $large, "\")
+	$results += Measure-Step $fmt "ls" 0 ($Files + $Depth) @("ls", $img, "0", "\small", "-r")
+	$results += Measure-Step $fmt "dump" $largeBytes 1 @("dump", $img, "0", "\large.bin", (Join-Path $WorkDir "large.out"))
+	$results += Measure-Step $fmt "remove" $smallBytes $Files @("remove", $img, "0", "\small")
+	Remove-Item $img, (Join-Path $WorkDir "large.out")
+
+	# -i sizes and formats the image for the archive content itself
+	$img = Join-Path $WorkDir "$fmt-extract.img"
+	$results += Measure-Step $fmt "extract" $archiveBytes 0 @("extract", $img, "0", $Archive, "-i", $fmt)
+	Remove-Item $img
+}
+
+[ordered]@{
+	fatio    = $Fatio
+	size_mb  = $SizeMB
+	files    = $Files
+	file_kb  = $FileKB
+	depth    = $Depth
+	large_mb = $LargeMB
+	archive  = $Archive
+	results  = $results
+} | ConvertTo-Json -Depth 4
+
+if (-not $Keep)
+{
+	Remove-Item -Recurse -Force $WorkDir
+}
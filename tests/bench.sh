@@ -0,0 +1,104 @@
+#!/bin/sh
+# Times fatio on FAT32 and exFAT image files and prints the results as JSON,
+# the same steps as bench.ps1 on Windows.
+#   bench.sh [PATH-TO-FATIO] > bench.json
+# For each format an image file of SIZE_MB is formatted with mkfs, then a
+# tree of small files and one large file are copied in, the tree is listed
+# recursively, the large file is dumped back and the tree is removed. Last
+# an archive is extracted into a new image made with -i. Every step runs
+# fatio with -j, the elapsed time, disk reads/writes and peak memory come
+# from that line. The archive is a FAT32 image of the generated files made
+# with copy -i unless ARCHIVE names another one. Nothing but files in
+# WORK_DIR is touched, and WORK_DIR is removed at the end unless KEEP is set.
+set -e
+FATIO=$(realpath "${1:-build/fatio}")
+FORMATS=${FORMATS:-"FAT32 EXFAT"}
+SIZE_MB=${SIZE_MB:-1024}
+FILES=${FILES:-2000}
+FILE_KB=${FILE_KB:-4}
+DEPTH=${DEPTH:-4}
+LARGE_MB=${LARGE_MB:-256}
+ARCHIVE=${ARCHIVE:-}
+WORK_DIR=${WORK_DIR:-${TMPDIR:-/tmp}/fatio-bench}
+
+# Runs one fatio command and prints its -j line
+run_fatio() {
+	out=$("$FATIO" "$@" -j) || true
+	json=$(printf '%s\n' "$out" | grep '^{' | tail -n 1)
+	if [ -z "$json" ] || [ "$(printf '%s' "$json" | field exit_code)" != 0 ]; then
+		printf 'fatio %s failed:\n%s\n' "$*" "$out" >&2
+		exit 1
+	fi
+	printf '%s\n' "$json"
+}
+
+# Number value of a key in a -j line on stdin
+field() {
+	sed -n "s/.*\"$1\":\([-0-9]*\).*/\1/p"
+}
+
+# measure FORMAT STEP BYTES FILES FATIO-ARGS...
+measure() {
+	fmt=$1 step=$2 bytes=$3 count=$4
+	shift 4
+	json=$(run_fatio "$@")
+	ms=$(printf '%s' "$json" | field elapsed_ms)
+	[ -n "$first" ] || printf ',\n'
+	first=
+	printf '    {"format":"%s","step":"%s","bytes":%s,"files":%s,"elapsed_ms":%s' \
+		"$fmt" "$step" "$bytes" "$count" "$ms"
+	awk -v b="$bytes" -v n="$count" -v ms="$ms" 'BEGIN {
+		s = (ms > 1 ? ms : 1) / 1000
+		printf ",\"mb_per_s\":%.2f,\"files_per_s\":%.2f", b / 1048576 / s, n / s }'
+	for k in disk_reads disk_writes read_bytes write_bytes cache_hits cache_misses peak_rss; do
+		printf ',"%s":%s' $k "$(printf '%s' "$json" | field $k)"
+	done
+	printf '}'
+}
+
+rm -rf "$WORK_DIR"
+src=$WORK_DIR/src
+deep=$src/small
+i=1
+while [ $i -le "$DEPTH" ]; do
+	deep=$deep/d$i
+	i=$((i + 1))
+done
+mkdir -p "$deep"
+
+head -c $((FILES * FILE_KB * 1024)) /dev/urandom |
+	split -b ${FILE_KB}k -a 6 -d --additional-suffix=.bin - "$deep/f"
+head -c $((LARGE_MB * 1024 * 1024)) /dev/urandom > "$src/large.bin"
+
+if [ -z "$ARCHIVE" ]; then
+	ARCHIVE=$WORK_DIR/src.img
+	run_fatio copy "$ARCHIVE" 0 "$src" '\' -i FAT32 > /dev/null
+fi
+archive_bytes=$(stat -c %s "$ARCHIVE")
+small_bytes=$((FILES * FILE_KB * 1024))
+large_bytes=$((LARGE_MB * 1024 * 1024))
+
+printf '{\n  "fatio":"%s","size_mb":%s,"files":%s,"file_kb":%s,"depth":%s,"large_mb":%s,"archive":"%s",\n  "results":[\n' \
+	"$FATIO" "$SIZE_MB" "$FILES" "$FILE_KB" "$DEPTH" "$LARGE_MB" "$ARCHIVE"
+first=1
+for fmt in $FORMATS; do
+	img=$WORK_DIR/$fmt.img
+	rm -f "$img"
+	truncate -s ${SIZE_MB}M "$img"
+
+	measure $fmt mkfs 0 0 mkfs "$img" 0 $fmt
+	measure $fmt copy_small $small_bytes $FILES copy "$img" 0 "$src/small" '\small'
+	measure $fmt copy_large $large_bytes 1 copy "$img" 0 "$src/large.bin" '\'
+	measure $fmt ls 0 $((FILES + DEPTH)) ls "$img" 0 '\small' -r
+	measure $fmt dump $large_bytes 1 dump "$img" 0 '\large.bin' "$WORK_DIR/large.out"
+	measure $fmt remove $small_bytes $FILES remove "$img" 0 '\small'
+	rm -f "$img" "$WORK_DIR/large.out"
+
+	# -i sizes and formats the image for the archive content itself
+	img=$WORK_DIR/$fmt-extract.img
+	measure $fmt extract $archive_bytes 0 extract "$img" 0 "$ARCHIVE" -i $fmt
+	rm -f "$img"
+done
+printf '\n  ]\n}\n'
+
+[ -n "$KEEP" ] || rm -rf "$WORK_DIR"
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Makes the compressed fixtures of seekio.c with the xz and zstd tools.
+#   mkdata.sh PATH-TO-TESTS-EXE
+# xz blocks of 48 MiB leave a snapshot inside the first block, the
+# pattern is split into three zstd frames for pattern.frames.zst.
+set -e
+cd "$(dirname "$0")"
+"$1" -g pattern.bin
+for c in none crc32 crc64 sha256; do
+	xz -T1 -6 -c --block-size=48MiB -C $c pattern.bin > pattern.$c.xz
+done
+zstd -q -f -3 --check pattern.bin -o pattern.zst
+zstd -q -f -3 --no-check pattern.bin -o pattern.nocheck.zst
+split -b 25M pattern.bin pattern.part.
+for p in pattern.part.*; do
+	zstd -q -3 --check -c $p
+done > pattern.frames.zst
+rm -f pattern.bin pattern.part.*
@@ -0,0 +1,273 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of the grub modules that work without a disk.
+ *
+ *   tests [DATADIR]      run them, DATADIR defaults to tests/data
+ *   tests -g FILE        write the pattern the fixtures are made from
+ *   tests -b             time the decoders against the ones of ref/
+ *
+ * The exit code is the number of failed checks.  The file layer is a
+ * stand-in for kern/file.c over fixtures held in memory.
+ */
+
+#include <win32.h>
+#include <stdio.h>
+#include <locale.h>
+#include <stdarg.h>
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/err.h>
+#include <grub/file.h>
+#include <grub/fs.h>
+
+#include "test.h"
+
+#define TEST_PERIOD		4093
+#define TEST_MARK_SHIFT		20
+
+int test_failures;
+
+static const wchar_t* test_dir = L"tests" HOST_PATH_SEP L"data";
+static grub_uint8_t test_base[TEST_PERIOD];
+
+grub_file_filter_t grub_file_filters[GRUB_FILE_FILTER_MAX];
+
+void
+test_fail(const char* file, int line, const char* fmt, ...)
+{
+	va_list ap;
+
+	test_failures++;
+	grub_printf("%s:%d: ", file, line);
+	va_start(ap, fmt);
+	grub_vprintf(fmt, ap);
+	va_end(ap);
+	if (grub_errno)
+		grub_printf(" (%s)", grub_errmsg);
+	grub_printf("\n");
+	grub_errno = GRUB_ERR_NONE;
+}
+
+/* A block of random bytes repeated, with its offset written at the start
+   of every MiB so that data from the wrong place never compares equal.  */
+void
+test_pattern(grub_uint64_t off, grub_uint8_t* buf, grub_size_t len)
+{
+	grub_size_t i;
+
+	for (i = 0; i < len; i++, off++)
+	{
+		grub_uint64_t in = off & ((1ULL << TEST_MARK_SHIFT) - 1);
+
+		if (in < 8)
+			buf[i] = (grub_uint8_t)((off - in) >> (in * 8));
+		else
+			buf[i] = test_base[off % TEST_PERIOD];
+	}
+}
+
+static void
+test_pattern_init(void)
+{
+	grub_uint32_t seed = 1;
+	grub_size_t i;
+
+	for (i = 0; i < TEST_PERIOD; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		test_base[i] = (grub_uint8_t)(seed >> 16);
+	}
+}
+
+static grub_ssize_t
+test_read(grub_file_t file, char* buf, grub_size_t len)
+{
+	grub_memcpy(buf, (grub_uint8_t*)file->data + file->offset, len);
+	return len;
+}
+
+static grub_err_t
+test_close(grub_file_t file)
+{
+	grub_free(file->data);
+	return GRUB_ERR_NONE;
+}
+
+static struct grub_fs test_fs =
+{
+	.name = "test",
+	.fs_dir = 0,
+	.fs_open = 0,
+	.fs_read = test_read,
+	.fs_close = test_close,
+	.fs_label = 0,
+	.next = 0
+};
+
+grub_file_t
+test_open(const wchar_t* name)
+{
+	wchar_t path[MAX_PATH];
+	FILE* fp = 0;
+	grub_file_t file;
+	grub_int64_t size;
+
+	swprintf(path, MAX_PATH, L"%ls" HOST_PATH_SEP L"%ls", test_dir, name);
+	if (_wfopen_s(&fp, path, L"rb") != 0)
+	{
+		printf("cannot open %ls\n", path);
+		return NULL;
+	}
+	_fseeki64(fp, 0, SEEK_END);
+	size = _ftelli64(fp);
+	_fseeki64(fp, 0, SEEK_SET);
+	file = grub_zalloc(sizeof(*file));
+	if (!file || (file->data = grub_malloc((grub_size_t)size + 1)) == NULL
+		|| fread(file->data, 1, (size_t)size, fp) != (size_t)size)
+	{
+		fclose(fp);
+		if (file)
+			grub_free(file->data);
+		grub_free(file);
+		printf("cannot read %ls\n", path);
+		return NULL;
+	}
+	fclose(fp);
+	file->fs = &test_fs;
+	file->size = size;
+	return file;
+}
+
+grub_ssize_t
+grub_file_read(grub_file_t file, void* buf, grub_size_t len)
+{
+	grub_ssize_t res;
+
+	if (file->offset > file->size)
+	{
+		grub_error(GRUB_ERR_OUT_OF_RANGE, "attempt to read past the end of file");
+		return -1;
+	}
+	if (len > file->size - file->offset)
+		len = (grub_size_t)(file->size - file->offset);
+	if (len == 0)
+		return 0;
+	res = file->fs->fs_read(file, buf, len);
+	if (res > 0)
+		file->offset += res;
+	return res;
+}
+
+grub_off_t
+grub_file_seek(grub_file_t file, grub_off_t offset)
+{
+	grub_off_t old;
+
+	if (offset > file->size)
+	{
+		grub_error(GRUB_ERR_OUT_OF_RANGE, "attempt to seek outside of the file");
+		return -1;
+	}
+	old = file->offset;
+	file->offset = offset;
+	return old;
+}
+
+grub_err_t
+grub_file_close(grub_file_t file)
+{
+	if (file->fs->fs_close)
+		file->fs->fs_close(file);
+	grub_free(file);
+	return grub_errno;
+}
+
+static int
+test_write_pattern(const wchar_t* name)
+{
+	static grub_uint8_t buf[1 << TEST_MARK_SHIFT];
+	FILE* fp = 0;
+	grub_uint64_t off;
+	grub_size_t n;
+
+	if (_wfopen_s(&fp, name, L"wb") != 0)
+	{
+		printf("cannot create %ls\n", name);
+		return 1;
+	}
+	for (off = 0; off < TEST_PATTERN_SIZE; off += n)
+	{
+		n = TEST_PATTERN_SIZE - off < sizeof(buf) ? (grub_size_t)(TEST_PATTERN_SIZE - off) : sizeof(buf);
+		test_pattern(off, buf, n);
+		if (fwrite(buf, 1, n, fp) != n)
+		{
+			fclose(fp);
+			printf("cannot write %ls\n", name);
+			return 1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+	test_pattern_init();
+	if (argc == 3 && wcscmp(argv[1], L"-g") == 0)
+		return test_write_pattern(argv[2]);
+	if (argc == 2 && wcscmp(argv[1], L"-b") == 0)
+	{
+		bench_mscompress();
+		return 0;
+	}
+	if (argc > 1)
+		test_dir = argv[1];
+
+	grub_module_init_xzio();
+	grub_module_init_zstdio();
+
+	test_seekio();
+	test_mscompress();
+
+	grub_printf("%d failure(s)\n", test_failures);
+	return test_failures;
+}
+
+#ifndef _WIN32
+int main(int argc, char* argv[])
+{
+	wchar_t** wargv = calloc(argc + 1, sizeof(wchar_t*));
+
+	setlocale(LC_ALL, "");
+	if (!wargv)
+		return 1;
+	for (int i = 0; i < argc; i++)
+	{
+		size_t len = mbstowcs(NULL, argv[i], 0);
+
+		if (len == (size_t)-1 || (wargv[i] = calloc(len + 1, sizeof(wchar_t))) == NULL)
+			return 1;
+		mbstowcs(wargv[i], argv[i], len + 1);
+	}
+	return wmain(argc, wargv);
+}
+#endif
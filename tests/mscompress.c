@@ -0,0 +1,466 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The LZX and XPRESS decoders of grub/lib/mscompress against the ones in
+ * ref/, which resolve every Huffman symbol bit by bit.  Streams come from
+ * a small encoder that draws random canonical codes, literals and matches,
+ * so every block type, code length and footer case gets decoded.  Both
+ * decoders must give the same output, and "tests -b" times them.
+ */
+
+#include <win32.h>
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+
+#include "../grub/lib/mscompress/mscompress.h"
+#include "test.h"
+
+#define MS_STREAMS		400
+#define MS_BENCH_STREAMS	64
+#define MS_BENCH_ROUNDS		50
+#define MS_IN_MAX		(1U << 18)
+#define MS_OUT_MAX		(1U << 18)
+
+#define LZX_MAIN_SYMS		496
+#define LZX_LEN_SYMS		249
+#define LZX_PRETREE_SYMS	20
+#define LZX_ALIGNED_SYMS	8
+#define XCA_SYMS		512
+
+/* The decoders of ref/.  */
+grub_ssize_t ref_lzx_decompress(const void* data, grub_size_t len, void* buf, grub_size_t max_len);
+grub_ssize_t ref_xca_decompress(const void* data, grub_size_t len, void* buf, grub_size_t max_len);
+
+typedef grub_ssize_t(*ms_decompress_t) (const void* data, grub_size_t len, void* buf,
+	grub_size_t max_len);
+
+/* Stream being written, bits go into 16-bit little-endian words from the
+   top down as both formats read them.  */
+struct ms_writer
+{
+	grub_uint8_t* buf;
+	grub_size_t pos;
+	grub_uint32_t acc;
+	int bits;
+};
+
+/* A canonical prefix code.  */
+struct ms_code
+{
+	grub_uint8_t len[XCA_SYMS];
+	grub_uint32_t code[XCA_SYMS];
+};
+
+static grub_uint32_t ms_seed;
+
+static unsigned int
+ms_rand(unsigned int n)
+{
+	ms_seed = ms_seed * 1103515245 + 12345;
+	return n ? (ms_seed >> 8) % n : 0;
+}
+
+static void
+ms_put(struct ms_writer* w, grub_uint32_t v, int n)
+{
+	while (n--)
+	{
+		w->acc = (w->acc << 1) | ((v >> n) & 1);
+		if (++w->bits == 16)
+		{
+			w->buf[w->pos++] = (grub_uint8_t)w->acc;
+			w->buf[w->pos++] = (grub_uint8_t)(w->acc >> 8);
+			w->acc = 0;
+			w->bits = 0;
+		}
+	}
+}
+
+static void
+ms_align(struct ms_writer* w)
+{
+	if (w->bits)
+		ms_put(w, 0, 16 - w->bits);
+}
+
+static void
+ms_sym(struct ms_writer* w, const struct ms_code* c, unsigned int s)
+{
+	ms_put(w, c->code[s], c->len[s]);
+}
+
+/* Random symbol of C below N that has a code.  */
+static unsigned int
+ms_pick(const struct ms_code* c, unsigned int first, unsigned int n)
+{
+	unsigned int s;
+
+	do
+		s = first + ms_rand(n);
+	while (!c->len[s]);
+	return s;
+}
+
+static void
+ms_swap(int* a, int* b)
+{
+	int t = *a;
+
+	*a = *b;
+	*b = t;
+}
+
+/* A complete code with about LEAVES of the N symbols, none longer than
+   MAX_LEN.  With LIT_FIRST the first 256 symbols get the short codes, as
+   literals do in real data.  */
+static void
+ms_make_code(struct ms_code* c, int n, int leaves, int max_len, int lit_first)
+{
+	int depth[XCA_SYMS], perm[XCA_SYMS], count[17] = { 0 };
+	grub_uint32_t next[17], code = 0;
+	int k = 1, i, j, tries;
+
+	/* Split random leaves of a one-leaf tree.  */
+	depth[0] = 0;
+	while (k < leaves)
+	{
+		tries = 0;
+		do
+			i = ms_rand(k);
+		while (depth[i] >= max_len && ++tries < 100);
+		if (depth[i] >= max_len)
+			break;
+		depth[i]++;
+		depth[k++] = depth[i];
+	}
+	if (k == 1)
+	{
+		depth[0] = depth[1] = 1;
+		k = 2;
+	}
+	for (i = 1; i < k; i++)
+	{
+		for (j = i; j > 0 && depth[j] < depth[j - 1]; j--)
+			ms_swap(&depth[j], &depth[j - 1]);
+	}
+
+	for (i = 0; i < n; i++)
+		perm[i] = i;
+	if (lit_first)
+	{
+		for (i = 255; i > 0; i--)
+			ms_swap(&perm[i], &perm[ms_rand(i + 1)]);
+		for (i = n - 1; i > 256; i--)
+			ms_swap(&perm[i], &perm[256 + ms_rand(i - 255)]);
+	}
+	else
+	{
+		for (i = n - 1; i > 0; i--)
+			ms_swap(&perm[i], &perm[ms_rand(i + 1)]);
+	}
+	grub_memset(c->len, 0, sizeof(c->len));
+	for (i = 0; i < k && i < n; i++)
+		c->len[perm[i]] = (grub_uint8_t)depth[i];
+
+	for (i = 0; i < n; i++)
+		count[c->len[i]]++;
+	for (i = 1; i <= 16; i++)
+	{
+		next[i] = code;
+		code = (code + count[i]) << 1;
+	}
+	for (i = 0; i < n; i++)
+	{
+		if (c->len[i])
+			c->code[i] = next[c->len[i]]++;
+	}
+}
+
+/* Lengths of N symbols as pretree deltas against PREV, which is updated.  */
+static void
+lzx_put_lengths(struct ms_writer* w, const grub_uint8_t* len, grub_uint8_t* prev, int n)
+{
+	struct ms_code pre;
+	int i;
+
+	ms_make_code(&pre, LZX_PRETREE_SYMS, LZX_PRETREE_SYMS, 15, 0);
+	for (i = 0; i < LZX_PRETREE_SYMS; i++)
+		ms_put(w, pre.len[i], 4);
+	for (i = 0; i < n; i++)
+	{
+		ms_sym(w, &pre, (prev[i] - len[i] + 17) % 17);
+		prev[i] = len[i];
+	}
+}
+
+static const grub_uint32_t lzx_slot_base[30] =
+{
+	0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384,
+	512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576
+};
+
+static unsigned int
+lzx_footer_bits(unsigned int slot)
+{
+	return slot < 2 ? 0 : (slot < 38 ? slot / 2 - 1 : 17);
+}
+
+/* One to three blocks of 32 KiB or a random size, each verbatim, aligned
+   or uncompressed.  Returns the stream size.  */
+static grub_size_t
+lzx_make(grub_uint8_t* buf)
+{
+	struct ms_writer w = { buf, 0, 0, 0 };
+	grub_uint8_t prev_main[LZX_MAIN_SYMS] = { 0 }, prev_len[LZX_LEN_SYMS] = { 0 };
+	static struct ms_code main_code, len_code, aligned;
+	grub_size_t out = 0, end;
+	unsigned int blocks = 1 + ms_rand(3), b, type, size, i;
+
+	for (b = 0; b < blocks; b++)
+	{
+		type = 1 + ms_rand(3);
+		ms_put(&w, type, 3);
+		if (ms_rand(2))
+		{
+			ms_put(&w, 1, 1);
+			size = 32768;
+		}
+		else
+		{
+			size = 1 + ms_rand(40000);
+			ms_put(&w, 0, 1);
+			ms_put(&w, size >> 8, 8);
+			ms_put(&w, size & 0xff, 8);
+		}
+
+		if (type == 3)
+		{
+			/* 1 to 16 bits of padding, R0, R1 and R2 of 1, then the bytes.  */
+			ms_put(&w, 0, 16 - w.bits);
+			for (i = 0; i < 12; i++)
+				buf[w.pos++] = (i % 4) ? 0 : 1;
+			for (i = 0; i < size; i++)
+				buf[w.pos++] = (grub_uint8_t)ms_rand(256);
+			if (size & 1)
+				buf[w.pos++] = 0;
+			out += size;
+			continue;
+		}
+
+		if (type == 2)
+		{
+			ms_make_code(&aligned, LZX_ALIGNED_SYMS, LZX_ALIGNED_SYMS, 7, 0);
+			for (i = 0; i < LZX_ALIGNED_SYMS; i++)
+				ms_put(&w, aligned.len[i], 3);
+		}
+		ms_make_code(&main_code, LZX_MAIN_SYMS, 2 + ms_rand(LZX_MAIN_SYMS - 1), 16, 1);
+		lzx_put_lengths(&w, main_code.len, prev_main, 256);
+		lzx_put_lengths(&w, main_code.len + 256, prev_main + 256, LZX_MAIN_SYMS - 256);
+		ms_make_code(&len_code, LZX_LEN_SYMS, 2 + ms_rand(LZX_LEN_SYMS - 1), 16, 0);
+		lzx_put_lengths(&w, len_code.len, prev_len, LZX_LEN_SYMS);
+
+		for (end = out + size; out < end; )
+		{
+			unsigned int s, slot, bits, match, tries = 0;
+
+			if (ms_rand(10) < 7 || out < 300)
+			{
+				ms_sym(&w, &main_code, ms_pick(&main_code, 0, 256));
+				out++;
+				continue;
+			}
+			/* A match whose offset stays inside the output.  */
+			do
+			{
+				s = 256 + ms_rand(LZX_MAIN_SYMS - 256);
+				slot = (s - 256) >> 3;
+			}
+			while ((!main_code.len[s] || lzx_slot_base[slot] + (1U << lzx_footer_bits(slot)) > out)
+				&& ++tries < 1000);
+			if (tries >= 1000)
+			{
+				ms_sym(&w, &main_code, ms_pick(&main_code, 0, 256));
+				out++;
+				continue;
+			}
+			ms_sym(&w, &main_code, s);
+			match = ((s - 256) & 7) + 2;
+			if (((s - 256) & 7) == 7)
+			{
+				i = ms_pick(&len_code, 0, LZX_LEN_SYMS);
+				ms_sym(&w, &len_code, i);
+				match += i;
+			}
+			if (slot >= 3)
+			{
+				bits = lzx_footer_bits(slot);
+				if (type == 2 && bits >= 3)
+				{
+					ms_put(&w, ms_rand(1U << (bits - 3)), bits - 3);
+					ms_sym(&w, &aligned, ms_pick(&aligned, 0, LZX_ALIGNED_SYMS));
+				}
+				else
+					ms_put(&w, ms_rand(1U << bits), bits);
+			}
+			out += match;
+		}
+	}
+	ms_align(&w);
+	return w.pos;
+}
+
+/* Up to 60000 bytes of XPRESS Huffman: the 4-bit code lengths, then
+   literals and matches.  Returns the stream size.  */
+static grub_size_t
+xca_make(grub_uint8_t* buf)
+{
+	static struct ms_code c;
+	struct ms_writer w = { buf, 256, 0, 0 };
+	grub_size_t out = 0, target = 1 + ms_rand(60000);
+	unsigned int s, bits, v, tries, i;
+
+	ms_make_code(&c, XCA_SYMS, 2 + ms_rand(XCA_SYMS - 1), 15, 1);
+	for (i = 0; i < 256; i++)
+		buf[i] = c.len[2 * i] | (c.len[2 * i + 1] << 4);
+
+	while (out < target)
+	{
+		if (ms_rand(10) < 6 || out < 2)
+		{
+			ms_sym(&w, &c, ms_pick(&c, 0, 256));
+			out++;
+			continue;
+		}
+		/* Short matches only, the extra length bytes are not drawn.  */
+		tries = 0;
+		do
+		{
+			s = 256 + ms_rand(256);
+			bits = (s - 256) >> 4;
+		}
+		while ((!c.len[s] || (1U << bits) > out || ((s - 256) & 15) == 15 || s == 256)
+			&& ++tries < 1000);
+		if (tries >= 1000)
+		{
+			ms_sym(&w, &c, ms_pick(&c, 0, 256));
+			out++;
+			continue;
+		}
+		ms_sym(&w, &c, s);
+		if (bits)
+		{
+			v = ms_rand(1U << bits);
+			if (v > out - (1U << bits))
+				v = (unsigned int)(out - (1U << bits));
+			ms_put(&w, v, bits);
+		}
+		out += ((s - 256) & 15) + 3;
+	}
+	ms_align(&w);
+	ms_put(&w, 0, 16);
+	ms_put(&w, 0, 16);
+	return w.pos;
+}
+
+static grub_uint8_t ms_in[MS_IN_MAX];
+static grub_uint8_t ms_out[MS_OUT_MAX];
+static grub_uint8_t ms_ref[MS_OUT_MAX];
+
+void
+test_mscompress(void)
+{
+	grub_ssize_t got, want;
+	grub_size_t n;
+	int i, xca;
+
+	for (i = 0; i < MS_STREAMS; i++)
+	{
+		ms_seed = i;
+		xca = i & 1;
+		n = xca ? xca_make(ms_in) : lzx_make(ms_in);
+		want = (xca ? ref_xca_decompress : ref_lzx_decompress)(ms_in, n, ms_ref, MS_OUT_MAX);
+		got = (xca ? grub_xca_decompress : grub_lzx_decompress)(ms_in, n, ms_out, MS_OUT_MAX);
+		TEST_CHECK(want > 0, "%s stream %d: reference decoder failed", xca ? "xca" : "lzx", i);
+		TEST_CHECK(got == want && grub_memcmp(ms_out, ms_ref, got > 0 ? got : 0) == 0,
+			"%s stream %d: %lld bytes, reference %lld", xca ? "xca" : "lzx", i,
+			(long long)got, (long long)want);
+	}
+}
+
+static double
+ms_now(void)
+{
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+}
+
+/* Decoding time of every stream of one format, several rounds.  */
+static double
+ms_time(ms_decompress_t decompress, grub_uint8_t** in, const grub_size_t* len, int count,
+	grub_uint64_t* bytes)
+{
+	double start = ms_now();
+	int r, i;
+
+	*bytes = 0;
+	for (r = 0; r < MS_BENCH_ROUNDS; r++)
+	{
+		for (i = 0; i < count; i++)
+			*bytes += decompress(in[i], len[i], ms_out, MS_OUT_MAX);
+	}
+	return ms_now() - start;
+}
+
+void
+bench_mscompress(void)
+{
+	static const char* names[2] = { "lzx", "xca" };
+	static const ms_decompress_t old_dec[2] = { ref_lzx_decompress, ref_xca_decompress };
+	static const ms_decompress_t new_dec[2] = { grub_lzx_decompress, grub_xca_decompress };
+	grub_uint8_t* in[MS_BENCH_STREAMS];
+	grub_size_t len[MS_BENCH_STREAMS];
+	grub_uint64_t bytes;
+	double t_old, t_new;
+	int x, i, k;
+
+	for (x = 0; x < 2; x++)
+	{
+		for (i = k = 0; k < MS_BENCH_STREAMS; i++)
+		{
+			ms_seed = 2 * i + x;
+			len[k] = x ? xca_make(ms_in) : lzx_make(ms_in);
+			in[k] = grub_malloc(len[k]);
+			if (!in[k])
+				return;
+			grub_memcpy(in[k], ms_in, len[k]);
+			k++;
+		}
+		t_old = ms_time(old_dec[x], in, len, k, &bytes);
+		t_new = ms_time(new_dec[x], in, len, k, &bytes);
+		grub_printf("%s: %llu bytes, old %.3fs new %.3fs (%.1f%%)\n", names[x],
+			(unsigned long long)bytes, t_old, t_new, 100.0 * (t_old - t_new) / t_old);
+		for (i = 0; i < k; i++)
+			grub_free(in[i]);
+	}
+}
@@ -0,0 +1,183 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Round trips through xzio and zstdio: fixtures made by the xz and zstd
+ * tools (data/mkdata.sh) are read in order, then by random seeks that
+ * resume from the seekpt index, and must give back the pattern.  A damaged
+ * check must fail the read.
+ */
+
+#include <grub/types.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/err.h>
+#include <grub/file.h>
+
+#include "test.h"
+
+#define SEEKIO_CHUNK		(1U << 20)
+#define SEEKIO_SEEKS		24
+
+enum seekio_damage
+{
+	SEEKIO_NO_CHECK,
+	/* Last byte of the check of the last xz block.  */
+	SEEKIO_XZ_CHECK,
+	/* Last byte of the content checksum of the last zstd frame.  */
+	SEEKIO_ZSTD_CHECK,
+};
+
+static const struct
+{
+	const wchar_t* name;
+	grub_file_filter_id_t filter;
+	enum seekio_damage damage;
+} seekio_fixtures[] =
+{
+	{ L"pattern.none.xz", GRUB_FILE_FILTER_XZIO, SEEKIO_NO_CHECK },
+	{ L"pattern.crc32.xz", GRUB_FILE_FILTER_XZIO, SEEKIO_XZ_CHECK },
+	{ L"pattern.crc64.xz", GRUB_FILE_FILTER_XZIO, SEEKIO_XZ_CHECK },
+	{ L"pattern.sha256.xz", GRUB_FILE_FILTER_XZIO, SEEKIO_XZ_CHECK },
+	{ L"pattern.nocheck.zst", GRUB_FILE_FILTER_ZSTDIO, SEEKIO_NO_CHECK },
+	{ L"pattern.zst", GRUB_FILE_FILTER_ZSTDIO, SEEKIO_ZSTD_CHECK },
+	{ L"pattern.frames.zst", GRUB_FILE_FILTER_ZSTDIO, SEEKIO_ZSTD_CHECK },
+};
+
+static grub_uint8_t seekio_got[SEEKIO_CHUNK];
+static grub_uint8_t seekio_want[SEEKIO_CHUNK];
+
+static grub_file_t
+seekio_open(const wchar_t* name, grub_file_filter_id_t filter, enum seekio_damage damage)
+{
+	grub_file_t io, file;
+	grub_uint8_t* p;
+
+	io = test_open(name);
+	if (!io)
+		return NULL;
+	p = io->data;
+	if (damage == SEEKIO_XZ_CHECK)
+	{
+		/* The check ends where the index starts, the footer has its size.  */
+		grub_size_t size = (grub_size_t)io->size;
+		grub_size_t index = size - 12
+			- ((grub_size_t)grub_le_to_cpu32(grub_get_unaligned32(p + size - 8)) + 1) * 4;
+
+		p[index - 1] ^= 0x01;
+	}
+	else if (damage == SEEKIO_ZSTD_CHECK)
+		p[(grub_size_t)io->size - 1] ^= 0x01;
+
+	file = grub_file_filters[filter](io, GRUB_FILE_TYPE_LOOPBACK | GRUB_FILE_TYPE_FILTER_VDISK);
+	if (!file)
+		grub_file_close(io);
+	return file;
+}
+
+/* Read LEN bytes at OFF and compare them with the pattern.  */
+static int
+seekio_compare(grub_file_t file, grub_uint64_t off, grub_size_t len)
+{
+	grub_file_seek(file, off);
+	if (grub_file_read(file, seekio_got, len) != (grub_ssize_t)len)
+		return 0;
+	test_pattern(off, seekio_want, len);
+	return grub_memcmp(seekio_got, seekio_want, len) == 0;
+}
+
+static void
+seekio_round_trip(const wchar_t* name, grub_file_filter_id_t filter)
+{
+	grub_file_t file;
+	grub_uint64_t off;
+	grub_uint32_t seed = 7;
+	grub_size_t n;
+	int i;
+
+	file = seekio_open(name, filter, SEEKIO_NO_CHECK);
+	TEST_CHECK(file, "%ls: open failed", name);
+	if (!file)
+		return;
+	TEST_CHECK(file->size == TEST_PATTERN_SIZE, "%ls: size %llu", name,
+		(unsigned long long)file->size);
+
+	for (off = 0; off < TEST_PATTERN_SIZE; off += n)
+	{
+		n = TEST_PATTERN_SIZE - off < SEEKIO_CHUNK ? (grub_size_t)(TEST_PATTERN_SIZE - off) : SEEKIO_CHUNK;
+		if (!seekio_compare(file, off, n))
+		{
+			TEST_CHECK(0, "%ls: sequential read differs at %llu", name, (unsigned long long)off);
+			break;
+		}
+	}
+
+	/* Backwards and forwards, both within and across snapshots.  */
+	for (i = 0; i < SEEKIO_SEEKS; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		off = ((grub_uint64_t)seed << 10) % TEST_PATTERN_SIZE;
+		seed = seed * 1103515245 + 12345;
+		n = (seed >> 8) % SEEKIO_CHUNK + 1;
+		if (n > TEST_PATTERN_SIZE - off)
+			n = (grub_size_t)(TEST_PATTERN_SIZE - off);
+		TEST_CHECK(seekio_compare(file, off, n), "%ls: read of %llu at %llu differs", name,
+			(unsigned long long)n, (unsigned long long)off);
+	}
+	TEST_CHECK(seekio_compare(file, TEST_PATTERN_SIZE - 1, 1), "%ls: last byte differs", name);
+	TEST_CHECK(seekio_compare(file, 0, SEEKIO_CHUNK), "%ls: first MiB differs", name);
+
+	grub_file_close(file);
+}
+
+static void
+seekio_damaged(const wchar_t* name, grub_file_filter_id_t filter, enum seekio_damage damage)
+{
+	grub_file_t file;
+	grub_uint64_t off;
+	grub_ssize_t n = 0;
+
+	file = seekio_open(name, filter, damage);
+	TEST_CHECK(file, "%ls: open of damaged file failed", name);
+	if (!file)
+		return;
+	for (off = 0; off < TEST_PATTERN_SIZE; off += n)
+	{
+		n = grub_file_read(file, seekio_got, SEEKIO_CHUNK);
+		if (n <= 0)
+			break;
+	}
+	TEST_CHECK(n < 0 && grub_errno == GRUB_ERR_BAD_COMPRESSED_DATA,
+		"%ls: damaged check not detected", name);
+	grub_errno = GRUB_ERR_NONE;
+	grub_file_close(file);
+}
+
+void
+test_seekio(void)
+{
+	grub_size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(seekio_fixtures); i++)
+	{
+		seekio_round_trip(seekio_fixtures[i].name, seekio_fixtures[i].filter);
+		if (seekio_fixtures[i].damage != SEEKIO_NO_CHECK)
+			seekio_damaged(seekio_fixtures[i].name, seekio_fixtures[i].filter,
+				seekio_fixtures[i].damage);
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ *  NkArc
+ *  Copyright (C) 2023 A1ive
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_HEADER
+#define TEST_HEADER	1
+
+#include <wchar.h>
+
+#include <grub/types.h>
+#include <grub/err.h>
+#include <grub/file.h>
+
+/* Size of the data the compressed fixtures were made from, more than two
+   snapshot spacings so that seeks resume from snapshots inside a block.  */
+#define TEST_PATTERN_SIZE	((72ULL << 20) + 12345)
+
+extern int test_failures;
+
+/* Report a failed check and go on with the next one.  */
+#define TEST_CHECK(cond, ...) \
+	do { if (!(cond)) test_fail(__FILE__, __LINE__, __VA_ARGS__); } while (0)
+
+void
+test_fail(const char* file, int line, const char* fmt, ...);
+
+/* Fixture NAME of the data directory read into memory, FILE->data holds
+   its contents.  NULL when it cannot be read.  */
+grub_file_t
+test_open(const wchar_t* name);
+
+/* LEN bytes of the pattern from OFF.  */
+void
+test_pattern(grub_uint64_t off, grub_uint8_t* buf, grub_size_t len);
+
+void
+test_seekio(void);
+
+void
+test_mscompress(void);
+
+void
+bench_mscompress(void);
+
+void grub_module_init_xzio(void);
+void grub_module_init_zstdio(void);
+
+#endif /* ! TEST_HEADER */